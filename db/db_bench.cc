@@ -13,6 +13,7 @@
 #include "leveldb/env.h"
 #include "leveldb/write_batch.h"
 #include "port/port.h"
+#include "util/arena.h"
 #include "util/crc32c.h"
 #include "util/histogram.h"
 #include "util/mutexlock.h"
@@ -40,11 +41,15 @@
 //      seekrandom    -- N random seeks
 //      open          -- cost of opening a DB
 //      crc32c        -- repeated crc32c of 4K of data
+//      crc32c_portable -- same, forcing the table-driven implementation
 //      acquireload   -- load N*1000 times
+//      getcpu        -- look up the current CPU N*1000 times with a syscall
+//      currentcpu    -- same, with ArenaNVM::CurrentCPU()
 //   Meta operations:
 //      compact     -- Compact the entire DB
 //      stats       -- Print DB stats
 //      sstables    -- Print sstable info
+//      poolstats   -- Print background pool counters
 //      heapprofile -- Dump a heap profile (if supported by this port)
 
 static const char* FLAGS_benchmarks =
@@ -98,13 +103,48 @@ static size_t FLAGS_dlock_way = 11;
 static size_t FLAGS_dlock_size = 33554432; 
 static size_t FLAGS_skiplistSync_threshold = 65536;
 static size_t FLAGS_compactImm_threshold = 10;
-static size_t FLAGS_subImm_partition = 0;
+static size_t FLAGS_subImm_partition = 4;
 static size_t FLAGS_subImm_thread = 4;
+static int FLAGS_memtable_sync_threads = 1;
+static int FLAGS_flush_threads = 1;
+static int FLAGS_compaction_threads = 1;
+// Key ranges each compaction is split into (see Options)
+static int FLAGS_max_subcompactions = 1;
+// Compactions that may run at once
+static int FLAGS_max_background_compactions = 1;
+// Target size of compaction output tables, in bytes
+static int FLAGS_max_file_size = 2 << 20;
+// Target size of level 1 in MB, and the growth of each level below it
+static int FLAGS_max_bytes_for_level_base = 10;
+static int FLAGS_max_bytes_for_level_multiplier = 10;
+// Derive level targets from the deepest level's size
+static bool FLAGS_level_compaction_dynamic_level_bytes = false;
+// Level-0 file counts that start compaction, favour it and stop flushes
+static int FLAGS_level0_file_num_compaction_trigger = 4;
+static int FLAGS_level0_slowdown_writes_trigger = 8;
+static int FLAGS_level0_stop_writes_trigger = 12;
+// CPUs for the threads of every background pool, e.g. "0-7" or "node:0"
+static const char* FLAGS_pool_cpus = "";
+static size_t FLAGS_flushImm_threshold = 8;
+static bool FLAGS_per_core_wal = false;
+// Index each write as it is made instead of in background batches
+static bool FLAGS_concurrent_memtable_insert = true;
+// Answer point lookups in the memtable from hash indexes
+static bool FLAGS_memtable_hash_index = false;
+// Size of each core's sub-memtable region, in KB; 0 uses the default
+static int FLAGS_sub_mem_kb = 0;
+// Directory for the tables of levels --sec_disk_level and deeper
+static const char* FLAGS_db_sec_disk = NULL;
+static int FLAGS_sec_disk_level = 2;
 
 // Number of bytes to use as a cache of uncompressed data.
 // Negative means use default settings.
 static int FLAGS_cache_size = -1;
 
+// Use CLOCK caches with 1 << cache_shard_bits shards instead of LRU ones
+static bool FLAGS_clock_cache = false;
+static int FLAGS_cache_shard_bits = 4;
+
 // Maximum number of files to keep open at the same time (use default if == 0)
 static int FLAGS_open_files = 0;
 
@@ -414,7 +454,10 @@ private:
 
 public:
     Benchmark()
-: cache_(FLAGS_cache_size >= 0 ? NewLRUCache(FLAGS_cache_size) : NULL),
+: cache_(FLAGS_cache_size < 0 ? NULL
+          : FLAGS_clock_cache ? NewClockCache(FLAGS_cache_size, FLAGS_cache_shard_bits,
+                                              Options().block_size)
+          : NewLRUCache(FLAGS_cache_size)),
   filter_policy_(FLAGS_bloom_bits >= 0
           ? NewBloomFilterPolicy(FLAGS_bloom_bits)
                   : NULL),
@@ -525,8 +568,14 @@ public:
                 method = &Benchmark::Compact;
             } else if (name == Slice("crc32c")) {
                 method = &Benchmark::Crc32c;
+            } else if (name == Slice("crc32c_portable")) {
+                method = &Benchmark::Crc32cPortable;
             } else if (name == Slice("acquireload")) {
                 method = &Benchmark::AcquireLoad;
+            } else if (name == Slice("getcpu")) {
+                method = &Benchmark::GetCPUSyscall;
+            } else if (name == Slice("currentcpu")) {
+                method = &Benchmark::CurrentCPU;
             } else if (name == Slice("snappycomp")) {
                 method = &Benchmark::SnappyCompress;
             } else if (name == Slice("snappyuncomp")) {
@@ -537,6 +586,8 @@ public:
                 PrintStats("leveldb.stats");
             } else if (name == Slice("sstables")) {
                 PrintStats("leveldb.sstables");
+            } else if (name == Slice("poolstats")) {
+                PrintStats("leveldb.background-pools");
             } else {
                 if (name != Slice()) {  // No error message for empty name
                     fprintf(stderr, "unknown benchmark '%s'\n", name.ToString().c_str());
@@ -550,7 +601,9 @@ public:
                 } else {
                     delete db_;
                     db_ = NULL;
-                    DestroyDB(FLAGS_db_disk, FLAGS_db_mem, Options());
+                    Options options;
+                    options.sec_diskpath = FLAGS_db_sec_disk;
+                    DestroyDB(FLAGS_db_disk, FLAGS_db_mem, options);
                     Open();
                 }
             }
@@ -651,14 +704,25 @@ private:
     }
 
     void Crc32c(ThreadState* thread) {
+        DoCrc32c(thread, &crc32c::Extend,
+                 crc32c::IsAccelerated() ? "(4K per op, sse4.2)"
+                                         : "(4K per op, portable)");
+    }
+
+    void Crc32cPortable(ThreadState* thread) {
+        DoCrc32c(thread, &crc32c::ExtendPortable, "(4K per op, portable)");
+    }
+
+    void DoCrc32c(ThreadState* thread,
+            uint32_t (*extend)(uint32_t, const char*, size_t),
+            const char* label) {
         // Checksum about 500MB of data total
         const int size = 4096;
-        const char* label = "(4K per op)";
         std::string data(size, 'x');
         int64_t bytes = 0;
         uint32_t crc = 0;
         while (bytes < 500 * 1048576) {
-            crc = crc32c::Value(data.data(), size);
+            crc = (*extend)(0, data.data(), size);
             thread->stats.FinishedSingleOp();
             bytes += size;
         }
@@ -685,6 +749,33 @@ private:
         if (ptr == NULL) exit(1); // Disable unused variable warning.
     }
 
+    // What ArenaNVM::Allocate() paid on every call before CurrentCPU()
+    void GetCPUSyscall(ThreadState* thread) {
+        long sum = 0;
+        thread->stats.AddMessage("(each op is 1000 lookups)");
+        for (int count = 0; count < 100000; count++) {
+            for (int i = 0; i < 1000; i++) {
+                unsigned int cpu = 0;
+                syscall(SYS_getcpu, &cpu, NULL, NULL);
+                sum += cpu;
+            }
+            thread->stats.FinishedSingleOp();
+        }
+        if (sum < 0) exit(1); // Disable unused variable warning.
+    }
+
+    void CurrentCPU(ThreadState* thread) {
+        long sum = 0;
+        thread->stats.AddMessage("(each op is 1000 lookups)");
+        for (int count = 0; count < 100000; count++) {
+            for (int i = 0; i < 1000; i++) {
+                sum += ArenaNVM::CurrentCPU();
+            }
+            thread->stats.FinishedSingleOp();
+        }
+        if (sum < 0) exit(1); // Disable unused variable warning.
+    }
+
     void SnappyCompress(ThreadState* thread) {
         RandomGenerator gen;
         Slice input = gen.Generate(Options().block_size);
@@ -740,6 +831,8 @@ private:
         options.write_buffer_size = FLAGS_write_buffer_size;
         options.nvm_buffer_size = FLAGS_nvm_buffer_size;
         options.max_open_files = FLAGS_open_files;
+        options.clock_cache = FLAGS_clock_cache;
+        options.cache_shard_bits = FLAGS_cache_shard_bits;
         options.filter_policy = filter_policy_;
         options.reuse_logs = FLAGS_reuse_logs;
         options.num_levels = FLAGS_num_levels;
@@ -750,6 +843,35 @@ private:
         options.compactImm_threshold = FLAGS_compactImm_threshold;
         options.subImm_partition = FLAGS_subImm_partition;
         options.subImm_thread = FLAGS_subImm_thread;
+        options.memtable_sync_threads = FLAGS_memtable_sync_threads;
+        options.flush_threads = FLAGS_flush_threads;
+        options.compaction_threads = FLAGS_compaction_threads;
+        options.max_subcompactions = FLAGS_max_subcompactions;
+        options.max_background_compactions = FLAGS_max_background_compactions;
+        options.max_file_size = FLAGS_max_file_size;
+        options.max_bytes_for_level_base =
+                static_cast<uint64_t>(FLAGS_max_bytes_for_level_base) << 20;
+        options.max_bytes_for_level_multiplier =
+                FLAGS_max_bytes_for_level_multiplier;
+        options.level_compaction_dynamic_level_bytes =
+                FLAGS_level_compaction_dynamic_level_bytes;
+        options.level0_file_num_compaction_trigger =
+                FLAGS_level0_file_num_compaction_trigger;
+        options.level0_slowdown_writes_trigger =
+                FLAGS_level0_slowdown_writes_trigger;
+        options.level0_stop_writes_trigger = FLAGS_level0_stop_writes_trigger;
+        options.memtable_sync_cpus = FLAGS_pool_cpus;
+        options.subImm_cpus = FLAGS_pool_cpus;
+        options.flush_cpus = FLAGS_pool_cpus;
+        options.compaction_cpus = FLAGS_pool_cpus;
+        options.flushImm_threshold = FLAGS_flushImm_threshold;
+        options.per_core_wal = FLAGS_per_core_wal;
+        options.concurrent_memtable_insert = FLAGS_concurrent_memtable_insert;
+        options.memtable_hash_index = FLAGS_memtable_hash_index;
+        if (FLAGS_sub_mem_kb > 0)
+            options.sub_mem_size = (size_t)FLAGS_sub_mem_kb << 10;
+        options.sec_diskpath = FLAGS_db_sec_disk;
+        options.sec_disk_level = FLAGS_sec_disk_level;
 
 
         Status s = DB::Open(options, FLAGS_db_disk, FLAGS_db_mem, &db_);
@@ -1098,9 +1220,54 @@ int main(int argc, char** argv) {
             FLAGS_subImm_partition = n;
         } else if (sscanf(argv[i], "--subImm_thread=%d%c", &n, &junk) == 1) {
             FLAGS_subImm_thread = n;
+        } else if (sscanf(argv[i], "--memtable_sync_threads=%d%c", &n, &junk) == 1) {
+            FLAGS_memtable_sync_threads = n;
+        } else if (sscanf(argv[i], "--flush_threads=%d%c", &n, &junk) == 1) {
+            FLAGS_flush_threads = n;
+        } else if (sscanf(argv[i], "--compaction_threads=%d%c", &n, &junk) == 1) {
+            FLAGS_compaction_threads = n;
+        } else if (sscanf(argv[i], "--max_subcompactions=%d%c", &n, &junk) == 1) {
+            FLAGS_max_subcompactions = n;
+        } else if (sscanf(argv[i], "--max_background_compactions=%d%c", &n, &junk) == 1) {
+            FLAGS_max_background_compactions = n;
+        } else if (sscanf(argv[i], "--max_file_size=%d%c", &n, &junk) == 1) {
+            FLAGS_max_file_size = n;
+        } else if (sscanf(argv[i], "--max_bytes_for_level_base=%d%c", &n, &junk) == 1) {
+            FLAGS_max_bytes_for_level_base = n;
+        } else if (sscanf(argv[i], "--max_bytes_for_level_multiplier=%d%c", &n, &junk) == 1) {
+            FLAGS_max_bytes_for_level_multiplier = n;
+        } else if (sscanf(argv[i], "--level_compaction_dynamic_level_bytes=%d%c", &n, &junk) == 1 &&
+                (n == 0 || n == 1)) {
+            FLAGS_level_compaction_dynamic_level_bytes = n;
+        } else if (sscanf(argv[i], "--level0_file_num_compaction_trigger=%d%c", &n, &junk) == 1) {
+            FLAGS_level0_file_num_compaction_trigger = n;
+        } else if (sscanf(argv[i], "--level0_slowdown_writes_trigger=%d%c", &n, &junk) == 1) {
+            FLAGS_level0_slowdown_writes_trigger = n;
+        } else if (sscanf(argv[i], "--level0_stop_writes_trigger=%d%c", &n, &junk) == 1) {
+            FLAGS_level0_stop_writes_trigger = n;
+        } else if (strncmp(argv[i], "--pool_cpus=", 12) == 0) {
+            FLAGS_pool_cpus = argv[i] + 12;
+        } else if (sscanf(argv[i], "--flushImm_threshold=%d%c", &n, &junk) == 1) {
+            FLAGS_flushImm_threshold = n;
+        } else if (sscanf(argv[i], "--per_core_wal=%d%c", &n, &junk) == 1 &&
+                (n == 0 || n == 1)) {
+            FLAGS_per_core_wal = n;
+        } else if (sscanf(argv[i], "--concurrent_memtable_insert=%d%c", &n, &junk) == 1 &&
+                (n == 0 || n == 1)) {
+            FLAGS_concurrent_memtable_insert = n;
+        } else if (sscanf(argv[i], "--memtable_hash_index=%d%c", &n, &junk) == 1 &&
+                (n == 0 || n == 1)) {
+            FLAGS_memtable_hash_index = n;
+        } else if (sscanf(argv[i], "--sub_mem_kb=%d%c", &n, &junk) == 1) {
+            FLAGS_sub_mem_kb = n;
 
         } else if (sscanf(argv[i], "--cache_size=%d%c", &n, &junk) == 1) {
             FLAGS_cache_size = n;
+        } else if (sscanf(argv[i], "--clock_cache=%d%c", &n, &junk) == 1 &&
+                (n == 0 || n == 1)) {
+            FLAGS_clock_cache = n;
+        } else if (sscanf(argv[i], "--cache_shard_bits=%d%c", &n, &junk) == 1) {
+            FLAGS_cache_shard_bits = n;
         } else if (sscanf(argv[i], "--bloom_bits=%d%c", &n, &junk) == 1) {
             FLAGS_bloom_bits = n;
         } else if (sscanf(argv[i], "--open_files=%d%c", &n, &junk) == 1) {
@@ -1109,6 +1276,10 @@ int main(int argc, char** argv) {
             FLAGS_db_disk = argv[i] + 10;
         } else if (strncmp(argv[i], "--db_mem=", 9) == 0) {
             FLAGS_db_mem = argv[i] + 9;
+        } else if (strncmp(argv[i], "--db_sec_disk=", 14) == 0) {
+            FLAGS_db_sec_disk = argv[i] + 14;
+        } else if (sscanf(argv[i], "--sec_disk_level=%d%c", &n, &junk) == 1) {
+            FLAGS_sec_disk_level = n;
         } else if (sscanf(argv[i], "--num_levels=%d%c", &n, &junk) == 1) {
             FLAGS_num_levels = n;
         } else if (sscanf(argv[i], "--num_read_threads=%d%c", &n, &junk) == 1) {
@@ -35,6 +35,7 @@
 #include "util/coding.h"
 #include "util/logging.h"
 #include "util/mutexlock.h"
+#include "util/sub_mem_pool.h"
 #include "util/debug.h"
 #include "hoard/heaplayers/wrappers/gnuwrapper.h"
 #include "util/thpool.h"
@@ -51,9 +52,12 @@
 using namespace std;
 
 namespace leveldb {
-std::atomic_int subImmCount;
 
 const int kNumNonTableCacheFiles = 10;
+
+// Lookups in a row that may race with memtable hand-offs before Get()
+// holds the hand-offs off for its next one
+static const int kMaxGetRetries = 4;
 bool kCheckCond = 0;
 uint64_t numreqsts=0;
 uint64_t numhits=0;
@@ -123,6 +127,7 @@ struct DBImpl::CompactionState {
     struct Output {
         uint64_t number;
         uint64_t file_size;
+        int path_id;
         InternalKey smallest, largest;
     };
     std::vector<Output> outputs;
@@ -133,13 +138,57 @@ struct DBImpl::CompactionState {
 
     uint64_t total_bytes;
 
+    // User keys in [*start, *end) when the compaction is split into
+    // subcompactions; NULL leaves that end unbounded
+    const std::string* start;
+    const std::string* end;
+    Compaction::Cursor cursor;
+    Status status;
+
     Output* current_output() { return &outputs[outputs.size()-1]; }
 
     explicit CompactionState(Compaction* c)
     : compaction(c),
       outfile(NULL),
       builder(NULL),
-      total_bytes(0) {
+      total_bytes(0),
+      start(NULL),
+      end(NULL) {
+    }
+};
+
+// Subcompactions shared by the thread running a compaction and the
+// helpers it schedules.  Each thread claims the next subcompaction not
+// yet started until none are left, so the compaction finishes even if
+// no helper gets a thread.
+struct DBImpl::SubcompactionJob {
+    DBImpl* db;
+    std::vector<CompactionState*> subs;
+    std::atomic<size_t> next;
+    port::Mutex mu;
+    port::CondVar cv;
+    size_t done;  // Guarded by mu
+    int refs;     // Guarded by mu; the last thread out deletes the job
+
+    SubcompactionJob() : next(0), cv(&mu), done(0), refs(1) { }
+
+    // Run unclaimed subcompactions
+    void Work(int64_t* imm_micros) {
+        for (size_t i; (i = next.fetch_add(1)) < subs.size(); ) {
+            subs[i]->status = db->DoSubcompactionWork(subs[i], imm_micros);
+            MutexLock l(&mu);
+            done++;
+            cv.SignalAll();
+        }
+    }
+
+    void Unref() {
+        mu.Lock();
+        const bool last = (--refs == 0);
+        mu.Unlock();
+        if (last) {
+            delete this;
+        }
     }
 };
 
@@ -161,6 +210,27 @@ Options SanitizeOptions(const std::string& dbname,
     //NoveLSM write_buffer_size_fix. Remove the line if all tests succeed
     //ClipToRange(&result.nvm_buffer_size, 64<<10,                      1<<30);
     ClipToRange(&result.block_size,        1<<10,                       4<<20);
+    // A power of two, so that a pointer's region is a shift away, and no
+    // larger than the NVM buffer it divides
+    ClipToRange(&result.sub_mem_size,      64<<10,                      64<<20);
+    ClipToRange(&result.sec_disk_level,    0,                           config::kNumLevels - 1);
+    ClipToRange(&result.max_subcompactions, 1,                          64);
+    ClipToRange(&result.max_background_compactions, 1,                  64);
+    ClipToRange(&result.max_file_size,     1<<20,                       1<<30);
+    ClipToRange(&result.max_bytes_for_level_base,
+                static_cast<uint64_t>(1) << 20, static_cast<uint64_t>(1) << 40);
+    ClipToRange(&result.max_bytes_for_level_multiplier, 2,              100);
+    // Each level-0 trigger is at least the one before it
+    ClipToRange(&result.level0_file_num_compaction_trigger, 1,          1000);
+    ClipToRange(&result.level0_slowdown_writes_trigger,
+                result.level0_file_num_compaction_trigger,              1000);
+    ClipToRange(&result.level0_stop_writes_trigger,
+                result.level0_slowdown_writes_trigger,                  1000);
+    while ((result.sub_mem_size & (result.sub_mem_size - 1)) != 0)
+        result.sub_mem_size &= result.sub_mem_size - 1;
+    while (result.sub_mem_size > 64<<10 &&
+           result.sub_mem_size > result.nvm_buffer_size)
+        result.sub_mem_size >>= 1;
     if (result.info_log == NULL) {
         // Open a log file in the same directory as the db
         src.env->CreateDir(dbname);  // In case it does not exist
@@ -171,14 +241,26 @@ Options SanitizeOptions(const std::string& dbname,
             result.info_log = NULL;
         }
     }
+    ClipToRange(&result.cache_shard_bits,  0,                           16);
     if (result.block_cache == NULL) {
-        result.block_cache = NewLRUCache(8 << 20);
+        if (result.clock_cache) {
+            result.block_cache = NewClockCache(8 << 20, result.cache_shard_bits,
+                                               result.block_size);
+        } else {
+            result.block_cache = NewLRUCache(8 << 20);
+        }
     }
     return result;
 }
 
 DBImpl::DBImpl(const Options& raw_options, const std::string& dbname_disk, const std::string& dbname_mem)
-: env_(raw_options.env),
+: skiplist_sync_cv_(&skiplist_sync_mu_),
+  skiplist_sync_waiters_(0),
+  bg_tasks_(0),
+  bg_tasks_cv_(&bg_tasks_mu_),
+  room_cv_(&room_mu_),
+  compact_imm_cv_(&compact_imm_mu_),
+  env_(raw_options.env),
   internal_comparator_(raw_options.comparator),
   internal_filter_policy_(raw_options.filter_policy),
   options_(SanitizeOptions(dbname_disk, &internal_comparator_,
@@ -186,6 +268,8 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname_disk, const
           owns_info_log_(options_.info_log != raw_options.info_log),
           owns_cache_(options_.block_cache != raw_options.block_cache),
           dbname_disk_(dbname_disk),
+          dbname_secndry_disk_(raw_options.sec_diskpath != NULL ?
+                  raw_options.sec_diskpath : ""),
           dbname_mem_(dbname_mem),
           db_lock_(NULL),
           shutting_down_(NULL),
@@ -198,18 +282,34 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname_disk, const
           mapfile_number_(0),
           logfile_number_(0),
           log_(NULL),
+          wal_(NULL),
+          merged_log_number_(~0ull),
           seed_(0),
           tmp_batch_(new WriteBatch),
           bg_compaction_scheduled_(false),
+          bg_extra_compactions_(0),
+          extra_idle_version_(0),
+          manifest_writing_(false),
           manual_compaction_(NULL) {
-    subImmKill = 0;
     isFirstArena = 1;
     inSkiplistBgSync.store(0);
     inCompactImm.store(0);
+    has_bg_error_.store(false);
+    mem_epoch_.store(0);
+    sub_mem_conversions_.store(0);
+    read_epoch_ = 0;
     skiplistSync_threshold = options_.skiplistSync_threshold;
     compactImm_threshold = options_.compactImm_threshold;
     subImm_partition = options_.subImm_partition;
     subImm_thread = options_.subImm_thread;
+    flushImm_threshold = options_.flushImm_threshold;
+    env_->SetPoolThreads(Env::kMemTableSyncPool, options_.memtable_sync_threads,
+            options_.memtable_sync_cpus);
+    env_->SetPoolThreads(Env::kSubImmPool, subImm_thread, options_.subImm_cpus);
+    env_->SetPoolThreads(Env::kFlushPool, options_.flush_threads,
+            options_.flush_cpus);
+    env_->SetPoolThreads(Env::kCompactionPool, options_.compaction_threads,
+            options_.compaction_cpus);
 
     has_imm_.Release_Store(NULL);
 
@@ -221,7 +321,8 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname_disk, const
     // Reserve ten files or so for other uses and give the rest to TableCache.
     const int table_cache_size = options_.max_open_files - kNumNonTableCacheFiles;
     DEBUG_T("dbname_disk_ %s, dbname_mem_ %s \n",dbname_disk_.c_str(), dbname_mem_.c_str());
-    table_cache_ = new TableCache(dbname_disk_, &options_, table_cache_size);
+    table_cache_ = new TableCache(dbname_disk_, dbname_secndry_disk_, &options_,
+            table_cache_size);
 
     //VersionSet uses dbname to place and locate MANIFEST and CURRENT files, which reside in disk for now
     versions_ = new VersionSet(dbname_disk_, &options_, table_cache_,
@@ -230,11 +331,17 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname_disk, const
 }
 
 DBImpl::~DBImpl() {
-    ArenaNVM *tmp_arena = reinterpret_cast<ArenaNVM*>(&mem_->arena_);
-    tmp_arena->setSubMemToImm();
-    skiplistBackgroundSync(this);
-    compactImm(this);
-    env_->SleepForMicroseconds(100000);
+    if (mem_ != NULL) {
+        // Convert every sub-mem and wait for the conversions (and any
+        // merges they queued) before merging what is left
+        ArenaNVM *tmp_arena = reinterpret_cast<ArenaNVM*>(&mem_->arena_);
+        tmp_arena->setSubMemToImm();
+        WaitForMemTableWork();
+        skiplistBackgroundSync(this);
+        compactImm(this);
+        // Helpers of its partition merges may not have started yet
+        WaitForMemTableWork();
+    }
 #ifdef _ENABLE_STATS
     std::cout << "Foreground compaction time: " << fgcompactime.count() << "s\n";
     fprintf(stderr,"mem_hits %u, imm_hits %u sstable_hits %u\n",
@@ -243,7 +350,9 @@ DBImpl::~DBImpl() {
     // Wait for background work to finish
     mutex_.Lock();
     shutting_down_.Release_Store(this);  // Any non-NULL value is ok
-    while (bg_compaction_scheduled_) {
+    SignalRoomWaiters();
+    bg_cv_.SignalAll();  // Writers waiting for level 0 to shrink
+    while (bg_compaction_scheduled_ || bg_extra_compactions_ > 0) {
         bg_cv_.Wait();
     }
     mutex_.Unlock();
@@ -253,11 +362,18 @@ DBImpl::~DBImpl() {
     }
 
     delete versions_;
-    if (mem_ != NULL) mem_->Unref();
+    // Sub-imms may hold regions of mem_'s arena, so they go first
+    for (size_t i = 0; i < retired_mems_.size(); i++)
+        retired_mems_[i].second->Unref();
     if (imm_ != NULL) imm_->Unref();
+    //Unflushed sub-imms keep their map files for recovery
+    for (size_t i = 0; i < compactImmQue.size(); i++)
+        compactImmQue[i]->Unref();
+    if (mem_ != NULL) mem_->Unref();
     delete tmp_batch_;
     delete log_;
     delete logfile_;
+    delete wal_;
     delete table_cache_;
 
     if (owns_info_log_) {
@@ -313,6 +429,19 @@ void DBImpl::MaybeIgnoreError(Status* s) const {
     }
 }
 
+int DBImpl::PathForLevel(int level) const {
+    return (!dbname_secndry_disk_.empty() &&
+            level >= options_.sec_disk_level) ? 1 : 0;
+}
+
+std::string DBImpl::getDBName(int level) {
+    return PathForLevel(level) != 0 ? dbname_secndry_disk_ : dbname_disk_;
+}
+
+std::string DBImpl::getDBNameFilenum(int level, uint64_t filenumber) {
+    return TableFileName(getDBName(level), filenumber);
+}
+
 void DBImpl::DeleteObsoleteFiles() {
     if (!bg_error_.ok()) {
         // After a background error, we don't know whether a new version may
@@ -326,11 +455,16 @@ void DBImpl::DeleteObsoleteFiles() {
 
     std::vector<std::string> filenames;
     std::vector<std::string> filenames_mem;
+    std::vector<std::string> filenames_sec;
     env_->GetChildren(dbname_disk_, &filenames); // Ignoring errors on purpose
     if (dbname_disk_ != dbname_mem_) {
         env_->GetChildren(dbname_mem_, &filenames_mem); // Ignoring errors on purpose
         filenames.insert(filenames.end(), filenames_mem.begin(), filenames_mem.end());
     }
+    if (!dbname_secndry_disk_.empty() && dbname_secndry_disk_ != dbname_disk_) {
+        env_->GetChildren(dbname_secndry_disk_, &filenames_sec); // Ignoring errors on purpose
+        filenames.insert(filenames.end(), filenames_sec.begin(), filenames_sec.end());
+    }
     uint64_t number;
     FileType type;
     for (size_t i = 0; i < filenames.size(); i++) {
@@ -374,6 +508,8 @@ void DBImpl::DeleteObsoleteFiles() {
                         static_cast<unsigned long long>(number));
                 if (find(filenames_mem.begin(), filenames_mem.end(), filenames[i]) != filenames_mem.end())
                     env_->DeleteFile(dbname_mem_ + "/" + filenames[i]);
+                else if (find(filenames_sec.begin(), filenames_sec.end(), filenames[i]) != filenames_sec.end())
+                    env_->DeleteFile(dbname_secndry_disk_ + "/" + filenames[i]);
                 else
                     env_->DeleteFile(dbname_disk_ + "/" + filenames[i]);
             }
@@ -390,6 +526,9 @@ Status DBImpl::Recover(VersionEdit* edit, bool *save_manifest) {
     // may already exist from a previous failed creation attempt.
     env_->CreateDir(dbname_disk_);
     env_->CreateDir(dbname_mem_);
+    if (!dbname_secndry_disk_.empty()) {
+        env_->CreateDir(dbname_secndry_disk_);
+    }
     assert(db_lock_ == NULL);
     Status s = env_->LockFile(LockFileName(dbname_disk_), &db_lock_);
     if (!s.ok()) {
@@ -448,6 +587,16 @@ Status DBImpl::Recover(VersionEdit* edit, bool *save_manifest) {
         filenames.insert(filenames.end(), filenames_mem.begin(), filenames_mem.end());
     }
 
+    //Tables of the deeper levels
+    if (!dbname_secndry_disk_.empty() && dbname_secndry_disk_ != dbname_disk_) {
+        std::vector<std::string> filenames_sec;
+        s = env_->GetChildren(dbname_secndry_disk_, &filenames_sec);
+        if (!s.ok()) {
+            return s;
+        }
+        filenames.insert(filenames.end(), filenames_sec.begin(), filenames_sec.end());
+    }
+
     std::set<uint64_t> expected;
     versions_->AddLiveFiles(&expected);
     uint64_t number;
@@ -476,10 +625,25 @@ Status DBImpl::Recover(VersionEdit* edit, bool *save_manifest) {
     // Recover in the order in which the logs were generated
     std::sort(logs.begin(), logs.end());
     std::sort(maps.begin(), maps.end());
-    if (maps.size() > 0 || logs.size() > 0) {
+    if (options_.per_core_wal) {
+        // The map files are not durable in this mode: everything
+        // acknowledged since the last level-0 flush is in the segments.
+        if (logs.size() > 0) {
+            s = RecoverLogFile(logs, false, save_manifest, edit, &max_sequence);
+            if (!s.ok()) {
+                return s;
+            }
+            for (size_t i = 0; i < logs.size(); i++) {
+                versions_->MarkFileNumberUsed(logs[i]);
+            }
+        }
+        for (size_t i = 0; i < maps.size(); i++) {
+            versions_->MarkFileNumberUsed(maps[i]);
+        }
+    } else if (maps.size() > 0 || logs.size() > 0) {
 
         if (maps.size() == 0) {
-            RecoverLogFile(logs[0], true, save_manifest, edit, &max_sequence);
+            RecoverLogFile(std::vector<uint64_t>(1, logs[0]), true, save_manifest, edit, &max_sequence);
             versions_->MarkFileNumberUsed(logs[0]);
             //NoveLSM: Set the NVM memtable map file with incrementing
             //log number
@@ -504,11 +668,11 @@ Status DBImpl::Recover(VersionEdit* edit, bool *save_manifest) {
                 RecoverMapFile(map_num, save_manifest, edit, &max_sequence);
                 versions_->MarkFileNumberUsed(map_num);
             }
-            RecoverLogFile(logs[0], true, save_manifest, edit, &max_sequence);
+            RecoverLogFile(std::vector<uint64_t>(1, logs[0]), true, save_manifest, edit, &max_sequence);
             versions_->MarkFileNumberUsed(logs[0]);
         }
         else {
-            RecoverLogFile(logs[0], true, save_manifest, edit, &max_sequence);
+            RecoverLogFile(std::vector<uint64_t>(1, logs[0]), true, save_manifest, edit, &max_sequence);
             versions_->MarkFileNumberUsed(logs[0]);
 
             //NoveLSM: TODO: Try to make all these blocks of NVM map file recovery
@@ -546,11 +710,22 @@ Status DBImpl::RecoverMapFile(uint64_t map_number, bool *save_manifest,
 
     MemTable *mem;
     options_.write_buffer_size = nvmbuff_;
-    ArenaNVM *arena= new ArenaNVM(options_.write_buffer_size, &fname, true);
+    ArenaNVM *arena= new ArenaNVM(options_.write_buffer_size, &fname, true,
+                                  options_.sub_mem_size);
     mem = new MemTable(internal_comparator_, *arena, true);
     mem->Ref();
     mem->isNVMMemtable = true;
-    *max_sequence = *(uint64_t *)((uint8_t*)arena->getMapStart() + sizeof(size_t));
+    // The sequence slot in the map header is never advanced by writers,
+    // so take the largest sequence number actually stored in the table.
+    Iterator* iter = mem->NewIterator();
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+        ParsedInternalKey ikey;
+        if (ParseInternalKey(iter->key(), &ikey) &&
+                ikey.sequence > *max_sequence) {
+            *max_sequence = ikey.sequence;
+        }
+    }
+    delete iter;
     mem_ = mem;
 
 #ifdef _ENABLE_DEBUG
@@ -561,7 +736,12 @@ Status DBImpl::RecoverMapFile(uint64_t map_number, bool *save_manifest,
 }
 
 
-Status DBImpl::RecoverLogFile(uint64_t log_number, bool last_log,
+// Orders log records (WriteBatch contents) by their first sequence number
+static bool RecordSequenceLess(const std::string& a, const std::string& b) {
+    return DecodeFixed64(a.data()) < DecodeFixed64(b.data());
+}
+
+Status DBImpl::RecoverLogFile(const std::vector<uint64_t>& log_numbers, bool last_log,
         bool* save_manifest, VersionEdit* edit,
         SequenceNumber* max_sequence) {
     struct LogReporter : public log::Reader::Reporter {
@@ -579,45 +759,62 @@ Status DBImpl::RecoverLogFile(uint64_t log_number, bool last_log,
 
     mutex_.AssertHeld();
 
-    // Open the log file
-    std::string fname = LogFileName(dbname_disk_, log_number);
-    SequentialFile* file;
-    Status status = env_->NewSequentialFile(fname, &file);
-    if (!status.ok()) {
-        MaybeIgnoreError(&status);
-        return status;
-    }
-
-    // Create the log reader.
-    LogReporter reporter;
-    reporter.env = env_;
-    reporter.info_log = options_.info_log;
-    reporter.fname = fname.c_str();
-    reporter.status = (options_.paranoid_checks ? &status : NULL);
-
-    // We intentionally make log::Reader do checksumming even if
-    // paranoid_checks==false so that corruptions cause entire commits
-    // to be skipped instead of propagating bad information (like overly
-    // large sequence numbers).
-    log::Reader reader(file, &reporter, true/*checksum*/,
-            0/*initial_offset*/);
-    Log(options_.info_log, "Recovering log #%llu",
-            (unsigned long long) log_number);
-
-    // Read all the records and add to a memtable
-    std::string scratch;
-    Slice record;
+    // Read all the records.  Per-core segments were appended to
+    // concurrently, so their records only line up once merged by sequence.
+    Status status;
+    std::vector<std::string> records;
+    for (size_t i = 0; i < log_numbers.size(); i++) {
+        // Open the log file
+        std::string fname = LogFileName(dbname_disk_, log_numbers[i]);
+        SequentialFile* file;
+        status = env_->NewSequentialFile(fname, &file);
+        if (!status.ok()) {
+            MaybeIgnoreError(&status);
+            return status;
+        }
+
+        // Create the log reader.
+        LogReporter reporter;
+        reporter.env = env_;
+        reporter.info_log = options_.info_log;
+        reporter.fname = fname.c_str();
+        reporter.status = (options_.paranoid_checks ? &status : NULL);
+
+        // We intentionally make log::Reader do checksumming even if
+        // paranoid_checks==false so that corruptions cause entire commits
+        // to be skipped instead of propagating bad information (like overly
+        // large sequence numbers).
+        log::Reader reader(file, &reporter, true/*checksum*/,
+                0/*initial_offset*/);
+        Log(options_.info_log, "Recovering log #%llu",
+                (unsigned long long) log_numbers[i]);
+
+        std::string scratch;
+        Slice record;
+        while (reader.ReadRecord(&record, &scratch) &&
+                status.ok()) {
+            if (record.size() < 12) {
+                reporter.Corruption(
+                        record.size(), Status::Corruption("log record too small"));
+                continue;
+            }
+            records.push_back(record.ToString());
+        }
+        delete file;
+        if (!status.ok()) {
+            return status;
+        }
+    }
+    if (log_numbers.size() > 1) {
+        std::stable_sort(records.begin(), records.end(), RecordSequenceLess);
+    }
+
+    // Add them to a memtable
     WriteBatch batch;
     int compactions = 0;
 
-    while (reader.ReadRecord(&record, &scratch) &&
-            status.ok()) {
-        if (record.size() < 12) {
-            reporter.Corruption(
-                    record.size(), Status::Corruption("log record too small"));
-            continue;
-        }
-        WriteBatchInternal::SetContents(&batch, record);
+    for (size_t i = 0; i < records.size(); i++) {
+        WriteBatchInternal::SetContents(&batch, records[i]);
 
         if (mem_ != NULL && mem_->ApproximateMemoryUsage() >= options_.write_buffer_size) {
             *save_manifest = true;
@@ -637,7 +834,7 @@ Status DBImpl::RecoverLogFile(uint64_t log_number, bool last_log,
             mem_->isNVMMemtable = false;
             mem_->Ref();
             options_.write_buffer_size = drambuff_;
-            logfile_number_ = log_number;
+            logfile_number_ = log_numbers.back();
         }
 
         status = WriteBatchInternal::InsertInto(&batch, mem_);
@@ -652,17 +849,26 @@ Status DBImpl::RecoverLogFile(uint64_t log_number, bool last_log,
             *max_sequence = last_seq;
         }
     }
-    delete file;
+
+    if (status.ok() && options_.per_core_wal && mem_ != NULL) {
+        // Segments are never reused: move what was replayed to level 0
+        // so the old generations can be deleted.
+        *save_manifest = true;
+        status = WriteLevel0Table(mem_, edit, NULL);
+        mem_->Unref();
+        mem_ = NULL;
+    }
 
     // See if we should keep reusing the last log file.
-    if (status.ok() && logfile_number_ == log_number) {
+    if (status.ok() && log_numbers.size() == 1 && logfile_number_ == log_numbers[0]) {
         assert(logfile_ == NULL);
         assert(log_ == NULL);
+        std::string fname = LogFileName(dbname_disk_, log_numbers[0]);
         uint64_t lfile_size;
         if (env_->GetFileSize(fname, &lfile_size).ok() &&
                 env_->NewAppendableFile(fname, &logfile_).ok()) {
             log_ = new log::Writer(logfile_, lfile_size);
-            logfile_number_ = log_number;
+            logfile_number_ = log_numbers[0];
         }
     }
     return status;
@@ -698,7 +904,8 @@ Status DBImpl::WriteLevel0Table(MemTable* mem, VersionEdit* edit,
     Status s;
     {
         mutex_.Unlock();
-        s = BuildTable(dbname_disk_, env_, options_, table_cache_, iter, &meta);
+        meta.path_id = PathForLevel(0);
+        s = BuildTable(getDBName(0), env_, options_, table_cache_, iter, &meta);
         mutex_.Lock();
     }
 
@@ -718,9 +925,13 @@ Status DBImpl::WriteLevel0Table(MemTable* mem, VersionEdit* edit,
         const Slice max_user_key = meta.largest.user_key();
         if (base != NULL) {
             level = base->PickLevelForMemTableOutput(min_user_key, max_user_key);
+            // The table was written for level-0's path
+            while (level > 0 && PathForLevel(level) != meta.path_id) {
+                level--;
+            }
         }
         edit->AddFile(level, meta.number, meta.file_size,
-                meta.smallest, meta.largest);
+                meta.smallest, meta.largest, meta.path_id);
     }
 
     CompactionStats stats;
@@ -756,7 +967,10 @@ void DBImpl::CompactBottomMemTable() {
 #else
         edit.SetLogNumber(logfile_number_);  // Earlier logs no longer needed
 #endif
-        s = versions_->LogAndApply(&edit, &mutex_);
+        if (wal_ != NULL) {
+            edit.SetLogNumber(MinLogNumberToKeep());
+        }
+        s = LogAndApply(&edit);
     }
 
     if (s.ok() && shutting_down_.Acquire_Load()) {
@@ -764,8 +978,14 @@ void DBImpl::CompactBottomMemTable() {
     }
 
     if (s.ok()) {
-        // Commit to the new state
-        imm_->Unref();
+        // Commit to the new state.  The sub-imms backing imm_ are now in
+        // level 0, so their map files are no longer needed for recovery;
+        // their memory goes with the last reference to imm_, once no
+        // reader that entered mem_ before the freeze can reach them.
+        for (size_t i = 0; i < imm_->subImmQue.size(); i++) {
+            env_->DeleteFile(imm_->subImmQue[i]->arena_.mfile);
+        }
+        RetireMemTable(imm_);
         imm_ = NULL;
         has_imm_.Release_Store(NULL);
         DeleteObsoleteFiles();
@@ -845,11 +1065,26 @@ Status DBImpl::TEST_CompactMemTable() {
     return s;
 }
 
+Status DBImpl::TEST_FreezeMergedTable() {
+    // A table still being flushed would keep the merged one from freezing
+    Status s = TEST_CompactMemTable();
+    if (!s.ok())
+        return s;
+    ArenaNVM *tmp_arena = reinterpret_cast<ArenaNVM*>(&mem_->arena_);
+    tmp_arena->setSubMemToImm();
+    WaitForMemTableWork();
+    compactImm(this);
+    WaitForMemTableWork();
+    return TEST_CompactMemTable();
+}
+
 void DBImpl::RecordBackgroundError(const Status& s) {
     mutex_.AssertHeld();
     if (bg_error_.ok()) {
         bg_error_ = s;
+        has_bg_error_.store(true);
         bg_cv_.SignalAll();
+        SignalRoomWaiters();
     }
 }
 
@@ -869,7 +1104,21 @@ void DBImpl::MaybeScheduleCompaction() {
     }
     else {
         bg_compaction_scheduled_ = true;
-        env_->Schedule(&DBImpl::BGWork, this);
+        env_->ScheduleOn(imm_ != NULL ? Env::kFlushPool : Env::kCompactionPool,
+                &DBImpl::BGWork, this);
+    }
+
+    // Further compactions take the inputs the scheduled one leaves free.
+    // Once one finds none, wait for a new version before trying again.
+    if (bg_compaction_scheduled_ &&
+            1 + bg_extra_compactions_ < options_.max_background_compactions &&
+            !shutting_down_.Acquire_Load() &&
+            bg_error_.ok() &&
+            manual_compaction_ == NULL &&
+            versions_->CurrentVersionNumber() != extra_idle_version_ &&
+            versions_->NeedsCompaction()) {
+        bg_extra_compactions_++;
+        env_->ScheduleOn(Env::kCompactionPool, &DBImpl::BGExtraWork, this);
     }
 }
 
@@ -879,7 +1128,8 @@ void DBImpl::ScheduleCompactionNow() {
         // Already scheduled
     }else {
         bg_compaction_scheduled_ = true;
-        env_->Schedule(&DBImpl::BGWork, this);
+        env_->ScheduleOn(imm_ != NULL ? Env::kFlushPool : Env::kCompactionPool,
+                &DBImpl::BGWork, this);
     }
 }
 
@@ -889,111 +1139,195 @@ void DBImpl::BGWork(void* db) {
 
 void DBImpl::skiplistBackgroundSync(void *db) {
     MemTable* tmp_mem = reinterpret_cast<DBImpl*>(db)->mem_;
-    int pending, index;
+    std::vector<char*> nodes;
     for(int i=0; i<tmp_mem->arena_.sub_mem_count; i++) {
         if(tmp_mem->arena_.sub_mem_bset[i] && !tmp_mem->arena_.in_trans_bset[i].load() && !tmp_mem->arena_.in_trans_bset[i].exchange(1)) {
-            pending = tmp_mem->sub_mem_pending_node[i].size();
-            index = tmp_mem->sub_mem_pending_node_index[i];
-            if(index < pending) {
-                char *buf;
-                for(int j=index; j<pending; j++){
-                    buf = tmp_mem->sub_mem_pending_node[i][j];
-                    tmp_mem->sub_mem_skiplist[i].Insert(buf);
-                }
-                tmp_mem->sub_mem_pending_node_index[i] = pending;
-            }
+            tmp_mem->TakePendingNodes(i, &nodes);
+            tmp_mem->InsertSubMemBatch(i, nodes);
             tmp_mem->arena_.in_trans_bset[i].store(0);
         }
     }
-    reinterpret_cast<DBImpl*>(db)->inSkiplistBgSync.store(0);
+    DBImpl* impl = reinterpret_cast<DBImpl*>(db);
+    impl->inSkiplistBgSync.store(0);
+    // Pairs with WaitForSkiplistSync(): a reader either sees the flag
+    // clear or is counted here before it sleeps.
+    if(impl->skiplist_sync_waiters_.load() > 0) {
+        MutexLock l(&impl->skiplist_sync_mu_);
+        impl->skiplist_sync_cv_.SignalAll();
+    }
 }
 
+void DBImpl::WaitForSkiplistSync() {
+    skiplist_sync_waiters_.fetch_add(1);
+    {
+        MutexLock l(&skiplist_sync_mu_);
+        while(inSkiplistBgSync.load())
+            skiplist_sync_cv_.Wait();
+    }
+    skiplist_sync_waiters_.fetch_sub(1);
+}
+
+void DBImpl::SubMemFull(void *db, int index) {
+    DBImpl* impl = reinterpret_cast<DBImpl*>(db);
+    work_struct *job = (work_struct*)malloc(sizeof(work_struct));
+    job->db = impl;
+    job->index = index;
+    impl->ScheduleMemTableWork(Env::kSubImmPool, &DBImpl::subImmToImm, (void*)job);
+}
+
+namespace {
+struct MemTableWork {
+    DBImpl* db;
+    void (*function)(void*);
+    void* arg;
+};
+}
+
+void DBImpl::ScheduleMemTableWork(Env::Pool pool, void (*function)(void*), void* arg) {
+    MemTableWork* work = new MemTableWork;
+    work->db = this;
+    work->function = function;
+    work->arg = arg;
+    bg_tasks_.fetch_add(1);
+    env_->ScheduleOn(pool, &DBImpl::RunMemTableWork, work);
+}
+
+void DBImpl::RunMemTableWork(void* arg) {
+    MemTableWork* work = reinterpret_cast<MemTableWork*>(arg);
+    DBImpl* impl = work->db;
+    (*work->function)(work->arg);
+    delete work;
+    // Work scheduled by the function was counted before this drops
+    if (impl->bg_tasks_.fetch_sub(1) == 1) {
+        MutexLock l(&impl->bg_tasks_mu_);
+        impl->bg_tasks_cv_.SignalAll();
+    }
+}
+
+void DBImpl::WaitForMemTableWork() {
+    MutexLock l(&bg_tasks_mu_);
+    while (bg_tasks_.load() > 0)
+        bg_tasks_cv_.Wait();
+}
+
+bool DBImpl::HasFreeSubMem() {
+    for(size_t i=0; i<mem_->arena_.sub_mem_count; i++) {
+        if(!mem_->arena_.sub_mem_bset[i].load())
+            return true;
+    }
+    return false;
+}
+
+void DBImpl::SignalRoomWaiters() {
+    MutexLock l(&room_mu_);
+    room_cv_.SignalAll();
+}
 
 
+/* Converts one sub-mem, queued by SubMemFull() when the arena marked it
+ * immutable, into a sub-imm on subImmQue and frees its region.
+ */
 void DBImpl::subImmToImm(void *work) {
     work_struct *p = (work_struct*)work;
     void *db = (void*)p->db;
-    int ImmNum = p->index;
+    int sub_imm_index = p->index;
     free(p);
-    if(ImmNum > reinterpret_cast<DBImpl*>(db)->subImm_thread){
-	    return ;
-    }
     MemTable* tmp_mem = reinterpret_cast<DBImpl*>(db)->mem_;
-    int sub_imm_index = -1;
-    int n = tmp_mem->arena_.sub_mem_count / reinterpret_cast<DBImpl*>(db)->subImm_thread;
-    int begin = n*ImmNum;
-    int end = begin + n;
-    if(!reinterpret_cast<DBImpl*>(db)->subImm_partition) {
-        begin = 0;
-        end = tmp_mem->arena_.sub_mem_count;
-    }
-
-retry:
-    for(int i=begin; i<end; i++)
-        if(tmp_mem->arena_.sub_immem_bset[i].load() 
-        && tmp_mem->arena_.sub_immem_bset[i].exchange(0)) {
-            sub_imm_index = i;
-            break;
-        }
-            
-    if(sub_imm_index == -1) {
-        if(reinterpret_cast<DBImpl*>(db)->subImmKill) {
-            subImmCount--;
-            return;
-        }
-        goto retry;
-    }
+
+    // A region queued twice is converted by whichever task claims it
+    if(!tmp_mem->arena_.sub_immem_bset[sub_imm_index].load()
+    || !tmp_mem->arena_.sub_immem_bset[sub_imm_index].exchange(0))
+        return;
     tmp_mem->arena_.sub_immem_count--;
     while(1) {
         if(!tmp_mem->arena_.in_trans_bset[sub_imm_index].load() && !tmp_mem->arena_.in_trans_bset[sub_imm_index].exchange(1))
             break;
     }
-
-    MemTable *imm = reinterpret_cast<DBImpl*>(db)->CreateNVMtable(false);
-    ArenaNVM *imm_arena = (ArenaNVM*)&imm->arena_;
-    imm_arena->isDataLock = 0;
-    imm_arena->AllocateFallbackNVM(SUB_MEM_SIZE);
-
-    int pending = tmp_mem->sub_mem_pending_node[sub_imm_index].size();
-    int index = tmp_mem->sub_mem_pending_node_index[sub_imm_index];
-    if(index < pending) {
-        char *buf;
-        for(int j=index; j<pending; j++){
-            buf = tmp_mem->sub_mem_pending_node[sub_imm_index][j];
-            tmp_mem->sub_mem_skiplist[sub_imm_index].Insert(buf);
+    // Writers that allocated in the region before it filled up may still
+    // be copying or indexing their entries
+    reinterpret_cast<ArenaNVM*>(&tmp_mem->arena_)->WaitForEntries(sub_imm_index);
+
+    std::vector<char*> nodes;
+    tmp_mem->TakePendingNodes(sub_imm_index, &nodes);
+    tmp_mem->InsertSubMemBatch(sub_imm_index, nodes);
+
+    // Keep mapfile_number_ on the active memtable's map file
+    MemTable *imm = reinterpret_cast<DBImpl*>(db)->CreateNVMtable(true);
+    ArenaNVM *mem_arena = reinterpret_cast<ArenaNVM*>(&tmp_mem->arena_);
+    char *region = mem_arena->DetachSubMem(sub_imm_index);
+    if (region != NULL) {
+        // A spare region takes over the sub-mem, so the sub-imm keeps
+        // this one and its entries and nodes stay where they are
+        imm->arena_.map_start_ = region;
+        imm->adopted_region = region;
+        imm->region_owner = mem_arena;
+        tmp_mem->MoveSubMemIndex(sub_imm_index, imm, 0);
+        tmp_mem->CopySubMemFence(sub_imm_index, imm, 0);
+    } else {
+        // No spare left: copy the region out so it can be reused.  The
+        // copy goes to a recycled block, returned when the sub-imm is.
+        region = tmp_mem->arena_.sub_mem_base[sub_imm_index];
+        char *copy = imm->arena_.sub_mem_pool->Allocate();
+        imm->arena_.map_start_ = copy;
+        imm->owned_arena->map_start_ = copy;
+        imm->adopted_region = copy;
+        memcpy(copy, region, tmp_mem->arena_.sub_mem_size);
+        // Repoint the nodes at the copy while they are still in the
+        // sub-mem; readers reaching them from there see identical bytes.
+        MemTable::Table::Iterator iter(&tmp_mem->sub_mem_skiplist[sub_imm_index]);
+        const intptr_t off = (char*)imm->arena_.map_start_ - region;
+        for (iter.SeekToFirst(); iter.Valid(); iter.Next()) {
+            iter.set_key_offset((char*)((intptr_t)iter.key_offset() + off));
         }
-        tmp_mem->sub_mem_pending_node_index[sub_imm_index] = pending;
-    }
-
-    memcpy(imm->arena_.map_start_, tmp_mem->arena_.map_start_ + SUB_MEM_SIZE * sub_imm_index, SUB_MEM_SIZE);
-    for(int i=0; i < tmp_mem->table_.kMaxHeight; i++) {
-        imm->table_.head_->SetNext(i, tmp_mem->sub_mem_skiplist[sub_imm_index].head_->Next(i));
-        tmp_mem->sub_mem_skiplist[sub_imm_index].head_->SetNext(i, NULL);
-    }
-    MemTable::Table::Iterator iter(&imm->table_);
-    char* new_off;
-    char *off;
-    off = (char*)imm->arena_.map_start_ - (char*)(tmp_mem->arena_.map_start_ + SUB_MEM_SIZE * sub_imm_index);
-    for (iter.SeekToFirst(); iter.Valid(); iter.Next()) {
-        new_off = (intptr_t)iter.key_offset() + off;
-        iter.set_key_offset(new_off);
-    }
-
-    tmp_mem->sub_mem_pending_node[sub_imm_index].clear();
-    tmp_mem->sub_mem_pending_node_index[sub_imm_index] = 0;
-
-    imm->arena_.blocks_ = tmp_mem->arena_.skiplist_blocks[sub_imm_index];
-    tmp_mem->arena_.skiplist_blocks[sub_imm_index].clear();
+        tmp_mem->MoveSubMemIndex(sub_imm_index, imm, off);
+        tmp_mem->CopySubMemFence(sub_imm_index, imm, off);
+    }
+    // Also carries the list height over so lookups in the sub-imm descend
+    // from the top level instead of walking level 0
+    tmp_mem->sub_mem_skiplist[sub_imm_index].ShareWith(&imm->table_);
+
+    // The sub-imm's own arena frees the node blocks when it is released.
+    // A writer may still be carving nodes out of the region's current
+    // block, so that one stays with the region and is handed to the next
+    // sub-imm converted from it, which is never released before this one.
+    std::vector<char*> &blocks = tmp_mem->arena_.skiplist_blocks[sub_imm_index];
+    if (!blocks.empty()) {
+        char *cur_block = blocks.back();
+        blocks.pop_back();
+        imm->arena_.skiplist_blocks[0].swap(blocks);
+        blocks.push_back(cur_block);
+    }
+
+    // The sub-imm takes over the region's log generation.  It is queued
+    // before the region's stamp is cleared and the region is released,
+    // so MinLogNumberToKeep() always finds the stamp in one of the two.
+    imm->logfile_number = tmp_mem->sub_mem_log_number[sub_imm_index].load();
+    imm->Ref();
+    size_t queued;
+    {
+        MutexLock l(&tmp_mem->subImmQueMu);
+        tmp_mem->subImmQue.push_front(imm);
+        queued = tmp_mem->subImmQue.size();
+        tmp_mem->subImmQueLen.store(queued, std::memory_order_release);
+    }
+    // Get_submem() probes the sub-mems before subImmQue, so the entries
+    // leave the sub-mem only after the sub-imm holding them is queued.
+    // Iterators that might not have seen the sub-imm rebuild onto it.
+    reinterpret_cast<DBImpl*>(db)->sub_mem_conversions_.fetch_add(1);
+    tmp_mem->sub_mem_skiplist[sub_imm_index].Clear();
+    tmp_mem->ResetSubMemFilter(sub_imm_index);
+    tmp_mem->sub_mem_log_number[sub_imm_index].store(~0ull);
 
     tmp_mem->arena_.sub_immem_bset[sub_imm_index].store(false);
     tmp_mem->arena_.sub_mem_bset[sub_imm_index].store(false);
-
-    while(tmp_mem->isQueBusy.load());
-    tmp_mem->subImmQue.push_front(imm);
     tmp_mem->arena_.in_trans_bset[sub_imm_index].store(0);
 
-    sub_imm_index = -1;
-    goto retry;
+    DBImpl* impl = reinterpret_cast<DBImpl*>(db);
+    // Writers in MakeRoomForWrite() may be waiting for a free region
+    impl->SignalRoomWaiters();
+    if(impl->compactImm_threshold > 0 && queued > impl->compactImm_threshold
+    && !impl->inCompactImm.load())
+        impl->ScheduleMemTableWork(Env::kMemTableSyncPool, &DBImpl::compactImm, impl);
 }
 
 void DBImpl::compactImm(void* db) {
@@ -1009,33 +1343,242 @@ void DBImpl::compactImm(void* db) {
     MemTable* sub_imm;
     std::deque<MemTable*> tmp_subImmQue;
 loop:
-    if(!tmp_mem->isQueBusy.load() && !tmp_mem->isQueBusy.exchange(1)){
+    reinterpret_cast<DBImpl*>(db)->mem_epoch_.fetch_add(1);
+    {
+        MutexLock l(&tmp_mem->subImmQueMu);
         std::swap(tmp_subImmQue, tmp_mem->subImmQue);
+        tmp_mem->subImmQueLen.store(0, std::memory_order_release);
+        // Account for their logs before they leave subImmQue
+        DBImpl* impl = reinterpret_cast<DBImpl*>(db);
+        for(size_t i=0; i<tmp_subImmQue.size(); i++) {
+            if(tmp_subImmQue[i]->logfile_number < impl->merged_log_number_.load())
+                impl->merged_log_number_.store(tmp_subImmQue[i]->logfile_number);
+        }
     }
-    else{
-        return;
-    }
-    tmp_mem->isQueBusy.store(0);
 
+    reinterpret_cast<DBImpl*>(db)->MergeSubImms(tmp_mem, tmp_subImmQue);
     for(int i=0; i<tmp_subImmQue.size(); i++) {
         sub_imm = tmp_subImmQue[i];
-        MemTable::Table::Iterator iter(&(sub_imm->table_));
-        iter.SeekToFirst();
-        void *p;
-        while(iter.Valid()){
-            p = (void*)iter.node_;
-            iter.Next();
-            tmp_mem->table_.InsertNode(p);
-        }
         reinterpret_cast<DBImpl*>(db)->compactImmQue.push_back(sub_imm);
     }
     tmp_subImmQue.clear();
-    if(tmp_mem->subImmQue.size() > reinterpret_cast<DBImpl*>(db)->compactImm_threshold){
+    reinterpret_cast<DBImpl*>(db)->mem_epoch_.fetch_add(1);
+    if(tmp_mem->subImmQueLen.load() > reinterpret_cast<DBImpl*>(db)->compactImm_threshold){
 		goto loop;
 	}
-    reinterpret_cast<DBImpl*>(db)->inCompactImm.store(0);
+    reinterpret_cast<DBImpl*>(db)->freezeMergedTable();
+    reinterpret_cast<DBImpl*>(db)->ReleaseCompactImm();
+}
+
+void DBImpl::AcquireCompactImm() {
+    MutexLock l(&compact_imm_mu_);
+    while(inCompactImm.exchange(1))
+        compact_imm_cv_.Wait();
+}
+
+void DBImpl::ReleaseCompactImm() {
+    MutexLock l(&compact_imm_mu_);
+    inCompactImm.store(0);
+    compact_imm_cv_.SignalAll();
+}
+
+namespace {
+// The partition merges of one compactImm() pass, shared by the thread
+// running it and the helpers it schedules.  runs[p * sub_imms + i] is
+// the run of sub-imm i that belongs in partition p.  Whoever drops the
+// last reference frees it.
+struct PartitionMerge {
+    MemTable* mem;
+    int parts;
+    size_t sub_imms;
+    std::vector<MemTable::Table::Run> runs;
+    std::atomic<int> next;      // Next partition to claim
+    std::atomic<int> refs;
+    port::Mutex mu;
+    port::CondVar cv;
+    int done;                   // Partitions merged; guarded by mu
+    PartitionMerge() : cv(&mu), done(0) { }
+};
+
+// Claim and merge partitions until none is left
+void MergeClaimedPartitions(PartitionMerge* job) {
+    int p;
+    while ((p = job->next.fetch_add(1)) < job->parts) {
+        job->mem->MergeIntoPartition(p, &job->runs[p * job->sub_imms], job->sub_imms);
+        MutexLock l(&job->mu);
+        if (++job->done == job->parts)
+            job->cv.SignalAll();
+    }
+}
+
+void UnrefPartitionMerge(PartitionMerge* job) {
+    if (job->refs.fetch_sub(1) == 1)
+        delete job;
+}
+
+void PartitionMergeHelper(void* arg) {
+    PartitionMerge* job = reinterpret_cast<PartitionMerge*>(arg);
+    MergeClaimedPartitions(job);
+    UnrefPartitionMerge(job);
+}
+}  // namespace
+
+void DBImpl::MergeSubImms(MemTable* mem, const std::deque<MemTable*>& sub_imms) {
+    if (sub_imms.empty())
+        return;
+    if (!mem->HasPartitionBounds())
+        mem->LearnPartitionBounds(sub_imms);
+    mem->IndexSubImms(sub_imms);
+
+    const int parts = mem->NumPartitions();
+    PartitionMerge* job = new PartitionMerge;
+    job->mem = mem;
+    job->parts = parts;
+    job->sub_imms = sub_imms.size();
+    job->runs.resize(parts * sub_imms.size());
+    job->next.store(0);
+    std::vector<MemTable::Table::Run> split(parts);
+    for (size_t i = 0; i < sub_imms.size(); i++) {
+        mem->SplitForPartitions(sub_imms[i], &split[0]);
+        for (int p = 0; p < parts; p++) {
+            job->runs[p * sub_imms.size() + i] = split[p];
+        }
+    }
+
+    // The memtable sync pool may be running this very call, so its
+    // threads only help: whatever they do not claim is merged here.
+    int helpers = std::min(parts, options_.memtable_sync_threads) - 1;
+    if (helpers < 0)
+        helpers = 0;
+    job->refs.store(helpers + 1);
+    for (int i = 0; i < helpers; i++) {
+        ScheduleMemTableWork(Env::kMemTableSyncPool, &PartitionMergeHelper, job);
+    }
+    MergeClaimedPartitions(job);
+    {
+        MutexLock l(&job->mu);
+        while (job->done < parts)
+            job->cv.Wait();
+    }
+    UnrefPartitionMerge(job);
+}
+
+/* Freezes the merged skiplist (mem_->table_) into imm_ once enough
+ * sub-imms have been merged into it, and hands it to the background
+ * compaction thread to be written out as level-0 tables.
+ * Caller must own inCompactImm so nothing is inserted concurrently.
+ */
+void DBImpl::freezeMergedTable() {
+    if (flushImm_threshold == 0 || compactImmQue.size() < flushImm_threshold)
+        return;
+
+    MutexLock l(&mutex_);
+    if (imm_ != NULL || shutting_down_.Acquire_Load() || !bg_error_.ok()) {
+        // Previous table is still being flushed; keep merging into mem_
+        return;
+    }
+    if (versions_->NumLevelFiles(0) >= options_.level0_stop_writes_trigger) {
+        // Let compactions drain level 0 first
+        MaybeScheduleCompaction();
+        return;
+    }
+    MemTable* frozen = new MemTable(internal_comparator_);
+    frozen->isNVMMemtable = false;
+    frozen->SetPartitions(mem_->NumPartitions());
+    frozen->Ref();
+
+    // Publish imm_ before the merged entries move from mem_'s partitions
+    // to imm_'s.  A Get() that sampled imm_ before this misses them
+    // meanwhile, so the odd mem_epoch_ makes it retry.
+    mem_epoch_.fetch_add(1);
+    imm_ = frozen;
+    has_imm_.Release_Store(imm_);
+    mem_->TransferPartitionsTo(imm_);
+    mem_epoch_.fetch_add(1);
+    // imm_ now owns the sub-imms its nodes live in
+    imm_->subImmQue.swap(compactImmQue);
+    imm_->subImmQueLen.store(imm_->subImmQue.size());
+    imm_->logfile_number = merged_log_number_.exchange(~0ull);
+
+    if (wal_ != NULL) {
+        Status s = RollLog();
+        if (!s.ok()) {
+            RecordBackgroundError(s);
+        }
+    }
+    MaybeScheduleCompaction();
 }
 
+uint64_t DBImpl::EnterMemRead() {
+    mutex_.AssertHeld();
+    mem_readers_[read_epoch_]++;
+    return read_epoch_;
+}
+
+void DBImpl::ExitMemRead(uint64_t epoch) {
+    mutex_.AssertHeld();
+    std::map<uint64_t, int>::iterator it = mem_readers_.find(epoch);
+    assert(it != mem_readers_.end());
+    if (--it->second == 0) {
+        mem_readers_.erase(it);
+        ReclaimMemTables();
+    }
+}
+
+// Readers in epochs up to the one "mem" retires in may still hold nodes
+// of its partitions, reached through mem_ before the freeze moved them.
+void DBImpl::RetireMemTable(MemTable* mem) {
+    mutex_.AssertHeld();
+    retired_mems_.push_back(std::make_pair(read_epoch_++, mem));
+    ReclaimMemTables();
+}
+
+void DBImpl::ReclaimMemTables() {
+    mutex_.AssertHeld();
+    const uint64_t oldest = mem_readers_.empty() ? read_epoch_
+                                                 : mem_readers_.begin()->first;
+    while (!retired_mems_.empty() && retired_mems_.front().first < oldest) {
+        retired_mems_.front().second->Unref();
+        retired_mems_.pop_front();
+    }
+}
+
+Status DBImpl::RollLog() {
+    mutex_.AssertHeld();
+    std::vector<uint64_t> numbers(wal_->NumSegments());
+    for (size_t i = 0; i < numbers.size(); i++) {
+        numbers[i] = versions_->NewFileNumber();
+    }
+    wal_->Roll(numbers);
+    return Status::OK();
+}
+
+uint64_t DBImpl::MinLogNumberToKeep() {
+    mutex_.AssertHeld();
+    uint64_t min_log = std::min(wal_->Generation(), wal_->OldestPinned());
+    // Live sub-mems before subImmQue: subImmToImm() queues a sub-imm
+    // before it clears the stamp of the region it came from.
+    for (size_t i = 0; i < mem_->arena_.sub_mem_count; i++) {
+        uint64_t n = mem_->sub_mem_log_number[i].load();
+        if (n < min_log)
+            min_log = n;
+    }
+    {
+        MutexLock l(&mem_->subImmQueMu);
+        for (size_t i = 0; i < mem_->subImmQue.size(); i++) {
+            if (mem_->subImmQue[i]->logfile_number < min_log)
+                min_log = mem_->subImmQue[i]->logfile_number;
+        }
+        if (merged_log_number_.load() < min_log)
+            min_log = merged_log_number_.load();
+    }
+    // LogAndApply() requires the log number never to move backwards
+    if (min_log < versions_->LogNumber())
+        min_log = versions_->LogNumber();
+    return min_log;
+}
+
+
 
 void DBImpl::BackgroundCall() {
     MutexLock l(&mutex_);
@@ -1060,7 +1603,8 @@ void DBImpl::BackgroundCompaction() {
 
     mutex_.AssertHeld();
 
-    if (versions_->NumLevelFiles(0) < config::kL0_SlowdownWritesTrigger && imm_ != NULL) {
+    if (versions_->NumLevelFiles(0) < options_.level0_slowdown_writes_trigger &&
+            imm_ != NULL) {
         CompactBottomMemTable();
         return;
     }
@@ -1069,6 +1613,10 @@ void DBImpl::BackgroundCompaction() {
     bool is_manual = (manual_compaction_ != NULL);
     InternalKey manual_end;
     if (is_manual) {
+        // A manual compaction takes its inputs whole
+        while (bg_extra_compactions_ > 0) {
+            bg_cv_.Wait();
+        }
         ManualCompaction* m = manual_compaction_;
         c = versions_->CompactRange(m->level, m->begin, m->end);
         m->done = (c == NULL);
@@ -1083,22 +1631,73 @@ void DBImpl::BackgroundCompaction() {
                 (m->done ? "(end)" : manual_end.DebugString().c_str()));
     } else {
         c = versions_->PickCompaction();
+        if (c != NULL) {
+            // Others may run alongside on the inputs left
+            MaybeScheduleCompaction();
+        }
+    }
+
+    Status status = RunCompaction(c, is_manual, true);
+
+    if (is_manual) {
+        ManualCompaction* m = manual_compaction_;
+        if (!status.ok()) {
+            m->done = true;
+        }
+        if (!m->done) {
+            // We only compacted part of the requested range.  Update *m
+            // to the range that is left to be compacted.
+            m->tmp_storage = manual_end;
+            m->begin = &m->tmp_storage;
+        }
+        manual_compaction_ = NULL;
+    }
+}
+
+void DBImpl::BGExtraWork(void* db) {
+    reinterpret_cast<DBImpl*>(db)->BackgroundExtraCall();
+}
+
+void DBImpl::BackgroundExtraCall() {
+    MutexLock l(&mutex_);
+    assert(bg_extra_compactions_ > 0);
+    Compaction* c = NULL;
+    if (!shutting_down_.Acquire_Load() && bg_error_.ok() &&
+            manual_compaction_ == NULL) {
+        c = versions_->PickCompaction();
     }
+    if (c == NULL) {
+        extra_idle_version_ = versions_->CurrentVersionNumber();
+    } else {
+        MaybeScheduleCompaction();
+        RunCompaction(c, false, false);
+    }
+    bg_extra_compactions_--;
+    if (c != NULL) {
+        MaybeScheduleCompaction();
+    }
+    bg_cv_.SignalAll();
+}
 
+Status DBImpl::RunCompaction(Compaction* c, bool is_manual, bool flush_imm) {
+    mutex_.AssertHeld();
     Status status;
     if (c == NULL) {
         // Nothing to do
-    } else if (!is_manual && c->IsTrivialMove()) {
-        // Move file to next level
+    } else if (!is_manual && c->IsTrivialMove() &&
+            c->input(0, 0)->path_id == PathForLevel(c->level() + 1)) {
+        // Move file to next level.  A file that has to change paths is
+        // rewritten by a compaction instead.
         assert(c->num_input_files(0) == 1);
         FileMetaData* f = c->input(0, 0);
         c->edit()->DeleteFile(c->level(), f->number);
         c->edit()->AddFile(c->level() + 1, f->number, f->file_size,
-                f->smallest, f->largest);
-        status = versions_->LogAndApply(c->edit(), &mutex_);
+                f->smallest, f->largest, f->path_id);
+        status = LogAndApply(c->edit());
         if (!status.ok()) {
             RecordBackgroundError(status);
         }
+        c->MarkBeingCompacted(false);
         VersionSet::LevelSummaryStorage tmp;
         Log(options_.info_log, "Moved #%lld to level-%d %lld bytes %s: %s\n",
                 static_cast<unsigned long long>(f->number),
@@ -1108,11 +1707,13 @@ void DBImpl::BackgroundCompaction() {
                 versions_->LevelSummary(&tmp));
     } else {
         CompactionState* compact = new CompactionState(c);
-        status = DoCompactionWork(compact);
+        status = DoCompactionWork(compact, flush_imm);
         if (!status.ok()) {
             RecordBackgroundError(status);
         }
         CleanupCompaction(compact);
+        // Before the inputs can go with the input version
+        c->MarkBeingCompacted(false);
         c->ReleaseInputs();
         DeleteObsoleteFiles();
     }
@@ -1126,20 +1727,7 @@ void DBImpl::BackgroundCompaction() {
         Log(options_.info_log,
                 "Compaction error: %s", status.ToString().c_str());
     }
-
-    if (is_manual) {
-        ManualCompaction* m = manual_compaction_;
-        if (!status.ok()) {
-            m->done = true;
-        }
-        if (!m->done) {
-            // We only compacted part of the requested range.  Update *m
-            // to the range that is left to be compacted.
-            m->tmp_storage = manual_end;
-            m->begin = &m->tmp_storage;
-        }
-        manual_compaction_ = NULL;
-    }
+    return status;
 }
 
 void DBImpl::CleanupCompaction(CompactionState* compact) {
@@ -1169,13 +1757,15 @@ Status DBImpl::OpenCompactionOutputFile(CompactionState* compact) {
         pending_outputs_.insert(file_number);
         CompactionState::Output out;
         out.number = file_number;
+        out.path_id = PathForLevel(compact->compaction->level() + 1);
         out.smallest.Clear();
         out.largest.Clear();
         compact->outputs.push_back(out);
         mutex_.Unlock();
     }
 
-    std::string fname = TableFileName(dbname_disk_, file_number);
+    std::string fname = getDBNameFilenum(compact->compaction->level() + 1,
+            file_number);
     Status s = env_->NewWritableFile(fname, &compact->outfile);
     if (s.ok()) {
         compact->builder = new TableBuilder(options_, compact->outfile);
@@ -1220,7 +1810,8 @@ Status DBImpl::FinishCompactionOutputFile(CompactionState* compact,
         // Verify that the table is usable
         Iterator* iter = table_cache_->NewIterator(ReadOptions(),
                 output_number,
-                current_bytes);
+                current_bytes,
+                compact->current_output()->path_id);
         s = iter->status();
         delete iter;
         if (s.ok()) {
@@ -1251,36 +1842,22 @@ Status DBImpl::InstallCompactionResults(CompactionState* compact) {
         const CompactionState::Output& out = compact->outputs[i];
         compact->compaction->edit()->AddFile(
                 level + 1,
-                out.number, out.file_size, out.smallest, out.largest);
+                out.number, out.file_size, out.smallest, out.largest,
+                out.path_id);
     }
-    return versions_->LogAndApply(compact->compaction->edit(), &mutex_);
+    return LogAndApply(compact->compaction->edit());
 }
 
 
-Status DBImpl::DoCompactionWork(CompactionState* compact) {
-    const uint64_t start_micros = env_->NowMicros();
-    int64_t imm_micros = 0;  // Micros spent doing imm_ compactions
-
-    Log(options_.info_log,  "Compacting %d@%d + %d@%d files",
-            compact->compaction->num_input_files(0),
-            compact->compaction->level(),
-            compact->compaction->num_input_files(1),
-            compact->compaction->level() + 1);
-
-    assert(versions_->NumLevelFiles(compact->compaction->level()) > 0);
-    assert(compact->builder == NULL);
-    assert(compact->outfile == NULL);
-    if (snapshots_.empty()) {
-        compact->smallest_snapshot = versions_->LastSequence();
+Status DBImpl::DoSubcompactionWork(CompactionState* compact,
+        int64_t* imm_micros) {
+    Iterator* input = versions_->MakeInputIterator(compact->compaction);
+    if (compact->start != NULL) {
+        InternalKey start(*compact->start, kMaxSequenceNumber, kValueTypeForSeek);
+        input->Seek(start.Encode());
     } else {
-        compact->smallest_snapshot = snapshots_.oldest()->number_;
+        input->SeekToFirst();
     }
-
-    // Release mutex while we're actually doing the compaction work
-    mutex_.Unlock();
-
-    Iterator* input = versions_->MakeInputIterator(compact->compaction);
-    input->SeekToFirst();
     Status status;
     ParsedInternalKey ikey;
     std::string current_user_key;
@@ -1289,7 +1866,7 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
 
     for (; input->Valid() && !shutting_down_.Acquire_Load(); ) {
         // Prioritize immutable compaction work
-        if (has_imm_.NoBarrier_Load() != NULL) {
+        if (imm_micros != NULL && has_imm_.NoBarrier_Load() != NULL) {
             const uint64_t imm_start = env_->NowMicros();
             mutex_.Lock();
             if (imm_ != NULL) {
@@ -1297,10 +1874,16 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
                 bg_cv_.SignalAll();  // Wakeup MakeRoomForWrite() if necessary
             }
             mutex_.Unlock();
-            imm_micros += (env_->NowMicros() - imm_start);
+            *imm_micros += (env_->NowMicros() - imm_start);
         }
         Slice key = input->key();
-        if (compact->compaction->ShouldStopBefore(key) &&
+        if (compact->end != NULL &&
+                user_comparator()->Compare(ExtractUserKey(key),
+                        *compact->end) >= 0) {
+            // The rest belongs to the next subcompaction
+            break;
+        }
+        if (compact->compaction->ShouldStopBefore(key, &compact->cursor) &&
                 compact->builder != NULL) {
             status = FinishCompactionOutputFile(compact, input);
             if (!status.ok()) {
@@ -1330,7 +1913,8 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
                 drop = true;    // (A)
             } else if (ikey.type == kTypeDeletion &&
                     ikey.sequence <= compact->smallest_snapshot &&
-                    compact->compaction->IsBaseLevelForKey(ikey.user_key)) {
+                    compact->compaction->IsBaseLevelForKey(ikey.user_key,
+                            &compact->cursor)) {
                 // For this user key:
                 // (1) there is no data in higher levels
                 // (2) data in lower levels will have larger sequence numbers
@@ -1381,6 +1965,110 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
     }
     delete input;
     input = NULL;
+    return status;
+}
+
+Status DBImpl::RunSubcompactions(CompactionState* compact,
+        const std::vector<std::string>& bounds, int64_t* imm_micros) {
+    Log(options_.info_log, "Compacting in %d subcompactions",
+            static_cast<int>(bounds.size() + 1));
+    SubcompactionJob* job = new SubcompactionJob;
+    job->db = this;
+    for (size_t i = 0; i <= bounds.size(); i++) {
+        CompactionState* sub = new CompactionState(compact->compaction);
+        sub->smallest_snapshot = compact->smallest_snapshot;
+        sub->start = (i == 0) ? NULL : &bounds[i - 1];
+        sub->end = (i == bounds.size()) ? NULL : &bounds[i];
+        job->subs.push_back(sub);
+    }
+    const int helpers = static_cast<int>(bounds.size());
+    job->refs += helpers;
+    for (int i = 0; i < helpers; i++) {
+        env_->ScheduleOn(Env::kCompactionPool, &DBImpl::BGSubcompaction, job);
+    }
+    job->Work(imm_micros);
+    {
+        MutexLock l(&job->mu);
+        while (job->done < job->subs.size()) {
+            job->cv.Wait();
+        }
+    }
+
+    // Outputs are in key order, as if one thread had written them
+    Status status;
+    for (size_t i = 0; i < job->subs.size(); i++) {
+        CompactionState* sub = job->subs[i];
+        if (status.ok()) {
+            status = sub->status;
+        }
+        compact->outputs.insert(compact->outputs.end(),
+                sub->outputs.begin(), sub->outputs.end());
+        compact->total_bytes += sub->total_bytes;
+        if (sub->builder != NULL) {
+            sub->builder->Abandon();
+            delete sub->builder;
+        }
+        delete sub->outfile;
+        delete sub;
+    }
+    job->Unref();
+    return status;
+}
+
+void DBImpl::BGSubcompaction(void* arg) {
+    SubcompactionJob* job = reinterpret_cast<SubcompactionJob*>(arg);
+    job->Work(NULL);
+    job->Unref();
+}
+
+// Serializes LogAndApply(), which releases mutex_ while it writes the
+// MANIFEST, among the flush and the compactions running concurrently
+Status DBImpl::LogAndApply(VersionEdit* edit) {
+    mutex_.AssertHeld();
+    while (manifest_writing_) {
+        bg_cv_.Wait();
+    }
+    manifest_writing_ = true;
+    Status s = versions_->LogAndApply(edit, &mutex_);
+    manifest_writing_ = false;
+    bg_cv_.SignalAll();
+    return s;
+}
+
+Status DBImpl::DoCompactionWork(CompactionState* compact, bool flush_imm) {
+    const uint64_t start_micros = env_->NowMicros();
+    int64_t imm_micros = 0;  // Micros spent doing imm_ compactions
+
+    Log(options_.info_log,  "Compacting %d@%d + %d@%d files",
+            compact->compaction->num_input_files(0),
+            compact->compaction->level(),
+            compact->compaction->num_input_files(1),
+            compact->compaction->level() + 1);
+
+    assert(versions_->NumLevelFiles(compact->compaction->level()) > 0);
+    assert(compact->builder == NULL);
+    assert(compact->outfile == NULL);
+    if (snapshots_.empty()) {
+        compact->smallest_snapshot = versions_->LastSequence();
+    } else {
+        compact->smallest_snapshot = snapshots_.oldest()->number_;
+    }
+
+    // Release mutex while we're actually doing the compaction work
+    mutex_.Unlock();
+
+    std::vector<std::string> bounds;
+    if (options_.max_subcompactions > 1) {
+        versions_->SubcompactionBoundaries(compact->compaction,
+                options_.max_subcompactions, &bounds);
+    }
+    Status status;
+    if (bounds.empty()) {
+        status = DoSubcompactionWork(compact, flush_imm ? &imm_micros : NULL);
+    } else {
+        status = RunSubcompactions(compact, bounds,
+                flush_imm ? &imm_micros : NULL);
+    }
 
     CompactionStats stats;
     stats.micros = env_->NowMicros() - start_micros - imm_micros;
@@ -1411,9 +2099,11 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
 namespace {
 struct IterState {
     port::Mutex* mu;
-    Version* version;
     MemTable* mem;
     MemTable* imm;
+    std::vector<MemTable*> sub_imms;
+    DBImpl* db;
+    uint64_t read_epoch;
 };
 
 static void CleanupIteratorState(void* arg1, void* arg2) {
@@ -1421,53 +2111,236 @@ static void CleanupIteratorState(void* arg1, void* arg2) {
     state->mu->Lock();
     state->mem->Unref();
     if (state->imm != NULL) state->imm->Unref();
-    state->version->Unref();
+    for (size_t i = 0; i < state->sub_imms.size(); i++)
+        state->sub_imms[i]->Unref();
+    state->db->ExitMemRead(state->read_epoch);
     state->mu->Unlock();
     delete state;
 }
+
+static void CleanupVersion(void* arg1, void* arg2) {
+    Version* version = reinterpret_cast<Version*>(arg1);
+    port::Mutex* mu = reinterpret_cast<port::Mutex*>(arg2);
+    mu->Lock();
+    version->Unref();
+    mu->Unlock();
+}
+
+// Forwards to an iterator owned by someone else, so that the merging
+// iterator around it can be rebuilt without rebuilding it
+class BorrowedIterator : public Iterator {
+public:
+    explicit BorrowedIterator(Iterator* iter) : iter_(iter) { }
+    virtual bool Valid() const { return iter_->Valid(); }
+    virtual void SeekToFirst() { iter_->SeekToFirst(); }
+    virtual void SeekToLast() { iter_->SeekToLast(); }
+    virtual void Seek(const Slice& target) { iter_->Seek(target); }
+    virtual void Next() { iter_->Next(); }
+    virtual void Prev() { iter_->Prev(); }
+    virtual Slice key() const { return iter_->key(); }
+    virtual Slice value() const { return iter_->value(); }
+    virtual Status status() const { return iter_->status(); }
+
+private:
+    Iterator* const iter_;
+};
+
+// Internal iterator that keeps returning the entries it was opened on
+// while sub-mems are converted and merged tables frozen under it.  Those
+// take entries out of the structures its memtable children walk, so when
+// one happens it rebuilds them over the new layout and puts them back on
+// the entry it was at.  The table children are kept until the version
+// changes.  The snapshot it holds keeps compactions from dropping the
+// entries it has yet to return.
+class MemLayoutIterator : public Iterator {
+public:
+    MemLayoutIterator(DBImpl* db, Env* env, const ReadOptions& options,
+            const Snapshot* snapshot)
+        : db_(db), env_(env), options_(options), snapshot_(snapshot),
+          iter_(NULL), version_(NULL), tables_(NULL),
+          epoch_(1), conversions_(0) { }
+
+    virtual ~MemLayoutIterator() {
+        delete iter_;
+        delete tables_;
+        if (snapshot_ != NULL)
+            db_->ReleaseSnapshot(snapshot_);
+    }
+
+    virtual bool Valid() const { return iter_ != NULL && iter_->Valid(); }
+    virtual Slice key() const { return iter_->key(); }
+    virtual Slice value() const { return iter_->value(); }
+    virtual Status status() const {
+        return iter_ != NULL ? iter_->status() : Status::OK();
+    }
+    virtual void SeekToFirst() { Run(kSeekToFirst, Slice()); }
+    virtual void SeekToLast() { Run(kSeekToLast, Slice()); }
+    virtual void Seek(const Slice& target) { Run(kSeek, target); }
+    virtual void Next() { Run(kNext, Slice()); }
+    virtual void Prev() { Run(kPrev, Slice()); }
+
+private:
+    enum Op { kSeekToFirst, kSeekToLast, kSeek, kNext, kPrev };
+
+    // True if nothing moved since the children were built
+    bool Current() const {
+        return (epoch_ & 1) == 0 && db_->mem_epoch_.load() == epoch_ &&
+               db_->sub_mem_conversions_.load() == conversions_;
+    }
+
+    void Rebuild() {
+        epoch_ = db_->mem_epoch_.load();
+        conversions_ = db_->sub_mem_conversions_.load();
+        Iterator* old = iter_;
+        Iterator* old_tables = NULL;
+        iter_ = db_->NewMemLayoutChildren(options_, &version_, &tables_,
+                                          &old_tables);
+        // "old" borrows "old_tables"
+        delete old;
+        delete old_tables;
+    }
+
+    void Apply(Op op, const Slice& target, bool resume) {
+        switch (op) {
+        case kSeekToFirst: iter_->SeekToFirst(); break;
+        case kSeekToLast: iter_->SeekToLast(); break;
+        case kSeek: iter_->Seek(target); break;
+        case kNext:
+            if (resume) {
+                // The entry itself may be gone, e.g. a dropped deletion
+                iter_->Seek(saved_);
+                if (iter_->Valid() && iter_->key() == Slice(saved_))
+                    iter_->Next();
+            } else {
+                iter_->Next();
+            }
+            break;
+        case kPrev:
+            if (resume) {
+                iter_->Seek(saved_);
+                if (iter_->Valid())
+                    iter_->Prev();
+                else
+                    iter_->SeekToLast();
+            } else {
+                iter_->Prev();
+            }
+            break;
+        }
+    }
+
+    void Run(Op op, const Slice& target) {
+        const bool step = (op == kNext || op == kPrev);
+        if (step)
+            saved_.assign(iter_->key().data(), iter_->key().size());
+        bool resume = false;
+        // A step that raced with a move is redone over the new layout.
+        // Each try only has to outlast one step, so unlike Get() it does
+        // not hold the moves off.
+        for (;;) {
+            if (iter_ == NULL || !Current()) {
+                Rebuild();
+                resume = step;
+            }
+            Apply(op, step ? Slice(saved_) : target, resume);
+            if (Current())
+                break;
+            env_->SleepForMicroseconds(0);
+        }
+    }
+
+    DBImpl* const db_;
+    Env* const env_;
+    const ReadOptions options_;
+    const Snapshot* const snapshot_;
+    Iterator* iter_;
+    Version* version_;          // Version tables_ iterates
+    Iterator* tables_;          // Table children, borrowed by iter_
+    uint64_t epoch_;            // mem_epoch_ when iter_ was built
+    uint64_t conversions_;      // sub_mem_conversions_ then
+    std::string saved_;         // Entry Next() or Prev() resumes from
+};
 }  // namespace
 
-Iterator* DBImpl::NewInternalIterator(const ReadOptions& options,
-        SequenceNumber* latest_snapshot,
-        uint32_t* seed) {
+Iterator* DBImpl::NewMemLayoutChildren(const ReadOptions& options,
+        Version** version, Iterator** tables, Iterator** old_tables) {
     IterState* cleanup = new IterState;
-    mutex_.Lock();
-    *latest_snapshot = versions_->LastSequence();
+    MutexLock l(&mutex_);
+
+    Version* current = versions_->current();
+    if (*version != current) {
+        std::vector<Iterator*> table_list;
+        current->AddIterators(options, &table_list);
+        Iterator* iter = NewMergingIterator(&internal_comparator_,
+                table_list.empty() ? NULL : &table_list[0], table_list.size());
+        current->Ref();
+        iter->RegisterCleanup(CleanupVersion, current, &mutex_);
+        *old_tables = *tables;
+        *tables = iter;
+        *version = current;
+    }
 
     // Collect together all needed child iterators
     std::vector<Iterator*> list;
     list.push_back(mem_->NewIterator());
     mem_->Ref();
-
-    if(!inSkiplistBgSync.load() && !inSkiplistBgSync.exchange(1)) {
-        skiplistBackgroundSync((void*)this);
-    }
-    else {
-        while(!inSkiplistBgSync.load());
-    }
-
-    if(mem_->subImmQue.size() && !inCompactImm.load()){
-	    compactImm((void*)this);
+    if (imm_ != NULL) {
+        list.push_back(imm_->NewIterator());
+        imm_->Ref();
     }
 
     for(int i=0; i<mem_->arena_.sub_mem_count; i++) {
         if(mem_->arena_.sub_mem_bset[i].load() || mem_->arena_.sub_immem_bset[i].load())
 	        list.push_back(mem_->NewSubMemIterator(i));
     }
-    versions_->current()->AddIterators(options, &list);
+    {
+        // Sub-imms converted since compactImm() last ran
+        MutexLock q(&mem_->subImmQueMu);
+        for (size_t i = 0; i < mem_->subImmQue.size(); i++) {
+            MemTable* sub_imm = mem_->subImmQue[i];
+            list.push_back(sub_imm->NewIterator());
+            sub_imm->Ref();
+            cleanup->sub_imms.push_back(sub_imm);
+        }
+    }
+    list.push_back(new BorrowedIterator(*tables));
     Iterator* internal_iter =
             NewMergingIterator(&internal_comparator_, &list[0], list.size());
-    versions_->current()->Ref();
 
     cleanup->mu = &mutex_;
     cleanup->mem = mem_;
     cleanup->imm = imm_;
-    cleanup->version = versions_->current();
+    cleanup->db = this;
+    cleanup->read_epoch = EnterMemRead();
     internal_iter->RegisterCleanup(CleanupIteratorState, cleanup, NULL);
+    return internal_iter;
+}
+
+Iterator* DBImpl::NewInternalIterator(const ReadOptions& options,
+        SequenceNumber* latest_snapshot,
+        uint32_t* seed) {
+    if(!mem_->concurrent_inserts) {
+        if(!inSkiplistBgSync.load() && !inSkiplistBgSync.exchange(1)) {
+            skiplistBackgroundSync((void*)this);
+        }
+        else {
+            WaitForSkiplistSync();
+        }
+    }
 
+    // compactImm() may freeze the merged table, which takes mutex_
+    if(mem_->subImmQueLen.load() && !inCompactImm.load()){
+	    compactImm((void*)this);
+    }
+
+    // The children are built by the first Seek*()
+    MutexLock l(&mutex_);
+    *latest_snapshot = versions_->LastSequence();
+    const Snapshot* snapshot = NULL;
+    if (options.snapshot == NULL)
+        snapshot = snapshots_.New(*latest_snapshot);
     *seed = ++seed_;
-    mutex_.Unlock();
-    return internal_iter;
+    return new MemLayoutIterator(this, env_, options, snapshot);
 }
 
 Iterator* DBImpl::TEST_NewInternalIterator() {
@@ -1568,14 +2441,16 @@ Status DBImpl::Get(const ReadOptions& options,
                    std::string* value) {
   Status s;
 
-  if(!inSkiplistBgSync.load() && !inSkiplistBgSync.exchange(1)) {
-    skiplistBackgroundSync((void*)this);
-  }
-  else {
-    while(!inSkiplistBgSync.load());
+  if(!mem_->concurrent_inserts) {
+    if(!inSkiplistBgSync.load() && !inSkiplistBgSync.exchange(1)) {
+      skiplistBackgroundSync((void*)this);
+    }
+    else {
+      WaitForSkiplistSync();
+    }
   }
 
-  if(mem_->subImmQue.size() && !inCompactImm.load()){
+  if(mem_->subImmQueLen.load() && !inCompactImm.load()){
 	compactImm((void*)this);
   }
 
@@ -1587,25 +2462,77 @@ Status DBImpl::Get(const ReadOptions& options,
     snapshot = versions_->LastSequence();
   }
 
-  MemTable* mem = mem_;
-  g_mem = mem_;
-  mem->Ref();
+  bool pinned = false;
+  for (int retries = 1; ; retries++) {
+    const uint64_t epoch = mem_epoch_.load();
+    MemTable* mem = mem_;
+    MemTable* imm = imm_;
+    Version* current = versions_->current();
+    g_mem = mem_;
+    mem->Ref();
+    if (imm != NULL) imm->Ref();
+    current->Ref();
+    const uint64_t read_epoch = EnterMemRead();
 
-  Version::GetStats stats;
+    bool have_stat_update = false;
+    Version::GetStats stats;
 
-  {
+    {
+      mutex_.Unlock();
+      LookupKey lkey(key, snapshot);
+      // Newest data first: live sub-mems and sub-imms not yet merged, the
+      // merged skiplist, the frozen table being flushed, then the SSTables.
+      bool in_mem = true;
+      if (mem->Get_submem(lkey, value, &s) ||
+          mem->Get(lkey, value, &s)) {
+          incr_mem_hits();
+      } else if (imm != NULL && imm->Get(lkey, value, &s)) {
+          incr_imm_hits();
+      } else {
+          in_mem = false;
+      }
+      // Only the memtable probes need the entries held still; merges
+      // and freezes may go ahead during the table reads.
+      if (pinned)
+          ReleaseCompactImm();
+      if (!in_mem) {
+          s = current->Get(options, lkey, value, &stats);
+          have_stat_update = true;
+          if (s.ok())
+              incr_sstable_hits();
+      }
+      mutex_.Lock();
+    }
+
+    if (have_stat_update && current->UpdateStats(stats)) {
+      MaybeScheduleCompaction();
+    }
+    mem->Unref();
+    if (imm != NULL) imm->Unref();
+    current->Unref();
+    ExitMemRead(read_epoch);
+
+    if (pinned) {
+      return s;
+    }
+    if ((epoch & 1) == 0 && mem_epoch_.load() == epoch) {
+      return s;
+    }
+    // Entries moved while we looked; the answer may come from an older
+    // copy or miss the key altogether.
+    value->clear();
+    s = Status::OK();
     mutex_.Unlock();
-    LookupKey lkey(key, snapshot);
-    if(mem->Get_submem(lkey, value, &s)) {}
-    else {
-        mem_->Get(lkey, value, &s);
+    if (retries < kMaxGetRetries) {
+      env_->SleepForMicroseconds(0);
+    } else {
+      // Still racing: own inCompactImm like compactImm() does, so that
+      // neither it nor freezeMergedTable() moves entries meanwhile
+      AcquireCompactImm();
+      pinned = true;
     }
-end:
     mutex_.Lock();
   }
-
-  mem->Unref();
-  return s;
 }
 
 Iterator* DBImpl::NewIterator(const ReadOptions& options) {
@@ -1655,16 +2582,37 @@ Status DBImpl::Write(const WriteOptions& options, WriteBatch* my_batch) {
     Status status;
     status = MakeRoomForWrite(my_batch == NULL);
 
-    if (status.ok() && my_batch != NULL) { 
+    if (status.ok() && my_batch != NULL &&
+            WriteBatchInternal::Count(my_batch) > 0) {
         WriteBatch* updates = my_batch;
 
+        // Each batch owns a contiguous range of sequence numbers, so
+        // concurrent writers never share one and the newest version of a
+        // key wins regardless of which sub-mem it landed in.
+        const uint64_t count = WriteBatchInternal::Count(updates);
+        const SequenceNumber first = versions_->AllocateSequence(count);
+        WriteBatchInternal::SetSequence(updates, first);
         {
-            status = Status::OK();
+            // Logged before the insert, so a write is never visible before
+            // it is durable.  The sub-mem is stamped with the generation of
+            // the segment holding the record, which stays pinned until
+            // then so that MinLogNumberToKeep() cannot drop it meanwhile.
+            PerCoreLog::Position pos;
+            pos.generation = 0;
+            if (wal_ != NULL) {
+                status = wal_->AddRecord(WriteBatchInternal::Contents(updates),
+                        options.sync, &pos);
+            }
             if (status.ok()) {
-                status = WriteBatchInternal::InsertInto(updates, mem_);
+                status = WriteBatchInternal::InsertInto(updates, mem_,
+                        pos.generation);
+                if (wal_ != NULL)
+                    wal_->Unpin(pos);
             }
         }
-        versions_->SetLastSequence(WriteBatchInternal::Count(updates));
+        // Published even on failure, or every later writer would wait
+        // on this range forever.
+        versions_->PublishSequence(first, first + count - 1);
     }
     assert(mem_->GetNumKeys());
     return status;
@@ -1751,15 +2699,24 @@ MemTable* DBImpl::CreateNVMtable(bool assign_map){
     uint64_t new_map_number = versions_->NewFileNumber();
     size_t size = 0;
     std::string filename = MapFileName(dbname_mem_, new_map_number);
-    size = nvmbuff_;
+    // A sub-imm (assign_map) only ever holds the one region it takes
+    // over, so its per-sub-mem metadata is sized for that region alone
+    size = assign_map ? options_.sub_mem_size : nvmbuff_;
     if (!assign_map)
         mapfile_number_ = new_map_number;
-    ArenaNVM *arena= new ArenaNVM(size, &filename, false);
+    ArenaNVM *arena= new ArenaNVM(size, &filename, false, options_.sub_mem_size);
 #else
     ArenaNVM *arena= new ArenaNVM();
 #endif
     mem = new MemTable(internal_comparator_, *arena, false);
     mem->isNVMMemtable = true;
+    mem->concurrent_inserts = options_.concurrent_memtable_insert;
+    if (!assign_map) {
+        mem->SetPartitions(options_.subImm_partition);
+        if (options_.memtable_hash_index)
+            mem->EnableHashIndex(flushImm_threshold + compactImm_threshold);
+    }
+    mem->owned_arena = arena;
     assert(mem);
     return mem;
 }
@@ -1793,42 +2750,55 @@ int DBImpl::SwapMemtables() {
  * making room for DRAM memtable
  */
 Status DBImpl::MakeRoomForWrite(bool force) {
-    mutex_.AssertHeld();
-    assert(!writers_.empty());
     Status s;
+    bool allow_delay = !force;
 
     while (true) {
-        int tmp_imm_count = 0;
-        int tmp_mem_count = 0;
-        for(int i=0; i<mem_->arena_.sub_mem_count; i++) {
-            if(mem_->arena_.sub_immem_bset[i].load())
-                tmp_imm_count++;
-            if(mem_->arena_.sub_mem_bset[i].load())
-                tmp_mem_count++;
-        }
-        if (!bg_error_.ok()) {
+        if (has_bg_error_.load()) {
             // Yield previous error
+            MutexLock l(&mutex_);
             s = bg_error_;
             break;
-        } else if (tmp_imm_count && !subImmCount.exchange(1)) {
-            work_struct *job;
-            for(int i=0; i<subImm_thread; i++) {
-                job = (work_struct*)malloc(sizeof(work_struct));
-                job->db = this;
-                job->index = i;
-                env_->Schedule(&DBImpl::subImmToImm, (void*)job);
-                job = NULL;
-            }
+        } else if (shutting_down_.Acquire_Load()) {
+            s = Status::IOError("Deleting DB during write");
             break;
-        } else if(compactImm_threshold>0 && mem_->subImmQue.size()>compactImm_threshold && !inCompactImm.load()) {
-                env_->Schedule(&DBImpl::compactImm, (void*)this);
-        } else if (tmp_mem_count < mem_->arena_.sub_mem_count)
-                break;
+        } else if (allow_delay &&
+                   versions_->NumLevel0FilesRelaxed() >=
+                   options_.level0_slowdown_writes_trigger) {
+            // We are getting close to hitting a hard limit on the number of
+            // L0 files.  Rather than delaying a single write by several
+            // seconds when we hit the hard limit, start delaying each
+            // individual write by 1ms to reduce latency variance.  Also,
+            // this delay hands over some CPU to the compaction thread in
+            // case it is sharing the same core as the writer.
+            env_->SleepForMicroseconds(1000);
+            allow_delay = false;  // Do not delay a single write more than once
+        } else if (versions_->NumLevel0FilesRelaxed() >=
+                   options_.level0_stop_writes_trigger) {
+            // There are too many level-0 files; wait for compactions
+            MutexLock l(&mutex_);
+            Log(options_.info_log, "Too many L0 files; waiting...\n");
+            MaybeScheduleCompaction();
+            while (versions_->NumLevelFiles(0) >= options_.level0_stop_writes_trigger &&
+                   bg_error_.ok() && !shutting_down_.Acquire_Load())
+                bg_cv_.Wait();
+        } else if (HasFreeSubMem()) {
+            break;
+        } else {
+            // Every region is filling or being converted; sleep until
+            // subImmToImm() frees one.  Full regions were queued for
+            // conversion by the arena when it marked them immutable.
+            MutexLock l(&room_mu_);
+            while (!HasFreeSubMem() && !has_bg_error_.load() &&
+                   !shutting_down_.Acquire_Load())
+                room_cv_.Wait();
+        }
     }
 
-    if(skiplistSync_threshold>0 && mem_->GetNumKeys()>1 && (mem_->GetNumKeys() % skiplistSync_threshold == 1) 
+    if(!mem_->concurrent_inserts
+    && skiplistSync_threshold>0 && mem_->GetNumKeys()>1 && (mem_->GetNumKeys() % skiplistSync_threshold == 1) 
     && !inSkiplistBgSync.load() && !inSkiplistBgSync.exchange(1)) {
-        env_->Schedule(&DBImpl::skiplistBackgroundSync, (void*)this);
+        ScheduleMemTableWork(Env::kMemTableSyncPool, &DBImpl::skiplistBackgroundSync, (void*)this);
     }
 
     return s;
@@ -1880,6 +2850,25 @@ bool DBImpl::GetProperty(const Slice& property, std::string* value) {
             }
         }
         return true;
+    } else if (in == "background-pools") {
+        char buf[200];
+        snprintf(buf, sizeof(buf), "%-14s %7s %7s %10s %12s %12s\n",
+                "Pool", "Threads", "Queued", "Scheduled", "Wait(ms)", "MaxWait(ms)");
+        value->append(buf);
+        for (int p = 0; p < Env::kNumPools; p++) {
+            Env::Pool pool = static_cast<Env::Pool>(p);
+            Env::PoolStats stats;
+            if (!env_->GetPoolStats(pool, &stats)) {
+                return false;
+            }
+            snprintf(buf, sizeof(buf), "%-14s %7d %7llu %10llu %12.3f %12.3f\n",
+                    Env::PoolName(pool), stats.threads,
+                    static_cast<unsigned long long>(stats.queue_depth),
+                    static_cast<unsigned long long>(stats.scheduled),
+                    stats.wait_micros / 1e3, stats.max_wait_micros / 1e3);
+            value->append(buf);
+        }
+        return true;
     } else if (in == "sstables") {
         *value = versions_->current()->DebugString();
         return true;
@@ -2001,7 +2990,6 @@ Status DB::Open(const Options& options, const std::string& dbname_disk,
     VersionEdit edit;
 
     size_t subMemSize = SUB_MEM_SIZE;
-    subImmCount.store(0);
 
     // Recover handles create_if_missing, error_if_exists
     bool save_manifest = false;
@@ -2015,15 +3003,24 @@ Status DB::Open(const Options& options, const std::string& dbname_disk,
         if (s.ok() && (impl->mem_ == NULL)) {
 #endif
             // Create new log and a corresponding memtable.
-            uint64_t new_log_number = impl->versions_->NewFileNumber();
-            WritableFile* lfile;
-            //Save log in disk for now
-            s = options.env->NewWritableFile(LogFileName(dbname_disk, new_log_number),
-                    &lfile);
+            uint64_t new_log_number = 0;
+            if (options.per_core_wal) {
+                // One segment per core, files opened on first append
+                impl->wal_ = new PerCoreLog(options.env, dbname_disk,
+                        sysconf(_SC_NPROCESSORS_ONLN));
+            } else {
+                new_log_number = impl->versions_->NewFileNumber();
+                WritableFile* lfile;
+                //Save log in disk for now
+                s = options.env->NewWritableFile(LogFileName(dbname_disk, new_log_number),
+                        &lfile);
+                if (s.ok()) {
+                    edit.SetLogNumber(new_log_number);
+                    impl->logfile_ = lfile;
+                    impl->log_ = new log::Writer(lfile);
+                }
+            }
             if (s.ok()) {
-                edit.SetLogNumber(new_log_number);
-                impl->logfile_ = lfile;
-                impl->log_ = new log::Writer(lfile);
                 if (impl->mem_ == NULL) {
                     if (init_pqos() != 0) {
                         (void)close_pqos();
@@ -2034,7 +3031,8 @@ Status DB::Open(const Options& options, const std::string& dbname_disk,
                     std::string filename = MapFileName(impl->dbname_mem_, new_map_number);
                     size = impl->nvmbuff_;
                     impl->mapfile_number_ = new_map_number;
-                    ArenaNVM *arena= new ArenaNVM(size, &filename, false);
+                    ArenaNVM *arena= new ArenaNVM(size, &filename, false,
+                                                  impl->options_.sub_mem_size);
                     if(impl->isFirstArena) {
                         arena->isDataLock = impl->isFirstArena;
                         arena->dlock_way = options.dlock_way;
@@ -2050,6 +3048,14 @@ Status DB::Open(const Options& options, const std::string& dbname_disk,
 #endif
                     impl->mem_ = new MemTable(impl->internal_comparator_, *arena, false);
                     impl->mem_->isNVMMemtable = true;
+                    impl->mem_->concurrent_inserts = options.concurrent_memtable_insert;
+                    impl->mem_->SetPartitions(options.subImm_partition);
+                    if (options.memtable_hash_index)
+                        impl->mem_->EnableHashIndex(impl->flushImm_threshold +
+                                                    impl->compactImm_threshold);
+                    // Fault in a node slab for every sub-mem up front, so
+                    // that the first writes and rotations find them pooled
+                    arena->sub_mem_pool->Reserve(arena->sub_mem_count);
 
 #if defined(ENABLE_RECOVERY)
                     impl->logfile_number_ = new_log_number;
@@ -2058,10 +3064,15 @@ Status DB::Open(const Options& options, const std::string& dbname_disk,
 #endif
                     impl->mem_->Ref();
                 }
+                if (impl->wal_ != NULL) {
+                    s = impl->RollLog();
+                }
             }
         }
 
-        if (s.ok() && save_manifest) {
+        // With a per-core WAL the old segments were replayed and the old
+        // map files are stale, so always record the new generation.
+        if (s.ok() && (save_manifest || impl->wal_ != NULL)) {
             edit.SetPrevLogNumber(0);  // No older logs needed after recovery.
 #ifdef ENABLE_RECOVERY
             uint64_t max = (impl->logfile_number_ > impl->mapfile_number_) ? impl->logfile_number_ : impl->mapfile_number_;
@@ -2070,9 +3081,16 @@ Status DB::Open(const Options& options, const std::string& dbname_disk,
 #else
             edit.SetLogNumber(impl->logfile_number_);
 #endif
+            if (impl->wal_ != NULL) {
+                edit.SetLogNumber(impl->wal_->Generation());
+            }
             s = impl->versions_->LogAndApply(&edit, &impl->mutex_);
         }
         if (s.ok()) {
+            // From now on every sub-mem that fills up is queued for
+            // conversion on the background executor
+            reinterpret_cast<ArenaNVM*>(&impl->mem_->arena_)->SetSubMemFullHook(
+                    &DBImpl::SubMemFull, impl);
             impl->DeleteObsoleteFiles();
             impl->MaybeScheduleCompaction();
         }
@@ -2102,6 +3120,10 @@ Status DB::Open(const Options& options, const std::string& dbname_disk,
             }
         }
         filenames.insert(filenames.end(), filenames_mem.begin(), filenames_mem.end());
+        std::vector<std::string> filenames_sec;
+        if (options.sec_diskpath != NULL) {
+            env->GetChildren(options.sec_diskpath, &filenames_sec);
+        }
 
         FileLock* lock;
         const std::string lockname = LockFileName(dbname_disk);
@@ -2122,6 +3144,20 @@ Status DB::Open(const Options& options, const std::string& dbname_disk,
                     }
                 }
             }
+            // The secondary path only ever holds tables
+            for (size_t i = 0; i < filenames_sec.size(); i++) {
+                if (ParseFileName(filenames_sec[i], &number, &type) &&
+                        type == kTableFile) {
+                    Status del = env->DeleteFile(std::string(options.sec_diskpath) +
+                            "/" + filenames_sec[i]);
+                    if (result.ok() && !del.ok()) {
+                        result = del;
+                    }
+                }
+            }
+            if (options.sec_diskpath != NULL) {
+                env->DeleteDir(options.sec_diskpath);  // Ignore error in case dir contains other files
+            }
             env->UnlockFile(lock);  // Ignore error since state is already gone
             env->DeleteFile(lockname);
             env->DeleteDir(dbname_disk);  // Ignore error in case dir contains other files
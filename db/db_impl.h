@@ -6,9 +6,11 @@
 #define STORAGE_LEVELDB_DB_DB_IMPL_H_
 #include <unistd.h>
 #include <deque>
+#include <map>
 #include <set>
 #include "db/dbformat.h"
 #include "db/log_writer.h"
+#include "db/percore_log.h"
 #include "db/snapshot.h"
 #include "leveldb/db.h"
 #include "leveldb/env.h"
@@ -23,6 +25,7 @@
 
 namespace leveldb {
 
+class Compaction;
 class MemTable;
 class TableCache;
 class Version;
@@ -87,6 +90,10 @@ public:
     // Force current memtable contents to be compacted.
     Status TEST_CompactMemTable();
 
+    // Convert every sub-mem, merge the sub-imms and freeze the merged
+    // table, then wait until it is flushed.
+    Status TEST_FreezeMergedTable();
+
     // Return an internal iterator over the current state of the database.
     // The keys of this iterator are internal keys (see format.h).
     // The returned iterator should be deleted when no longer needed.
@@ -148,22 +155,85 @@ public:
 
     bool isFirstArena;
     std::atomic_bool inSkiplistBgSync;
-    volatile bool subImmKill;
+    // Readers that find a pending-node sync in flight sleep here until
+    // it finishes
+    port::Mutex skiplist_sync_mu_;
+    port::CondVar skiplist_sync_cv_;
+    std::atomic<int> skiplist_sync_waiters_;
+    void WaitForSkiplistSync();
+
+    // Run "(*function)(arg)" on "pool" of env_, counted in bg_tasks_ so
+    // that the destructor can wait for this DB's memtable work alone.
+    void ScheduleMemTableWork(Env::Pool pool, void (*function)(void*), void* arg);
+    static void RunMemTableWork(void* work);
+    void WaitForMemTableWork();
+    std::atomic<int> bg_tasks_;
+    port::Mutex bg_tasks_mu_;
+    port::CondVar bg_tasks_cv_;
+    // Arena hook queueing the conversion of a full sub-mem
+    static void SubMemFull(void* db, int index);
+    // Writers wait on room_cv_ while no sub-mem region is free, until a
+    // background error or shutdown, which also signal it
+    port::Mutex room_mu_;
+    port::CondVar room_cv_;
+    bool HasFreeSubMem();
+    void SignalRoomWaiters();
 
     static void compactImm(void* db);
+    // Merge "sub_imms" into the partitions of "mem", several partitions
+    // at a time when the memtable sync pool has threads to spare.
+    // REQUIRES: caller owns inCompactImm.
+    void MergeSubImms(MemTable* mem, const std::deque<MemTable*>& sub_imms);
     std::deque<MemTable*> compactImmQue;
     std::atomic_bool inCompactImm;
+    // Blocking claim and release of inCompactImm for readers.  Waiters
+    // sleep on compact_imm_cv_, signalled whenever the flag is released.
+    port::Mutex compact_imm_mu_;
+    port::CondVar compact_imm_cv_;
+    void AcquireCompactImm();
+    void ReleaseCompactImm();
+    // Odd while compactImm() or freezeMergedTable() moves entries from
+    // one memtable structure to another.  They are invisible to lookups
+    // meanwhile, so Get() retries if it changed under it, and after
+    // kMaxGetRetries takes inCompactImm to hold both off.
+    std::atomic<uint64_t> mem_epoch_;
+    // Bumped by subImmToImm() before a sub-mem's entries leave it for
+    // their queued sub-imm.  Iterators rebuild their children when it or
+    // mem_epoch_ changes under them.
+    std::atomic<uint64_t> sub_mem_conversions_;
+    // Children of an iterator over the current layout of the memtables,
+    // and over "*tables", the tables of "*version", which the result
+    // borrows.  If "*version" is no longer current, both are replaced by
+    // the current ones first, and the old "*tables" is returned in
+    // "*old_tables" for the caller to delete after the old children.
+    Iterator* NewMemLayoutChildren(const ReadOptions& options,
+            Version** version, Iterator** tables, Iterator** old_tables);
+
+    // Readers that may walk mem_'s merged skiplist hold a read epoch from
+    // EnterMemRead() until ExitMemRead().  freezeMergedTable() moves its
+    // nodes to imm_, so once flushed, imm_ is retired rather than
+    // released: it and the sub-imms its nodes live in are freed only
+    // after every reader that entered before then has left.
+    // REQUIRES: mutex_ held
+    uint64_t EnterMemRead();
+    void ExitMemRead(uint64_t epoch);
 
     size_t skiplistSync_threshold;
     size_t compactImm_threshold;
     size_t subImm_partition;
     size_t subImm_thread;
+    size_t flushImm_threshold;
 
 private:
     friend class DB;
     struct CompactionState;
+    struct SubcompactionJob;
     struct Writer;
 
+    // Path id (see FileMetaData) of the tables of "level"
+    int PathForLevel(int level) const;
+
+    // Directory of the tables of "level"
     std::string getDBName(int level);
 
     //NoveLSM Also  take file number as input to decide where t
@@ -197,8 +267,10 @@ private:
     static void *read_thread(void *arg);
     bool thread_task(read_struct *str, std::string *value);
 
-    Status RecoverLogFile(uint64_t log_number, bool last_log, bool* save_manifest,
-            VersionEdit* edit, SequenceNumber* max_sequence)
+    // Replay the given log files.  Records from several files, e.g. the
+    // segments of a per-core WAL, are applied in sequence order.
+    Status RecoverLogFile(const std::vector<uint64_t>& log_numbers, bool last_log,
+            bool* save_manifest, VersionEdit* edit, SequenceNumber* max_sequence)
     EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 #ifdef ENABLE_RECOVERY
     Status RecoverMapFile(uint64_t map_number, bool* save_manifest,
@@ -219,13 +291,33 @@ private:
     static void BGWork(void* db);
     static void skiplistBackgroundSync(void* db);
     static void subImmToImm(void* work);
+    void freezeMergedTable();
+
+    // Per-core WAL: start a new generation of segments, and find the
+    // oldest log still holding entries that are not in level-0 tables
+    // yet, leaving out imm_ which is being written out.
+    Status RollLog() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+    uint64_t MinLogNumberToKeep() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
     void BackgroundCall();
     void  BackgroundCompaction() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+    static void BGExtraWork(void* db);
+    void BackgroundExtraCall();
+    // Move or merge the inputs of "c"; only the caller passing
+    // "flush_imm" also flushes imm_ meanwhile
+    Status RunCompaction(Compaction* c, bool is_manual, bool flush_imm)
+    EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+    Status LogAndApply(VersionEdit* edit) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
     void CleanupCompaction(CompactionState* compact)
     EXCLUSIVE_LOCKS_REQUIRED(mutex_);
-    Status DoCompactionWork(CompactionState* compact)
+    Status DoCompactionWork(CompactionState* compact, bool flush_imm)
     EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+    // Merge the inputs of compact->compaction in the key range of
+    // "compact".  Only the thread passed "imm_micros" also flushes imm_.
+    Status DoSubcompactionWork(CompactionState* compact, int64_t* imm_micros);
+    Status RunSubcompactions(CompactionState* compact,
+            const std::vector<std::string>& bounds, int64_t* imm_micros);
+    static void BGSubcompaction(void* job);
     void IterateMemAndPrint(MemTable *mem);
     Status OpenCompactionOutputFile(CompactionState* compact);
     Status FinishCompactionOutputFile(CompactionState* compact, Iterator* input);
@@ -271,7 +363,18 @@ private:
     uint64_t mapfile_number_;
 
     log::Writer* log_;
+    PerCoreLog* wal_;              // NULL unless options_.per_core_wal
+    // Oldest log generation among the sub-imms merged into mem_
+    // since the last freeze; updated under mem_->subImmQueMu.
+    std::atomic<uint64_t> merged_log_number_;
     uint32_t seed_;                // For sampling.
+
+    // Read epochs and retired memtables; guarded by mutex_
+    uint64_t read_epoch_;
+    std::map<uint64_t, int> mem_readers_;   // Readers in each epoch
+    std::deque<std::pair<uint64_t, MemTable*> > retired_mems_;
+    void RetireMemTable(MemTable* mem);
+    void ReclaimMemTables();
     bool use_multiple_levels;
     threadpool thpool;
 
@@ -288,6 +391,15 @@ private:
     // Has a background compaction been scheduled or is running?
     bool bg_compaction_scheduled_;
 
+    // Compactions scheduled alongside the one above, up to
+    // Options::max_background_compactions in all, and the number of the
+    // version in which the last of them found nothing to compact
+    int bg_extra_compactions_;
+    uint64_t extra_idle_version_;
+
+    // Is a LogAndApply() writing the MANIFEST?
+    bool manifest_writing_;
+
     // Information for a manual compaction
     struct ManualCompaction {
         int level;
@@ -302,6 +414,8 @@ private:
 
     // Have we encountered a background error in paranoid mode?
     Status bg_error_;
+    // Set along with bg_error_, for writers waiting without mutex_
+    std::atomic_bool has_bg_error_;
 
     // Per level compaction stats.  stats_[level] stores the stats for
     // compactions that produced data for the specified "level".
@@ -10,6 +10,9 @@
 #include "util/coding.h"
 #include "db/skiplist.h"
 #include "port/cache_flush.h"
+#include "util/mutexlock.h"
+#include "util/sub_mem_pool.h"
+#include <algorithm>
 #include <cstdio>
 #include <gnuwrapper.h>
 #include <string>
@@ -25,6 +28,7 @@ static Slice GetLengthPrefixedSlice(const char* data) {
     return Slice(p, len);
 }
 
+#ifdef _ENABLE_PREDICTION
 void MemTable::AddPredictIndex
                 (std::unordered_set<std::string> *set,
                         const uint8_t* data) {
@@ -37,11 +41,42 @@ int MemTable::CheckPredictIndex
     return this->bloom_.possiblyContains(data,
             (size_t)strlen((const char*)data));
 }
+#endif
 
 //TODO: Implement prediction clear
 void MemTable::ClearPredictIndex(std::unordered_set<std::string> *set) {
 }
 
+// Per sub-mem filter: a bit per 16 bytes of region, 16KB for a 2MB
+// region, i.e. about 7 bits per entry for 100-byte values.
+static const size_t kRegionBytesPerFilterBit = 16;
+static const uint8_t kSubMemFilterProbes = 6;
+// Per sub-mem hash index: room for a user key per 128 bytes of region,
+// 256KB for a 2MB region.  Regions of smaller entries overflow it, and
+// lookups fall back to the skiplist.
+static const size_t kRegionBytesPerIndexEntry = 128;
+
+// Skiplists sharing one arena, e.g. one per sub-memtable region.  Built
+// element by element since array new with constructor arguments is not
+// portable C++.
+static MemTable::Table* NewSkiplists(const MemTable::KeyComparator& cmp,
+        Arena* arena, size_t count, bool recovery) {
+    void* mem = ::operator new[](sizeof(MemTable::Table) * count);
+    MemTable::Table* lists = static_cast<MemTable::Table*>(mem);
+    for (size_t i = 0; i < count; i++) {
+        new (&lists[i]) MemTable::Table(cmp, arena, recovery);
+    }
+    return lists;
+}
+
+static void DeleteSkiplists(MemTable::Table* lists, size_t count) {
+    typedef MemTable::Table Table;
+    for (size_t i = 0; i < count; i++) {
+        lists[i].~Table();
+    }
+    ::operator delete[](lists);
+}
+
 void* MemTable::operator new(std::size_t sz) {
     return malloc(sz);
 }
@@ -59,16 +94,41 @@ MemTable::MemTable(const InternalKeyComparator& cmp)
   refs_(0),
   logfile_number(0),
   numkeys_(0),
+#ifdef _ENABLE_PREDICTION
   bloom_(BLOOMSIZE, BLOOMHASH),
+#endif
   table_(comparator_, &arena_),
   sub_imm_skiplist(comparator_, &arena_) {
-    sub_mem_skiplist = new Table[arena_.sub_mem_count](comparator_, &arena_);
+    owned_arena = NULL;
+    adopted_region = NULL;
+    region_owner = NULL;
+    concurrent_inserts = false;
+    sub_mem_skiplist = NewSkiplists(comparator_, &arena_, arena_.sub_mem_count, false);
     sub_mem_pending_node_index = (int*)malloc(sizeof(int) * arena_.sub_mem_count);
     sub_mem_pending_node = new std::vector<char*>[arena_.sub_mem_count];
-    isQueBusy.store(0);
+    sub_mem_pending_mu = new port::Mutex[arena_.sub_mem_count];
+    sub_mem_min_entry = new std::atomic<const char*>[arena_.sub_mem_count];
+    sub_mem_max_entry = new std::atomic<const char*>[arena_.sub_mem_count];
+    sub_mem_filter = new std::atomic<BlockedBloomFilter*>[arena_.sub_mem_count];
+    sub_mem_index = new std::atomic<MemTableIndex*>[arena_.sub_mem_count];
+    sub_mem_log_number = new std::atomic<uint64_t>[arena_.sub_mem_count];
+    num_partitions_ = 1;
+    partitions_ = NULL;
+    partition_max_entry_ = new std::atomic<const char*>[1];
+    partition_max_entry_[0].store(NULL);
+    partition_bounds_learned_ = false;
+    index_entries_ = 0;
+    index_.store(NULL);
+    min_entry_ = NULL;
+    max_entry_ = NULL;
+    subImmQueLen.store(0);
 
     for(int i=0; i<arena_.sub_mem_count; i++) {
         sub_mem_pending_node_index[i] = 0;
+        sub_mem_log_number[i].store(~0ull);
+        sub_mem_filter[i].store(NULL);
+        sub_mem_index[i].store(NULL);
+        ResetSubMemFilter(i);
     }
 }
 
@@ -78,25 +138,75 @@ MemTable::MemTable(const InternalKeyComparator& cmp, ArenaNVM& arena, bool recov
   logfile_number(0),
   arena_(arena),
   numkeys_(0),
+#ifdef _ENABLE_PREDICTION
   bloom_(BLOOMSIZE, BLOOMHASH),
+#endif
   table_(comparator_, &arena_, recovery),
   sub_imm_skiplist(comparator_, &arena_, recovery) {
     arena_.nvmarena_ = arena.nvmarena_;
-    sub_mem_skiplist = new Table[arena_.sub_mem_count](comparator_, &arena_, recovery);
+    owned_arena = NULL;
+    adopted_region = NULL;
+    region_owner = NULL;
+    concurrent_inserts = false;
+    sub_mem_skiplist = NewSkiplists(comparator_, &arena_, arena_.sub_mem_count, recovery);
     sub_mem_pending_node_index = (int*)malloc(sizeof(int) * arena_.sub_mem_count);
     sub_mem_pending_node = new std::vector<char*>[arena_.sub_mem_count];
-    isQueBusy.store(0);
+    sub_mem_pending_mu = new port::Mutex[arena_.sub_mem_count];
+    sub_mem_min_entry = new std::atomic<const char*>[arena_.sub_mem_count];
+    sub_mem_max_entry = new std::atomic<const char*>[arena_.sub_mem_count];
+    sub_mem_filter = new std::atomic<BlockedBloomFilter*>[arena_.sub_mem_count];
+    sub_mem_index = new std::atomic<MemTableIndex*>[arena_.sub_mem_count];
+    sub_mem_log_number = new std::atomic<uint64_t>[arena_.sub_mem_count];
+    num_partitions_ = 1;
+    partitions_ = NULL;
+    partition_max_entry_ = new std::atomic<const char*>[1];
+    partition_max_entry_[0].store(NULL);
+    partition_bounds_learned_ = false;
+    index_entries_ = 0;
+    index_.store(NULL);
+    min_entry_ = NULL;
+    max_entry_ = NULL;
+    subImmQueLen.store(0);
 
     for(int i=0; i<arena_.sub_mem_count; i++) {
         sub_mem_pending_node_index[i] = 0;
+        sub_mem_log_number[i].store(~0ull);
+        sub_mem_filter[i].store(NULL);
+        sub_mem_index[i].store(NULL);
+        ResetSubMemFilter(i);
     }
 }
 
 MemTable::~MemTable() {
     assert(refs_ == 0);
-    delete[] sub_mem_skiplist;
+    DeleteSkiplists(sub_mem_skiplist, arena_.sub_mem_count);
+    if (partitions_ != NULL)
+        DeleteSkiplists(partitions_, num_partitions_ - 1);
+    delete[] partition_max_entry_;
     free(sub_mem_pending_node_index);
     delete[] sub_mem_pending_node;
+    delete[] sub_mem_pending_mu;
+    delete[] sub_mem_min_entry;
+    delete[] sub_mem_max_entry;
+    for(size_t i=0; i<arena_.sub_mem_count; i++)
+        delete sub_mem_filter[i].load(std::memory_order_relaxed);
+    delete[] sub_mem_filter;
+    for(size_t i=0; i<arena_.sub_mem_count; i++)
+        delete sub_mem_index[i].load(std::memory_order_relaxed);
+    delete[] sub_mem_index;
+    delete index_.load(std::memory_order_relaxed);
+    delete[] sub_mem_log_number;
+    // Sub-imms whose nodes are still linked into this table
+    for (size_t i = 0; i < subImmQue.size(); i++) {
+        subImmQue[i]->Unref();
+    }
+    if (adopted_region != NULL) {
+        if (region_owner != NULL)
+            region_owner->ReleaseRegion(adopted_region);
+        else
+            arena_.sub_mem_pool->Release(adopted_region);
+    }
+    delete owned_arena;
 }
 
 
@@ -110,6 +220,21 @@ size_t MemTable::ApproximateMemoryUsage()
 }
 
 //size_t MemTable::ApproximateArenaMemoryUsage() { return arena_.MemoryUsage(); }
+MemTable::KeyComparator::KeyComparator(const InternalKeyComparator& c)
+    : comparator(c),
+      bytewise(strcmp(c.user_comparator()->Name(),
+                      BytewiseComparator()->Name()) == 0) {
+}
+
+void MemTable::KeyComparator::GetPrefix(const char* aptr, KeyPrefix* prefix) const {
+    if (!bytewise) {
+        prefix->SetUnknown();
+        return;
+    }
+    Slice a = GetLengthPrefixedSlice(aptr);
+    prefix->Set(a.data(), a.size() - 8);
+}
+
 int MemTable::KeyComparator::operator()(const char* aptr, const char* bptr)
 const {
     // Internal keys are encoded as length-prefixed strings.
@@ -184,7 +309,102 @@ private:
     void operator=(const MemTableIterator&);
 };
 
+// Walks the partitions of a table one after another.  They hold disjoint
+// key ranges in partition order, so no merging is needed.
+class MemTablePartitionIterator: public Iterator {
+public:
+    explicit MemTablePartitionIterator(MemTable* mem)
+        : current_(mem->NumPartitions()) {
+        for (int i = 0; i < mem->NumPartitions(); i++) {
+            parts_.push_back(new MemTableIterator(mem->Partition(i)));
+        }
+    }
+
+    virtual ~MemTablePartitionIterator() {
+        for (size_t i = 0; i < parts_.size(); i++) {
+            delete parts_[i];
+        }
+    }
+
+    virtual bool Valid() const {
+        return current_ < parts_.size() && parts_[current_]->Valid();
+    }
+    virtual void Seek(const Slice& k) {
+        // Partitions below the one holding k have nothing at or after it
+        for (current_ = 0; current_ < parts_.size(); current_++) {
+            parts_[current_]->Seek(k);
+            if (parts_[current_]->Valid())
+                break;
+        }
+    }
+    virtual void SeekToFirst() {
+        current_ = 0;
+        SkipEmptyForward();
+    }
+    virtual void SeekToLast() {
+        current_ = parts_.size() - 1;
+        parts_[current_]->SeekToLast();
+        SkipEmptyBackward();
+    }
+    virtual void Next() {
+        parts_[current_]->Next();
+        if (!parts_[current_]->Valid()) {
+            current_++;
+            SkipEmptyForward();
+        }
+    }
+    virtual void Prev() {
+        parts_[current_]->Prev();
+        SkipEmptyBackward();
+    }
+
+    virtual char *GetNodeKey() { return parts_[current_]->GetNodeKey(); }
+    virtual Slice key() const { return parts_[current_]->key(); }
+    virtual Slice value() const { return parts_[current_]->value(); }
+
+    void* operator new(std::size_t sz) {
+        return malloc(sz);
+    }
+    void operator delete(void* ptr)
+    {
+        free(ptr);
+    }
+    virtual Status status() const { return Status::OK(); }
+
+private:
+    // Position at the first entry of parts_[current_] or of the first
+    // non-empty partition after it
+    void SkipEmptyForward() {
+        for (; current_ < parts_.size(); current_++) {
+            parts_[current_]->SeekToFirst();
+            if (parts_[current_]->Valid())
+                return;
+        }
+    }
+    // Unless parts_[current_] is positioned, move to the last entry of
+    // the first non-empty partition before it
+    void SkipEmptyBackward() {
+        while (!parts_[current_]->Valid()) {
+            if (current_ == 0) {
+                current_ = parts_.size();
+                return;
+            }
+            current_--;
+            parts_[current_]->SeekToLast();
+        }
+    }
+
+    std::vector<MemTableIterator*> parts_;
+    size_t current_;    // parts_.size() when not Valid()
+
+    // No copying allowed
+    MemTablePartitionIterator(const MemTablePartitionIterator&);
+    void operator=(const MemTablePartitionIterator&);
+};
+
 Iterator* MemTable::NewIterator() {
+    if (num_partitions_ > 1)
+        return new MemTablePartitionIterator(this);
     return new MemTableIterator(&table_);
 }
 
@@ -206,7 +426,8 @@ void* MemTable::GeTableoffset(){
 
 void MemTable::Add(SequenceNumber s, ValueType type,
         const Slice& key,
-        const Slice& value) {
+        const Slice& value,
+        uint64_t log_number) {
     // Format of an entry is concatenation of:
     //  key_size     : varint32 of internal_key.size()
     //  key bytes    : char[internal_key.size()]
@@ -219,10 +440,11 @@ void MemTable::Add(SequenceNumber s, ValueType type,
             VarintLength(internal_key_size) + internal_key_size +
             VarintLength(val_size) + val_size;
     char* buf = NULL;
+    int sub_mem_index = -1;
 retry:
     ArenaNVM *nvm_arena = (ArenaNVM *)&arena_;
     if(arena_.nvmarena_) {
-        buf = nvm_arena->Allocate(encoded_len);
+        buf = nvm_arena->AllocateEntry(encoded_len, &sub_mem_index);
     }else {
         buf = arena_.Allocate(encoded_len);
     }
@@ -264,14 +486,27 @@ retry:
     }
     assert((p + val_size) - buf == encoded_len);
 
-    int sub_mem_index;
-    if(arena_.nvmarena_) {
-        ArenaNVM *nvm_arena = (ArenaNVM *)&arena_;
-        sub_mem_index = (buf - (char*)nvm_arena->map_start_) / SUB_MEM_SIZE;
-    }else {
-        sub_mem_index = (buf - (char*)arena_.map_start_) / SUB_MEM_SIZE;
+    if (arena_.sub_mem_count == 0) {
+        // Plain DRAM table, e.g. one rebuilt from the log on recovery
+        table_.Insert(buf);
+        this->IncrKeys();
+        return;
+    }
+
+    if (concurrent_inserts) {
+        InsertSubMem(sub_mem_index, buf);
+    } else {
+        MutexLock l(&sub_mem_pending_mu[sub_mem_index]);
+        sub_mem_pending_node[sub_mem_index].push_back(buf);
     }
-    sub_mem_pending_node[sub_mem_index].push_back(buf);
+
+    if (log_number != 0) {
+        uint64_t cur = sub_mem_log_number[sub_mem_index].load();
+        while (log_number < cur &&
+               !sub_mem_log_number[sub_mem_index].compare_exchange_weak(cur, log_number));
+    }
+    // subImmToImm() may now convert the region
+    nvm_arena->FinishEntry(sub_mem_index);
 /*
 #ifdef ENABLE_RECOVERY
     table_.Insert(buf, s);
@@ -288,88 +523,418 @@ retry:
 }
 
 
-bool MemTable::Get(const LookupKey& key, std::string* value, Status* s) {
+// Stores the result of a lookup that found "entry" and returns true.
+static bool ResolveEntry(const char* entry, std::string* value, Status* s) {
+    // entry format is:
+    //    klength  varint32
+    //    userkey  char[klength]
+    //    tag      uint64
+    //    vlength  varint32
+    //    value    char[vlength]
+    uint32_t key_length;
+    const char* key_ptr = GetVarint32Ptr(entry, entry+5, &key_length);
+    const uint64_t tag = DecodeFixed64(key_ptr + key_length - 8);
+    switch (static_cast<ValueType>(tag & 0xff)) {
+    case kTypeValue: {
+        Slice v = GetLengthPrefixedSlice(key_ptr + key_length);
+        value->assign(v.data(), v.size());
+        return true;
+    }
+    case kTypeDeletion:
+        *s = Status::NotFound(Slice());
+        return true;
+    }
+    return false;
+}
+
+static inline Slice EntryUserKey(const char* entry) {
+    Slice internal_key = GetLengthPrefixedSlice(entry);
+    return Slice(internal_key.data(), internal_key.size() - 8);
+}
 
+static inline SequenceNumber EntrySequence(const char* entry) {
+    Slice internal_key = GetLengthPrefixedSlice(entry);
+    return DecodeFixed64(internal_key.data() + internal_key.size() - 8) >> 8;
+}
+
+const char* MemTable::FindEntry(Table* list, const LookupKey& key) {
     Slice memkey = key.memtable_key();
-    Table::Iterator iter(&table_);
+    Table::Iterator iter(list);
     iter.Seek(memkey.data());
-    if (iter.Valid()) {
-        // entry format is:
-        //    klength  varint32
-        //    userkey  char[klength]
-        //    tag      uint64
-        //    vlength  varint32
-        //    value    char[vlength]
-        // Check that it belongs to same user key.  We do not check the
-        // sequence number since the Seek() call above should have skipped
-        // all entries with overly large sequence numbers.
+    if (!iter.Valid())
+        return NULL;
 #if defined(USE_OFFSETS)
-        const char* entry = reinterpret_cast<const char *>((intptr_t)iter.key_offset());
+    const char* entry = reinterpret_cast<const char *>((intptr_t)iter.key_offset());
 #else
-        const char* entry = iter.key();
+    const char* entry = iter.key();
 #endif
-        uint32_t key_length;
-        const char* key_ptr = GetVarint32Ptr(entry, entry+5, &key_length);
-        if (comparator_.comparator.user_comparator()->Compare(
-                Slice(key_ptr, key_length - 8),
-                key.user_key()) == 0) {
-            // Correct user key
-            const uint64_t tag = DecodeFixed64(key_ptr + key_length - 8);
-            switch (static_cast<ValueType>(tag & 0xff)) {
-            case kTypeValue: {
-                Slice v = GetLengthPrefixedSlice(key_ptr + key_length);
-                value->assign(v.data(), v.size());
-                return true;
-            }
-            case kTypeDeletion:
-                *s = Status::NotFound(Slice());
-                return true;
-            }
+    // Check that it belongs to same user key.  We do not check the
+    // sequence number since the Seek() call above should have skipped
+    // all entries with overly large sequence numbers.
+    if (comparator_.comparator.user_comparator()->Compare(
+            EntryUserKey(entry), key.user_key()) != 0)
+        return NULL;
+    return entry;
+}
+
+const char* MemTable::FindEntry(const MemTableIndex* index, Table* list,
+                                const LookupKey& key) {
+    if (index != NULL) {
+        const char* entry = index->Lookup(key.user_key());
+        if (entry == NULL && !index->overflowed())
+            return NULL;
+        // Only the newest entry is indexed; a snapshot older than it
+        // needs the skiplist
+        Slice internal_key = key.internal_key();
+        SequenceNumber seq =
+            DecodeFixed64(internal_key.data() + internal_key.size() - 8) >> 8;
+        if (entry != NULL && EntrySequence(entry) <= seq)
+            return entry;
+    }
+    return list == NULL ? NULL : FindEntry(list, key);
+}
+
+bool MemTable::Get(const LookupKey& key, std::string* value, Status* s) {
+    const char* entry = FindEntry(index_.load(std::memory_order_acquire),
+                                  FindPartition(key.user_key()), key);
+    if (entry == NULL)
+        return false;
+    return ResolveEntry(entry, value, s);
+}
+
+void MemTable::SetPartitions(int n) {
+    assert(num_partitions_ == 1);
+    if (n <= 1)
+        return;
+    num_partitions_ = n;
+    partitions_ = NewSkiplists(comparator_, &arena_, n - 1, false);
+    delete[] partition_max_entry_;
+    partition_max_entry_ = new std::atomic<const char*>[n];
+    for (int i = 0; i < n; i++) {
+        partition_max_entry_[i].store(NULL);
+    }
+}
+
+MemTable::Table* MemTable::FindPartition(const Slice& user_key) {
+    if (num_partitions_ == 1)
+        return &table_;
+    // Partitions hold disjoint, ascending key ranges, so the first one
+    // reaching user_key is the only one that may hold it
+    const Comparator* ucmp = comparator_.comparator.user_comparator();
+    for (int i = 0; i < num_partitions_; i++) {
+        const char* max_entry = partition_max_entry_[i].load(std::memory_order_acquire);
+        if (max_entry != NULL && ucmp->Compare(user_key, EntryUserKey(max_entry)) <= 0)
+            return Partition(i);
+    }
+    return NULL;
+}
+
+namespace {
+struct UserKeyLess {
+    const Comparator* ucmp;
+    bool operator()(const Slice& a, const Slice& b) const {
+        return ucmp->Compare(a, b) < 0;
+    }
+};
+}  // namespace
+
+// Keys sampled from each sub-imm when choosing partition bounds
+static const size_t kPartitionSamples = 32;
+
+void MemTable::LearnPartitionBounds(const std::deque<MemTable*>& sub_imms) {
+    partition_bounds_.clear();
+    partition_bounds_learned_ = true;
+    if (num_partitions_ == 1)
+        return;
+
+    // Sub-imms of sequential writes cover disjoint ranges that their
+    // first and last keys describe; those of random writes all span
+    // the key space, so their samples decide.
+    std::vector<const char*> entries;
+    for (size_t i = 0; i < sub_imms.size(); i++) {
+        Table::Iterator iter(&sub_imms[i]->table_);
+        iter.SeekToFirst();
+        if (!iter.Valid())
+            continue;
+        entries.push_back(iter.key());
+        iter.SeekToLast();
+        entries.push_back(iter.key());
+        sub_imms[i]->table_.SampleKeys(kPartitionSamples, &entries);
+    }
+    if (entries.empty())
+        return;
+    std::vector<Slice> keys(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        keys[i] = EntryUserKey(entries[i]);
+    }
+    UserKeyLess less = { comparator_.comparator.user_comparator() };
+    std::sort(keys.begin(), keys.end(), less);
+
+    // Equal shares of the sample; a key repeated across a share boundary
+    // leaves fewer bounds, and the last partitions stay empty.
+    for (int i = 1; i < num_partitions_; i++) {
+        const Slice& bound = keys[keys.size() * i / num_partitions_];
+        if (!partition_bounds_.empty() &&
+            !less(EntryUserKey(partition_bounds_.back().data()), bound))
+            continue;
+        LookupKey lkey(bound, kMaxSequenceNumber);
+        partition_bounds_.push_back(lkey.memtable_key().ToString());
+    }
+}
+
+void MemTable::SplitForPartitions(MemTable* sub_imm, Table::Run* runs) {
+    std::vector<const char*> bounds(partition_bounds_.size());
+    for (size_t i = 0; i < bounds.size(); i++) {
+        bounds[i] = partition_bounds_[i].data();
+    }
+    // Fewer bounds than partitions leave the last runs empty
+    for (int i = bounds.size() + 1; i < num_partitions_; i++) {
+        runs[i] = Table::Run();
+    }
+    sub_imm->table_.SplitAt(bounds.empty() ? NULL : &bounds[0], bounds.size(), runs);
+}
+
+void MemTable::MergeIntoPartition(int index, const Table::Run* runs, size_t n) {
+    Table* list = Partition(index);
+    for (size_t i = 0; i < n; i++) {
+        if (!runs[i].empty())
+            list->MergeFrom(runs[i]);
+    }
+    Table::Iterator iter(list);
+    iter.SeekToLast();
+    if (iter.Valid())
+        partition_max_entry_[index].store(iter.key(), std::memory_order_release);
+}
+
+void MemTable::TransferPartitionsTo(MemTable* dst) {
+    assert(dst->num_partitions_ == num_partitions_);
+    // dst is fully linked before the nodes disappear from this table
+    for (int i = 0; i < num_partitions_; i++) {
+        Partition(i)->ShareWith(dst->Partition(i));
+        dst->partition_max_entry_[i].store(partition_max_entry_[i].load());
+    }
+    dst->index_.store(index_.exchange(NULL), std::memory_order_release);
+    for (int i = 0; i < num_partitions_; i++) {
+        Partition(i)->Clear();
+        partition_max_entry_[i].store(NULL, std::memory_order_release);
+    }
+    partition_bounds_.clear();
+    partition_bounds_learned_ = false;
+}
+
+void MemTable::EnableHashIndex(size_t merged_regions) {
+    if (comparator_.bytewise)
+        index_entries_ = arena_.sub_mem_size / kRegionBytesPerIndexEntry *
+                         std::max<size_t>(merged_regions, 1);
+}
+
+void MemTable::MoveSubMemIndex(int index, MemTable* sub_imm, ptrdiff_t delta) {
+    MemTableIndex* sub_index = sub_mem_index[index].exchange(NULL);
+    if (sub_index == NULL)
+        return;
+    if (delta != 0)
+        sub_index->Rebase(delta);
+    sub_imm->index_.store(sub_index, std::memory_order_release);
+}
+
+void MemTable::CopySubMemFence(int index, MemTable* sub_imm, ptrdiff_t delta) {
+    const char* min_entry = sub_mem_min_entry[index].load(std::memory_order_acquire);
+    const char* max_entry = sub_mem_max_entry[index].load(std::memory_order_acquire);
+    if (min_entry == NULL || max_entry == NULL)
+        return;
+    sub_imm->min_entry_ = min_entry + delta;
+    sub_imm->max_entry_ = max_entry + delta;
+}
+
+void MemTable::IndexSubImms(const std::deque<MemTable*>& sub_imms) {
+    if (index_entries_ == 0)
+        return;
+    MemTableIndex* index = index_.load(std::memory_order_acquire);
+    if (index == NULL) {
+        index = new MemTableIndex(index_entries_);
+        index_.store(index, std::memory_order_release);
+    }
+    for (size_t i = 0; i < sub_imms.size(); i++) {
+        // Only this table looks the sub-imm's entries up from now on
+        MemTableIndex* sub_index = sub_imms[i]->index_.exchange(NULL);
+        if (index->overflowed()) {
+            delete sub_index;
+            continue;
+        }
+        if (sub_index != NULL) {
+            index->AddAll(*sub_index);
+            delete sub_index;
+        } else {
+            Table::Iterator iter(&sub_imms[i]->table_);
+            for (iter.SeekToFirst(); iter.Valid(); iter.Next())
+                index->Add(iter.key());
         }
     }
-    return false;
+}
+
+BlockedBloomFilter* MemTable::SubMemFilter(int index) {
+    BlockedBloomFilter* filter = sub_mem_filter[index].load(std::memory_order_acquire);
+    if (filter == NULL) {
+        BlockedBloomFilter* created = new BlockedBloomFilter(
+                arena_.sub_mem_size / kRegionBytesPerFilterBit, kSubMemFilterProbes);
+        if (sub_mem_filter[index].compare_exchange_strong(filter, created,
+                                                          std::memory_order_acq_rel))
+            filter = created;
+        else
+            delete created;
+    }
+    return filter;
+}
+
+MemTableIndex* MemTable::SubMemIndex(int index) {
+    if (index_entries_ == 0)
+        return NULL;
+    MemTableIndex* sub_index = sub_mem_index[index].load(std::memory_order_acquire);
+    if (sub_index == NULL) {
+        MemTableIndex* created = new MemTableIndex(arena_.sub_mem_size / kRegionBytesPerIndexEntry);
+        if (sub_mem_index[index].compare_exchange_strong(sub_index, created,
+                                                         std::memory_order_acq_rel))
+            sub_index = created;
+        else
+            delete created;
+    }
+    return sub_index;
+}
+
+void MemTable::WidenSubMemFence(int index, const char* lo, const char* hi) {
+    const Comparator* ucmp = comparator_.comparator.user_comparator();
+    Slice lo_key = EntryUserKey(lo);
+    Slice hi_key = EntryUserKey(hi);
+    const char* min_entry = sub_mem_min_entry[index].load(std::memory_order_acquire);
+    while ((min_entry == NULL || ucmp->Compare(lo_key, EntryUserKey(min_entry)) < 0)
+           && !sub_mem_min_entry[index].compare_exchange_weak(min_entry, lo,
+                                                              std::memory_order_release,
+                                                              std::memory_order_acquire));
+    const char* max_entry = sub_mem_max_entry[index].load(std::memory_order_acquire);
+    while ((max_entry == NULL || ucmp->Compare(hi_key, EntryUserKey(max_entry)) > 0)
+           && !sub_mem_max_entry[index].compare_exchange_weak(max_entry, hi,
+                                                              std::memory_order_release,
+                                                              std::memory_order_acquire));
+}
+
+void MemTable::InsertSubMem(int index, char* buf) {
+    // The filter is updated before Insert() so a reader that finds the
+    // entry in the skiplist can never be turned away by it; the fence
+    // may lag one entry, which Get_submem() tolerates since the entry
+    // was not visible in the skiplist before Insert() either.  With
+    // concurrent_inserts several writers get here at once, so the
+    // filter and hash index are installed and the fence widened by
+    // compare-and-swap.  The hash index follows the skiplist.
+    Slice user_key = EntryUserKey(buf);
+    SubMemFilter(index)->add(user_key.data(), user_key.size());
+    if (concurrent_inserts)
+        sub_mem_skiplist[index].InsertConcurrently(buf);
+    else
+        sub_mem_skiplist[index].Insert(buf);
+    MemTableIndex* sub_index = SubMemIndex(index);
+    if (sub_index != NULL)
+        sub_index->Add(buf);
+    WidenSubMemFence(index, buf, buf);
+}
+
+void MemTable::InsertSubMemBatch(int index, const std::vector<char*>& bufs) {
+    if (bufs.empty())
+        return;
+    // Same ordering as InsertSubMem(): filter, skiplist, hash index, fence
+    const Comparator* ucmp = comparator_.comparator.user_comparator();
+    BlockedBloomFilter* filter = SubMemFilter(index);
+    const char* lo = bufs[0];
+    const char* hi = bufs[0];
+    for (size_t i = 0; i < bufs.size(); i++) {
+        Slice user_key = EntryUserKey(bufs[i]);
+        filter->add(user_key.data(), user_key.size());
+        if (ucmp->Compare(user_key, EntryUserKey(lo)) < 0)
+            lo = bufs[i];
+        if (ucmp->Compare(user_key, EntryUserKey(hi)) > 0)
+            hi = bufs[i];
+    }
+    sub_mem_skiplist[index].InsertBatch(&bufs[0], bufs.size());
+    MemTableIndex* sub_index = SubMemIndex(index);
+    if (sub_index != NULL) {
+        for (size_t i = 0; i < bufs.size(); i++)
+            sub_index->Add(bufs[i]);
+    }
+    WidenSubMemFence(index, lo, hi);
+}
+
+void MemTable::TakePendingNodes(int index, std::vector<char*>* nodes) {
+    nodes->clear();
+    MutexLock l(&sub_mem_pending_mu[index]);
+    std::vector<char*>& pending = sub_mem_pending_node[index];
+    if (sub_mem_pending_node_index[index] == 0) {
+        nodes->swap(pending);
+    } else {
+        nodes->assign(pending.begin() + sub_mem_pending_node_index[index], pending.end());
+        pending.clear();
+    }
+    sub_mem_pending_node_index[index] = 0;
+}
+
+void MemTable::ResetSubMemFilter(int index) {
+    sub_mem_min_entry[index].store(NULL, std::memory_order_release);
+    sub_mem_max_entry[index].store(NULL, std::memory_order_release);
+    BlockedBloomFilter* filter = sub_mem_filter[index].load(std::memory_order_acquire);
+    if (filter != NULL)
+        filter->clear();
 }
 
 bool MemTable::Get_submem(const LookupKey& key, std::string* value, Status* s){
-    Slice memkey = key.memtable_key();
-    Table::Iterator iter(&table_);
+    const Comparator* ucmp = comparator_.comparator.user_comparator();
+    Slice user_key = key.user_key();
+    const char* best = NULL;
+    const char* entry;
 
     for(int i=0; i<arena_.sub_mem_count; i++){
-        if(!arena_.sub_mem_bset[i].load() || !arena_.sub_immem_bset[i].load())
+        // Live sub-mems, including full ones waiting for subImmToImm()
+        if(!arena_.sub_mem_bset[i].load())
+            continue;
+        const char* min_entry = sub_mem_min_entry[i].load(std::memory_order_acquire);
+        const char* max_entry = sub_mem_max_entry[i].load(std::memory_order_acquire);
+        if(min_entry == NULL || max_entry == NULL
+           || ucmp->Compare(user_key, EntryUserKey(min_entry)) < 0
+           || ucmp->Compare(user_key, EntryUserKey(max_entry)) > 0)
+            continue;
+        BlockedBloomFilter* filter = sub_mem_filter[i].load(std::memory_order_acquire);
+        if(filter == NULL || !filter->possiblyContains(user_key.data(), user_key.size()))
             continue;
-        iter.list_ = &sub_mem_skiplist[i];
-        iter.node_ = NULL;
-        iter.Seek(memkey.data());
-        if(iter.Valid())
-            break;
+        entry = FindEntry(sub_mem_index[i].load(std::memory_order_acquire),
+                          &sub_mem_skiplist[i], key);
+        if(entry != NULL && (best == NULL || EntrySequence(entry) > EntrySequence(best)))
+            best = entry;
     }
 
-    if (iter.Valid()) {
-#if defined(USE_OFFSETS)
-        const char* entry = reinterpret_cast<const char *>((intptr_t)iter.key_offset());
-#else
-        const char* entry = iter.key();
-#endif
-        uint32_t key_length;
-        const char* key_ptr = GetVarint32Ptr(entry, entry+5, &key_length);
-        if (comparator_.comparator.user_comparator()->Compare(
-                Slice(key_ptr, key_length - 8),
-                key.user_key()) == 0) {
-            // Correct user key
-            const uint64_t tag = DecodeFixed64(key_ptr + key_length - 8);
-            switch (static_cast<ValueType>(tag & 0xff)) {
-            case kTypeValue: {
-                Slice v = GetLengthPrefixedSlice(key_ptr + key_length);
-                value->assign(v.data(), v.size());
-                return true;
-            }
-            case kTypeDeletion:
-                *s = Status::NotFound(Slice());
-                return true;
-            }
-        }
+    // Probe the sub-imms without subImmQueMu, so that lookups neither
+    // serialize on it nor hold off subImmToImm() and compactImm().  The
+    // references keep them, and the one owning "best", alive meanwhile.
+    std::vector<MemTable*> sub_imms;
+    if(subImmQueLen.load(std::memory_order_acquire) > 0) {
+        MutexLock l(&subImmQueMu);
+        sub_imms.assign(subImmQue.begin(), subImmQue.end());
+        for(size_t i=0; i<sub_imms.size(); i++)
+            sub_imms[i]->Ref();
     }
-    return false;
+    for(size_t i=0; i<sub_imms.size(); i++) {
+        MemTable* sub_imm = sub_imms[i];
+        if(sub_imm->min_entry_ != NULL
+           && (ucmp->Compare(user_key, EntryUserKey(sub_imm->min_entry_)) < 0
+               || ucmp->Compare(user_key, EntryUserKey(sub_imm->max_entry_)) > 0))
+            continue;
+        entry = sub_imm->FindEntry(sub_imm->index_.load(std::memory_order_acquire),
+                                   &sub_imm->table_, key);
+        if(entry != NULL && (best == NULL || EntrySequence(entry) > EntrySequence(best)))
+            best = entry;
+    }
+    bool found = false;
+    if (best != NULL)
+        found = ResolveEntry(best, value, s);
+    for(size_t i=0; i<sub_imms.size(); i++)
+        sub_imms[i]->Unref();
+    return found;
 }
 
 
@@ -8,14 +8,17 @@
 #include <string>
 #include "leveldb/db.h"
 #include "db/dbformat.h"
+#include "db/memtable_index.h"
 #include "db/skiplist.h"
 #include "util/arena.h"
 #include "util/BloomFilter.h"
+#include "port/port.h"
 
 #include <string>
 #include <unordered_set>
 
 #include <deque>
+#include <vector>
 
 namespace leveldb {
 
@@ -57,9 +60,9 @@ public:
 
 	// Drop reference count.  Delete if no more references exist.
 	void Unref() {
-		--refs_;
-		assert(refs_ >= 0);
-		if (refs_ <= 0) {
+		int refs = --refs_;
+		assert(refs >= 0);
+		if (refs <= 0) {
 			delete this;
 		}
 	}
@@ -81,9 +84,13 @@ public:
 	// Add an entry into memtable that maps key to value at the
 	// specified sequence number and with the specified type.
 	// Typically value will be empty if type==kTypeDeletion.
+	// "log_number" is the write-ahead log generation holding the entry,
+	// 0 if it was not logged; it is folded into the sub-mem's
+	// sub_mem_log_number.
 	void Add(SequenceNumber seq, ValueType type,
 			const Slice& key,
-			const Slice& value);
+			const Slice& value,
+			uint64_t log_number = 0);
 
 	//NoveLSM:TODO: To purge
 	//void AddSpecial(const Slice& key, const Slice& value, char *keybuf);
@@ -93,12 +100,61 @@ public:
 	// in *status and return true.
 	// Else, return false.
 	bool Get(const LookupKey& key, std::string* value, Status* s);
+	// Same as Get(), over every live sub-mem and every sub-imm in
+	// subImmQue that has not been merged into table_ yet.  When several
+	// of them hold the key, the entry with the highest sequence wins.
 	bool Get_submem(const LookupKey& key, std::string* value, Status* s);
 
+	// Insert an entry into sub-skiplist "index", adding its user key to
+	// the sub-mem's filter and widening its key fence.
+	// REQUIRES: caller owns in_trans_bset[index], unless
+	// concurrent_inserts is set.
+	void InsertSubMem(int index, char* buf);
+	// InsertSubMem() for a batch of pending entries, sorted and linked
+	// in one pass.
+	// REQUIRES: caller owns in_trans_bset[index].
+	void InsertSubMemBatch(int index, const std::vector<char*>& bufs);
+	// Move the entries added to sub-mem "index" since the last call into
+	// *nodes, oldest first.
+	void TakePendingNodes(int index, std::vector<char*>* nodes);
+	// Forget the fence and filter of a sub-mem whose entries have been
+	// handed off.
+	void ResetSubMemFilter(int index);
+
+	// If called, each sub-mem keeps a hash index from user key to its
+	// newest entry, and Get() and Get_submem() answer exact-match
+	// lookups from it instead of descending the skiplist.  The index
+	// moves to the sub-imm converted from the sub-mem, and is folded
+	// into one over the merged table sized for "merged_regions" sub-imms.
+	// Does nothing unless user keys compare bytewise.  Set by the owner
+	// before the first Add().
+	void EnableHashIndex(size_t merged_regions);
+	// Hand the hash index of sub-mem "index" to "sub_imm", whose copy of
+	// the region lies "delta" bytes away.  The sub-mem falls back to its
+	// skiplist until it is indexed again.
+	void MoveSubMemIndex(int index, MemTable* sub_imm, ptrdiff_t delta);
+	// Give "sub_imm" the key fence of sub-mem "index", rebased like
+	// MoveSubMemIndex(), so Get_submem() can skip it by user key.
+	// REQUIRES: caller owns in_trans_bset[index] and no entry is in flight.
+	void CopySubMemFence(int index, MemTable* sub_imm, ptrdiff_t delta);
+	// Fold the hash indexes of "sub_imms" into that of the merged table,
+	// before their entries are merged into it.
+	// REQUIRES: caller owns merges into this table.
+	void IndexSubImms(const std::deque<MemTable*>& sub_imms);
+
 	void SetMemTableHead(void *ptr);
 
 	void* GeTableoffset();
 
+	// If true, Add() links every entry into its sub-skiplist before it
+	// returns, concurrently with other writers, instead of leaving it
+	// on sub_mem_pending_node for skiplistBackgroundSync() to replay.
+	// Set by the owner before the first Add().
+	bool concurrent_inserts;
+
+	// Sub-imms and frozen tables: oldest write-ahead log generation that
+	// may hold their entries, ~0 when none does.  Set by subImmToImm()
+	// and freezeMergedTable().
 	uint64_t logfile_number;
 
 
@@ -109,7 +165,20 @@ public:
 	//NoveLSM Swap/Alternate between nvm and DRAM arena
 	bool isNVMMemtable;
 
+	//Heap ArenaNVM that arena_ was copied from, if this table owns it.
+	//Sub-imms own theirs and release it on destruction.
+	ArenaNVM* owned_arena;
+
+	//Region holding a sub-imm's entries, released on destruction: to
+	//region_owner's spares if the entries stayed in the region of the
+	//memtable they came from, or to arena_.sub_mem_pool if they were
+	//copied into a pooled block (region_owner NULL).
+	char* adopted_region;
+	ArenaNVM* region_owner;
+
+#ifdef _ENABLE_PREDICTION
        BloomFilter bloom_;
+#endif
        std::unordered_set<std::string> predict_set;
        void AddPredictIndex(std::unordered_set<std::string> *set, const uint8_t*);
        int  CheckPredictIndex(std::unordered_set<std::string> *set, const uint8_t*);
@@ -117,8 +186,13 @@ public:
 
 	struct KeyComparator {
 		const InternalKeyComparator comparator;
-		explicit KeyComparator(const InternalKeyComparator& c) : comparator(c) { }
+		// Whether the user keys order bytewise, so that a prefix of the
+		// user key orders entries
+		const bool bytewise;
+		explicit KeyComparator(const InternalKeyComparator& c);
 		int operator()(const char* a, const char* b) const;
+		// Summary of the user key of entry "a" for the skiplist nodes
+		void GetPrefix(const char* a, KeyPrefix* prefix) const;
 	};
 	KeyComparator comparator_;
 	typedef SkipList<const char*, KeyComparator> Table;
@@ -126,17 +200,109 @@ public:
     Table *sub_mem_skiplist;
 	int *sub_mem_pending_node_index;
     std::vector<char*> *sub_mem_pending_node;
+	// Guards sub_mem_pending_node[i] and sub_mem_pending_node_index[i].
+	// Writers on the same core share a sub-mem, so Add() can race with
+	// another Add() and with the background sync draining the list.
+	port::Mutex *sub_mem_pending_mu;
     std::deque<MemTable*> subImmQue;
-	std::atomic_bool isQueBusy;
+	// Smallest and largest entry inserted into each sub-skiplist, NULL
+	// while it is empty.  Lets Get_submem() skip sub-mems by user key.
+	std::atomic<const char*> *sub_mem_min_entry;
+	std::atomic<const char*> *sub_mem_max_entry;
+	// Blocked bloom filter over the user keys of each sub-skiplist,
+	// allocated on its first insert so sub-imms and idle sub-mems cost
+	// nothing.  Sized for one sub_mem_size region.
+	std::atomic<BlockedBloomFilter*> *sub_mem_filter;
+	// Hash index of each sub-skiplist, allocated on its first insert
+	// when EnableHashIndex() was called
+	std::atomic<MemTableIndex*> *sub_mem_index;
+	// Oldest log generation of any entry in each sub-mem, ~0 while it
+	// holds none.  subImmToImm() hands it to the sub-imm.
+	std::atomic<uint64_t> *sub_mem_log_number;
+	// Guards subImmQue.  A blocking mutex, so that readers copying the
+	// sub-imms and the conversion workers sleep instead of spinning.
+	port::Mutex subImmQueMu;
+	// subImmQue.size(), updated under subImmQueMu, for callers that only
+	// need to know whether sub-imms are waiting
+	std::atomic<size_t> subImmQueLen;
 	
 	Table table_;
+
+	// The merged skiplist may be split by user key into partitions, so
+	// that compactImm() merges sub-imms into them in parallel and a
+	// lookup searches only one.  Partition 0 is table_.  Set by the
+	// owner before the first merge; 1 keeps table_ alone.
+	void SetPartitions(int n);
+	int NumPartitions() const { return num_partitions_; }
+	Table* Partition(int i) { return i == 0 ? &table_ : &partitions_[i - 1]; }
+
+	// Whether the partition bounds were chosen since the partitions
+	// were last emptied
+	bool HasPartitionBounds() const { return partition_bounds_learned_; }
+	// Choose the bounds from the key range and a sample of the keys of
+	// every sub-imm in "sub_imms", so that they split evenly.
+	// REQUIRES: the partitions are empty; same synchronization as
+	// SplitForPartitions().
+	void LearnPartitionBounds(const std::deque<MemTable*>& sub_imms);
+	// Cut the table_ of "sub_imm" into runs[0..NumPartitions()-1], one
+	// per partition.  REQUIRES: caller owns merges into this table.
+	void SplitForPartitions(MemTable* sub_imm, Table::Run* runs);
+	// Merge runs[0..n-1] into partition "index".  Calls for different
+	// partitions may run concurrently.
+	void MergeIntoPartition(int index, const Table::Run* runs, size_t n);
+	// Link every partition into the same partition of "dst", which must
+	// be empty and partitioned alike, and then reset this table's
+	// partitions and their bounds.  The hash index goes along.
+	void TransferPartitionsTo(MemTable* dst);
+
 private:
 	~MemTable();  // Private since only Unref() should be used to delete it
 
+	// Returns the entry for key's user key in "list" that is visible at
+	// key's sequence, or NULL.
+	const char* FindEntry(Table* list, const LookupKey& key);
+
+	// Like FindEntry(list, key), but answered from "index" when it can be
+	const char* FindEntry(const MemTableIndex* index, Table* list, const LookupKey& key);
+
+	// Filter of sub-mem "index", installing one on first use
+	BlockedBloomFilter* SubMemFilter(int index);
+	// Hash index of sub-mem "index", installing one on first use, or
+	// NULL if EnableHashIndex() was not called
+	MemTableIndex* SubMemIndex(int index);
+	// Widen the fence of sub-mem "index" to cover the user keys of
+	// entries "lo" and "hi"
+	void WidenSubMemFence(int index, const char* lo, const char* hi);
+
+	// The partition that may hold "user_key", or NULL if none does
+	Table* FindPartition(const Slice& user_key);
+
+	int num_partitions_;
+	Table* partitions_;  // Partitions 1..num_partitions_-1
+	// Largest entry of each partition, NULL while it is empty.  Lets a
+	// lookup pick the one partition that may hold its key.
+	std::atomic<const char*>* partition_max_entry_;
+	// Memtable keys that sort before every entry of their user key;
+	// partition i starts at partition_bounds_[i-1].  Only used by merges.
+	std::vector<std::string> partition_bounds_;
+	bool partition_bounds_learned_;
+
+	// Room of the hash index over the merged table, 0 while hash indexes
+	// are disabled
+	size_t index_entries_;
+	// Hash index over table_ and the partitions, NULL if there is none.
+	// A sub-imm's comes from its sub-mem.
+	std::atomic<MemTableIndex*> index_;
+	// Smallest and largest entry of a sub-imm, from its sub-mem's fence.
+	// NULL for other tables, and for sub-imms of an empty sub-mem.
+	const char* min_entry_;
+	const char* max_entry_;
+
 	friend class MemTableIterator;
 	friend class MemTableBackwardIterator;
 
-	int refs_;
+	// Atomic, since Get_submem() references sub-imms without a DB lock
+	std::atomic<int> refs_;
 
 	//NoveLSM: Num memtable enteries
 	unsigned int numkeys_;
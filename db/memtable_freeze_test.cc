@@ -0,0 +1,170 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include "db/db_impl.h"
+#include "leveldb/db.h"
+#include "leveldb/env.h"
+#include "leveldb/iterator.h"
+#include "util/logging.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+static const int kNumKeys = 2000;
+
+static std::string Key(int i) {
+  char buf[100];
+  snprintf(buf, sizeof(buf), "key%06d", i);
+  return std::string(buf);
+}
+
+static std::string Value(int i, int round) {
+  char buf[100];
+  snprintf(buf, sizeof(buf), "value%06d.%d", i, round);
+  return std::string(buf) + std::string(100, 'x');
+}
+
+class MemTableFreezeTest {
+ public:
+  Env* env_;
+  std::string disk_;
+  std::string mem_;
+  Options options_;
+  DB* db_;
+
+  MemTableFreezeTest() : env_(Env::Default()), db_(NULL) {
+    disk_ = test::TmpDir() + "/memtable_freeze_test_disk";
+    mem_ = test::TmpDir() + "/memtable_freeze_test_mem";
+    Clear(disk_);
+    Clear(mem_);
+    options_.create_if_missing = true;
+    options_.nvm_buffer_size = 8 << 20;
+    options_.dlock_way = 11;
+    options_.dlock_size = options_.nvm_buffer_size;
+    options_.sub_mem_size = 64 << 10;
+    options_.flushImm_threshold = 1;
+    options_.compactImm_threshold = 1;
+    options_.skiplistSync_threshold = 0;
+    options_.num_read_threads = 0;
+    // No compactions, so every flushed table shows up in NumFiles()
+    options_.level0_file_num_compaction_trigger = 1000;
+    options_.level0_slowdown_writes_trigger = 1000;
+    options_.level0_stop_writes_trigger = 1000;
+    ASSERT_OK(DB::Open(options_, disk_, mem_, &db_));
+  }
+
+  ~MemTableFreezeTest() {
+    delete db_;
+    Clear(disk_);
+    Clear(mem_);
+  }
+
+  void Clear(const std::string& dir) {
+    env_->CreateDir(dir);
+    std::vector<std::string> files;
+    env_->GetChildren(dir, &files);
+    for (size_t i = 0; i < files.size(); i++) {
+      env_->DeleteFile(dir + "/" + files[i]);
+    }
+  }
+
+  DBImpl* dbfull() { return reinterpret_cast<DBImpl*>(db_); }
+
+  int NumFiles() {
+    int files = 0;
+    for (int level = 0; level < config::kNumLevels; level++) {
+      std::string property;
+      ASSERT_TRUE(db_->GetProperty(
+          "leveldb.num-files-at-level" + NumberToString(level), &property));
+      files += atoi(property.c_str());
+    }
+    return files;
+  }
+
+  // Checks that "iter" yields exactly the contents of "model"
+  void CheckIterator(Iterator* iter,
+                     const std::map<std::string, std::string>& model) {
+    std::map<std::string, std::string>::const_iterator m = model.begin();
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next(), ++m) {
+      ASSERT_TRUE(m != model.end());
+      ASSERT_EQ(m->first, iter->key().ToString());
+      ASSERT_EQ(m->second, iter->value().ToString());
+    }
+    ASSERT_OK(iter->status());
+    ASSERT_TRUE(m == model.end());
+
+    // And backwards, across the same tables
+    std::map<std::string, std::string>::const_reverse_iterator r =
+        model.rbegin();
+    for (iter->SeekToLast(); iter->Valid(); iter->Prev(), ++r) {
+      ASSERT_TRUE(r != model.rend());
+      ASSERT_EQ(r->first, iter->key().ToString());
+    }
+    ASSERT_TRUE(r == model.rend());
+  }
+};
+
+// An iterator opened before the memtable is frozen several times must
+// still see the state it was opened on, although the entries it reads
+// move out of the memtable and it is freed from under the DB meanwhile.
+TEST(MemTableFreezeTest, IteratorAcrossFreezes) {
+  std::map<std::string, std::string> snapshot;
+  for (int i = 0; i < kNumKeys; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), Key(i), Value(i, 0)));
+    snapshot[Key(i)] = Value(i, 0);
+  }
+  Iterator* iter = db_->NewIterator(ReadOptions());
+  iter->Seek(Key(kNumKeys / 2));
+  ASSERT_TRUE(iter->Valid());
+  ASSERT_EQ(Key(kNumKeys / 2), iter->key().ToString());
+
+  std::map<std::string, std::string> latest = snapshot;
+  for (int round = 1; round <= 3; round++) {
+    for (int i = round; i < kNumKeys + 100 * round; i += 3) {
+      ASSERT_OK(db_->Put(WriteOptions(), Key(i), Value(i, round)));
+      latest[Key(i)] = Value(i, round);
+    }
+    for (int i = round + 1; i < kNumKeys; i += 7) {
+      ASSERT_OK(db_->Delete(WriteOptions(), Key(i)));
+      latest.erase(Key(i));
+    }
+    const int before = NumFiles();
+    ASSERT_OK(dbfull()->TEST_FreezeMergedTable());
+    ASSERT_GT(NumFiles(), before);
+  }
+
+  // Carry on from where it was, then walk it all again
+  for (int i = kNumKeys / 2; i < kNumKeys; i++) {
+    ASSERT_TRUE(iter->Valid());
+    ASSERT_EQ(Key(i), iter->key().ToString());
+    ASSERT_EQ(Value(i, 0), iter->value().ToString());
+    iter->Next();
+  }
+  ASSERT_TRUE(!iter->Valid());
+  CheckIterator(iter, snapshot);
+  delete iter;
+
+  iter = db_->NewIterator(ReadOptions());
+  CheckIterator(iter, latest);
+  delete iter;
+  for (int i = 0; i < kNumKeys + 300; i++) {
+    std::string value;
+    Status s = db_->Get(ReadOptions(), Key(i), &value);
+    if (latest.count(Key(i))) {
+      ASSERT_OK(s);
+      ASSERT_EQ(latest[Key(i)], value);
+    } else {
+      ASSERT_TRUE(s.IsNotFound());
+    }
+  }
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
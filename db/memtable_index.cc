@@ -0,0 +1,140 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/memtable_index.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <new>
+#include "db/dbformat.h"
+#include "util/coding.h"
+#include "util/hash.h"
+
+namespace leveldb {
+
+// A slot holds the entry's address in its low 48 bits and a tag of the
+// user key's hash in the high 16, so most mismatches are rejected
+// without touching the entry.  0 marks an empty slot.
+static const size_t kSlotsPerBucket = 8;
+static const int kAddressBits = 48;
+static const uint64_t kAddressMask = (uint64_t(1) << kAddressBits) - 1;
+// Buckets an Add() or Lookup() probes before giving up
+static const size_t kMaxProbes = 8;
+
+static inline Slice EntryUserKey(const char* entry) {
+  uint32_t len;
+  const char* p = GetVarint32Ptr(entry, entry + 5, &len);
+  return Slice(p, len - 8);
+}
+
+static inline SequenceNumber EntrySequence(const char* entry) {
+  Slice user_key = EntryUserKey(entry);
+  return DecodeFixed64(user_key.data() + user_key.size()) >> 8;
+}
+
+static inline uint64_t SlotTag(uint32_t hash) {
+  // Multiplied so that the tag does not repeat the bucket bits
+  return uint64_t((hash * 0x9e3779b9u) >> 16) << kAddressBits;
+}
+
+static inline const char* SlotEntry(uint64_t slot) {
+  return reinterpret_cast<const char*>(slot & kAddressMask);
+}
+
+MemTableIndex::MemTableIndex(size_t entries)
+    : num_buckets_(1) {
+  // At most three quarters full
+  while (num_buckets_ * kSlotsPerBucket * 3 < entries * 4)
+    num_buckets_ *= 2;
+  void* mem = NULL;
+  if (posix_memalign(&mem, 64, num_buckets_ * kSlotsPerBucket * sizeof(uint64_t)) != 0)
+    abort();
+  slots_ = static_cast<std::atomic<uint64_t>*>(mem);
+  for (size_t i = 0; i < num_buckets_ * kSlotsPerBucket; i++)
+    new (&slots_[i]) std::atomic<uint64_t>(0);
+  overflowed_.store(false);
+}
+
+MemTableIndex::~MemTableIndex() {
+  free(slots_);
+}
+
+void MemTableIndex::Add(const char* entry) {
+  assert((reinterpret_cast<uintptr_t>(entry) & ~kAddressMask) == 0);
+  const Slice user_key = EntryUserKey(entry);
+  const SequenceNumber seq = EntrySequence(entry);
+  const uint32_t hash = Hash(user_key.data(), user_key.size(), 0);
+  const uint64_t tag = SlotTag(hash);
+  const uint64_t desired = tag | reinterpret_cast<uintptr_t>(entry);
+
+  // Slots never empty again, so the first empty slot on the probe path
+  // ends it: a user key is only ever recorded once.
+  size_t b = hash & (num_buckets_ - 1);
+  for (size_t probe = 0; probe < kMaxProbes; probe++) {
+    std::atomic<uint64_t>* bucket = slots_ + b * kSlotsPerBucket;
+    for (size_t i = 0; i < kSlotsPerBucket; i++) {
+      uint64_t cur = bucket[i].load(std::memory_order_acquire);
+      for (;;) {
+        if (cur == 0) {
+          if (bucket[i].compare_exchange_strong(cur, desired,
+                                                std::memory_order_acq_rel))
+            return;
+          continue;  // Claimed meanwhile; it may be our user key
+        }
+        if ((cur & ~kAddressMask) != tag ||
+            EntryUserKey(SlotEntry(cur)) != user_key)
+          break;
+        if (EntrySequence(SlotEntry(cur)) >= seq)
+          return;
+        if (bucket[i].compare_exchange_weak(cur, desired,
+                                            std::memory_order_acq_rel))
+          return;
+      }
+    }
+    b = (b + 1) & (num_buckets_ - 1);
+  }
+  overflowed_.store(true, std::memory_order_release);
+}
+
+void MemTableIndex::AddAll(const MemTableIndex& other) {
+  for (size_t i = 0; i < other.num_buckets_ * kSlotsPerBucket; i++) {
+    uint64_t slot = other.slots_[i].load(std::memory_order_acquire);
+    if (slot != 0)
+      Add(SlotEntry(slot));
+  }
+  if (other.overflowed())
+    overflowed_.store(true, std::memory_order_release);
+}
+
+const char* MemTableIndex::Lookup(const Slice& user_key) const {
+  const uint32_t hash = Hash(user_key.data(), user_key.size(), 0);
+  const uint64_t tag = SlotTag(hash);
+  size_t b = hash & (num_buckets_ - 1);
+  for (size_t probe = 0; probe < kMaxProbes; probe++) {
+    const std::atomic<uint64_t>* bucket = slots_ + b * kSlotsPerBucket;
+    for (size_t i = 0; i < kSlotsPerBucket; i++) {
+      uint64_t slot = bucket[i].load(std::memory_order_acquire);
+      if (slot == 0)
+        return NULL;
+      if ((slot & ~kAddressMask) == tag && EntryUserKey(SlotEntry(slot)) == user_key)
+        return SlotEntry(slot);
+    }
+    b = (b + 1) & (num_buckets_ - 1);
+  }
+  return NULL;
+}
+
+void MemTableIndex::Rebase(ptrdiff_t delta) {
+  for (size_t i = 0; i < num_buckets_ * kSlotsPerBucket; i++) {
+    uint64_t slot = slots_[i].load(std::memory_order_relaxed);
+    if (slot == 0)
+      continue;
+    const char* entry = SlotEntry(slot) + delta;
+    assert((reinterpret_cast<uintptr_t>(entry) & ~kAddressMask) == 0);
+    slots_[i].store((slot & ~kAddressMask) | reinterpret_cast<uintptr_t>(entry),
+                    std::memory_order_release);
+  }
+}
+
+}  // namespace leveldb
@@ -0,0 +1,60 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_LEVELDB_DB_MEMTABLE_INDEX_H_
+#define STORAGE_LEVELDB_DB_MEMTABLE_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include "leveldb/slice.h"
+
+namespace leveldb {
+
+// Hash index from each user key to the newest memtable entry holding it,
+// so that exact-match lookups need not descend a skiplist.  Open
+// addressing over 64-byte buckets of eight slots, so a lookup usually
+// touches a single cache line.  User keys compare bytewise.
+//
+// Add() is safe to run concurrently with Lookup() and with other Add()
+// calls.  Entries are never removed.
+class MemTableIndex {
+ public:
+  // Room for about "entries" distinct user keys
+  explicit MemTableIndex(size_t entries);
+  ~MemTableIndex();
+
+  // Record "entry", a memtable entry, unless a newer entry with its
+  // user key is recorded already.  Sets overflowed() if there is no
+  // room for its user key.
+  void Add(const char* entry);
+
+  // Add() every entry recorded in "other"
+  void AddAll(const MemTableIndex& other);
+
+  // Newest entry recorded for "user_key", or NULL
+  const char* Lookup(const Slice& user_key) const;
+
+  // Whether an Add() found no room, so that NULL from Lookup() no
+  // longer proves the user key absent
+  bool overflowed() const { return overflowed_.load(std::memory_order_acquire); }
+
+  // Move every recorded entry by "delta" bytes, after the entries were
+  // copied there.  Lookups meanwhile return either copy.
+  // REQUIRES: no concurrent Add()
+  void Rebase(ptrdiff_t delta);
+
+ private:
+  size_t num_buckets_;    // A power of two
+  std::atomic<uint64_t>* slots_;
+  std::atomic<bool> overflowed_;
+
+  // No copying allowed
+  MemTableIndex(const MemTableIndex&);
+  void operator=(const MemTableIndex&);
+};
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_DB_MEMTABLE_INDEX_H_
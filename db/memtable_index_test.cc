@@ -0,0 +1,221 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/memtable_index.h"
+
+#include <string.h>
+#include <deque>
+#include <string>
+#include "db/dbformat.h"
+#include "leveldb/env.h"
+#include "port/port.h"
+#include "util/coding.h"
+#include "util/mutexlock.h"
+#include "util/random.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+namespace {
+
+// A memtable entry with an empty value
+std::string EncodeEntry(const std::string& user_key, SequenceNumber seq) {
+  std::string entry;
+  PutVarint32(&entry, user_key.size() + 8);
+  entry.append(user_key);
+  PutFixed64(&entry, (seq << 8) | kTypeValue);
+  PutVarint32(&entry, 0);
+  return entry;
+}
+
+// Memtable entries with stable addresses
+class EntryStore {
+ public:
+  const char* New(const std::string& user_key, SequenceNumber seq) {
+    entries_.push_back(EncodeEntry(user_key, seq));
+    return entries_.back().data();
+  }
+
+ private:
+  std::deque<std::string> entries_;
+};
+
+std::string IndexKey(int i) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "key%06d", i);
+  return buf;
+}
+
+SequenceNumber EntrySeq(const char* entry) {
+  uint32_t len;
+  const char* p = GetVarint32Ptr(entry, entry + 5, &len);
+  return DecodeFixed64(p + len - 8) >> 8;
+}
+
+}  // namespace
+
+class MemTableIndexTest { };
+
+TEST(MemTableIndexTest, Empty) {
+  MemTableIndex index(100);
+  ASSERT_TRUE(index.Lookup("foo") == NULL);
+  ASSERT_TRUE(!index.overflowed());
+}
+
+TEST(MemTableIndexTest, KeepsNewest) {
+  const int N = 2000;
+  EntryStore store;
+  MemTableIndex index(N);
+  SequenceNumber newest[N];
+  Random rnd(301);
+  for (int i = 0; i < N; i++) {
+    newest[i] = 0;
+  }
+  // Versions arrive out of order, as from concurrent writers
+  for (int n = 0; n < 5 * N; n++) {
+    int i = rnd.Uniform(N);
+    SequenceNumber seq = 1 + rnd.Uniform(1000000);
+    index.Add(store.New(IndexKey(i), seq));
+    if (seq > newest[i])
+      newest[i] = seq;
+  }
+  ASSERT_TRUE(!index.overflowed());
+  for (int i = 0; i < N; i++) {
+    const char* entry = index.Lookup(IndexKey(i));
+    if (newest[i] == 0) {
+      ASSERT_TRUE(entry == NULL);
+    } else {
+      ASSERT_TRUE(entry != NULL);
+      ASSERT_EQ(newest[i], EntrySeq(entry));
+    }
+  }
+  ASSERT_TRUE(index.Lookup(IndexKey(N)) == NULL);
+  // Prefixes and extensions of recorded keys are other keys
+  ASSERT_TRUE(index.Lookup("key00000") == NULL);
+  ASSERT_TRUE(index.Lookup(IndexKey(0) + "x") == NULL);
+}
+
+TEST(MemTableIndexTest, Overflow) {
+  EntryStore store;
+  MemTableIndex index(16);
+  for (int i = 0; i < 1000; i++) {
+    index.Add(store.New(IndexKey(i), i + 1));
+  }
+  ASSERT_TRUE(index.overflowed());
+  // Whatever is found is still right
+  int found = 0;
+  for (int i = 0; i < 1000; i++) {
+    const char* entry = index.Lookup(IndexKey(i));
+    if (entry != NULL) {
+      ASSERT_EQ(i + 1, EntrySeq(entry));
+      found++;
+    }
+  }
+  ASSERT_GT(found, 0);
+}
+
+TEST(MemTableIndexTest, AddAll) {
+  EntryStore store;
+  MemTableIndex a(100), b(100), merged(200);
+  for (int i = 0; i < 100; i++) {
+    a.Add(store.New(IndexKey(i), 10));
+    b.Add(store.New(IndexKey(i + 50), 20));
+  }
+  merged.AddAll(b);
+  merged.AddAll(a);
+  for (int i = 0; i < 150; i++) {
+    const char* entry = merged.Lookup(IndexKey(i));
+    ASSERT_TRUE(entry != NULL);
+    ASSERT_EQ(i < 50 ? 10 : 20, EntrySeq(entry));
+  }
+}
+
+TEST(MemTableIndexTest, Rebase) {
+  const int N = 100;
+  const size_t kEntrySize = 32;
+  char region[N * kEntrySize];
+  char copy[N * kEntrySize];
+  MemTableIndex index(N);
+  for (int i = 0; i < N; i++) {
+    std::string entry = EncodeEntry(IndexKey(i), i + 1);
+    memcpy(region + i * kEntrySize, entry.data(), entry.size());
+    index.Add(region + i * kEntrySize);
+  }
+  memcpy(copy, region, sizeof(region));
+  index.Rebase(copy - region);
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(copy + i * kEntrySize, index.Lookup(IndexKey(i)));
+  }
+}
+
+// Writers add interleaved versions of the same keys while a reader
+// looks them up; every key must end on its newest version.
+namespace {
+struct ConcurrentAddState {
+  MemTableIndex* index;
+  EntryStore stores[4];
+  port::Mutex mu;
+  port::CondVar cv;
+  int running;
+  int next_id;
+  ConcurrentAddState() : cv(&mu), running(0), next_id(0) { }
+};
+
+const int kAddThreads = 4;
+const int kAddKeys = 5000;
+
+// Version "id" of every key, from writer "id", in a scrambled order
+void ConcurrentAdder(void* arg) {
+  ConcurrentAddState* state = reinterpret_cast<ConcurrentAddState*>(arg);
+  int id;
+  {
+    MutexLock l(&state->mu);
+    id = state->next_id++;
+  }
+  for (int n = 0; n < kAddKeys; n++) {
+    int i = (n * 7919) % kAddKeys;
+    state->index->Add(state->stores[id].New(IndexKey(i), i * kAddThreads + id + 1));
+  }
+  MutexLock l(&state->mu);
+  state->running--;
+  state->cv.SignalAll();
+}
+}  // namespace
+
+TEST(MemTableIndexTest, ConcurrentAdd) {
+  MemTableIndex index(kAddKeys);
+  ConcurrentAddState state;
+  state.index = &index;
+  state.running = kAddThreads;
+  for (int t = 0; t < kAddThreads; t++) {
+    Env::Default()->StartThread(ConcurrentAdder, &state);
+  }
+
+  bool done = false;
+  while (!done) {
+    {
+      MutexLock l(&state.mu);
+      done = (state.running == 0);
+    }
+    for (int i = 0; i < kAddKeys; i += 97) {
+      const char* entry = index.Lookup(IndexKey(i));
+      if (entry != NULL) {
+        ASSERT_EQ(i, (EntrySeq(entry) - 1) / kAddThreads);
+      }
+    }
+  }
+
+  ASSERT_TRUE(!index.overflowed());
+  for (int i = 0; i < kAddKeys; i++) {
+    const char* entry = index.Lookup(IndexKey(i));
+    ASSERT_TRUE(entry != NULL);
+    ASSERT_EQ(i * kAddThreads + kAddThreads, EntrySeq(entry));
+  }
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
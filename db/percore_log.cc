@@ -0,0 +1,194 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/percore_log.h"
+
+#include <assert.h>
+#include <deque>
+#include "db/filename.h"
+#include "db/log_writer.h"
+#include "leveldb/env.h"
+#include "port/port.h"
+#include "util/arena.h"
+#include "util/mutexlock.h"
+
+namespace leveldb {
+
+struct PerCoreLog::Writer {
+  Slice record;
+  bool sync;
+  bool pin;
+  bool done;
+  Status status;
+  uint64_t generation;  // Of the file the record went to
+  port::CondVar cv;
+
+  explicit Writer(port::Mutex* mu)
+      : sync(false), pin(false), done(false), generation(0), cv(mu) { }
+};
+
+struct PerCoreLog::Segment {
+  port::Mutex mu;
+  std::deque<Writer*> writers;  // Guarded by mu
+  uint64_t next_number;         // Guarded by mu; file of the current generation
+  uint64_t next_generation;     // Guarded by mu
+  // Records in flight or awaiting Unpin(), by generation; guarded by mu
+  std::map<uint64_t, int> pinned;
+
+  // Only touched by the writer at the front of "writers"
+  uint64_t number;
+  WritableFile* file;
+  log::Writer* log;
+
+  Segment() : next_number(0), next_generation(0), number(0), file(NULL),
+              log(NULL) { }
+};
+
+PerCoreLog::PerCoreLog(Env* env, const std::string& dbname, int segments)
+    : env_(env),
+      dbname_(dbname),
+      nsegments_(segments > 0 ? segments : 1),
+      segments_(new Segment[nsegments_]),
+      generation_(0) {
+}
+
+PerCoreLog::~PerCoreLog() {
+  for (int i = 0; i < nsegments_; i++) {
+    delete segments_[i].log;
+    delete segments_[i].file;
+  }
+  delete[] segments_;
+}
+
+void PerCoreLog::Roll(const std::vector<uint64_t>& numbers) {
+  assert(numbers.size() == static_cast<size_t>(nsegments_));
+  for (int i = 0; i < nsegments_; i++) {
+    MutexLock l(&segments_[i].mu);
+    segments_[i].next_number = numbers[i];
+    segments_[i].next_generation = numbers[0];
+  }
+  generation_.store(numbers[0]);
+}
+
+Status PerCoreLog::SwitchFile(Segment* seg, uint64_t number) {
+  WritableFile* file;
+  Status s = env_->NewWritableFile(LogFileName(dbname_, number), &file);
+  if (s.ok()) {
+    // Closing flushes whatever the old file still buffers
+    delete seg->log;
+    delete seg->file;
+    seg->file = file;
+    seg->log = new log::Writer(file);
+    seg->number = number;
+  }
+  return s;
+}
+
+Status PerCoreLog::AddRecord(const Slice& record, bool sync, Position* pos) {
+  const int index = ArenaNVM::CurrentCPU() % nsegments_;
+  Segment* seg = &segments_[index];
+  Writer w(&seg->mu);
+  w.record = record;
+  w.sync = sync;
+  w.pin = (pos != NULL);
+
+  MutexLock l(&seg->mu);
+  seg->writers.push_back(&w);
+  while (!w.done && &w != seg->writers.front()) {
+    w.cv.Wait();
+  }
+  if (w.done) {
+    if (pos != NULL && w.status.ok()) {
+      pos->segment = index;
+      pos->generation = w.generation;
+    }
+    return w.status;
+  }
+
+  // We are the front writer: take everyone queued so far as our group.
+  // Records queued after this point were enqueued after any Roll() seen
+  // here, so they go to the next group and the next file check.
+  std::vector<Writer*> group(seg->writers.begin(), seg->writers.end());
+  bool need_sync = false;
+  int pins = 0;
+  for (size_t i = 0; i < group.size(); i++) {
+    need_sync |= group[i]->sync;
+    pins += group[i]->pin;
+  }
+  const uint64_t number = seg->next_number;
+  const uint64_t generation = seg->next_generation;
+  // Pinned before the file is written, so that a Roll() meanwhile cannot
+  // make the generation look unused
+  if (pins > 0) {
+    seg->pinned[generation] += pins;
+  }
+
+  Status status;
+  {
+    // The front writer owns the file; let others queue meanwhile.
+    seg->mu.Unlock();
+    if (seg->file == NULL || seg->number != number) {
+      status = SwitchFile(seg, number);
+    }
+    for (size_t i = 0; status.ok() && i < group.size(); i++) {
+      status = seg->log->AddRecord(group[i]->record);
+    }
+    if (status.ok() && need_sync) {
+      status = seg->file->Sync();
+    }
+    seg->mu.Lock();
+  }
+  if (!status.ok() && pins > 0) {
+    UnpinLocked(seg, generation, pins);
+  }
+
+  for (size_t i = 0; i < group.size(); i++) {
+    Writer* ready = seg->writers.front();
+    seg->writers.pop_front();
+    if (ready != &w) {
+      ready->status = status;
+      ready->generation = generation;
+      ready->done = true;
+      ready->cv.Signal();
+    }
+  }
+
+  // Notify new head of write queue
+  if (!seg->writers.empty()) {
+    seg->writers.front()->cv.Signal();
+  }
+  if (pos != NULL && status.ok()) {
+    pos->segment = index;
+    pos->generation = generation;
+  }
+  return status;
+}
+
+void PerCoreLog::UnpinLocked(Segment* seg, uint64_t generation, int n) {
+  std::map<uint64_t, int>::iterator it = seg->pinned.find(generation);
+  assert(it != seg->pinned.end() && it->second >= n);
+  if ((it->second -= n) == 0) {
+    seg->pinned.erase(it);
+  }
+}
+
+void PerCoreLog::Unpin(const Position& pos) {
+  Segment* seg = &segments_[pos.segment];
+  MutexLock l(&seg->mu);
+  UnpinLocked(seg, pos.generation, 1);
+}
+
+uint64_t PerCoreLog::OldestPinned() {
+  uint64_t oldest = ~0ull;
+  for (int i = 0; i < nsegments_; i++) {
+    MutexLock l(&segments_[i].mu);
+    if (!segments_[i].pinned.empty() &&
+        segments_[i].pinned.begin()->first < oldest) {
+      oldest = segments_[i].pinned.begin()->first;
+    }
+  }
+  return oldest;
+}
+
+}  // namespace leveldb
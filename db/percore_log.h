@@ -0,0 +1,84 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_LEVELDB_DB_PERCORE_LOG_H_
+#define STORAGE_LEVELDB_DB_PERCORE_LOG_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+#include "leveldb/slice.h"
+#include "leveldb/status.h"
+
+namespace leveldb {
+
+class Env;
+
+// Write-ahead log split into one segment per core, so that writers on
+// different cores append without sharing a lock, the same way they fill
+// separate sub-memtables.  Each segment is an ordinary log file
+// (LogFileName) written through log::Writer.  The segments opened by one
+// Roll() form a generation, named by its smallest file number.
+//
+// Writers landing on the same segment queue up behind each other.  The
+// writer at the front appends the records of everyone queued and, if any
+// of them asked for sync, syncs the file once for the whole group.
+class PerCoreLog {
+ public:
+  // Where AddRecord() put a record
+  struct Position {
+    int segment;
+    uint64_t generation;
+  };
+
+  PerCoreLog(Env* env, const std::string& dbname, int segments);
+  ~PerCoreLog();
+
+  int NumSegments() const { return nsegments_; }
+
+  // Start a new generation on file numbers[0,NumSegments()-1], which must
+  // be ascending and larger than any number used before.  Each segment
+  // moves to its new file before its next append, so once this returns,
+  // no record is added to a file of an older generation.
+  void Roll(const std::vector<uint64_t>& numbers);
+
+  // Smallest file number of the current generation.
+  uint64_t Generation() const { return generation_.load(); }
+
+  // Append "record" to the calling core's segment.  If "sync" is true,
+  // returns once the record is on stable storage.
+  //
+  // If "pos" is non-NULL and the append succeeds, it is set to where the
+  // record went, and the record's generation counts towards
+  // OldestPinned() until the caller passes *pos to Unpin(), e.g. once
+  // the record is in a memtable that accounts for its generation.
+  Status AddRecord(const Slice& record, bool sync, Position* pos = NULL);
+  void Unpin(const Position& pos);
+
+  // Oldest generation holding records that are still pinned, ~0 if none.
+  uint64_t OldestPinned();
+
+ private:
+  struct Writer;
+  struct Segment;
+
+  Status SwitchFile(Segment* seg, uint64_t number);
+  void UnpinLocked(Segment* seg, uint64_t generation, int n);
+
+  Env* const env_;
+  const std::string dbname_;
+  const int nsegments_;
+  Segment* segments_;
+  std::atomic<uint64_t> generation_;
+
+  // No copying allowed
+  PerCoreLog(const PerCoreLog&);
+  void operator=(const PerCoreLog&);
+};
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_DB_PERCORE_LOG_H_
@@ -0,0 +1,171 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/percore_log.h"
+
+#include <atomic>
+#include <set>
+#include "db/filename.h"
+#include "db/log_reader.h"
+#include "leveldb/env.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+static const int kSegments = 4;
+
+class PerCoreLogTest {
+ public:
+  Env* env_;
+  std::string dbname_;
+  uint64_t next_number_;
+
+  PerCoreLogTest() : env_(Env::Default()), next_number_(10) {
+    dbname_ = test::TmpDir() + "/percore_log_test";
+    env_->CreateDir(dbname_);
+    std::vector<std::string> files;
+    env_->GetChildren(dbname_, &files);
+    for (size_t i = 0; i < files.size(); i++) {
+      env_->DeleteFile(dbname_ + "/" + files[i]);
+    }
+  }
+
+  std::vector<uint64_t> NextGeneration() {
+    std::vector<uint64_t> numbers;
+    for (int i = 0; i < kSegments; i++) {
+      numbers.push_back(next_number_++);
+    }
+    return numbers;
+  }
+
+  // Every record in log files [first, last]
+  std::multiset<std::string> ReadRecords(uint64_t first, uint64_t last) {
+    std::multiset<std::string> result;
+    for (uint64_t n = first; n <= last; n++) {
+      SequentialFile* file;
+      if (!env_->NewSequentialFile(LogFileName(dbname_, n), &file).ok()) {
+        continue;  // Segment never written to
+      }
+      log::Reader reader(file, NULL, true, 0);
+      std::string scratch;
+      Slice record;
+      while (reader.ReadRecord(&record, &scratch)) {
+        result.insert(record.ToString());
+      }
+      delete file;
+    }
+    return result;
+  }
+};
+
+TEST(PerCoreLogTest, Roll) {
+  PerCoreLog log(env_, dbname_, kSegments);
+  std::vector<uint64_t> gen1 = NextGeneration();
+  log.Roll(gen1);
+  ASSERT_EQ(gen1[0], log.Generation());
+  ASSERT_OK(log.AddRecord("a", false));
+  ASSERT_OK(log.AddRecord("b", true));
+
+  std::vector<uint64_t> gen2 = NextGeneration();
+  log.Roll(gen2);
+  ASSERT_EQ(gen2[0], log.Generation());
+  ASSERT_OK(log.AddRecord("c", true));
+
+  std::multiset<std::string> old_records = ReadRecords(gen1[0], gen1.back());
+  ASSERT_EQ(2, old_records.size());
+  ASSERT_EQ(1, old_records.count("a"));
+  ASSERT_EQ(1, old_records.count("b"));
+  std::multiset<std::string> new_records = ReadRecords(gen2[0], gen2.back());
+  ASSERT_EQ(1, new_records.size());
+  ASSERT_EQ(1, new_records.count("c"));
+}
+
+TEST(PerCoreLogTest, Pin) {
+  PerCoreLog log(env_, dbname_, kSegments);
+  std::vector<uint64_t> gen1 = NextGeneration();
+  log.Roll(gen1);
+  ASSERT_EQ(~0ull, log.OldestPinned());
+  PerCoreLog::Position pos;
+  ASSERT_OK(log.AddRecord("a", false, &pos));
+  ASSERT_EQ(gen1[0], pos.generation);
+  ASSERT_EQ(gen1[0], log.OldestPinned());
+
+  // Still pinned after a roll, until the record is accounted for
+  std::vector<uint64_t> gen2 = NextGeneration();
+  log.Roll(gen2);
+  ASSERT_EQ(gen1[0], log.OldestPinned());
+  PerCoreLog::Position pos2;
+  ASSERT_OK(log.AddRecord("b", false, &pos2));
+  ASSERT_EQ(gen2[0], pos2.generation);
+  log.Unpin(pos);
+  ASSERT_EQ(gen2[0], log.OldestPinned());
+  log.Unpin(pos2);
+  ASSERT_EQ(~0ull, log.OldestPinned());
+}
+
+namespace {
+
+struct WriterState {
+  PerCoreLog* log;
+  int id;
+  std::atomic<int>* done;
+  bool ok;
+};
+
+static const int kThreads = 4;
+static const int kRecordsPerThread = 2000;
+
+static void WriterThread(void* arg) {
+  WriterState* state = reinterpret_cast<WriterState*>(arg);
+  state->ok = true;
+  char buf[32];
+  for (int i = 0; i < kRecordsPerThread; i++) {
+    snprintf(buf, sizeof(buf), "%d.%d", state->id, i);
+    if (!state->log->AddRecord(buf, i % 100 == 0).ok()) {
+      state->ok = false;
+    }
+  }
+  state->done->fetch_add(1);
+}
+
+}  // namespace
+
+TEST(PerCoreLogTest, ConcurrentWriters) {
+  PerCoreLog* log = new PerCoreLog(env_, dbname_, kSegments);
+  std::vector<uint64_t> gen1 = NextGeneration();
+  log->Roll(gen1);
+
+  std::atomic<int> done(0);
+  WriterState state[kThreads];
+  for (int t = 0; t < kThreads; t++) {
+    state[t].log = log;
+    state[t].id = t;
+    state[t].done = &done;
+    env_->StartThread(WriterThread, &state[t]);
+  }
+  // Roll while the writers are running
+  env_->SleepForMicroseconds(1000);
+  log->Roll(NextGeneration());
+  while (done.load() < kThreads) {
+    env_->SleepForMicroseconds(1000);
+  }
+  delete log;  // Closes the segments
+
+  std::multiset<std::string> records = ReadRecords(gen1[0], next_number_ - 1);
+  ASSERT_EQ(kThreads * kRecordsPerThread, records.size());
+  char buf[32];
+  for (int t = 0; t < kThreads; t++) {
+    ASSERT_TRUE(state[t].ok);
+    for (int i = 0; i < kRecordsPerThread; i++) {
+      snprintf(buf, sizeof(buf), "%d.%d", t, i);
+      ASSERT_EQ(1, records.count(buf));
+    }
+  }
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -26,11 +26,26 @@
 // more lists.
 //
 // ... prev vs. next pointer ordering ...
+//
+// Key prefixes
+// ------------
+//
+// Every node caches a KeyPrefix of its key, filled in by the
+// comparator's GetPrefix().  A search summarizes its target once and
+// compares prefixes first, so most steps resolve inside the node
+// without reading the key (for the memtable, an entry in the NVM
+// arena).  A comparator that cannot summarize its keys returns
+// KeyPrefix::kUnknownLength, and every comparison falls back to it.
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
 #include "port/port.h"
 #include "util/arena.h"
+#include "util/mutexlock.h"
 #include "util/random.h"
 #include "port/cache_flush.h"
 
@@ -39,6 +54,53 @@ namespace leveldb {
 
 class Arena;
 
+// Order-preserving summary of a key whose ordering is bytewise on some
+// leading part of it (for internal keys, the user key).
+struct KeyPrefix {
+    enum { kUnknownLength = 0xffffffffu };
+    enum { kBytes = 16 };
+
+    uint64_t bytes[2];  // First kBytes bytes, big-endian, zero padded
+    uint32_t length;    // Length of the summarized part of the key
+
+    // Summarize the "n" bytes at "p"
+    void Set(const char* p, size_t n) {
+        unsigned char buf[kBytes] = { 0 };
+        memcpy(buf, p, n < kBytes ? n : kBytes);
+        for (int w = 0; w < 2; w++) {
+            uint64_t v = 0;
+            for (int i = 0; i < 8; i++) {
+                v = (v << 8) | buf[w * 8 + i];
+            }
+            bytes[w] = v;
+        }
+        length = static_cast<uint32_t>(n);
+    }
+
+    // Summary that never decides a comparison
+    void SetUnknown() {
+        bytes[0] = bytes[1] = 0;
+        length = kUnknownLength;
+    }
+
+    // <0 or >0 when the summaries alone order a and b, 0 when the keys
+    // must be compared.  Equal leading bytes decide when the shorter key
+    // fits in them, since it is then a prefix of the longer one (any
+    // byte of the longer key past it is a padding zero).
+    static int Compare(const KeyPrefix& a, const KeyPrefix& b) {
+        if (a.bytes[0] != b.bytes[0]) {
+            return a.bytes[0] < b.bytes[0] ? -1 : +1;
+        }
+        if (a.bytes[1] != b.bytes[1]) {
+            return a.bytes[1] < b.bytes[1] ? -1 : +1;
+        }
+        if (a.length != b.length && (a.length <= kBytes || b.length <= kBytes)) {
+            return a.length < b.length ? -1 : +1;
+        }
+        return 0;
+    }
+};
+
 template<typename Key, class Comparator>
 class SkipList {
 
@@ -54,12 +116,70 @@ public:
     // Insert key into the list.
     // REQUIRES: nothing that compares equal to key is currently in the list.
 #ifdef ENABLE_RECOVERY
-    void Insert(const Key& key, uint64_t s);
+    void Insert(const Key& key, uint64_t s = 0);
 #else
     void Insert(const Key& key);
 #endif
     void InsertNode(void *n);
 
+    // Like Insert(), but may run concurrently with other calls to
+    // InsertConcurrently() and with readers.  Each level is linked with
+    // a compare-and-swap, bottom up, retrying the splice from the
+    // predecessor when another insert won the race.  Not to be mixed
+    // with Insert()/InsertNode() on the same list.
+    void InsertConcurrently(const Key& key);
+
+    // Insert keys[0..n-1], in any order.  The batch is sorted by
+    // key prefix first, then linked in one pass: each search starts from
+    // the splice left by the previous key instead of from the head.
+    // REQUIRES: the keys are distinct and none is in the list yet; same
+    // synchronization as Insert().
+    void InsertBatch(const Key* keys, size_t n);
+
+    // Relink every node of "src" into this list, in one pass with the
+    // same finger search as InsertBatch().  The nodes are not copied;
+    // "src" must not be modified meanwhile and is left unusable.
+    // REQUIRES: same synchronization as InsertNode().
+    void MergeFrom(SkipList* src);
+
+    // Consecutive nodes cut out of a list by SplitAt(), for MergeFrom()
+    class Run {
+    public:
+        Run() : first_(NULL) { }
+        bool empty() const { return first_ == NULL; }
+    private:
+        friend class SkipList;
+        Node* first_;
+    };
+
+    // Cut this list in front of the first node at or after each of
+    // bounds[0..n-1], which must be sorted, into runs[0..n]: runs[0]
+    // holds the nodes before bounds[0] and runs[n] those at or after
+    // bounds[n-1].  Only level-0 links are cut, and the list is left
+    // unusable as after MergeFrom().  The runs share no node, so they
+    // may be merged into different lists concurrently.
+    void SplitAt(const Key* bounds, int n, Run* runs);
+
+    // MergeFrom() for the nodes of a run
+    void MergeFrom(const Run& run);
+
+    // Append the keys of about n nodes spread over the whole list: those
+    // of the highest level holding at least n nodes, or of level 0 when
+    // none does.
+    void SampleKeys(size_t n, std::vector<Key>* keys) const;
+
+    // Link every node of this list into "dst", which must be empty, and
+    // then reset this list to empty.  No node is copied or freed, so
+    // readers that are traversing either list remain safe.
+    // REQUIRES: external synchronization against Insert()/InsertNode().
+    void TransferTo(SkipList* dst);
+
+    // The two halves of TransferTo().  Between them both lists hold the
+    // same nodes, so the caller can publish "dst" before the nodes
+    // disappear from this list.
+    void ShareWith(SkipList* dst);
+    void Clear();
+
     // Returns true iff an entry that compares equal to key is in the list.
     bool Contains(const Key& key) const;
 
@@ -80,10 +200,9 @@ public:
 
 #ifdef USE_OFFSETS
         const Key& key_offset() const;
-#else
-        const Key& key() const;
 #endif
-        const Key& set_key_offset(Key new_off) const;
+        const Key& key() const;
+        void set_key_offset(Key new_off) const;
 
         // Advances to the next position.
         // REQUIRES: Valid()
@@ -123,8 +242,8 @@ private:
     //void* head_offset_;   // Head offset from map_start
     //Node* head_;
 
-    // Modified only by Insert().  Read racily by readers, but stale
-    // values are ok.
+    // Modified only by Insert() and InsertConcurrently().  Read racily
+    // by readers, but stale values are ok.
     port::AtomicPointer max_height_;   // Height of the entire list
 
     inline int GetMaxHeight() const {
@@ -135,12 +254,24 @@ private:
     // Read/written only by Insert().
     Random rnd_;
 
+    // Serializes node allocation in InsertConcurrently(); the arena is
+    // not thread-safe
+    port::Mutex alloc_mu_;
+
     Node* NewNode(const Key& key, int height, bool head_alloc);
     int RandomHeight();
+    // RandomHeight() from a per-thread generator
+    int RandomHeightConcurrently();
     bool Equal(const Key& a, const Key& b) const { return (compare_(a, b) == 0); }
 
-    // Return true if key is greater than the data stored in "n"
-    bool KeyIsAfterNode(const Key& key, Node* n) const;
+    // The key stored in "n"
+    static const Key& NodeKey(const Node* n);
+
+    // Return true if key is greater than the data stored in "n".
+    // "prefix" is the comparator's summary of key.
+    bool KeyIsAfterNode(const Key& key, const KeyPrefix& prefix, Node* n) const;
+    // <0, 0, >0 as the key of "n" sorts before, with or after key
+    int CompareNode(const Node* n, const Key& key, const KeyPrefix& prefix) const;
 
     // Return the earliest node that comes at or after key.
     // Return NULL if there is no such node.
@@ -148,11 +279,35 @@ private:
     // If prev is non-NULL, fills prev[level] with pointer to previous
     // node at "level" for every level in [0..max_height_-1].
     Node* FindGreaterOrEqual(const Key& key, Node** prev) const;
+    Node* FindGreaterOrEqual(const Key& key, const KeyPrefix& prefix,
+                             Node** prev) const;
 
     // Return the latest node with a key < key.
     // Return head_ if there is no such node.
     Node* FindLessThan(const Key& key) const;
 
+    // Where the previous key of a sorted pass was linked.  For every
+    // level i < height, prev[i] sorts before that key and next[i] is the
+    // node after prev[i]; brackets only widen going up.
+    struct Splice {
+        int height;
+        Node* prev[kMaxHeight];
+        Node* next[kMaxHeight];
+        Splice() : height(0) { }
+    };
+
+    // Link x, whose key is key and which is "height" levels tall, into
+    // the list, finding its place from *splice and leaving the splice
+    // just after x.  key must sort after the key of the previous call.
+    void LinkWithSplice(Node* x, int height, const Key& key,
+                        const KeyPrefix& prefix, Splice* splice);
+
+    // Starting at "before", which sorts before key, find the nodes
+    // between which key belongs at "level"
+    void FindSpliceForLevel(const Key& key, const KeyPrefix& prefix,
+                            Node* before, int level,
+                            Node** out_prev, Node** out_next) const;
+
     // Return the last node in the list.
     // Return head_ if list is empty.
     Node* FindLast() const;
@@ -174,8 +329,8 @@ public:
 template<typename Key, class Comparator>
 struct SkipList<Key,Comparator>::Node {
 #ifdef USE_OFFSETS
-    explicit Node(const Key& k, const Key& mem) : key_offset(reinterpret_cast<const Key>(k)) { }
-    explicit Node(const Key& k, const Key& mem, int h) : key_offset(reinterpret_cast<const Key>(k)), height(h) { }
+    explicit Node(const Key& k, const Key& mem) : key_offset(k) { }
+    explicit Node(const Key& k, const Key& mem, int h) : key_offset(k), height(h) { }
     Key key_offset;
     int height;
 #else
@@ -183,6 +338,10 @@ struct SkipList<Key,Comparator>::Node {
 
     Key const key;
 #endif
+    // Comparator's summary of the key, so that a search can usually
+    // order the node without reading the key.  With the fields above
+    // a node of height <= 3, nearly all of them, fits in one cache line.
+    KeyPrefix prefix;
     // Accessors/mutators for links.  Wrapped in methods so we can
     // add the appropriate barriers as necessary.
     Node* Next(int n) {
@@ -218,6 +377,11 @@ struct SkipList<Key,Comparator>::Node {
         return reinterpret_cast<Node*>(next_[n].NoBarrier_Load());
 #endif
     }
+    // Link x at level n if the link still points to "expected"
+    bool CASNext(int n, Node* expected, Node* x) {
+        assert(n >= 0);
+        return next_[n].CompareAndSwap(expected, x);
+    }
     void NoBarrier_SetNext(int n, Node* x) {
         assert(n >= 0);
 #if defined(USE_OFFSETS)
@@ -243,8 +407,7 @@ SkipList<Key,Comparator>::NewNode(const Key& key, int height, bool head_alloc) {
               mem = nvm_arena->AllocateAligned(  
                     sizeof(size_t) + sizeof (uint64_t) + sizeof(int) + sizeof(Node) + sizeof(port::AtomicPointer) * (height - 1));
         else {
-            char *key_offset = reinterpret_cast<char *>((intptr_t)key) - (char*)nvm_arena->map_start_;
-            int sub_mem_index = (int)key_offset / SUB_MEM_SIZE;
+            int sub_mem_index = nvm_arena->SubMemOf(reinterpret_cast<const char *>((intptr_t)key));
             mem = nvm_arena->AllocateAligned_submemIndex(  
                     sizeof(Node) + sizeof(port::AtomicPointer) * (height - 1), sub_mem_index);
         }
@@ -282,20 +445,28 @@ inline bool SkipList<Key,Comparator>::Iterator::Valid() const {
 #ifdef USE_OFFSETS
 template<typename Key, class Comparator>
 inline const Key& SkipList<Key,Comparator>::Iterator::key_offset() const {
-#else
-    template<typename Key, class Comparator>
-    inline const Key& SkipList<Key,Comparator>::Iterator::key() const {
+    assert(Valid());
+    return node_->key_offset;
+}
 #endif
-        assert(Valid());
+
+template<typename Key, class Comparator>
+inline const Key& SkipList<Key,Comparator>::Iterator::key() const {
+    assert(Valid());
+    return NodeKey(node_);
+}
+
+template<typename Key, class Comparator>
+inline const Key& SkipList<Key,Comparator>::NodeKey(const Node* n) {
 #if defined(USE_OFFSETS)
-        return node_->key_offset;
+    return n->key_offset;
 #else
-        return node_->key;
+    return n->key;
 #endif
-    }
+}
 
 template<typename Key, class Comparator>
-inline const Key& SkipList<Key,Comparator>::Iterator::set_key_offset(Key new_off) const {
+inline void SkipList<Key,Comparator>::Iterator::set_key_offset(Key new_off) const {
         node_->key_offset = new_off;
 }
 
@@ -310,11 +481,7 @@ inline const Key& SkipList<Key,Comparator>::Iterator::set_key_offset(Key new_off
         // Instead of using explicit "prev" links, we just search for the
         // last node that falls before key.
         assert(Valid());
-#if defined(USE_OFFSETS)
-        node_ = list_->FindLessThan(reinterpret_cast<Key>((intptr_t)node_ - (intptr_t)node_->key_offset));
-#else
-        node_ = list_->FindLessThan(node_->key);
-#endif
+        node_ = list_->FindLessThan(NodeKey(node_));
         if (node_ == list_->head_) {
             node_ = NULL;
         }
@@ -357,23 +524,59 @@ inline void SkipList<Key,Comparator>::Iterator::SetHead(void *ptr) {
     }
 
     template<typename Key, class Comparator>
-    bool SkipList<Key,Comparator>::KeyIsAfterNode(const Key& key, Node* n) const {
+    int SkipList<Key,Comparator>::RandomHeightConcurrently() {
+        static const unsigned int kBranching = 4;
+        static __thread uint32_t seed = 0;
+        if (seed == 0) {
+            seed = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(&seed) >> 4) | 1;
+        }
+        int height = 1;
+        while (height < kMaxHeight) {
+            // xorshift32
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            if ((seed % kBranching) != 0) {
+                break;
+            }
+            height++;
+        }
+        return height;
+    }
+
+    template<typename Key, class Comparator>
+    inline int SkipList<Key,Comparator>::CompareNode(const Node* n, const Key& key,
+                                                     const KeyPrefix& prefix) const {
+        int r = KeyPrefix::Compare(n->prefix, prefix);
+        if (r == 0) {
+            r = compare_(NodeKey(n), key);
+        }
+        return r;
+    }
+
+    template<typename Key, class Comparator>
+    inline bool SkipList<Key,Comparator>::KeyIsAfterNode(const Key& key, const KeyPrefix& prefix,
+                                                         Node* n) const {
         // NULL n is considered infinite
-#if defined(USE_OFFSETS)
-        return (n != NULL) && (compare_(reinterpret_cast<Key>((intptr_t)n->key_offset), key) < 0);
-#else
-        return (n != NULL) && (compare_(n->key, key) < 0);
-#endif
+        return (n != NULL) && (CompareNode(n, key, prefix) < 0);
     }
 
     template<typename Key, class Comparator>
     typename SkipList<Key,Comparator>::Node* SkipList<Key,Comparator>::FindGreaterOrEqual(const Key& key, Node** prev)
     const {
+        KeyPrefix prefix;
+        compare_.GetPrefix(key, &prefix);
+        return FindGreaterOrEqual(key, prefix, prev);
+    }
+
+    template<typename Key, class Comparator>
+    typename SkipList<Key,Comparator>::Node* SkipList<Key,Comparator>::FindGreaterOrEqual(
+            const Key& key, const KeyPrefix& prefix, Node** prev) const {
         Node* x = head_;
         int level = GetMaxHeight() - 1;
         while (true) {
             Node* next = x->Next(level);
-            if (KeyIsAfterNode(key, next)) {
+            if (KeyIsAfterNode(key, prefix, next)) {
                 // Keep searching in this list
                 x = next;
             } else {
@@ -391,20 +594,14 @@ inline void SkipList<Key,Comparator>::Iterator::SetHead(void *ptr) {
     template<typename Key, class Comparator>
     typename SkipList<Key,Comparator>::Node*
     SkipList<Key,Comparator>::FindLessThan(const Key& key) const {
+        KeyPrefix prefix;
+        compare_.GetPrefix(key, &prefix);
         Node* x = head_;
         int level = GetMaxHeight() - 1;
         while (true) {
-#if defined(USE_OFFSETS)
-            assert(x == head_ || compare_(reinterpret_cast<Key>((intptr_t)x - (intptr_t)x->key_offset), key) < 0);
-#else
-            assert(x == head_ || compare_(x->key, key) < 0);
-#endif
+            assert(x == head_ || compare_(NodeKey(x), key) < 0);
             Node* next = x->Next(level);
-#if defined(USE_OFFSETS)
-            if (next == NULL || compare_(reinterpret_cast<Key>((intptr_t)next - (intptr_t)next->key_offset), key) >= 0) {
-#else
-                if (next == NULL || compare_(next->key, key) >= 0) {
-#endif
+                if (next == NULL || CompareNode(next, key, prefix) >= 0) {
                     if (level == 0) {
                         return x;
                     } else {
@@ -490,18 +687,16 @@ inline void SkipList<Key,Comparator>::Iterator::SetHead(void *ptr) {
 
 #ifdef ENABLE_RECOVERY
         template<typename Key, class Comparator>
-        void SkipList<Key,Comparator>::Insert(const Key& key, uint64_t s=0) {
+        void SkipList<Key,Comparator>::Insert(const Key& key, uint64_t s) {
 #else
             template<typename Key, class Comparator>
             void SkipList<Key,Comparator>::Insert(const Key& key) {
 #endif
                 Node* prev[kMaxHeight];
-                Node* x = FindGreaterOrEqual(key, prev);
-#if defined(USE_OFFSETS)
-                assert(x == NULL || !Equal(key, reinterpret_cast<Key>((intptr_t)x - (intptr_t)x->key_offset)));
-#else
-                assert(x == NULL || !Equal(key, x->key));
-#endif
+                KeyPrefix prefix;
+                compare_.GetPrefix(key, &prefix);
+                Node* x = FindGreaterOrEqual(key, prefix, prev);
+                assert(x == NULL || !Equal(key, NodeKey(x)));
 
                 int height = RandomHeight();
                 if (height > GetMaxHeight()) {
@@ -513,16 +708,77 @@ inline void SkipList<Key,Comparator>::Iterator::SetHead(void *ptr) {
                 }
 
                 x = NewNode(key, height, false);
+                x->prefix = prefix;
                 for (int i = 0; i < height; i++) {
                     x->NoBarrier_SetNext(i, prev[i]->NoBarrier_Next(i));
                     prev[i]->SetNext(i, x);
                 }
             }
 
+        template<typename Key, class Comparator>
+        void SkipList<Key,Comparator>::FindSpliceForLevel(const Key& key, const KeyPrefix& prefix,
+                                                          Node* before, int level,
+                                                          Node** out_prev, Node** out_next) const {
+            while (true) {
+                Node* next = before->Next(level);
+                if (!KeyIsAfterNode(key, prefix, next)) {
+                    *out_prev = before;
+                    *out_next = next;
+                    return;
+                }
+                before = next;
+            }
+        }
+
+        template<typename Key, class Comparator>
+        void SkipList<Key,Comparator>::InsertConcurrently(const Key& key) {
+            KeyPrefix prefix;
+            compare_.GetPrefix(key, &prefix);
+
+            int height = RandomHeightConcurrently();
+            int max_height = GetMaxHeight();
+            while (height > max_height) {
+                if (max_height_.CompareAndSwap(reinterpret_cast<void*>(max_height),
+                                               reinterpret_cast<void*>(height))) {
+                    max_height = height;
+                    break;
+                }
+                max_height = GetMaxHeight();
+            }
+
+            Node* x;
+            {
+                MutexLock l(&alloc_mu_);
+                x = NewNode(key, height, false);
+            }
+            x->prefix = prefix;
+
+            Node* prev[kMaxHeight];
+            Node* next[kMaxHeight];
+            Node* before = head_;
+            for (int i = max_height - 1; i >= 0; i--) {
+                FindSpliceForLevel(key, prefix, before, i, &prev[i], &next[i]);
+                before = prev[i];
+            }
+            // Bottom up, so a reader that reaches x at some level finds it
+            // at every level below as well
+            for (int i = 0; i < height; i++) {
+                while (true) {
+                    x->NoBarrier_SetNext(i, next[i]);
+                    if (prev[i]->CASNext(i, next[i], x)) {
+                        break;
+                    }
+                    // Another insert linked a node after prev[i], which
+                    // still sorts before key
+                    FindSpliceForLevel(key, prefix, prev[i], i, &prev[i], &next[i]);
+                }
+            }
+        }
+
         template<typename Key, class Comparator>
         void SkipList<Key,Comparator>::InsertNode(void *n){
             Node* prev[kMaxHeight];
-            Node* x = FindGreaterOrEqual(((Node*)n)->key_offset, prev);
+            Node* x = FindGreaterOrEqual(NodeKey((Node*)n), ((Node*)n)->prefix, prev);
             int height = ((Node*)n)->height;
             if (height > GetMaxHeight()) {
                 for (int i = GetMaxHeight(); i < height; i++) {
@@ -538,14 +794,166 @@ inline void SkipList<Key,Comparator>::Iterator::SetHead(void *ptr) {
         }
 
 
+        template<typename Key, class Comparator>
+        void SkipList<Key,Comparator>::LinkWithSplice(Node* x, int height, const Key& key,
+                                                      const KeyPrefix& prefix, Splice* splice) {
+            int max_height = GetMaxHeight();
+            if (height > max_height) {
+                max_height_.NoBarrier_Store(reinterpret_cast<void*>(height));
+                max_height = height;
+            }
+            // Levels the splice has not covered yet start at the head
+            for (int i = splice->height; i < max_height; i++) {
+                splice->prev[i] = head_;
+                splice->next[i] = head_->NoBarrier_Next(i);
+            }
+            if (splice->height < max_height) {
+                splice->height = max_height;
+            }
+
+            // The lowest bracket that still holds key, so do all above it;
+            // search the levels below it again, starting from its left end
+            int level = 0;
+            while (level < max_height && KeyIsAfterNode(key, prefix, splice->next[level])) {
+                level++;
+            }
+            Node* before;
+            if (level == max_height) {
+                level = max_height - 1;
+                before = splice->prev[level];
+            } else {
+                before = splice->prev[level];
+                level--;
+            }
+            for (int i = level; i >= 0; i--) {
+                FindSpliceForLevel(key, prefix, before, i, &splice->prev[i], &splice->next[i]);
+                before = splice->prev[i];
+            }
+            assert(splice->next[0] == NULL || !Equal(key, NodeKey(splice->next[0])));
+
+            for (int i = 0; i < height; i++) {
+                x->NoBarrier_SetNext(i, splice->next[i]);
+                splice->prev[i]->SetNext(i, x);
+                splice->prev[i] = x;
+            }
+        }
+
+        template<typename Key, class Comparator>
+        void SkipList<Key,Comparator>::InsertBatch(const Key* keys, size_t n) {
+            typedef std::pair<KeyPrefix, Key> Entry;
+            struct EntryLess {
+                const Comparator* compare;
+                bool operator()(const Entry& a, const Entry& b) const {
+                    int r = KeyPrefix::Compare(a.first, b.first);
+                    if (r == 0) {
+                        r = (*compare)(a.second, b.second);
+                    }
+                    return r < 0;
+                }
+            };
+            std::vector<Entry> sorted(n);
+            for (size_t i = 0; i < n; i++) {
+                compare_.GetPrefix(keys[i], &sorted[i].first);
+                sorted[i].second = keys[i];
+            }
+            EntryLess less = { &compare_ };
+            std::sort(sorted.begin(), sorted.end(), less);
+
+            Splice splice;
+            for (size_t i = 0; i < sorted.size(); i++) {
+                int height = RandomHeight();
+                Node* x = NewNode(sorted[i].second, height, false);
+                x->prefix = sorted[i].first;
+                LinkWithSplice(x, height, sorted[i].second, sorted[i].first, &splice);
+            }
+        }
+
+        template<typename Key, class Comparator>
+        void SkipList<Key,Comparator>::MergeFrom(SkipList* src) {
+            Run run;
+            run.first_ = src->head_->Next(0);
+            MergeFrom(run);
+        }
+
+        template<typename Key, class Comparator>
+        void SkipList<Key,Comparator>::MergeFrom(const Run& run) {
+            Splice splice;
+            Node* x = run.first_;
+            while (x != NULL) {
+                // Read before x is relinked into this list
+                Node* next = x->Next(0);
+                LinkWithSplice(x, x->height, NodeKey(x), x->prefix, &splice);
+                x = next;
+            }
+        }
+
+        template<typename Key, class Comparator>
+        void SkipList<Key,Comparator>::SplitAt(const Key* bounds, int n, Run* runs) {
+            // Every cut is found before any is made, since the searches
+            // finish on level 0
+            std::vector<Node*> before(n);
+            std::vector<Node*> at(n);
+            Node* prev[kMaxHeight];
+            for (int i = 0; i < n; i++) {
+                at[i] = FindGreaterOrEqual(bounds[i], prev);
+                before[i] = prev[0];
+            }
+            Node* first = head_->Next(0);
+            for (int i = 0; i < n; i++) {
+                runs[i].first_ = (first == at[i]) ? NULL : first;
+                first = at[i];
+            }
+            runs[n].first_ = first;
+            for (int i = 0; i < n; i++) {
+                if (before[i] != head_) {
+                    before[i]->SetNext(0, NULL);
+                }
+            }
+        }
+
+        template<typename Key, class Comparator>
+        void SkipList<Key,Comparator>::SampleKeys(size_t n, std::vector<Key>* keys) const {
+            for (int level = GetMaxHeight() - 1; level >= 0; level--) {
+                size_t count = 0;
+                for (Node* x = head_->Next(level); x != NULL && count < n; x = x->Next(level)) {
+                    count++;
+                }
+                if (count >= n || level == 0) {
+                    for (Node* x = head_->Next(level); x != NULL; x = x->Next(level)) {
+                        keys->push_back(NodeKey(x));
+                    }
+                    return;
+                }
+            }
+        }
+
+        template<typename Key, class Comparator>
+        void SkipList<Key,Comparator>::TransferTo(SkipList* dst){
+            // dst is fully linked before the nodes disappear from this list
+            ShareWith(dst);
+            Clear();
+        }
+
+        template<typename Key, class Comparator>
+        void SkipList<Key,Comparator>::ShareWith(SkipList* dst){
+            dst->max_height_.NoBarrier_Store(max_height_.NoBarrier_Load());
+            for (int i = 0; i < kMaxHeight; i++) {
+                dst->head_->SetNext(i, head_->Next(i));
+            }
+        }
+
+        template<typename Key, class Comparator>
+        void SkipList<Key,Comparator>::Clear(){
+            for (int i = 0; i < kMaxHeight; i++) {
+                head_->SetNext(i, NULL);
+            }
+            max_height_.NoBarrier_Store(reinterpret_cast<void*>(1));
+        }
+
             template<typename Key, class Comparator>
             bool SkipList<Key,Comparator>::Contains(const Key& key) const {
                 Node* x = FindGreaterOrEqual(key, NULL);
-#if defined(USE_OFFSETS)
-                if (x != NULL && Equal(key, reinterpret_cast<Key>((intptr_t)x - (intptr_t)x->key_offset))) {
-#else
-                    if (x != NULL && Equal(key, x->key)) {
-#endif
+                    if (x != NULL && Equal(key, NodeKey(x))) {
                         return true;
                     } else {
                         return false;
@@ -4,14 +4,19 @@
 
 #include "db/skiplist.h"
 #include <set>
+#include <string>
+#include <vector>
 #include "leveldb/env.h"
 #include "util/arena.h"
 #include "util/hash.h"
+#include "util/mutexlock.h"
 #include "util/random.h"
 #include "util/testharness.h"
 
 namespace leveldb {
 
+static const int kVerbose = 0;
+
 typedef uint64_t Key;
 
 struct Comparator {
@@ -24,6 +29,30 @@ struct Comparator {
       return 0;
     }
   }
+  void GetPrefix(const Key& k, KeyPrefix* prefix) const {
+    prefix->bytes[0] = k;
+    prefix->bytes[1] = 0;
+    prefix->length = sizeof(k);
+  }
+};
+
+// Compares NUL-terminated strings and counts the full comparisons, with
+// or without handing the skiplist key prefixes
+struct CountingComparator {
+  bool use_prefix;
+  int* compares;
+  CountingComparator(bool p, int* c) : use_prefix(p), compares(c) { }
+  int operator()(const char* a, const char* b) const {
+    ++*compares;
+    return strcmp(a, b);
+  }
+  void GetPrefix(const char* k, KeyPrefix* prefix) const {
+    if (use_prefix) {
+      prefix->Set(k, strlen(k));
+    } else {
+      prefix->SetUnknown();
+    }
+  }
 };
 
 class SkipTest { };
@@ -122,6 +151,313 @@ TEST(SkipTest, InsertAndLookup) {
   }
 }
 
+TEST(SkipTest, KeyPrefix) {
+  KeyPrefix a, b;
+  a.Set("abc", 3);
+  b.Set("abcd", 4);
+  ASSERT_LT(KeyPrefix::Compare(a, b), 0);
+  ASSERT_GT(KeyPrefix::Compare(b, a), 0);
+  b.Set("abd", 3);
+  ASSERT_LT(KeyPrefix::Compare(a, b), 0);
+  a.Set("abcdefgh01234567x", 17);
+  b.Set("abcdefgh01234567", 16);
+  ASSERT_GT(KeyPrefix::Compare(a, b), 0);
+  b.Set("abcdefgh01234568", 16);
+  ASSERT_LT(KeyPrefix::Compare(a, b), 0);  // Decided by the second word
+  b.Set("abcdefgh01234567y", 17);
+  ASSERT_EQ(KeyPrefix::Compare(a, b), 0);  // Undecided, keys must be read
+  a.Set("\xff", 1);
+  b.Set("\x01", 1);
+  ASSERT_GT(KeyPrefix::Compare(a, b), 0);  // Bytes compare unsigned
+}
+
+// Same lookups with and without prefixes: both must find exactly the
+// inserted keys, and the prefixes must spare most full comparisons
+TEST(SkipTest, PrefixesSkipComparisons) {
+  const int N = 5000;
+  Random rnd(301);
+  std::vector<std::string> keys;
+  std::set<std::string> model;
+  for (int i = 0; i < N; i++) {
+    char buf[32];
+    // Keys that fit in a prefix and keys that run past it
+    snprintf(buf, sizeof(buf), rnd.OneIn(2) ? "%u" : "%u.long-suffix",
+             rnd.Uniform(N * 4));
+    if (model.insert(buf).second) {
+      keys.push_back(buf);
+    }
+  }
+
+  int compares[2];
+  for (int p = 0; p < 2; p++) {
+    compares[p] = 0;
+    Arena arena;
+    CountingComparator cmp(p == 1, &compares[p]);
+    SkipList<const char*, CountingComparator> list(cmp, &arena);
+    for (size_t i = 0; i < keys.size(); i++) {
+      list.Insert(keys[i].c_str());
+    }
+    for (int i = 0; i < N; i++) {
+      char buf[32];
+      snprintf(buf, sizeof(buf), rnd.OneIn(2) ? "%u" : "%u.long-suffix",
+               rnd.Uniform(N * 4));
+      ASSERT_EQ(model.count(buf) == 1, list.Contains(buf));
+    }
+
+    SkipList<const char*, CountingComparator>::Iterator iter(&list);
+    std::set<std::string>::iterator m = model.begin();
+    for (iter.SeekToFirst(); iter.Valid(); iter.Next(), ++m) {
+      ASSERT_TRUE(m != model.end());
+      ASSERT_EQ(*m, std::string(iter.key()));
+    }
+    ASSERT_TRUE(m == model.end());
+    std::set<std::string>::reverse_iterator r = model.rbegin();
+    for (iter.SeekToLast(); iter.Valid(); iter.Prev(), ++r) {
+      ASSERT_TRUE(r != model.rend());
+      ASSERT_EQ(*r, std::string(iter.key()));
+    }
+    ASSERT_TRUE(r == model.rend());
+  }
+  if (kVerbose >= 1) {
+    fprintf(stderr, "full comparisons: %d without prefixes, %d with\n",
+            compares[0], compares[1]);
+  }
+  ASSERT_LT(compares[1] * 4, compares[0]);
+}
+
+TEST(SkipTest, InsertBatch) {
+  Random rnd(301);
+  Arena arena;
+  Comparator cmp;
+  SkipList<Key, Comparator> list(cmp, &arena);
+  std::set<Key> model;
+  for (int round = 0; round < 20; round++) {
+    // Batches of every size, landing between, before and after the
+    // keys already in the list
+    std::vector<Key> batch;
+    size_t n = (round == 0) ? 0 : rnd.Uniform(1 << (round % 12));
+    while (batch.size() < n) {
+      Key k = rnd.Uniform(100000);
+      if (model.insert(k).second) {
+        batch.push_back(k);
+      }
+    }
+    if (round % 3 == 0) {
+      for (size_t i = 0; i < batch.size(); i++) {
+        list.Insert(batch[i]);
+      }
+    } else if (!batch.empty()) {
+      list.InsertBatch(&batch[0], batch.size());
+    }
+
+    SkipList<Key, Comparator>::Iterator iter(&list);
+    std::set<Key>::iterator m = model.begin();
+    for (iter.SeekToFirst(); iter.Valid(); iter.Next(), ++m) {
+      ASSERT_TRUE(m != model.end());
+      ASSERT_EQ(*m, iter.key());
+    }
+    ASSERT_TRUE(m == model.end());
+    for (int i = 0; i < 100; i++) {
+      Key k = rnd.Uniform(100000);
+      ASSERT_EQ(model.count(k), list.Contains(k) ? 1 : 0);
+    }
+  }
+}
+
+TEST(SkipTest, MergeFrom) {
+  Random rnd(301);
+  Arena arena;
+  Comparator cmp;
+  SkipList<Key, Comparator> dst(cmp, &arena);
+  std::set<Key> model;
+  for (int round = 0; round < 10; round++) {
+    SkipList<Key, Comparator> src(cmp, &arena);
+    int n = rnd.Uniform(3000);
+    for (int i = 0; i < n; i++) {
+      Key k = rnd.Uniform(1000000);
+      if (model.insert(k).second) {
+        src.Insert(k);
+      }
+    }
+    dst.MergeFrom(&src);
+
+    SkipList<Key, Comparator>::Iterator iter(&dst);
+    std::set<Key>::iterator m = model.begin();
+    for (iter.SeekToFirst(); iter.Valid(); iter.Next(), ++m) {
+      ASSERT_TRUE(m != model.end());
+      ASSERT_EQ(*m, iter.key());
+    }
+    ASSERT_TRUE(m == model.end());
+    std::set<Key>::reverse_iterator r = model.rbegin();
+    for (iter.SeekToLast(); iter.Valid(); iter.Prev(), ++r) {
+      ASSERT_EQ(*r, iter.key());
+    }
+    ASSERT_TRUE(r == model.rend());
+  }
+}
+
+TEST(SkipTest, SplitAt) {
+  Random rnd(301);
+  Arena arena;
+  Comparator cmp;
+  const int kParts = 4;
+  SkipList<Key, Comparator>* parts[kParts];
+  for (int p = 0; p < kParts; p++) {
+    parts[p] = new SkipList<Key, Comparator>(cmp, &arena);
+  }
+  // Bounds that fall between keys, on keys, and past every key, so that
+  // some runs come out empty
+  const Key bounds[kParts - 1] = { 250000, 250000, 500000 };
+  std::set<Key> model;
+  for (int round = 0; round < 10; round++) {
+    SkipList<Key, Comparator> src(cmp, &arena);
+    int n = rnd.Uniform(3000);
+    for (int i = 0; i < n; i++) {
+      Key k = rnd.Uniform(500000);
+      if (model.insert(k).second) {
+        src.Insert(k);
+      }
+    }
+    if (round == 3 && model.insert(250000).second) {
+      src.Insert(250000);
+    }
+    SkipList<Key, Comparator>::Run runs[kParts];
+    src.SplitAt(bounds, kParts - 1, runs);
+    ASSERT_TRUE(runs[1].empty());
+    ASSERT_TRUE(runs[kParts - 1].empty());
+    for (int p = 0; p < kParts; p++) {
+      parts[p]->MergeFrom(runs[p]);
+    }
+
+    // Each partition holds exactly the model's keys in its range
+    std::set<Key>::iterator m = model.begin();
+    for (int p = 0; p < kParts; p++) {
+      SkipList<Key, Comparator>::Iterator iter(parts[p]);
+      for (iter.SeekToFirst(); iter.Valid(); iter.Next(), ++m) {
+        ASSERT_TRUE(m != model.end());
+        ASSERT_EQ(*m, iter.key());
+        if (p > 0) ASSERT_GE(iter.key(), bounds[p - 1]);
+        if (p < kParts - 1) ASSERT_LT(iter.key(), bounds[p]);
+      }
+    }
+    ASSERT_TRUE(m == model.end());
+  }
+  for (int p = 0; p < kParts; p++) {
+    delete parts[p];
+  }
+}
+
+TEST(SkipTest, SampleKeys) {
+  Arena arena;
+  Comparator cmp;
+  SkipList<Key, Comparator> list(cmp, &arena);
+  std::vector<Key> keys;
+  list.SampleKeys(16, &keys);
+  ASSERT_TRUE(keys.empty());
+
+  for (int i = 0; i < 10; i++) {
+    list.Insert(i);
+  }
+  list.SampleKeys(16, &keys);
+  ASSERT_EQ(10, keys.size());  // Short lists give every key
+
+  for (int i = 10; i < 100000; i++) {
+    list.Insert(i);
+  }
+  keys.clear();
+  list.SampleKeys(16, &keys);
+  ASSERT_GE(keys.size(), 16);
+  ASSERT_LT(keys.size(), 1000);
+  for (size_t i = 1; i < keys.size(); i++) {
+    ASSERT_LT(keys[i - 1], keys[i]);
+  }
+  // Spread over the list, not bunched at its start
+  ASSERT_GT(keys.back(), 50000);
+}
+
+// Several writers link disjoint keys with InsertConcurrently() while a
+// reader walks the list; every walk must be sorted, and the final list
+// must hold every key exactly once.
+namespace {
+struct ConcurrentInsertState {
+  SkipList<Key, Comparator>* list;
+  port::AtomicPointer writers_done;
+  port::Mutex mu;
+  port::CondVar cv;
+  int running;
+  int next_id;
+  ConcurrentInsertState() : cv(&mu), running(0), next_id(0) { }
+};
+
+const int kInsertThreads = 4;
+const int kKeysPerThread = 20000;
+
+// The i-th key written by writer "id", in a scrambled order
+Key ConcurrentInsertKey(int id, int i) {
+  return (static_cast<Key>((i * 7919) % kKeysPerThread) << 8) | id;
+}
+
+void ConcurrentInserter(void* arg) {
+  ConcurrentInsertState* state = reinterpret_cast<ConcurrentInsertState*>(arg);
+  int id;
+  {
+    MutexLock l(&state->mu);
+    id = state->next_id++;
+  }
+  // The writers' keys interleave, so they race for the same splices
+  for (int i = 0; i < kKeysPerThread; i++) {
+    state->list->InsertConcurrently(ConcurrentInsertKey(id, i));
+  }
+  MutexLock l(&state->mu);
+  state->running--;
+  state->cv.SignalAll();
+}
+}  // namespace
+
+TEST(SkipTest, InsertConcurrently) {
+  Arena arena;
+  Comparator cmp;
+  SkipList<Key, Comparator> list(cmp, &arena);
+  ConcurrentInsertState state;
+  state.list = &list;
+  state.running = kInsertThreads;
+  for (int t = 0; t < kInsertThreads; t++) {
+    Env::Default()->StartThread(ConcurrentInserter, &state);
+  }
+
+  bool done = false;
+  while (!done) {
+    {
+      MutexLock l(&state.mu);
+      done = (state.running == 0);
+    }
+    SkipList<Key, Comparator>::Iterator iter(&list);
+    Key last = 0;
+    for (iter.SeekToFirst(); iter.Valid(); iter.Next()) {
+      ASSERT_LE(last, iter.key());
+      last = iter.key();
+    }
+  }
+
+  std::set<Key> model;
+  for (int t = 0; t < kInsertThreads; t++) {
+    for (int i = 0; i < kKeysPerThread; i++) {
+      model.insert(ConcurrentInsertKey(t, i));
+    }
+  }
+  ASSERT_EQ(kInsertThreads * kKeysPerThread, model.size());
+  SkipList<Key, Comparator>::Iterator iter(&list);
+  std::set<Key>::iterator m = model.begin();
+  for (iter.SeekToFirst(); iter.Valid(); iter.Next(), ++m) {
+    ASSERT_TRUE(m != model.end());
+    ASSERT_EQ(*m, iter.key());
+  }
+  ASSERT_TRUE(m == model.end());
+  for (std::set<Key>::iterator k = model.begin(); k != model.end(); ++k) {
+    ASSERT_TRUE(list.Contains(*k));
+  }
+}
+
 // We want to make sure that with a single writer and multiple
 // concurrent readers (with no synchronization other than when a
 // reader's iterator is created), the reader always observes all the
@@ -30,20 +30,36 @@ static void UnrefEntry(void* arg1, void* arg2) {
 }
 
 TableCache::TableCache(const std::string& dbname_disk,
+                       const std::string& dbname_secndry_disk,
                        const Options* options,
                        int entries)
     : env_(options->env),
       dbname_disk_(dbname_disk),
+      dbname_secndry_disk_(dbname_secndry_disk),
       options_(options),
-      cache_(NewLRUCache(entries)) {
+      cache_(options->clock_cache
+                 ? NewClockCache(entries, options->cache_shard_bits, 1)
+                 : NewLRUCache(entries)) {
 }
 
 TableCache::~TableCache() {
   delete cache_;
 }
 
+Status TableCache::OpenTableFile(const std::string& dir, uint64_t file_number,
+                                 RandomAccessFile** file) {
+  Status s = env_->NewRandomAccessFile(TableFileName(dir, file_number), file);
+  if (!s.ok()) {
+    std::string old_fname = SSTTableFileName(dir, file_number);
+    if (env_->NewRandomAccessFile(old_fname, file).ok()) {
+      s = Status::OK();
+    }
+  }
+  return s;
+}
+
 Status TableCache::FindTable(uint64_t file_number, uint64_t file_size,
-                             Cache::Handle** handle) {
+                             int path_id, Cache::Handle** handle) {
   Status s;
   char buf[sizeof(file_number)];
   EncodeFixed64(buf, file_number);
@@ -52,11 +68,13 @@ Status TableCache::FindTable(uint64_t file_number, uint64_t file_size,
   if (*handle == NULL) {
     RandomAccessFile* file = NULL;
     Table* table = NULL;
-    std::string fname = TableFileName(dbname_disk_, file_number);
-    s = env_->NewRandomAccessFile(fname, &file);
-    if (!s.ok()) {
-      std::string old_fname = SSTTableFileName(dbname_disk_, file_number);
-      if (env_->NewRandomAccessFile(old_fname, &file).ok()) {
+    const bool secondary = path_id != 0 && !dbname_secndry_disk_.empty();
+    s = OpenTableFile(secondary ? dbname_secndry_disk_ : dbname_disk_,
+                      file_number, &file);
+    if (!s.ok() && !dbname_secndry_disk_.empty()) {
+      // The file may have been moved between the paths by hand
+      if (OpenTableFile(secondary ? dbname_disk_ : dbname_secndry_disk_,
+                        file_number, &file).ok()) {
         s = Status::OK();
       }
     }
@@ -82,13 +100,14 @@ Status TableCache::FindTable(uint64_t file_number, uint64_t file_size,
 Iterator* TableCache::NewIterator(const ReadOptions& options,
                                   uint64_t file_number,
                                   uint64_t file_size,
+                                  int path_id,
                                   Table** tableptr) {
   if (tableptr != NULL) {
     *tableptr = NULL;
   }
 
   Cache::Handle* handle = NULL;
-  Status s = FindTable(file_number, file_size, &handle);
+  Status s = FindTable(file_number, file_size, path_id, &handle);
   if (!s.ok()) {
     return NewErrorIterator(s);
   }
@@ -105,11 +124,12 @@ Iterator* TableCache::NewIterator(const ReadOptions& options,
 Status TableCache::Get(const ReadOptions& options,
                        uint64_t file_number,
                        uint64_t file_size,
+                       int path_id,
                        const Slice& k,
                        void* arg,
                        void (*saver)(void*, const Slice&, const Slice&)) {
   Cache::Handle* handle = NULL;
-  Status s = FindTable(file_number, file_size, &handle);
+  Status s = FindTable(file_number, file_size, path_id, &handle);
   if (s.ok()) {
     Table* t = reinterpret_cast<TableAndFile*>(cache_->Value(handle))->table;
     s = t->InternalGet(options, k, arg, saver);
@@ -118,6 +138,21 @@ Status TableCache::Get(const ReadOptions& options,
   return s;
 }
 
+Iterator* TableCache::NewIndexIterator(uint64_t file_number,
+                                       uint64_t file_size,
+                                       int path_id) {
+  Cache::Handle* handle = NULL;
+  Status s = FindTable(file_number, file_size, path_id, &handle);
+  if (!s.ok()) {
+    return NewErrorIterator(s);
+  }
+
+  Table* table = reinterpret_cast<TableAndFile*>(cache_->Value(handle))->table;
+  Iterator* result = table->NewIndexIterator();
+  result->RegisterCleanup(&UnrefEntry, cache_, handle);
+  return result;
+}
+
 void TableCache::Evict(uint64_t file_number) {
   char buf[sizeof(file_number)];
   EncodeFixed64(buf, file_number);
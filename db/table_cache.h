@@ -20,11 +20,15 @@ class Env;
 
 class TableCache {
  public:
-  TableCache(const std::string& dbname_disk, const Options* options, int entries);
+  // Tables with path id 0 live in "dbname_disk", those with path id 1 in
+  // "dbname_secndry_disk" (see FileMetaData::path_id).
+  TableCache(const std::string& dbname_disk,
+             const std::string& dbname_secndry_disk,
+             const Options* options, int entries);
   ~TableCache();
 
-  // Return an iterator for the specified file number (the corresponding
-  // file length must be exactly "file_size" bytes).  If "tableptr" is
+  // Return an iterator for the specified file number on path "path_id"
+  // (the corresponding file length must be exactly "file_size" bytes).  If "tableptr" is
   // non-NULL, also sets "*tableptr" to point to the Table object
   // underlying the returned iterator, or NULL if no Table object underlies
   // the returned iterator.  The returned "*tableptr" object is owned by
@@ -33,6 +37,7 @@ class TableCache {
   Iterator* NewIterator(const ReadOptions& options,
                         uint64_t file_number,
                         uint64_t file_size,
+                        int path_id,
                         Table** tableptr = NULL);
 
   // If a seek to internal key "k" in specified file finds an entry,
@@ -40,10 +45,17 @@ class TableCache {
   Status Get(const ReadOptions& options,
              uint64_t file_number,
              uint64_t file_size,
+             int path_id,
              const Slice& k,
              void* arg,
              void (*handle_result)(void*, const Slice&, const Slice&));
 
+  // Return an iterator over the index block of the specified file (see
+  // Table::NewIndexIterator)
+  Iterator* NewIndexIterator(uint64_t file_number,
+                             uint64_t file_size,
+                             int path_id);
+
   // Evict any entry for the specified file number
   void Evict(uint64_t file_number);
 
@@ -54,7 +66,10 @@ class TableCache {
   const Options* options_;
   Cache* cache_;
 
-  Status FindTable(uint64_t file_number, uint64_t file_size, Cache::Handle**);
+  Status FindTable(uint64_t file_number, uint64_t file_size, int path_id,
+                   Cache::Handle**);
+  Status OpenTableFile(const std::string& dir, uint64_t file_number,
+                       RandomAccessFile** file);
 };
 
 }  // namespace leveldb
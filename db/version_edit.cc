@@ -23,7 +23,9 @@ enum Tag {
   kMapNumber            = 8,
 #endif
   // 8 was used for large value refs
-  kPrevLogNumber        = 9
+  kPrevLogNumber        = 9,
+  // kNewFile with the file's path id after the level
+  kNewFileOnPath        = 10
 };
 
 void VersionEdit::Clear() {
@@ -91,8 +93,16 @@ void VersionEdit::EncodeTo(std::string* dst) const {
 
   for (size_t i = 0; i < new_files_.size(); i++) {
     const FileMetaData& f = new_files_[i].second;
-    PutVarint32(dst, kNewFile);
-    PutVarint32(dst, new_files_[i].first);  // level
+    // Files in the DB directory keep the original tag, so that their
+    // edits stay readable by older versions
+    if (f.path_id == 0) {
+      PutVarint32(dst, kNewFile);
+      PutVarint32(dst, new_files_[i].first);  // level
+    } else {
+      PutVarint32(dst, kNewFileOnPath);
+      PutVarint32(dst, new_files_[i].first);  // level
+      PutVarint32(dst, f.path_id);
+    }
     PutVarint64(dst, f.number);
     PutVarint64(dst, f.file_size);
     PutLengthPrefixedSlice(dst, f.smallest.Encode());
@@ -129,6 +139,7 @@ Status VersionEdit::DecodeFrom(const Slice& src) {
 
   // Temporary storage for parsing
   int level;
+  uint32_t path_id;
   uint64_t number;
   FileMetaData f;
   Slice str;
@@ -205,11 +216,16 @@ Status VersionEdit::DecodeFrom(const Slice& src) {
         break;
 
       case kNewFile:
+      case kNewFileOnPath:
+        f.path_id = 0;
         if (GetLevel(&input, &level) &&
+            (tag == kNewFile || GetVarint32(&input, &path_id)) &&
             GetVarint64(&input, &f.number) &&
             GetVarint64(&input, &f.file_size) &&
             GetInternalKey(&input, &f.smallest) &&
             GetInternalKey(&input, &f.largest)) {
+          if (tag == kNewFileOnPath)
+            f.path_id = path_id;
           new_files_.push_back(std::make_pair(level, f));
         } else {
           msg = "new-file entry";
@@ -284,6 +300,10 @@ std::string VersionEdit::DebugString() const {
     AppendNumberTo(&r, f.number);
     r.append(" ");
     AppendNumberTo(&r, f.file_size);
+    if (f.path_id != 0) {
+      r.append(" @");
+      AppendNumberTo(&r, f.path_id);
+    }
     r.append(" ");
     r.append(f.smallest.DebugString());
     r.append(" .. ");
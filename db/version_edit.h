@@ -21,8 +21,12 @@ struct FileMetaData {
   uint64_t file_size;         // File size in bytes
   InternalKey smallest;       // Smallest internal key served by table
   InternalKey largest;        // Largest internal key served by table
+  int path_id;                // 0: DB directory, 1: Options::sec_diskpath
+  bool being_compacted;       // Input of a running compaction; guarded by
+                              // the DB mutex
 
-  FileMetaData() : refs(0), allowed_seeks(1 << 30), file_size(0) { }
+  FileMetaData() : refs(0), allowed_seeks(1 << 30), file_size(0), path_id(0),
+                   being_compacted(false) { }
 };
 
 class VersionEdit {
@@ -62,18 +66,21 @@ class VersionEdit {
     compact_pointers_.push_back(std::make_pair(level, key));
   }
 
-  // Add the specified file at the specified number.
+  // Add the specified file at the specified number, in the directory
+  // identified by "path_id" (see FileMetaData).
   // REQUIRES: This version has not been saved (see VersionSet::SaveTo)
   // REQUIRES: "smallest" and "largest" are smallest and largest keys in file
   void AddFile(int level, uint64_t file,
                uint64_t file_size,
                const InternalKey& smallest,
-               const InternalKey& largest) {
+               const InternalKey& largest,
+               int path_id = 0) {
     FileMetaData f;
     f.number = file;
     f.file_size = file_size;
     f.smallest = smallest;
     f.largest = largest;
+    f.path_id = path_id;
     new_files_.push_back(std::make_pair(level, f));
   }
 
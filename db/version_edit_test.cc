@@ -39,6 +39,25 @@ TEST(VersionEditTest, EncodeDecode) {
   TestEncodeDecode(edit);
 }
 
+TEST(VersionEditTest, PathId) {
+  VersionEdit edit;
+  edit.AddFile(1, 10, 100,
+               InternalKey("a", 1, kTypeValue),
+               InternalKey("b", 2, kTypeValue));
+  edit.AddFile(3, 11, 200,
+               InternalKey("c", 3, kTypeValue),
+               InternalKey("d", 4, kTypeValue), 1);
+  TestEncodeDecode(edit);
+
+  std::string encoded;
+  edit.EncodeTo(&encoded);
+  VersionEdit parsed;
+  ASSERT_OK(parsed.DecodeFrom(encoded));
+  std::string debug = parsed.DebugString();
+  ASSERT_TRUE(debug.find(" 10 100 ") != std::string::npos) << debug;
+  ASSERT_TRUE(debug.find(" 11 200 @1 ") != std::string::npos) << debug;
+}
+
 }  // namespace leveldb
 
 int main(int argc, char** argv) {
@@ -5,6 +5,7 @@
 #include "db/version_set.h"
 
 #include <algorithm>
+#include <sched.h>
 #include <stdio.h>
 #include "db/filename.h"
 #include "db/log_reader.h"
@@ -20,30 +21,43 @@
 
 namespace leveldb {
 
-static const int kTargetFileSize = 2 * 1048576;
+static size_t TargetFileSize(const Options* options) {
+  return options->max_file_size;
+}
 
 // Maximum bytes of overlaps in grandparent (i.e., level+2) before we
 // stop building a single file in a level->level+1 compaction.
-static const int64_t kMaxGrandParentOverlapBytes = 10L * kTargetFileSize;
+static int64_t MaxGrandParentOverlapBytes(const Options* options) {
+  return 10 * TargetFileSize(options);
+}
 
 // Maximum number of bytes in all compacted files.  We avoid expanding
 // the lower level file set of a compaction if it would make the
 // total compaction cover more than this many bytes.
-static const int64_t kExpandedCompactionByteSizeLimit = 25L * kTargetFileSize;
+static int64_t ExpandedCompactionByteSizeLimit(const Options* options) {
+  return 25 * TargetFileSize(options);
+}
 
-static double MaxBytesForLevel(int level) {
+// Number of write batch ranges that may be applied ahead of the visible
+// sequence before PublishSequence() makes a writer wait.
+static const int kSequenceSlots = 4096;
+
+static double MaxBytesForLevel(const Options* options, int level) {
   // Note: the result for level zero is not really used since we set
   // the level-0 compaction threshold based on number of files.
-  double result = 10 * 1048576.0;  // Result for both level-0 and level-1
+
+  // Result for both level-0 and level-1
+  double result = static_cast<double>(options->max_bytes_for_level_base);
   while (level > 1) {
-    result *= 10;
+    result *= options->max_bytes_for_level_multiplier;
     level--;
   }
   return result;
 }
 
-static uint64_t MaxFileSizeForLevel(int level) {
-  return kTargetFileSize;  // We could vary per level to reduce number of files?
+static uint64_t MaxFileSizeForLevel(const Options* options, int level) {
+  // We could vary per level to reduce number of files?
+  return TargetFileSize(options);
 }
 
 static int64_t TotalFileSize(const std::vector<FileMetaData*>& files) {
@@ -190,6 +204,7 @@ class Version::LevelFileNumIterator : public Iterator {
     assert(Valid());
     EncodeFixed64(value_buf_, (*flist_)[index_]->number);
     EncodeFixed64(value_buf_+8, (*flist_)[index_]->file_size);
+    EncodeFixed32(value_buf_+16, (*flist_)[index_]->path_id);
     return Slice(value_buf_, sizeof(value_buf_));
   }
   virtual Status status() const { return Status::OK(); }
@@ -198,21 +213,22 @@ class Version::LevelFileNumIterator : public Iterator {
   const std::vector<FileMetaData*>* const flist_;
   uint32_t index_;
 
-  // Backing store for value().  Holds the file number and size.
-  mutable char value_buf_[16];
+  // Backing store for value().  Holds the file number, size and path id.
+  mutable char value_buf_[20];
 };
 
 static Iterator* GetFileIterator(void* arg,
                                  const ReadOptions& options,
                                  const Slice& file_value) {
   TableCache* cache = reinterpret_cast<TableCache*>(arg);
-  if (file_value.size() != 16) {
+  if (file_value.size() != 20) {
     return NewErrorIterator(
         Status::Corruption("FileReader invoked with unexpected value"));
   } else {
     return cache->NewIterator(options,
                               DecodeFixed64(file_value.data()),
-                              DecodeFixed64(file_value.data() + 8));
+                              DecodeFixed64(file_value.data() + 8),
+                              DecodeFixed32(file_value.data() + 16));
   }
 }
 
@@ -229,7 +245,8 @@ void Version::AddIterators(const ReadOptions& options,
   for (size_t i = 0; i < files_[0].size(); i++) {
     iters->push_back(
         vset_->table_cache_->NewIterator(
-            options, files_[0][i]->number, files_[0][i]->file_size));
+            options, files_[0][i]->number, files_[0][i]->file_size,
+            files_[0][i]->path_id));
   }
 
   // For levels > 0, we can use a concatenating iterator that sequentially
@@ -420,7 +437,7 @@ Status Version::Get(const ReadOptions& options,
       return Status::NotFound(Slice());	    
 
       s = vset_->table_cache_->Get(options, f->number, f->file_size,
-                                   ikey, &saver, SaveValue);
+                                   f->path_id, ikey, &saver, SaveValue);
       if (!s.ok()) {
         return s;
       }
@@ -531,7 +548,7 @@ int Version::PickLevelForMemTableOutput(
         // Check that file does not overlap too many grandparent bytes.
         GetOverlappingInputs(level + 2, &start, &limit, &overlaps);
         const int64_t sum = TotalFileSize(overlaps);
-        if (sum > kMaxGrandParentOverlapBytes) {
+        if (sum > MaxGrandParentOverlapBytes(vset_->options_)) {
           break;
         }
       }
@@ -801,6 +818,9 @@ VersionSet::VersionSet(const std::string& dbname,
       next_file_number_(2),
       manifest_file_number_(0),  // Filled by Recover()
       last_sequence_(0),
+      allocated_sequence_(0),
+      completed_ranges_(new std::atomic<uint64_t>[kSequenceSlots]),
+      publishing_(false),
       log_number_(0),
 #if defined(ENABLE_RECOVERY)
       map_number_(0),
@@ -809,7 +829,12 @@ VersionSet::VersionSet(const std::string& dbname,
       descriptor_file_(NULL),
       descriptor_log_(NULL),
       dummy_versions_(this),
-      current_(NULL) {
+      current_(NULL),
+      version_number_(0),
+      level0_files_(0) {
+  for (int i = 0; i < kSequenceSlots; i++) {
+    completed_ranges_[i].store(0);
+  }
   AppendVersion(new Version(this));
 }
 
@@ -818,6 +843,7 @@ VersionSet::~VersionSet() {
   assert(dummy_versions_.next_ == &dummy_versions_);  // List must be empty
   delete descriptor_log_;
   delete descriptor_file_;
+  delete[] completed_ranges_;
 }
 
 void VersionSet::AppendVersion(Version* v) {
@@ -828,6 +854,8 @@ void VersionSet::AppendVersion(Version* v) {
     current_->Unref();
   }
   current_ = v;
+  version_number_++;
+  level0_files_.store(v->files_[0].size(), std::memory_order_relaxed);
   v->Ref();
 
   // Append to linked list
@@ -1060,6 +1088,7 @@ Status VersionSet::Recover(bool *save_manifest) {
     manifest_file_number_ = next_file;
     next_file_number_ = next_file + 1;
     last_sequence_ = last_sequence;
+    allocated_sequence_ = last_sequence;
     log_number_ = log_number;
 #if defined(ENABLE_RECOVERY)
     map_number_ = map_number;
@@ -1089,7 +1118,7 @@ bool VersionSet::ReuseManifest(const std::string& dscname,
       manifest_type != kDescriptorFile ||
       !env_->GetFileSize(dscname, &manifest_size).ok() ||
       // Make new compacted MANIFEST if old one is too big
-      manifest_size >= kTargetFileSize) {
+      manifest_size >= TargetFileSize(options_)) {
     return false;
   }
 
@@ -1108,6 +1137,38 @@ bool VersionSet::ReuseManifest(const std::string& dscname,
   return true;
 }
 
+void VersionSet::PublishSequence(uint64_t first, uint64_t last) {
+  // Unpublished ranges starting within kSequenceSlots of the visible
+  // sequence have distinct slots.  One further ahead waits for the
+  // ranges before it to drain; at most that many writers are ever in
+  // flight, so normally this never happens.
+  while (first - last_sequence_.load() > kSequenceSlots) {
+    sched_yield();
+  }
+  completed_ranges_[first % kSequenceSlots].store(last);
+
+  // Only the holder of publishing_ advances the visible sequence, so it
+  // never races with itself.  A writer that finds it held leaves its
+  // range to the holder, which rechecks the next slot after letting go.
+  while (!publishing_.exchange(true)) {
+    uint64_t v = last_sequence_.load();
+    for (;;) {
+      std::atomic<uint64_t>* slot = &completed_ranges_[(v + 1) % kSequenceSlots];
+      const uint64_t end = slot->load();
+      if (end == 0) {
+        break;
+      }
+      slot->store(0);
+      last_sequence_.store(end);
+      v = end;
+    }
+    publishing_.store(false);
+    if (completed_ranges_[(v + 1) % kSequenceSlots].load() == 0) {
+      break;
+    }
+  }
+}
+
 void VersionSet::MarkFileNumberUsed(uint64_t number) {
   if (next_file_number_ <= number) {
     next_file_number_ = number + 1;
@@ -1115,6 +1176,26 @@ void VersionSet::MarkFileNumberUsed(uint64_t number) {
 }
 
 void VersionSet::Finalize(Version* v) {
+  double max_bytes[config::kNumLevels];
+  for (int level = 1; level < config::kNumLevels; level++) {
+    max_bytes[level] = MaxBytesForLevel(options_, level);
+  }
+  if (options_->level_compaction_dynamic_level_bytes) {
+    // Size the levels above the deepest non-empty one from its actual
+    // size.  That one keeps its static target, so it only spills into
+    // the next level once it outgrows it.
+    int bottom = config::kNumLevels - 1;
+    while (bottom > 1 && v->files_[bottom].empty()) {
+      bottom--;
+    }
+    double target = static_cast<double>(TotalFileSize(v->files_[bottom]));
+    for (int level = bottom - 1; level >= 1; level--) {
+      target /= options_->max_bytes_for_level_multiplier;
+      max_bytes[level] = std::max(
+          target, static_cast<double>(options_->max_bytes_for_level_base));
+    }
+  }
+
   // Precomputed best level for next compaction
   int best_level = -1;
   double best_score = -1;
@@ -1134,13 +1215,14 @@ void VersionSet::Finalize(Version* v) {
       // setting, or very high compression ratios, or lots of
       // overwrites/deletions).
       score = v->files_[level].size() /
-          static_cast<double>(config::kL0_CompactionTrigger);
+          static_cast<double>(options_->level0_file_num_compaction_trigger);
     } else {
       // Compute the ratio of current size to size limit.
       const uint64_t level_bytes = TotalFileSize(v->files_[level]);
-      score = static_cast<double>(level_bytes) / MaxBytesForLevel(level);
+      score = static_cast<double>(level_bytes) / max_bytes[level];
     }
 
+    v->compaction_scores_[level] = score;
     if (score > best_score) {
       best_level = level;
       best_score = score;
@@ -1172,7 +1254,8 @@ Status VersionSet::WriteSnapshot(log::Writer* log) {
     const std::vector<FileMetaData*>& files = current_->files_[level];
     for (size_t i = 0; i < files.size(); i++) {
       const FileMetaData* f = files[i];
-      edit.AddFile(level, f->number, f->file_size, f->smallest, f->largest);
+      edit.AddFile(level, f->number, f->file_size, f->smallest, f->largest,
+                   f->path_id);
     }
   }
 
@@ -1223,7 +1306,8 @@ uint64_t VersionSet::ApproximateOffsetOf(Version* v, const InternalKey& ikey) {
         // approximate offset of "ikey" within the table.
         Table* tableptr;
         Iterator* iter = table_cache_->NewIterator(
-            ReadOptions(), files[i]->number, files[i]->file_size, &tableptr);
+            ReadOptions(), files[i]->number, files[i]->file_size,
+            files[i]->path_id, &tableptr);
         if (tableptr != NULL) {
           result += tableptr->ApproximateOffsetOf(ikey.Encode());
         }
@@ -1324,7 +1408,8 @@ Iterator* VersionSet::MakeInputIterator(Compaction* c) {
         const std::vector<FileMetaData*>& files = c->inputs_[which];
         for (size_t i = 0; i < files.size(); i++) {
           list[num++] = table_cache_->NewIterator(
-              options, files[i]->number, files[i]->file_size);
+              options, files[i]->number, files[i]->file_size,
+              files[i]->path_id);
         }
       } else {
         // Create concatenating iterator for the files from this level
@@ -1340,66 +1425,172 @@ Iterator* VersionSet::MakeInputIterator(Compaction* c) {
   return result;
 }
 
-Compaction* VersionSet::PickCompaction() {
-  Compaction* c;
-  int level;
+namespace {
+struct UserKeyLess {
+  const Comparator* ucmp;
+  explicit UserKeyLess(const Comparator* c) : ucmp(c) { }
+  bool operator()(const std::string& a, const std::string& b) const {
+    return ucmp->Compare(a, b) < 0;
+  }
+};
+}  // namespace
 
-  // We prefer compactions triggered by too much data in a level over
-  // the compactions triggered by seeks.
-  const bool size_compaction = (current_->compaction_score_ >= 1);
-  const bool seek_compaction = (current_->file_to_compact_ != NULL);
-  if (size_compaction) {
-    level = current_->compaction_level_;
-    assert(level >= 0);
-    assert(level+1 < config::kNumLevels);
-    c = new Compaction(level);
-
-    // Pick the first file that comes after compact_pointer_[level]
-    for (size_t i = 0; i < current_->files_[level].size(); i++) {
-      FileMetaData* f = current_->files_[level][i];
-      if (compact_pointer_[level].empty() ||
-          icmp_.Compare(f->largest.Encode(), compact_pointer_[level]) > 0) {
-        c->inputs_[0].push_back(f);
-        break;
+void VersionSet::SubcompactionBoundaries(Compaction* c, int n,
+                                         std::vector<std::string>* bounds) {
+  bounds->clear();
+  uint64_t input_bytes = 0;
+  for (int which = 0; which < 2; which++) {
+    for (size_t i = 0; i < c->inputs_[which].size(); i++) {
+      input_bytes += c->inputs_[which][i]->file_size;
+    }
+  }
+  // Every range should fill at least one output file
+  const uint64_t max_ranges = input_bytes / c->MaxOutputFileSize();
+  if (static_cast<uint64_t>(n) > max_ranges) {
+    n = static_cast<int>(max_ranges);
+  }
+  if (n <= 1) {
+    return;
+  }
+
+  // Each index entry bounds one data block of about options_->block_size
+  // bytes, so splitting the sorted entries evenly splits the input bytes
+  const Comparator* ucmp = icmp_.user_comparator();
+  std::vector<std::string> keys;
+  for (int which = 0; which < 2; which++) {
+    for (size_t i = 0; i < c->inputs_[which].size(); i++) {
+      const FileMetaData* f = c->inputs_[which][i];
+      Iterator* iter = table_cache_->NewIndexIterator(f->number, f->file_size,
+                                                      f->path_id);
+      for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+        Slice user_key = ExtractUserKey(iter->key());
+        keys.push_back(user_key.ToString());
       }
+      delete iter;
     }
-    if (c->inputs_[0].empty()) {
-      // Wrap-around to the beginning of the key space
-      c->inputs_[0].push_back(current_->files_[level][0]);
+  }
+  if (keys.empty()) {
+    return;
+  }
+  std::sort(keys.begin(), keys.end(), UserKeyLess(ucmp));
+
+  for (int i = 1; i < n; i++) {
+    const std::string& key = keys[i * keys.size() / n];
+    if (bounds->empty() || ucmp->Compare(key, bounds->back()) > 0) {
+      bounds->push_back(key);
     }
-  } else if (seek_compaction) {
-    level = current_->file_to_compact_level_;
-    c = new Compaction(level);
-    c->inputs_[0].push_back(current_->file_to_compact_);
-  } else {
+  }
+}
+
+static bool AnyBeingCompacted(const std::vector<FileMetaData*>& files) {
+  for (size_t i = 0; i < files.size(); i++) {
+    if (files[i]->being_compacted) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Compaction* VersionSet::PickLevelCompaction(int level) {
+  const std::vector<FileMetaData*>& files = current_->files_[level];
+  if (files.empty() || (level == 0 && AnyBeingCompacted(files))) {
     return NULL;
   }
 
-  c->input_version_ = current_;
-  c->input_version_->Ref();
+  // Pick the first file that comes after compact_pointer_[level],
+  // wrapping around to the beginning of the key space
+  size_t start = 0;
+  while (start < files.size() &&
+         !compact_pointer_[level].empty() &&
+         icmp_.Compare(files[start]->largest.Encode(),
+                       compact_pointer_[level]) <= 0) {
+    start++;
+  }
+  for (size_t i = 0; i < files.size(); i++) {
+    FileMetaData* f = files[(start + i) % files.size()];
+    if (f->being_compacted) {
+      continue;
+    }
+    Compaction* c = new Compaction(options_, level);
+    c->inputs_[0].push_back(f);
+    c->input_version_ = current_;
+    c->input_version_->Ref();
 
-  // Files in level 0 may overlap each other, so pick up all overlapping ones
-  if (level == 0) {
-    InternalKey smallest, largest;
-    GetRange(c->inputs_[0], &smallest, &largest);
-    // Note that the next call will discard the file we placed in
-    // c->inputs_[0] earlier and replace it with an overlapping set
-    // which will include the picked file.
-    current_->GetOverlappingInputs(0, &smallest, &largest, &c->inputs_[0]);
-    assert(!c->inputs_[0].empty());
+    // Files in level 0 may overlap each other, so pick up all overlapping ones
+    if (level == 0) {
+      InternalKey smallest, largest;
+      GetRange(c->inputs_[0], &smallest, &largest);
+      // Note that the next call will discard the file we placed in
+      // c->inputs_[0] earlier and replace it with an overlapping set
+      // which will include the picked file.
+      current_->GetOverlappingInputs(0, &smallest, &largest, &c->inputs_[0]);
+      assert(!c->inputs_[0].empty());
+    }
+
+    if (SetupOtherInputs(c)) {
+      return c;
+    }
+    delete c;
+  }
+  return NULL;
+}
+
+Compaction* VersionSet::PickCompaction() {
+  Compaction* c = NULL;
+
+  // We prefer compactions triggered by too much data in a level over
+  // the compactions triggered by seeks.
+  int levels[config::kNumLevels];
+  int num_levels = 0;
+  for (int level = 0; level < config::kNumLevels - 1; level++) {
+    const double score = current_->compaction_scores_[level];
+    if (score < 1) {
+      continue;
+    }
+    int i = num_levels++;
+    for (; i > 0 && current_->compaction_scores_[levels[i - 1]] < score; i--) {
+      levels[i] = levels[i - 1];
+    }
+    levels[i] = level;
+  }
+  for (int i = 0; i < num_levels && c == NULL; i++) {
+    c = PickLevelCompaction(levels[i]);
   }
 
-  SetupOtherInputs(c);
+  FileMetaData* f = current_->file_to_compact_;
+  if (c == NULL && f != NULL && !f->being_compacted) {
+    const int level = current_->file_to_compact_level_;
+    c = new Compaction(options_, level);
+    c->inputs_[0].push_back(f);
+    c->input_version_ = current_;
+    c->input_version_->Ref();
+    if (level == 0) {
+      InternalKey smallest, largest;
+      GetRange(c->inputs_[0], &smallest, &largest);
+      current_->GetOverlappingInputs(0, &smallest, &largest, &c->inputs_[0]);
+    }
+    if ((level == 0 && AnyBeingCompacted(current_->files_[0])) ||
+        !SetupOtherInputs(c)) {
+      delete c;
+      c = NULL;
+    }
+  }
 
+  if (c != NULL) {
+    c->MarkBeingCompacted(true);
+  }
   return c;
 }
 
-void VersionSet::SetupOtherInputs(Compaction* c) {
+bool VersionSet::SetupOtherInputs(Compaction* c) {
   const int level = c->level();
   InternalKey smallest, largest;
   GetRange(c->inputs_[0], &smallest, &largest);
 
   current_->GetOverlappingInputs(level+1, &smallest, &largest, &c->inputs_[1]);
+  if (AnyBeingCompacted(c->inputs_[0]) || AnyBeingCompacted(c->inputs_[1])) {
+    return false;
+  }
 
   // Get entire range covered by compaction
   InternalKey all_start, all_limit;
@@ -1414,7 +1605,9 @@ void VersionSet::SetupOtherInputs(Compaction* c) {
     const int64_t inputs1_size = TotalFileSize(c->inputs_[1]);
     const int64_t expanded0_size = TotalFileSize(expanded0);
     if (expanded0.size() > c->inputs_[0].size() &&
-        inputs1_size + expanded0_size < kExpandedCompactionByteSizeLimit) {
+        inputs1_size + expanded0_size <
+            ExpandedCompactionByteSizeLimit(options_) &&
+        !AnyBeingCompacted(expanded0)) {
       InternalKey new_start, new_limit;
       GetRange(expanded0, &new_start, &new_limit);
       std::vector<FileMetaData*> expanded1;
@@ -1459,6 +1652,7 @@ void VersionSet::SetupOtherInputs(Compaction* c) {
   // key range next time.
   compact_pointer_[level] = largest.Encode().ToString();
   c->edit_.SetCompactPointer(level, largest);
+  return true;
 }
 
 Compaction* VersionSet::CompactRange(
@@ -1476,7 +1670,7 @@ Compaction* VersionSet::CompactRange(
   // and we must not pick one file and drop another older file if the
   // two files overlap.
   if (level > 0) {
-    const uint64_t limit = MaxFileSizeForLevel(level);
+    const uint64_t limit = MaxFileSizeForLevel(options_, level);
     uint64_t total = 0;
     for (size_t i = 0; i < inputs.size(); i++) {
       uint64_t s = inputs[i]->file_size;
@@ -1488,23 +1682,32 @@ Compaction* VersionSet::CompactRange(
     }
   }
 
-  Compaction* c = new Compaction(level);
+  Compaction* c = new Compaction(options_, level);
   c->input_version_ = current_;
   c->input_version_->Ref();
   c->inputs_[0] = inputs;
-  SetupOtherInputs(c);
+  if (!SetupOtherInputs(c)) {
+    // Manual compactions wait for the others to finish, so this only
+    // happens if one is still running
+    delete c;
+    return NULL;
+  }
+  c->MarkBeingCompacted(true);
   return c;
 }
 
-Compaction::Compaction(int level)
+Compaction::Compaction(const Options* options, int level)
     : level_(level),
-      max_output_file_size_(MaxFileSizeForLevel(level)),
-      input_version_(NULL),
-      grandparent_index_(0),
-      seen_key_(false),
-      overlapped_bytes_(0) {
+      max_output_file_size_(MaxFileSizeForLevel(options, level)),
+      input_version_(NULL) {
+}
+
+Compaction::Cursor::Cursor()
+    : grandparent_index(0),
+      seen_key(false),
+      overlapped_bytes(0) {
   for (int i = 0; i < config::kNumLevels; i++) {
-    level_ptrs_[i] = 0;
+    level_ptrs[i] = 0;
   }
 }
 
@@ -1518,9 +1721,11 @@ bool Compaction::IsTrivialMove() const {
   // Avoid a move if there is lots of overlapping grandparent data.
   // Otherwise, the move could create a parent file that will require
   // a very expensive merge later on.
+  const VersionSet* vset = input_version_->vset_;
   return (num_input_files(0) == 1 &&
           num_input_files(1) == 0 &&
-          TotalFileSize(grandparents_) <= kMaxGrandParentOverlapBytes);
+          TotalFileSize(grandparents_) <=
+              MaxGrandParentOverlapBytes(vset->options_));
 }
 
 void Compaction::AddInputDeletions(VersionEdit* edit) {
@@ -1531,13 +1736,14 @@ void Compaction::AddInputDeletions(VersionEdit* edit) {
   }
 }
 
-bool Compaction::IsBaseLevelForKey(const Slice& user_key) {
+bool Compaction::IsBaseLevelForKey(const Slice& user_key,
+                                   Cursor* cursor) const {
   // Maybe use binary search to find right entry instead of linear search?
   const Comparator* user_cmp = input_version_->vset_->icmp_.user_comparator();
   for (int lvl = level_ + 2; lvl < config::kNumLevels; lvl++) {
     const std::vector<FileMetaData*>& files = input_version_->files_[lvl];
-    for (; level_ptrs_[lvl] < files.size(); ) {
-      FileMetaData* f = files[level_ptrs_[lvl]];
+    for (; cursor->level_ptrs[lvl] < files.size(); ) {
+      FileMetaData* f = files[cursor->level_ptrs[lvl]];
       if (user_cmp->Compare(user_key, f->largest.user_key()) <= 0) {
         // We've advanced far enough
         if (user_cmp->Compare(user_key, f->smallest.user_key()) >= 0) {
@@ -1546,34 +1752,44 @@ bool Compaction::IsBaseLevelForKey(const Slice& user_key) {
         }
         break;
       }
-      level_ptrs_[lvl]++;
+      cursor->level_ptrs[lvl]++;
     }
   }
   return true;
 }
 
-bool Compaction::ShouldStopBefore(const Slice& internal_key) {
+bool Compaction::ShouldStopBefore(const Slice& internal_key,
+                                  Cursor* cursor) const {
+  const VersionSet* vset = input_version_->vset_;
   // Scan to find earliest grandparent file that contains key.
-  const InternalKeyComparator* icmp = &input_version_->vset_->icmp_;
-  while (grandparent_index_ < grandparents_.size() &&
+  const InternalKeyComparator* icmp = &vset->icmp_;
+  while (cursor->grandparent_index < grandparents_.size() &&
       icmp->Compare(internal_key,
-                    grandparents_[grandparent_index_]->largest.Encode()) > 0) {
-    if (seen_key_) {
-      overlapped_bytes_ += grandparents_[grandparent_index_]->file_size;
+                    grandparents_[cursor->grandparent_index]->largest.Encode()) > 0) {
+    if (cursor->seen_key) {
+      cursor->overlapped_bytes += grandparents_[cursor->grandparent_index]->file_size;
     }
-    grandparent_index_++;
+    cursor->grandparent_index++;
   }
-  seen_key_ = true;
+  cursor->seen_key = true;
 
-  if (overlapped_bytes_ > kMaxGrandParentOverlapBytes) {
+  if (cursor->overlapped_bytes > MaxGrandParentOverlapBytes(vset->options_)) {
     // Too much overlap for current output; start new output
-    overlapped_bytes_ = 0;
+    cursor->overlapped_bytes = 0;
     return true;
   } else {
     return false;
   }
 }
 
+void Compaction::MarkBeingCompacted(bool value) {
+  for (int which = 0; which < 2; which++) {
+    for (size_t i = 0; i < inputs_[which].size(); i++) {
+      inputs_[which][i]->being_compacted = value;
+    }
+  }
+}
+
 void Compaction::ReleaseInputs() {
   if (input_version_ != NULL) {
     input_version_->Unref();
@@ -149,11 +149,12 @@ class Version {
   FileMetaData* file_to_compact_;
   int file_to_compact_level_;
 
-  // Level that should be compacted next and its compaction score.
-  // Score < 1 means compaction is not strictly needed.  These fields
-  // are initialized by Finalize().
+  // Level that should be compacted next and its compaction score, and
+  // the score of every level.  Score < 1 means compaction is not
+  // strictly needed.  These fields are initialized by Finalize().
   double compaction_score_;
   int compaction_level_;
+  double compaction_scores_[config::kNumLevels];
 
   explicit Version(VersionSet* vset)
       : vset_(vset), next_(this), prev_(this), refs_(0),
@@ -161,6 +162,10 @@ class Version {
         file_to_compact_level_(-1),
         compaction_score_(-1),
         compaction_level_(-1) {
+    stop_search = 0;
+    for (int level = 0; level < config::kNumLevels; level++) {
+      compaction_scores_[level] = -1;
+    }
   }
 
   ~Version();
@@ -182,7 +187,8 @@ class VersionSet {
   // is both saved to persistent state and installed as the new
   // current version.  Will release *mu while actually writing to the file.
   // REQUIRES: *mu is held on entry.
-  // REQUIRES: no other thread concurrently calls LogAndApply()
+  // REQUIRES: no other thread concurrently calls LogAndApply() (see
+  // DBImpl::LogAndApply)
   Status LogAndApply(VersionEdit* edit, port::Mutex* mu)
       EXCLUSIVE_LOCKS_REQUIRED(mu);
 
@@ -192,6 +198,10 @@ class VersionSet {
   // Return the current version.
   Version* current() const { return current_; }
 
+  // Number of versions made current so far.  Unlike current(), never
+  // repeats, so it tells whether the version changed since it was read.
+  uint64_t CurrentVersionNumber() const { return version_number_; }
+
   // Return the current manifest file number
   uint64_t ManifestFileNumber() const { return manifest_file_number_; }
 
@@ -210,19 +220,41 @@ class VersionSet {
   // Return the number of Table files at the specified level.
   int NumLevelFiles(int level) const;
 
+  // Number of level-0 files in the current version.  Unlike
+  // NumLevelFiles(), may be called without the DB mutex.
+  int NumLevel0FilesRelaxed() const {
+    return level0_files_.load(std::memory_order_relaxed);
+  }
+
   // Return the combined file size of all files at the specified level.
   int64_t NumLevelBytes(int level) const;
 
-  // Return the last sequence number.
-  uint64_t LastSequence() const { return last_sequence_.load(); }
+  // Return the last sequence number visible to readers.  Every write
+  // batch with a sequence number at or below it has been fully applied.
+  uint64_t LastSequence() const {
+    return last_sequence_.load(std::memory_order_acquire);
+  }
 
-  // Set the last sequence number to s.
+  // Set the last sequence number to s, and restart allocation after it.
+  // REQUIRES: no write is in progress
   void SetLastSequence(uint64_t s) {
     assert(s >= last_sequence_);
-    //last_sequence_ = s;
-    last_sequence_.fetch_add(s);
+    last_sequence_.store(s);
+    allocated_sequence_.store(s);
+  }
+
+  // Reserve n consecutive sequence numbers and return the first of them.
+  // Safe to call from any number of writers without holding the mutex.
+  uint64_t AllocateSequence(uint64_t n) {
+    return allocated_sequence_.fetch_add(n) + 1;
   }
 
+  // Mark [first,last], obtained from AllocateSequence(), as applied.
+  // LastSequence() advances over ranges in allocation order only, so a
+  // range applied early stays invisible until everything before it is
+  // applied too; whichever writer completes the gap publishes it.
+  void PublishSequence(uint64_t first, uint64_t last);
+
   // Mark the specified file number as used.
   void MarkFileNumberUsed(uint64_t number);
 
@@ -236,7 +268,10 @@ class VersionSet {
   // being compacted, or zero if there is no such log file.
   uint64_t PrevLogNumber() const { return prev_log_number_; }
 
-  // Pick level and inputs for a new compaction.
+  // Pick level and inputs for a new compaction, from the levels with
+  // the highest scores first, leaving out files that are being compacted
+  // (see Compaction::MarkBeingCompacted).  Only one compaction at a time
+  // takes level-0 files, which overlap each other.
   // Returns NULL if there is no compaction to be done.
   // Otherwise returns a pointer to a heap-allocated object that
   // describes the compaction.  Caller should delete the result.
@@ -259,6 +294,14 @@ class VersionSet {
   // The caller should delete the iterator when no longer needed.
   Iterator* MakeInputIterator(Compaction* c);
 
+  // Split the key range of "*c" into at most "n" ranges that hold about
+  // the same number of data blocks of its inputs, as counted from their
+  // index blocks, and store the user keys that start the second and
+  // later ranges, in order, in *bounds.  Ranges too small to fill an
+  // output file are merged.
+  void SubcompactionBoundaries(Compaction* c, int n,
+                               std::vector<std::string>* bounds);
+
   // Returns true iff some level needs a compaction.
   bool NeedsCompaction() const {
     Version* v = current_;
@@ -299,7 +342,12 @@ class VersionSet {
                  InternalKey* smallest,
                  InternalKey* largest);
 
-  void SetupOtherInputs(Compaction* c);
+  // Pick a compaction of "level" whose inputs are all free
+  Compaction* PickLevelCompaction(int level);
+
+  // Returns false, changing nothing, if an input file it would add is
+  // being compacted
+  bool SetupOtherInputs(Compaction* c);
 
   // Save current contents to *log
   Status WriteSnapshot(log::Writer* log);
@@ -313,8 +361,11 @@ class VersionSet {
   const InternalKeyComparator icmp_;
   uint64_t next_file_number_;
   uint64_t manifest_file_number_;
-  //uint64_t last_sequence_;
-  std::atomic<uint64_t> last_sequence_;
+  std::atomic<uint64_t> last_sequence_;       // Published to readers
+  std::atomic<uint64_t> allocated_sequence_;  // Handed out to writers
+  // Applied but unpublished ranges: slot first%kSequenceSlots holds last
+  std::atomic<uint64_t>* completed_ranges_;
+  std::atomic<bool> publishing_;              // Held while advancing
   uint64_t log_number_;
 #if defined(ENABLE_RECOVERY)
   uint64_t map_number_;
@@ -326,6 +377,8 @@ class VersionSet {
   log::Writer* descriptor_log_;
   Version dummy_versions_;  // Head of circular doubly-linked list of versions.
   Version* current_;        // == dummy_versions_.prev_
+  uint64_t version_number_;
+  std::atomic<int> level0_files_;
 
   // Per-level key at which the next compaction at that level should start.
   // Either an empty string, or a valid InternalKey.
@@ -365,14 +418,41 @@ class Compaction {
   // Add all inputs to this compaction as delete operations to *edit.
   void AddInputDeletions(VersionEdit* edit);
 
+  // Flag the inputs as inputs of a running compaction, so that other
+  // compactions leave them alone.  REQUIRES: the DB mutex is held.
+  void MarkBeingCompacted(bool value);
+
+  // Position of one stream of output keys in the levels below the
+  // compaction.  Each subcompaction walks its key range with its own.
+  struct Cursor {
+    // State used to check for number of of overlapping grandparent files
+    // (parent == level_ + 1, grandparent == level_ + 2)
+    size_t grandparent_index;  // Index in grandparents_
+    bool seen_key;             // Some output key has been seen
+    int64_t overlapped_bytes;  // Bytes of overlap between current output
+                               // and grandparent files
+
+    // State for implementing IsBaseLevelForKey
+
+    // level_ptrs holds indices into input_version_->levels_: our state
+    // is that we are positioned at one of the file ranges for each
+    // higher level than the ones involved in this compaction (i.e. for
+    // all L >= level_ + 2).
+    size_t level_ptrs[config::kNumLevels];
+
+    Cursor();
+  };
+
   // Returns true if the information we have available guarantees that
   // the compaction is producing data in "level+1" for which no data exists
   // in levels greater than "level+1".
-  bool IsBaseLevelForKey(const Slice& user_key);
+  // REQUIRES: keys passed with "cursor" are increasing
+  bool IsBaseLevelForKey(const Slice& user_key, Cursor* cursor) const;
 
   // Returns true iff we should stop building the current output
   // before processing "internal_key".
-  bool ShouldStopBefore(const Slice& internal_key);
+  // REQUIRES: keys passed with "cursor" are increasing
+  bool ShouldStopBefore(const Slice& internal_key, Cursor* cursor) const;
 
   // Release the input version for the compaction, once the compaction
   // is successful.
@@ -382,7 +462,7 @@ class Compaction {
   friend class Version;
   friend class VersionSet;
 
-  explicit Compaction(int level);
+  Compaction(const Options* options, int level);
 
   int level_;
   uint64_t max_output_file_size_;
@@ -395,18 +475,6 @@ class Compaction {
   // State used to check for number of of overlapping grandparent files
   // (parent == level_ + 1, grandparent == level_ + 2)
   std::vector<FileMetaData*> grandparents_;
-  size_t grandparent_index_;  // Index in grandparent_starts_
-  bool seen_key_;             // Some output key has been seen
-  int64_t overlapped_bytes_;  // Bytes of overlap between current output
-                              // and grandparent files
-
-  // State for implementing IsBaseLevelForKey
-
-  // level_ptrs_ holds indices into input_version_->levels_: our state
-  // is that we are positioned at one of the file ranges for each
-  // higher level than the ones involved in this compaction (i.e. for
-  // all L >= level_ + 2).
-  size_t level_ptrs_[config::kNumLevels];
 };
 
 }  // namespace leveldb
@@ -3,6 +3,8 @@
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
 #include "db/version_set.h"
+#include "leveldb/env.h"
+#include "util/mutexlock.h"
 #include "util/logging.h"
 #include "util/testharness.h"
 #include "util/testutil.h"
@@ -172,6 +174,229 @@ TEST(FindFileTest, OverlappingFiles) {
   ASSERT_TRUE(Overlaps("600", "700"));
 }
 
+class SequenceTest {
+ public:
+  Options options_;
+  InternalKeyComparator icmp_;
+  VersionSet versions_;
+
+  SequenceTest()
+      : icmp_(BytewiseComparator()),
+        versions_("sequence_test", &options_, NULL, &icmp_) { }
+};
+
+TEST(SequenceTest, PublishInOrder) {
+  versions_.SetLastSequence(10);
+  const uint64_t a = versions_.AllocateSequence(3);
+  const uint64_t b = versions_.AllocateSequence(1);
+  const uint64_t c = versions_.AllocateSequence(2);
+  ASSERT_EQ(11, a);
+  ASSERT_EQ(14, b);
+  ASSERT_EQ(15, c);
+
+  // Later ranges stay invisible until the ranges before them are done
+  versions_.PublishSequence(c, c + 1);
+  ASSERT_EQ(10, versions_.LastSequence());
+  versions_.PublishSequence(b, b);
+  ASSERT_EQ(10, versions_.LastSequence());
+  versions_.PublishSequence(a, a + 2);
+  ASSERT_EQ(16, versions_.LastSequence());
+
+  const uint64_t d = versions_.AllocateSequence(1);
+  ASSERT_EQ(17, d);
+  versions_.PublishSequence(d, d);
+  ASSERT_EQ(17, versions_.LastSequence());
+}
+
+class PickCompactionTest {
+ public:
+  Env* env_;
+  std::string dbname_;
+  Options options_;
+  InternalKeyComparator icmp_;
+  port::Mutex mu_;
+  VersionSet* versions_;
+  uint64_t next_file_;
+
+  PickCompactionTest()
+      : env_(Env::Default()),
+        icmp_(BytewiseComparator()),
+        versions_(NULL),
+        next_file_(100) {
+    dbname_ = test::TmpDir() + "/version_set_test";
+    env_->CreateDir(dbname_);
+    std::vector<std::string> files;
+    env_->GetChildren(dbname_, &files);
+    for (size_t i = 0; i < files.size(); i++) {
+      env_->DeleteFile(dbname_ + "/" + files[i]);
+    }
+    options_.max_bytes_for_level_base = 1000;
+    options_.max_bytes_for_level_multiplier = 10;
+  }
+
+  ~PickCompactionTest() {
+    delete versions_;
+  }
+
+  // Adds a file of "size" bytes spanning [smallest,largest] to "level"
+  // and returns it.  Opens the version set on first use, so tests can
+  // set options_ up before.
+  FileMetaData* Add(int level, const char* smallest, const char* largest,
+                    uint64_t size) {
+    if (versions_ == NULL) {
+      versions_ = new VersionSet(dbname_, &options_, NULL, &icmp_);
+    }
+    const uint64_t number = next_file_++;
+    VersionEdit edit;
+    edit.AddFile(level, number, size,
+                 InternalKey(smallest, 100, kTypeValue),
+                 InternalKey(largest, 100, kTypeValue));
+    MutexLock l(&mu_);
+    versions_->MarkFileNumberUsed(number);
+    ASSERT_OK(versions_->LogAndApply(&edit, &mu_));
+    std::vector<FileMetaData*> files;
+    versions_->current()->GetOverlappingInputs(level, NULL, NULL, &files);
+    for (size_t i = 0; i < files.size(); i++) {
+      if (files[i]->number == number) {
+        return files[i];
+      }
+    }
+    ASSERT_TRUE(false);
+    return NULL;
+  }
+
+  Compaction* Pick() {
+    MutexLock l(&mu_);
+    return versions_->PickCompaction();
+  }
+
+  void Finish(Compaction* c) {
+    MutexLock l(&mu_);
+    c->MarkBeingCompacted(false);
+    c->ReleaseInputs();
+    delete c;
+  }
+};
+
+TEST(PickCompactionTest, SkipsFilesBeingCompacted) {
+  FileMetaData* a = Add(1, "100", "199", 600);
+  FileMetaData* b = Add(1, "300", "399", 600);
+  FileMetaData* c = Add(2, "150", "160", 100);
+  FileMetaData* d = Add(2, "350", "360", 100);
+
+  // Disjoint inputs, so both compactions may run at once
+  Compaction* first = Pick();
+  ASSERT_TRUE(first != NULL);
+  ASSERT_EQ(1, first->level());
+  ASSERT_EQ(1, first->num_input_files(0));
+  ASSERT_EQ(1, first->num_input_files(1));
+  ASSERT_TRUE(first->input(0, 0) == a);
+  ASSERT_TRUE(first->input(1, 0) == c);
+  ASSERT_TRUE(a->being_compacted && c->being_compacted);
+
+  Compaction* second = Pick();
+  ASSERT_TRUE(second != NULL);
+  ASSERT_EQ(1, second->num_input_files(0));
+  ASSERT_EQ(1, second->num_input_files(1));
+  ASSERT_TRUE(second->input(0, 0) == b);
+  ASSERT_TRUE(second->input(1, 0) == d);
+
+  // Every file of level 1 is taken
+  ASSERT_TRUE(Pick() == NULL);
+
+  Finish(first);
+  ASSERT_TRUE(!a->being_compacted && !c->being_compacted);
+  Compaction* third = Pick();
+  ASSERT_TRUE(third != NULL);
+  ASSERT_TRUE(third->input(0, 0) == a);
+  Finish(third);
+  Finish(second);
+}
+
+TEST(PickCompactionTest, SkipsOverlapBeingCompacted) {
+  FileMetaData* a = Add(1, "100", "199", 600);
+  FileMetaData* b = Add(1, "300", "399", 600);
+  FileMetaData* c = Add(2, "150", "350", 100);
+  FileMetaData* e = Add(2, "390", "395", 100);
+
+  // Growing "first" to "b" would pull in "e" as well, so it is not grown
+  Compaction* first = Pick();
+  ASSERT_TRUE(first != NULL);
+  ASSERT_EQ(1, first->num_input_files(0));
+  ASSERT_TRUE(first->input(0, 0) == a);
+  ASSERT_EQ(1, first->num_input_files(1));
+  ASSERT_TRUE(first->input(1, 0) == c);
+
+  // "b" is free, but its level-2 overlap is an input of "first"
+  ASSERT_TRUE(!b->being_compacted);
+  ASSERT_TRUE(Pick() == NULL);
+
+  // Once it is done, "b" is picked and grown back to "a"
+  Finish(first);
+  Compaction* second = Pick();
+  ASSERT_TRUE(second != NULL);
+  ASSERT_EQ(2, second->num_input_files(0));
+  ASSERT_TRUE(second->input(0, 0) == a);
+  ASSERT_TRUE(second->input(0, 1) == b);
+  ASSERT_EQ(2, second->num_input_files(1));
+  ASSERT_TRUE(second->input(1, 0) == c);
+  ASSERT_TRUE(second->input(1, 1) == e);
+  Finish(second);
+}
+
+TEST(PickCompactionTest, VersionNumbers) {
+  Add(1, "100", "199", 100);
+  const uint64_t before = versions_->CurrentVersionNumber();
+  Add(1, "300", "399", 100);
+  ASSERT_EQ(before + 1, versions_->CurrentVersionNumber());
+}
+
+TEST(PickCompactionTest, Level0WaitsForRunningLevel0) {
+  options_.level0_file_num_compaction_trigger = 2;
+  FileMetaData* a = Add(0, "100", "199", 100);
+  FileMetaData* b = Add(0, "300", "399", 100);
+  Add(0, "500", "599", 100);
+
+  // Level-0 files may overlap, so one level-0 compaction at a time
+  Compaction* first = Pick();
+  ASSERT_TRUE(first != NULL);
+  ASSERT_EQ(0, first->level());
+  ASSERT_TRUE(first->input(0, 0) == a || first->input(0, 0) == b);
+  ASSERT_TRUE(Pick() == NULL);
+  Finish(first);
+}
+
+TEST(PickCompactionTest, LevelTargets) {
+  options_.max_file_size = 4096;
+  Add(1, "500", "599", 900);
+  Add(2, "100", "199", 9000);
+  // Level 1 holds up to 1000 bytes and level 2 ten times as much
+  ASSERT_TRUE(Pick() == NULL);
+
+  Add(2, "300", "399", 2000);
+  Compaction* c = Pick();
+  ASSERT_TRUE(c != NULL);
+  ASSERT_EQ(2, c->level());
+  ASSERT_EQ(4096, c->MaxOutputFileSize());
+  Finish(c);
+}
+
+TEST(PickCompactionTest, DynamicLevelTargets) {
+  options_.level_compaction_dynamic_level_bytes = true;
+  // The deepest level keeps its static target of 100000 bytes
+  Add(3, "000", "999", 50000);
+  // Level 1 would aim for 500 bytes, but never less than the base
+  Add(1, "500", "599", 900);
+  ASSERT_TRUE(Pick() == NULL);
+
+  // Level 2 aims for a tenth of level 3 rather than 10000 bytes
+  Add(2, "100", "199", 6000);
+  Compaction* c = Pick();
+  ASSERT_TRUE(c != NULL);
+  ASSERT_EQ(2, c->level());
+  Finish(c);
+}
+
 }  // namespace leveldb
 
 int main(int argc, char** argv) {
@@ -39,7 +39,10 @@ class WriteBatchInternal {
 
   static void SetContents(WriteBatch* batch, const Slice& contents);
 
-  static Status InsertInto(const WriteBatch* batch, MemTable* memtable);
+  // "log_number" is the write-ahead log generation the batch was
+  // appended to, 0 if it was not logged.
+  static Status InsertInto(const WriteBatch* batch, MemTable* memtable,
+                           uint64_t log_number = 0);
 
   static void Append(WriteBatch* dst, const WriteBatch* src);
 };
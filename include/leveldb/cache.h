@@ -10,10 +10,11 @@
 // length strings, may use the length of the string as the charge for
 // the string.
 //
-// A builtin cache implementation with a least-recently-used eviction
-// policy is provided.  Clients may use their own implementations if
-// they want something more sophisticated (like scan-resistance, a
-// custom eviction policy, variable cache sizing, etc.)
+// Builtin cache implementations with least-recently-used and CLOCK
+// eviction policies are provided.  Clients may use their own
+// implementations if they want something more sophisticated (like
+// scan-resistance, a custom eviction policy, variable cache sizing,
+// etc.)
 
 #ifndef STORAGE_LEVELDB_INCLUDE_CACHE_H_
 #define STORAGE_LEVELDB_INCLUDE_CACHE_H_
@@ -29,6 +30,15 @@ class Cache;
 // of Cache uses a least-recently-used eviction policy.
 extern Cache* NewLRUCache(size_t capacity);
 
+// Create a new cache with a fixed size capacity, split into
+// 1 << num_shard_bits shards.  This implementation of Cache evicts in
+// CLOCK order: a hit only sets the entry's reference bit, and lookups
+// take no locks.  Each shard's table holds up to its share of
+// capacity / estimated_entry_charge entries (e.g. the block size for a
+// block cache), evicting by count as well as by charge beyond that.
+extern Cache* NewClockCache(size_t capacity, int num_shard_bits,
+                            size_t estimated_entry_charge);
+
 class Cache {
  public:
   Cache() { }
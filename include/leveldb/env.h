@@ -140,6 +140,42 @@ class Env {
       void (*function)(void* arg),
       void* arg) = 0;
 
+  // Background work is split over independent pools, so that e.g. a
+  // long compaction cannot hold up the conversion of full sub-mems.
+  enum Pool {
+    kMemTableSyncPool = 0,  // Skiplist sync and merges into the memtable
+    kSubImmPool,            // Sub-mem to sub-imm conversion
+    kFlushPool,             // Writing frozen memtables to level-0
+    kCompactionPool,        // SSTable compactions and Schedule()
+    kNumPools
+  };
+
+  // Short name of "pool", e.g. "compaction".
+  static const char* PoolName(Pool pool);
+
+  // Like Schedule(), but runs "(*function)(arg)" on a thread of "pool".
+  // The default implementation calls Schedule().
+  virtual void ScheduleOn(Pool pool, void (*function)(void* arg), void* arg);
+
+  // Give "pool" "threads" threads, restricted to the CPUs in "cpus": a
+  // list such as "0-7,16" or "node:1" for every CPU of NUMA node 1.
+  // An empty "cpus" leaves the threads unpinned.  A pool is sized when
+  // it starts, so this has no effect on a pool that already ran work.
+  // The default implementation does nothing.
+  virtual void SetPoolThreads(Pool pool, int threads, const std::string& cpus);
+
+  struct PoolStats {
+    int threads;               // Threads serving the pool
+    uint64_t queue_depth;      // Items waiting for a thread right now
+    uint64_t scheduled;        // Items scheduled so far
+    uint64_t wait_micros;      // Total time items spent queued
+    uint64_t max_wait_micros;  // Longest time an item spent queued
+  };
+
+  // Store the counters of "pool" in *stats.  Returns false if this Env
+  // does not keep them.  The default implementation returns false.
+  virtual bool GetPoolStats(Pool pool, PoolStats* stats);
+
   // Start a new thread, invoking "function(arg)" within the new thread.
   // When "function(arg)" returns, the thread will be destroyed.
   virtual void StartThread(void (*function)(void* arg), void* arg) = 0;
@@ -327,6 +363,15 @@ class EnvWrapper : public Env {
   void Schedule(void (*f)(void*), void* a) {
     return target_->Schedule(f, a);
   }
+  void ScheduleOn(Pool pool, void (*f)(void*), void* a) {
+    return target_->ScheduleOn(pool, f, a);
+  }
+  void SetPoolThreads(Pool pool, int threads, const std::string& cpus) {
+    return target_->SetPoolThreads(pool, threads, cpus);
+  }
+  bool GetPoolStats(Pool pool, PoolStats* stats) {
+    return target_->GetPoolStats(pool, stats);
+  }
   void StartThread(void (*f)(void*), void* a) {
     return target_->StartThread(f, a);
   }
@@ -6,6 +6,8 @@
 #define STORAGE_LEVELDB_INCLUDE_OPTIONS_H_
 
 #include <stddef.h>
+#include <stdint.h>
+#include <string>
 
 namespace leveldb {
 
@@ -82,13 +84,141 @@ struct Options {
   // Default: 4MB
   size_t write_buffer_size;
   size_t nvm_buffer_size;
+
+  // Bytes of the NVM buffer each core fills before its sub-memtable is
+  // converted into a sub-imm, rounded down to a power of two between
+  // 64KB and 64MB.  Smaller regions rotate more often but pin less of
+  // the buffer, and of the locked cache, on cores that write little.
+  //
+  // Default: 2MB
+  size_t sub_mem_size;
   int num_levels;
   size_t dlock_way;
   size_t dlock_size;
   size_t skiplistSync_threshold;
   size_t compactImm_threshold;
+
+  // Number of key-range partitions of the global skiplist that sub-imms
+  // are merged into.  Their bounds are chosen from the keys of the first
+  // sub-imms merged after each flush.  Partitions are merged in parallel
+  // by up to memtable_sync_threads threads, and a lookup searches one
+  // of them.  0 or 1 keeps a single skiplist.
+  //
+  // Default: 4
   size_t subImm_partition;
   size_t subImm_thread;
+
+  // Threads of the other background pools (see Env::Pool); subImm_thread
+  // sizes the sub-imm conversion pool.  The pools belong to the Env, so
+  // the first DB to use a pool in a process decides its size.
+  //
+  // Default: 1 each
+  int memtable_sync_threads;
+  int flush_threads;
+  int compaction_threads;
+
+  // A compaction is split into up to this many key ranges, cut where
+  // its inputs' data blocks divide evenly, which are merged concurrently
+  // on the compaction pool.  A range is never smaller than one output
+  // file.  1 merges each compaction on a single thread.
+  //
+  // Default: 1
+  int max_subcompactions;
+
+  // Compactions that may run at once.  Each takes the highest-scoring
+  // level whose inputs no running compaction holds, so e.g. a level-0
+  // compaction can run alongside one of a deep level.  The ones beyond
+  // the first run on the compaction pool.
+  //
+  // Default: 1
+  int max_background_compactions;
+
+  // Compactions write tables of up to about this many bytes.  Larger
+  // tables mean fewer files to open and cache, but longer compactions.
+  // It also bounds, at 10x and 25x, how much of the level below a
+  // compaction output may overlap and how far its inputs may grow.
+  //
+  // Default: 2MB
+  size_t max_file_size;
+
+  // Target size of level 1.  Each deeper level may hold
+  // max_bytes_for_level_multiplier times as much as the one above it.
+  //
+  // Default: 10MB and 10
+  uint64_t max_bytes_for_level_base;
+  int max_bytes_for_level_multiplier;
+
+  // If true, the targets are instead derived from the size of the
+  // deepest non-empty level, each level above it aiming for
+  // 1/max_bytes_for_level_multiplier of the one below, but never less
+  // than max_bytes_for_level_base.  This keeps the ratio between levels
+  // close to the multiplier however much data the DB holds, which
+  // bounds the space taken by obsolete versions.
+  //
+  // Default: false
+  bool level_compaction_dynamic_level_bytes;
+
+  // Level-0 compaction is started at this many level-0 files.
+  //
+  // Default: 4
+  int level0_file_num_compaction_trigger;
+
+  // Soft limit on number of level-0 files.  From this many on, each
+  // write is delayed by 1ms, and compacting level 0 takes priority over
+  // flushing the frozen merged table.
+  //
+  // Default: 8
+  int level0_slowdown_writes_trigger;
+
+  // Maximum number of level-0 files.  At this many, writes wait for
+  // compactions to bring level 0 below it, and merged tables stop being
+  // frozen for flushing meanwhile.
+  //
+  // Default: 12
+  int level0_stop_writes_trigger;
+
+  // CPUs the threads of each pool are restricted to, e.g. "0-7,16", or
+  // "node:1" for the CPUs of NUMA node 1.  Empty leaves them unpinned.
+  //
+  // Default: ""
+  std::string memtable_sync_cpus;
+  std::string subImm_cpus;
+  std::string flush_cpus;
+  std::string compaction_cpus;
+
+  // If true, each write is linked into its sub-memtable's skiplist
+  // before it returns, with lock-free inserts that run concurrently
+  // with other writers, so it is visible to reads at once.  If false,
+  // writes are buffered per sub-memtable and indexed in batches every
+  // skiplistSync_threshold writes, or by the next read.
+  //
+  // Default: true
+  bool concurrent_memtable_insert;
+
+  // If true, the memtable keeps hash indexes from user key to newest
+  // entry beside its skiplists, about 256KB per sub-memtable, and point
+  // lookups probe them instead of the skiplists.  Iterators still use
+  // the skiplists.  Ignored unless the comparator is bytewise.
+  //
+  // Default: false
+  bool memtable_hash_index;
+
+  // Number of sub-imms merged into the global skiplist before it is
+  // frozen and written out as level-0 tables in the background.
+  // 0 keeps everything in the NVM memtable.
+  //
+  // Default: 8
+  size_t flushImm_threshold;
+
+  // If true, every write is also appended to a write-ahead log split
+  // into one segment per core, and WriteOptions::sync is honoured by
+  // syncing that segment.  Use it when the NVM memtable's map files do
+  // not survive a restart (e.g. DRAM or tmpfs); recovery then replays
+  // the segments instead of the map files.
+  //
+  // Default: false
+  bool per_core_wal;
+
   // Number of open files that can be used by the DB.  You may need to
   // increase this if your database has a large working set (budget
   // one open file per 2MB of working set).
@@ -96,6 +226,15 @@ struct Options {
   // Default: 1000
   int max_open_files;
 
+  // If true, the table cache, and the block cache when block_cache is
+  // NULL, are NewClockCache()s with 1 << cache_shard_bits shards rather
+  // than LRU caches, so that concurrent readers do not contend on shard
+  // locks.
+  //
+  // Default: false and 4
+  bool clock_cache;
+  int cache_shard_bits;
+
   // Control over blocks (user data is stored in a set of blocks, and
   // a block is the unit of reading from disk).
 
@@ -152,9 +291,19 @@ struct Options {
   //No of read threads
   int num_read_threads;
 
-  //Secondary disk path
+  // Directory for the tables of levels sec_disk_level and deeper, e.g.
+  // on a cheaper device than the DB directory, which keeps the
+  // shallower, hotter levels.  Tables move as compactions push their
+  // data down.  NULL keeps every table in the DB directory.
+  //
+  // Default: NULL
   const char *sec_diskpath;
 
+  // Shallowest level whose tables go to sec_diskpath
+  //
+  // Default: 2
+  int sec_disk_level;
+
   // Create an Options object with default values for all fields.
   Options();
 };
@@ -71,6 +71,10 @@ class Table {
       void* arg,
       void (*handle_result)(void* arg, const Slice& k, const Slice& v));
 
+  // Returns a new iterator over the index block: one entry per data
+  // block, keyed by a key >= every key in the block and < every key in
+  // the next one.
+  Iterator* NewIndexIterator() const;
 
   void ReadMeta(const Footer& footer);
   void ReadFilter(const Slice& filter_handle_value);
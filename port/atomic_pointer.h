@@ -140,6 +140,11 @@ class AtomicPointer {
     MemoryBarrier();
     rep_ = v;
   }
+  // Stores v if the pointer still holds "expected"; returns whether it
+  // did.  A full barrier either way.
+  inline bool CompareAndSwap(void* expected, void* v) {
+    return __sync_bool_compare_and_swap(&rep_, expected, v);
+  }
 };
 
 // AtomicPointer based on <cstdatomic>
@@ -162,6 +167,11 @@ class AtomicPointer {
   inline void NoBarrier_Store(void* v) {
     rep_.store(v, std::memory_order_relaxed);
   }
+  // Stores v if the pointer still holds "expected"; returns whether it
+  // did.  Sequentially consistent either way.
+  inline bool CompareAndSwap(void* expected, void* v) {
+    return rep_.compare_exchange_strong(expected, v);
+  }
 };
 
 // Atomic pointer based on sparc memory barriers
@@ -192,6 +202,11 @@ class AtomicPointer {
   }
   inline void* NoBarrier_Load() const { return rep_; }
   inline void NoBarrier_Store(void* v) { rep_ = v; }
+  // Stores v if the pointer still holds "expected"; returns whether it
+  // did.  A full barrier either way.
+  inline bool CompareAndSwap(void* expected, void* v) {
+    return __sync_bool_compare_and_swap(&rep_, expected, v);
+  }
 };
 
 // Atomic pointer based on ia64 acq/rel
@@ -222,6 +237,11 @@ class AtomicPointer {
   }
   inline void* NoBarrier_Load() const { return rep_; }
   inline void NoBarrier_Store(void* v) { rep_ = v; }
+  // Stores v if the pointer still holds "expected"; returns whether it
+  // did.  A full barrier either way.
+  inline bool CompareAndSwap(void* expected, void* v) {
+    return __sync_bool_compare_and_swap(&rep_, expected, v);
+  }
 };
 
 // We have neither MemoryBarrier(), nor <atomic>
@@ -0,0 +1,173 @@
+// Copyright 2016 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// crc32c using the x86 SSE 4.2 crc32 instruction, with a three-stream
+// kernel merged by PCLMULQDQ for large buffers.
+//
+// In a separate source file so that only these functions are compiled for
+// SSE 4.2.  The instruction sets are enabled per function with the target
+// attribute and the CPU is probed at runtime, so the rest of the tree
+// keeps building for the baseline ISA.
+
+#include <stdint.h>
+#include <string.h>
+#include "port/port.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LEVELDB_PLATFORM_POSIX_SSE
+#include <cpuid.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+namespace leveldb {
+namespace port {
+
+#if defined(LEVELDB_PLATFORM_POSIX_SSE)
+
+#define LEVELDB_TARGET_SSE42 __attribute__((target("sse4.2")))
+#define LEVELDB_TARGET_CLMUL __attribute__((target("sse4.2,pclmul")))
+
+// Used to fetch a naturally-aligned 32-bit word in little endian byte-order
+static inline uint32_t LE_LOAD32(const uint8_t *p) {
+  // SSE is x86 only, so ensured that |p| is always little-endian.
+  uint32_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+#if defined(__x86_64__)
+// Used to fetch a naturally-aligned 64-bit word in little endian byte-order
+static inline uint64_t LE_LOAD64(const uint8_t *p) {
+  uint64_t dword;
+  memcpy(&dword, p, sizeof(dword));
+  return dword;
+}
+#endif
+
+struct CRC32CFeatures {
+  bool sse42;
+  bool pclmul;
+
+  CRC32CFeatures() : sse42(false), pclmul(false) {
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+      sse42 = (ecx & bit_SSE4_2) != 0;
+      pclmul = (ecx & bit_PCLMUL) != 0;
+    }
+  }
+};
+
+// Single stream: one crc32 instruction per 8 bytes, bound by its
+// 3-cycle latency.
+LEVELDB_TARGET_SSE42
+static uint64_t ExtendOneStream(uint64_t l, const uint8_t*& p,
+                                const uint8_t* e) {
+#if defined(__x86_64__)
+  while ((e - p) >= 8) {
+    l = _mm_crc32_u64(l, LE_LOAD64(p));
+    p += 8;
+  }
+#endif
+  while ((e - p) >= 4) {
+    l = _mm_crc32_u32(static_cast<uint32_t>(l), LE_LOAD32(p));
+    p += 4;
+  }
+  while (p != e) {
+    l = _mm_crc32_u8(static_cast<uint32_t>(l), *p++);
+  }
+  return l;
+}
+
+#if defined(__x86_64__)
+
+// Stream lengths for the interleaved kernel.  Each round checksums three
+// adjacent stripes of kLongStripe (or kShortStripe) bytes in parallel,
+// which hides the crc32 latency, then folds them together.
+static const size_t kLongStripe = 8192;
+static const size_t kShortStripe = 256;
+
+// Return x^(8*n - 33) mod P in the bit-reflected form the crc32
+// instruction uses.  Multiplying a crc by this with PCLMULQDQ and then
+// reducing the 64-bit product with one crc32 instruction advances the
+// crc over n zero bytes.
+static uint32_t ShiftConstant(size_t n) {
+  uint32_t r = 0x80000000u;  // x^0
+  for (size_t i = 0; i < 8 * n - 33; i++) {
+    r = (r >> 1) ^ ((r & 1) ? 0x82f63b78u : 0);
+  }
+  return r;
+}
+
+struct CRC32CShifts {
+  uint32_t long_stripe;
+  uint32_t short_stripe;
+
+  CRC32CShifts()
+      : long_stripe(ShiftConstant(kLongStripe)),
+        short_stripe(ShiftConstant(kShortStripe)) {
+  }
+};
+
+LEVELDB_TARGET_CLMUL
+static inline uint64_t ShiftCRC(uint64_t crc, uint32_t k) {
+  __m128i product = _mm_clmulepi64_si128(
+      _mm_cvtsi64_si128(static_cast<int64_t>(crc)),
+      _mm_cvtsi32_si128(static_cast<int>(k)), 0x00);
+  return _mm_crc32_u64(0, static_cast<uint64_t>(_mm_cvtsi128_si64(product)));
+}
+
+LEVELDB_TARGET_CLMUL
+static uint64_t ExtendThreeStreams(uint64_t l, const uint8_t*& p,
+                                   const uint8_t* e, size_t stripe,
+                                   uint32_t k) {
+  while (static_cast<size_t>(e - p) >= 3 * stripe) {
+    uint64_t l1 = 0, l2 = 0;
+    const uint8_t* p1 = p + stripe;
+    const uint8_t* p2 = p1 + stripe;
+    for (size_t i = 0; i < stripe; i += 8) {
+      l = _mm_crc32_u64(l, LE_LOAD64(p + i));
+      l1 = _mm_crc32_u64(l1, LE_LOAD64(p1 + i));
+      l2 = _mm_crc32_u64(l2, LE_LOAD64(p2 + i));
+    }
+    // The crc is linear, so the three partial crcs combine by shifting
+    // each over the bytes that follow it.
+    l = ShiftCRC(l, k) ^ l1;
+    l = ShiftCRC(l, k) ^ l2;
+    p += 3 * stripe;
+  }
+  return l;
+}
+
+#endif  // defined(__x86_64__)
+
+#endif  // defined(LEVELDB_PLATFORM_POSIX_SSE)
+
+uint32_t AcceleratedCRC32C(uint32_t crc, const char* buf, size_t size) {
+#if !defined(LEVELDB_PLATFORM_POSIX_SSE)
+  return 0;
+#else
+  static const CRC32CFeatures features;
+  if (!features.sse42) {
+    return 0;
+  }
+
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(buf);
+  const uint8_t *e = p + size;
+  uint64_t l = crc ^ 0xffffffffu;
+
+#if defined(__x86_64__)
+  if (features.pclmul && size >= 3 * kShortStripe) {
+    static const CRC32CShifts shifts;
+    l = ExtendThreeStreams(l, p, e, kLongStripe, shifts.long_stripe);
+    l = ExtendThreeStreams(l, p, e, kShortStripe, shifts.short_stripe);
+  }
+#endif
+  l = ExtendOneStream(l, p, e);
+  return static_cast<uint32_t>(l ^ 0xffffffffu);
+#endif
+}
+
+}  // namespace port
+}  // namespace leveldb
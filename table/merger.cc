@@ -4,6 +4,8 @@
 
 #include "table/merger.h"
 
+#include <string.h>
+#include "db/dbformat.h"
 #include "leveldb/comparator.h"
 #include "leveldb/iterator.h"
 #include "table/iterator_wrapper.h"
@@ -11,6 +13,33 @@
 namespace leveldb {
 
 namespace {
+
+// Fan-in from which the children are kept in a heap.  Below it a linear
+// scan over the children is cheaper than maintaining the heap.
+static const int kHeapThreshold = 8;
+
+// How much of a key the cached prefixes are taken from
+enum PrefixMode {
+  kNoPrefix,          // Unknown ordering, always call the comparator
+  kWholeKey,          // Bytewise ordering of the whole key
+  kInternalUserKey    // Internal keys over a bytewise user ordering
+};
+
+static PrefixMode ChoosePrefixMode(const Comparator* cmp) {
+  const char* bytewise = BytewiseComparator()->Name();
+  if (strcmp(cmp->Name(), bytewise) == 0) {
+    return kWholeKey;
+  }
+  if (strcmp(cmp->Name(), "leveldb.InternalKeyComparator") == 0) {
+    const Comparator* user =
+        static_cast<const InternalKeyComparator*>(cmp)->user_comparator();
+    if (strcmp(user->Name(), bytewise) == 0) {
+      return kInternalUserKey;
+    }
+  }
+  return kNoPrefix;
+}
+
 class MergingIterator : public Iterator {
  public:
   MergingIterator(const Comparator* comparator, Iterator** children, int n)
@@ -18,13 +47,20 @@ class MergingIterator : public Iterator {
         children_(new IteratorWrapper[n]),
         n_(n),
         current_(NULL),
-        direction_(kForward) {
+        direction_(kForward),
+        use_heap_(n >= kHeapThreshold),
+        prefix_mode_(ChoosePrefixMode(comparator)),
+        prefix_(new uint64_t[n]),
+        heap_(use_heap_ ? new int[n] : NULL),
+        heap_size_(0) {
     for (int i = 0; i < n; i++) {
       children_[i].Set(children[i]);
     }
   }
 
   virtual ~MergingIterator() {
+    delete[] heap_;
+    delete[] prefix_;
     delete[] children_;
   }
 
@@ -36,24 +72,24 @@ class MergingIterator : public Iterator {
     for (int i = 0; i < n_; i++) {
       children_[i].SeekToFirst();
     }
-    FindSmallest();
     direction_ = kForward;
+    FindSmallest();
   }
 
   virtual void SeekToLast() {
     for (int i = 0; i < n_; i++) {
       children_[i].SeekToLast();
     }
-    FindLargest();
     direction_ = kReverse;
+    FindLargest();
   }
 
   virtual void Seek(const Slice& target) {
     for (int i = 0; i < n_; i++) {
       children_[i].Seek(target);
     }
-    FindSmallest();
     direction_ = kForward;
+    FindSmallest();
   }
 
   virtual void Next() {
@@ -76,10 +112,17 @@ class MergingIterator : public Iterator {
         }
       }
       direction_ = kForward;
+      if (use_heap_) {
+        BuildHeap();  // Children moved; current_ is still the smallest
+      }
     }
 
     current_->Next();
-    FindSmallest();
+    if (use_heap_) {
+      FixTop();
+    } else {
+      FindSmallest();
+    }
   }
 
   virtual void Prev() {
@@ -105,10 +148,17 @@ class MergingIterator : public Iterator {
         }
       }
       direction_ = kReverse;
+      if (use_heap_) {
+        BuildHeap();  // Children moved; current_ is still the largest
+      }
     }
 
     current_->Prev();
-    FindLargest();
+    if (use_heap_) {
+      FixTop();
+    } else {
+      FindLargest();
+    }
   }
 
   virtual Slice key() const {
@@ -133,26 +183,128 @@ class MergingIterator : public Iterator {
   }
 
  private:
+  // Which direction is the iterator moving?
+  enum Direction {
+    kForward,
+    kReverse
+  };
+
   void FindSmallest();
   void FindLargest();
 
-  // We might want to use a heap in case there are lots of children.
-  // For now we use a simple array since we expect a very small number
-  // of children in leveldb.
+  // Recompute prefix_[i] after children_[i] moved
+  void UpdatePrefix(int i);
+  // <0, 0, >0 as the key of child a sorts before, with, or after b's
+  int CompareChildren(int a, int b) const;
+  // Whether child a belongs above child b in the heap for direction_
+  bool HeapBefore(int a, int b) const {
+    int r = CompareChildren(a, b);
+    return direction_ == kForward ? r < 0 : r > 0;
+  }
+  // Rebuild the heap from every valid child, for direction_
+  void BuildHeap();
+  void SiftDown(int pos);
+  // The heap top moved; restore the heap and update current_
+  void FixTop();
+
   const Comparator* comparator_;
   IteratorWrapper* children_;
   int n_;
   IteratorWrapper* current_;
-
-  // Which direction is the iterator moving?
-  enum Direction {
-    kForward,
-    kReverse
-  };
   Direction direction_;
+
+  // With many children (sub-mems of a large NVM memtable) the valid
+  // ones are kept in a binary heap of child indexes, ordered smallest
+  // first going forward and largest first in reverse.
+  const bool use_heap_;
+  const PrefixMode prefix_mode_;
+  // Leading 8 bytes of each valid child's (user) key, big-endian and
+  // zero padded, so most comparisons are one integer compare
+  uint64_t* prefix_;
+  int* heap_;
+  int heap_size_;
 };
 
+void MergingIterator::UpdatePrefix(int i) {
+  if (prefix_mode_ == kNoPrefix || !children_[i].Valid()) {
+    return;
+  }
+  Slice k = children_[i].key();
+  size_t len = k.size();
+  if (prefix_mode_ == kInternalUserKey) {
+    len = len >= 8 ? len - 8 : 0;
+  }
+  unsigned char buf[8] = { 0 };
+  memcpy(buf, k.data(), len < 8 ? len : 8);
+  uint64_t p = 0;
+  for (int b = 0; b < 8; b++) {
+    p = (p << 8) | buf[b];
+  }
+  prefix_[i] = p;
+}
+
+int MergingIterator::CompareChildren(int a, int b) const {
+  // Differing prefixes decide the order: a key that runs out first is
+  // padded with zeros and so sorts first, as it does bytewise.
+  if (prefix_mode_ != kNoPrefix && prefix_[a] != prefix_[b]) {
+    return prefix_[a] < prefix_[b] ? -1 : +1;
+  }
+  return comparator_->Compare(children_[a].key(), children_[b].key());
+}
+
+void MergingIterator::SiftDown(int pos) {
+  const int item = heap_[pos];
+  for (;;) {
+    int child = 2 * pos + 1;
+    if (child >= heap_size_) {
+      break;
+    }
+    if (child + 1 < heap_size_ && HeapBefore(heap_[child + 1], heap_[child])) {
+      child++;
+    }
+    if (!HeapBefore(heap_[child], item)) {
+      break;
+    }
+    heap_[pos] = heap_[child];
+    pos = child;
+  }
+  heap_[pos] = item;
+}
+
+void MergingIterator::BuildHeap() {
+  heap_size_ = 0;
+  for (int i = 0; i < n_; i++) {
+    if (children_[i].Valid()) {
+      UpdatePrefix(i);
+      heap_[heap_size_++] = i;
+    }
+  }
+  for (int pos = heap_size_ / 2 - 1; pos >= 0; pos--) {
+    SiftDown(pos);
+  }
+  current_ = heap_size_ > 0 ? &children_[heap_[0]] : NULL;
+}
+
+void MergingIterator::FixTop() {
+  const int top = heap_[0];
+  if (children_[top].Valid()) {
+    UpdatePrefix(top);
+  } else {
+    heap_[0] = heap_[--heap_size_];
+  }
+  if (heap_size_ > 0) {
+    SiftDown(0);
+    current_ = &children_[heap_[0]];
+  } else {
+    current_ = NULL;
+  }
+}
+
 void MergingIterator::FindSmallest() {
+  if (use_heap_) {
+    BuildHeap();
+    return;
+  }
   IteratorWrapper* smallest = NULL;
   for (int i = 0; i < n_; i++) {
     IteratorWrapper* child = &children_[i];
@@ -168,6 +320,10 @@ void MergingIterator::FindSmallest() {
 }
 
 void MergingIterator::FindLargest() {
+  if (use_heap_) {
+    BuildHeap();
+    return;
+  }
   IteratorWrapper* largest = NULL;
   for (int i = n_-1; i >= 0; i--) {
     IteratorWrapper* child = &children_[i];
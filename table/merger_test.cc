@@ -0,0 +1,179 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "table/merger.h"
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+#include "db/dbformat.h"
+#include "leveldb/comparator.h"
+#include "leveldb/iterator.h"
+#include "util/random.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+namespace {
+
+// Iterates over a sorted vector of keys; each value is its key
+class VectorIterator : public Iterator {
+ public:
+  VectorIterator(const std::vector<std::string>& keys)
+      : keys_(keys), pos_(keys.size()) { }
+
+  virtual bool Valid() const { return pos_ < keys_.size(); }
+  virtual void SeekToFirst() { pos_ = 0; }
+  virtual void SeekToLast() { pos_ = keys_.empty() ? 0 : keys_.size() - 1; }
+  virtual void Seek(const Slice& target) {
+    pos_ = 0;
+    while (pos_ < keys_.size() && cmp_->Compare(keys_[pos_], target) < 0) {
+      pos_++;
+    }
+  }
+  virtual void Next() { pos_++; }
+  virtual void Prev() { pos_ = pos_ == 0 ? keys_.size() : pos_ - 1; }
+  virtual Slice key() const { return keys_[pos_]; }
+  virtual Slice value() const { return key(); }
+  virtual Status status() const { return Status::OK(); }
+
+  static const Comparator* cmp_;
+
+ private:
+  std::vector<std::string> keys_;
+  size_t pos_;
+};
+
+const Comparator* VectorIterator::cmp_ = NULL;
+
+struct Less {
+  const Comparator* cmp;
+  bool operator()(const std::string& a, const std::string& b) const {
+    return cmp->Compare(a, b) < 0;
+  }
+};
+
+}  // namespace
+
+class MergerTest {
+ public:
+  Random rnd_;
+  std::vector<std::string> all_;  // Every key of every child, sorted
+
+  MergerTest() : rnd_(301) { }
+
+  // Short keys, and keys sharing their first 8 bytes, so the cached
+  // prefixes both decide and tie
+  std::string RandomUserKey() {
+    std::string k;
+    switch (rnd_.Uniform(3)) {
+      case 0: k.assign(1 + rnd_.Uniform(7), 'a' + rnd_.Uniform(3)); break;
+      case 1: k = "commonpf"; break;
+      default: k = "commonpf" + std::string(1, 'a' + rnd_.Uniform(26)); break;
+    }
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%d", rnd_.Uniform(1000));
+    return k + buf;
+  }
+
+  Iterator* Build(const Comparator* cmp, int children, bool internal) {
+    VectorIterator::cmp_ = cmp;
+    Less less = { cmp };
+    all_.clear();
+    std::set<std::string> used;
+    std::vector<Iterator*> list;
+    for (int c = 0; c < children; c++) {
+      std::vector<std::string> keys;
+      int n = rnd_.Uniform(40);  // Some children stay empty
+      for (int i = 0; i < n; i++) {
+        std::string k = RandomUserKey();
+        if (internal) {
+          // User keys repeat across children, internal keys never do
+          std::string ikey;
+          AppendInternalKey(&ikey, ParsedInternalKey(
+              k, c * 1000 + i, kTypeValue));
+          k = ikey;
+        } else if (!used.insert(k).second) {
+          continue;
+        }
+        keys.push_back(k);
+      }
+      std::sort(keys.begin(), keys.end(), less);
+      all_.insert(all_.end(), keys.begin(), keys.end());
+      list.push_back(new VectorIterator(keys));
+    }
+    std::sort(all_.begin(), all_.end(), less);
+    return NewMergingIterator(cmp, &list[0], children);
+  }
+
+  void Check(const Comparator* cmp, int children, bool internal) {
+    Iterator* iter = Build(cmp, children, internal);
+    Less less = { cmp };
+
+    // Forward, then all the way back
+    size_t pos = 0;
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+      ASSERT_LT(pos, all_.size());
+      ASSERT_EQ(0, cmp->Compare(all_[pos], iter->key()));
+      pos++;
+    }
+    ASSERT_EQ(all_.size(), pos);
+    for (iter->SeekToLast(); iter->Valid(); iter->Prev()) {
+      ASSERT_GT(pos, 0);
+      pos--;
+      ASSERT_EQ(0, cmp->Compare(all_[pos], iter->key()));
+    }
+    ASSERT_EQ(0, pos);
+
+    // Seeks followed by a few steps in mixed directions
+    for (int i = 0; i < 200 && !all_.empty(); i++) {
+      std::string target = all_[rnd_.Uniform(all_.size())];
+      iter->Seek(target);
+      pos = std::lower_bound(all_.begin(), all_.end(), target, less) -
+            all_.begin();
+      for (int step = 0; step < 10; step++) {
+        if (pos == all_.size()) {
+          ASSERT_TRUE(!iter->Valid());
+          break;
+        }
+        ASSERT_TRUE(iter->Valid());
+        ASSERT_EQ(0, cmp->Compare(all_[pos], iter->key()));
+        if (rnd_.OneIn(3) && pos > 0) {
+          iter->Prev();
+          pos--;
+        } else {
+          iter->Next();
+          pos++;
+        }
+      }
+    }
+    delete iter;
+  }
+};
+
+TEST(MergerTest, FewChildren) {
+  for (int run = 0; run < 20; run++) {
+    Check(BytewiseComparator(), 3, false);
+  }
+}
+
+TEST(MergerTest, ManyChildren) {
+  for (int run = 0; run < 20; run++) {
+    Check(BytewiseComparator(), 100, false);
+  }
+}
+
+TEST(MergerTest, ManyChildrenInternalKeys) {
+  InternalKeyComparator icmp(BytewiseComparator());
+  for (int run = 0; run < 20; run++) {
+    Check(&icmp, 100, true);
+  }
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
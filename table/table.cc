@@ -255,6 +255,10 @@ Status Table::InternalGet(const ReadOptions& options, const Slice& k,
 }
 
 
+Iterator* Table::NewIndexIterator() const {
+  return rep_->index_block->NewIterator(rep_->options.comparator);
+}
+
 uint64_t Table::ApproximateOffsetOf(const Slice& key) const {
   Iterator* index_iter =
       rep_->index_block->NewIterator(rep_->options.comparator);
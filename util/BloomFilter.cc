@@ -1,5 +1,6 @@
 #include "BloomFilter.h"
 #include "MurmurHash3.h"
+#include "util/hash.h"
 
 #include <algorithm>
 #include <set>
@@ -9,6 +10,7 @@
 #include <vector>
 #include <iostream>
 #include <array>
+#include <new>
 
 BloomFilter::BloomFilter(uint64_t size, uint8_t numHashes)
       : m_bits(size),
@@ -51,3 +53,55 @@ bool BloomFilter::possiblyContains(const uint8_t *data, size_t len) const {
 
   return true;
 }
+
+//512-bit blocks of eight words
+static const uint64_t kBlockBits = 512;
+static const uint64_t kBlockWords = kBlockBits / 64;
+
+BlockedBloomFilter::BlockedBloomFilter(uint64_t size, uint8_t numProbes)
+      : m_numBlocks((size + kBlockBits - 1) / kBlockBits),
+        m_numProbes(numProbes) {
+  if (m_numBlocks == 0)
+    m_numBlocks = 1;
+  void *mem = NULL;
+  if (posix_memalign(&mem, 64, m_numBlocks * kBlockWords * sizeof(uint64_t)) != 0)
+    abort();
+  m_words = static_cast<std::atomic<uint64_t>*>(mem);
+  for (uint64_t i = 0; i < m_numBlocks * kBlockWords; i++)
+    new (&m_words[i]) std::atomic<uint64_t>(0);
+}
+
+BlockedBloomFilter::~BlockedBloomFilter() {
+  free(m_words);
+}
+
+void BlockedBloomFilter::clear() {
+  for (uint64_t i = 0; i < m_numBlocks * kBlockWords; i++)
+    m_words[i].store(0, std::memory_order_relaxed);
+}
+
+//The high bits pick the block; the low bits, rotated by delta as in
+//leveldb's bloom.cc, pick the bits inside it.
+void BlockedBloomFilter::add(const char *data, size_t len) {
+  uint32_t h = leveldb::Hash(data, len, 0xbc9f1d34);
+  std::atomic<uint64_t> *block = m_words + ((h >> 9) % m_numBlocks) * kBlockWords;
+  const uint32_t delta = (h >> 17) | (h << 15);
+  for (int n = 0; n < m_numProbes; n++) {
+    const uint32_t bit = h & (kBlockBits - 1);
+    block[bit / 64].fetch_or(uint64_t(1) << (bit % 64), std::memory_order_release);
+    h += delta;
+  }
+}
+
+bool BlockedBloomFilter::possiblyContains(const char *data, size_t len) const {
+  uint32_t h = leveldb::Hash(data, len, 0xbc9f1d34);
+  const std::atomic<uint64_t> *block = m_words + ((h >> 9) % m_numBlocks) * kBlockWords;
+  const uint32_t delta = (h >> 17) | (h << 15);
+  for (int n = 0; n < m_numProbes; n++) {
+    const uint32_t bit = h & (kBlockBits - 1);
+    if ((block[bit / 64].load(std::memory_order_acquire) & (uint64_t(1) << (bit % 64))) == 0)
+      return false;
+    h += delta;
+  }
+  return true;
+}
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <vector>
 #include <stdint.h>
+#include <atomic>
 
 //13MB Bloom filter
 #define BLOOMSIZE 13631488
@@ -23,4 +24,25 @@ private:
   std::vector<bool> m_bits;
 };
 
+//Bloom filter whose probes for a key all fall into one 64-byte block,
+//so a lookup touches a single cache line.  add() is safe to run
+//concurrently with possiblyContains() and with other add() calls.
+class BlockedBloomFilter {
+
+public:
+  BlockedBloomFilter(uint64_t size, uint8_t numProbes);
+  ~BlockedBloomFilter();
+  void add(const char *data, size_t len);
+  bool possiblyContains(const char *data, size_t len) const;
+  void clear();
+
+private:
+  uint64_t m_numBlocks;
+  uint8_t m_numProbes;
+  std::atomic<uint64_t> *m_words;
+
+  BlockedBloomFilter(const BlockedBloomFilter&);
+  void operator=(const BlockedBloomFilter&);
+};
+
 #endif
@@ -3,8 +3,11 @@
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 #include <cstdlib>
 #include "util/arena.h"
+#include "util/mutexlock.h"
+#include "util/sub_mem_pool.h"
 #include <assert.h>
 #include "hoard/heaplayers/wrappers/gnuwrapper.h"
+#include <sched.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -13,7 +16,6 @@
 
 #include <unistd.h>
 #include <atomic>
-#define SKIPLIST_ALLOC_SIZE 2097152 
 
 #include <pqos.h>
 #define MAX_L3CAT_NUM 16
@@ -30,6 +32,19 @@ static const long kBlockSize = 4096;
 static int mmap_count = 0;
 
 namespace leveldb {
+
+static int Log2(size_t n) {
+    int shift = 0;
+    while ((size_t(1) << (shift + 1)) <= n)
+        shift++;
+    return shift;
+}
+
+static uint64_t NowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
 Arena::Arena()
 : memory_usage_(0)
 {
@@ -41,6 +56,26 @@ Arena::Arena()
     nvmarena_ = false;
     fd = -1;
     kSize = kBlockSize;
+    // A DRAM arena has no sub-memtable regions
+    isDataLock = false;
+    sub_mem_count = 0;
+    sub_immem_count = 0;
+    sub_mem_bset = sub_immem_bset = in_trans_bset = NULL;
+    sub_mem_writers = NULL;
+    sub_mem_full_hook_ = NULL;
+    sub_mem_full_arg_ = NULL;
+    percore_busy_ = NULL;
+    percore_sub_mem_ = NULL;
+    percore_fill_start_ = percore_fill_micros_ = NULL;
+    sub_mem_size = SUB_MEM_SIZE;
+    sub_mem_shift = Log2(SUB_MEM_SIZE);
+    sub_mem_pool = NULL;
+    region_sub_mem = NULL;
+    region_count = 0;
+    sub_mem_base = NULL;
+    spare_regions = NULL;
+    spare_mu = NULL;
+    skiplist_blocks = NULL;
 }
 
 
@@ -125,8 +160,12 @@ char* Arena::AllocateFallback_submemIndex(size_t bytes, int sub_mem_index) {
 
     char *result = NULL;
 
-    skiplist_alloc_ptr_[sub_mem_index] = AllocateNewBlock(SKIPLIST_ALLOC_SIZE);
-    skiplist_alloc_bytes_remaining_[sub_mem_index] = SKIPLIST_ALLOC_SIZE;
+    // Node slabs are recycled through the pool as sub-imms are released
+    SubMemPool* pool = sub_mem_pool;
+    skiplist_alloc_ptr_[sub_mem_index] = pool->Allocate();
+    skiplist_alloc_bytes_remaining_[sub_mem_index] = pool->block_size();
+    memory_usage_.NoBarrier_Store(
+            reinterpret_cast<void*>(MemoryUsage() + pool->block_size() + sizeof(char*)));
 
     result = skiplist_alloc_ptr_[sub_mem_index];
     skiplist_alloc_ptr_[sub_mem_index] += bytes;
@@ -137,7 +176,7 @@ char* Arena::AllocateFallback_submemIndex(size_t bytes, int sub_mem_index) {
 char* Arena::AllocateAligned_submemIndex(size_t bytes, int sub_mem_index) {
     const int align = (sizeof(void*) > 8) ? sizeof(void*) : 8;
     assert((align & (align-1)) == 0);   // Pointer size should be a power of 2
-    size_t current_mod = reinterpret_cast<uintptr_t>(alloc_ptr_) & (align-1);
+    size_t current_mod = reinterpret_cast<uintptr_t>(skiplist_alloc_ptr_[sub_mem_index]) & (align-1);
     size_t slop = (current_mod == 0 ? 0 : align - current_mod);
     size_t needed = bytes + slop;
     char* result;
@@ -164,7 +203,8 @@ char* Arena::AllocateNewBlock(size_t block_bytes) {
 
 
 #ifdef ENABLE_RECOVERY
-ArenaNVM::ArenaNVM(long size, std::string *filename, bool recovery)
+ArenaNVM::ArenaNVM(long size, std::string *filename, bool recovery,
+                   size_t sub_mem_size)
 {
     //: memory_usage_(0)
     if (recovery) {
@@ -191,35 +231,55 @@ ArenaNVM::ArenaNVM(long size, std::string *filename, bool recovery)
         allocation = false;
     }
     isDataLock = 0;
+    assert((sub_mem_size & (sub_mem_size - 1)) == 0 && sub_mem_size <= size);
+    this->sub_mem_size = sub_mem_size;
+    sub_mem_shift = Log2(sub_mem_size);
+    sub_mem_pool = SubMemPool::Shared(sub_mem_size);
 
+    // sysconf() fails with -1; keep at least one slot to fold CPUs into
     long online_core;
     online_core = sysconf(_SC_NPROCESSORS_ONLN);
-    if(online_core == -1){}
-    else
-        cores = online_core;
-    percore_alloc_ptr_ = (char**)malloc(sizeof(char*) * online_core);
-    percore_alloc_bytes_remaining_ = (size_t*)malloc(sizeof(size_t) * online_core);
-    for(int i=0; i<online_core; i++) {
+    cores = online_core < 1 ? 1 : online_core;
+    percore_alloc_ptr_ = new char*[cores];
+    percore_alloc_bytes_remaining_ = new size_t[cores];
+    percore_busy_ = new std::atomic_bool[cores];
+    percore_sub_mem_ = new int[cores];
+    percore_fill_start_ = new uint64_t[cores];
+    percore_fill_micros_ = new uint64_t[cores];
+    for(int i=0; i<cores; i++) {
         percore_alloc_ptr_[i] = NULL;
         percore_alloc_bytes_remaining_[i] = 0;
-    }
-    sub_mem_bset = (std::atomic_bool*)malloc(sizeof(std::atomic_bool) * size / SUB_MEM_SIZE);
-    sub_mem_count = size / SUB_MEM_SIZE;
-    sub_immem_bset = (std::atomic_bool*)malloc(sizeof(std::atomic_bool) * size / SUB_MEM_SIZE);
+        percore_busy_[i] = 0;
+        percore_sub_mem_[i] = -1;
+        percore_fill_start_[i] = 0;
+        percore_fill_micros_[i] = 0;
+    }
+    sub_mem_bset = (std::atomic_bool*)malloc(sizeof(std::atomic_bool) * size / sub_mem_size);
+    sub_mem_count = size / sub_mem_size;
+    sub_immem_bset = (std::atomic_bool*)malloc(sizeof(std::atomic_bool) * size / sub_mem_size);
     sub_immem_count = 0;
-    in_trans_bset = (std::atomic_bool*)malloc(sizeof(std::atomic_bool) * size / SUB_MEM_SIZE);
-
-    skiplist_blocks = new std::vector<char*>[size / SUB_MEM_SIZE];
-    skiplist_alloc_ptr_ = (char**)malloc(sizeof(char*) * size / SUB_MEM_SIZE);
-    skiplist_alloc_bytes_remaining_ = (size_t*)malloc(sizeof(size_t) * size / SUB_MEM_SIZE);
-
-    for(int i=0; i<(size / SUB_MEM_SIZE); i++) {
+    in_trans_bset = (std::atomic_bool*)malloc(sizeof(std::atomic_bool) * size / sub_mem_size);
+    sub_mem_writers = (std::atomic<int>*)malloc(sizeof(std::atomic<int>) * size / sub_mem_size);
+
+    sub_mem_base = (char**)malloc(sizeof(char*) * size / sub_mem_size);
+    region_count = (size_t)(MEM_THRESH * size) / sub_mem_size;
+    region_sub_mem = (int*)malloc(sizeof(int) * region_count);
+    spare_regions = new std::vector<char*>;
+    spare_mu = new port::Mutex;
+    skiplist_blocks = new std::vector<char*>[size / sub_mem_size];
+    skiplist_alloc_ptr_ = (char**)malloc(sizeof(char*) * size / sub_mem_size);
+    skiplist_alloc_bytes_remaining_ = (size_t*)malloc(sizeof(size_t) * size / sub_mem_size);
+
+    for(size_t i=0; i<(size / sub_mem_size); i++) {
         sub_mem_bset[i] = 0;
         sub_immem_bset[i] = 0;
         in_trans_bset[i] = 0;
+        sub_mem_writers[i] = 0;
         skiplist_alloc_ptr_[i] = NULL;
         skiplist_alloc_bytes_remaining_[i] = 0;
     }
+    if (recovery)
+        MapSubMems(size);
 }
 #else
 ArenaNVM::ArenaNVM()
@@ -243,28 +303,99 @@ void* ArenaNVM::getMapStart() {
     return map_start_;
 }
 
+// Whether "cpu" fills its sub-mems more slowly than the average core
+// that has filled one.  Unmeasured cores count as fast.
+bool ArenaNVM::FillsSlowly(int cpu) const {
+    const uint64_t mine = percore_fill_micros_[cpu];
+    if(mine == 0)
+        return false;
+    uint64_t sum = 0;
+    int measured = 0;
+    for(int i=0; i<cores; i++) {
+        if(percore_fill_micros_[i] != 0) {
+            sum += percore_fill_micros_[i];
+            measured++;
+        }
+    }
+    return mine * measured > sum;
+}
+
 int ArenaNVM::alloc_sub_mem(int cpu) {
-    int i;
-    for(i=0; i<sub_mem_count; i++) {
-        if(!sub_mem_bset[i].load() && !sub_mem_bset[i].exchange(true))
-            break;
+    const int n = sub_mem_count;
+    const bool slow = FillsSlowly(cpu);
+    for(int k=0; k<n; k++) {
+        const int i = slow ? n - 1 - k : k;
+        if(!sub_mem_bset[i].load() && !sub_mem_bset[i].exchange(true)) {
+            percore_alloc_ptr_[cpu] = sub_mem_base[i];
+            percore_alloc_bytes_remaining_[cpu] = sub_mem_size;
+            percore_sub_mem_[cpu] = i;
+            percore_fill_start_[cpu] = NowMicros();
+            return i;
+        }
     }
-    if(i == sub_mem_count)
-        return -1;
-    percore_alloc_ptr_[cpu] = (char*)map_start_ + i * SUB_MEM_SIZE;
-    percore_alloc_bytes_remaining_[cpu] = SUB_MEM_SIZE;
-    return i;
+    return -1;
 }
 
 int ArenaNVM::swap_sub_mem(int cpu) {
-    int sub_mem = (percore_alloc_ptr_[cpu] - (char*)map_start_) / SUB_MEM_SIZE;
+    int sub_mem = percore_sub_mem_[cpu];
+    // Average over the last few fills, so a burst shows within a couple
+    // of regions
+    const uint64_t took = NowMicros() - percore_fill_start_[cpu] + 1;
+    const uint64_t avg = percore_fill_micros_[cpu];
+    percore_fill_micros_[cpu] = avg == 0 ? took : (3 * avg + took) / 4;
     sub_immem_bset[sub_mem].store(1);
     sub_immem_count++;
     percore_alloc_ptr_[cpu] = NULL;
     percore_alloc_bytes_remaining_[cpu] = 0;
+    percore_sub_mem_[cpu] = -1;
+    if(sub_mem_full_hook_)
+        (*sub_mem_full_hook_)(sub_mem_full_arg_, sub_mem);
     return alloc_sub_mem(cpu);
 }
 
+void ArenaNVM::WaitForEntries(int sub_mem_index) {
+    // A writer only holds the count while it copies and indexes one
+    // entry, so this is short; yield in case it was preempted.
+    while(sub_mem_writers[sub_mem_index].load(std::memory_order_acquire) > 0)
+        sched_yield();
+}
+
+void ArenaNVM::MapSubMems(size_t mapped) {
+    for(size_t i=0; i<region_count; i++)
+        region_sub_mem[i] = i < sub_mem_count ? i : -1;
+    for(size_t i=0; i<sub_mem_count; i++)
+        sub_mem_base[i] = (char*)map_start_ + i * sub_mem_size;
+    // The mapping is overprovisioned by MEM_THRESH; whole regions past
+    // the sub-mems become spares
+    MutexLock l(spare_mu);
+    spare_regions->clear();
+    for(size_t i=sub_mem_count; i<region_count && (i + 1) * sub_mem_size <= mapped; i++)
+        spare_regions->push_back((char*)map_start_ + i * sub_mem_size);
+}
+
+char* ArenaNVM::DetachSubMem(int index) {
+    MutexLock l(spare_mu);
+    if(spare_regions->empty())
+        return NULL;
+    char* region = sub_mem_base[index];
+    char* spare = spare_regions->back();
+    spare_regions->pop_back();
+    region_sub_mem[(region - (char*)map_start_) >> sub_mem_shift] = -1;
+    region_sub_mem[(spare - (char*)map_start_) >> sub_mem_shift] = index;
+    sub_mem_base[index] = spare;
+    return region;
+}
+
+void ArenaNVM::ReleaseRegion(char* region) {
+    MutexLock l(spare_mu);
+    spare_regions->push_back(region);
+}
+
+void ArenaNVM::SetSubMemFullHook(void (*hook)(void* arg, int index), void* arg) {
+    sub_mem_full_arg_ = arg;
+    sub_mem_full_hook_ = hook;
+}
+
 void ArenaNVM::reclaim_sub_mem(int cpu){
     if(cpu!=-1 && !percore_alloc_ptr_[cpu])
         return;
@@ -273,29 +404,32 @@ void ArenaNVM::reclaim_sub_mem(int cpu){
         for(int i=0; i<cores; i++) {
             percore_alloc_ptr_[i] = NULL;
             percore_alloc_bytes_remaining_[i] = 0;
+            percore_sub_mem_[i] = -1;
         }
         for(int i=0; i<sub_mem_count; i++) {
             sub_mem_bset[i].store(0);
         }
     }
     else{
-        int sub_mem = (percore_alloc_ptr_[cpu] - (char*)map_start_) / SUB_MEM_SIZE;
+        int sub_mem = percore_sub_mem_[cpu];
         percore_alloc_ptr_[cpu] = NULL;
         percore_alloc_bytes_remaining_[cpu] = 0;
+        percore_sub_mem_[cpu] = -1;
         sub_mem_bset[sub_mem].store(0);
     }
 }
 
 void ArenaNVM::setSubMemToImm(){
-    long online_core;
-    online_core = sysconf(_SC_NPROCESSORS_ONLN);
-    for(int i=0; i<online_core; i++) {
+    for(int i=0; i<cores; i++) {
         percore_alloc_ptr_[i] = NULL;
         percore_alloc_bytes_remaining_[i] = 0;
+        percore_sub_mem_[i] = -1;
     }
     for(int i=0; i<sub_mem_count; i++) {
         sub_immem_bset[i].store(1);
         sub_immem_count++;
+        if(sub_mem_full_hook_)
+            (*sub_mem_full_hook_)(sub_mem_full_arg_, i);
     }
 }
 
@@ -369,17 +503,27 @@ ArenaNVM::~ArenaNVM() {
 #endif
     if(isDataLock)
         dlock_exit();
-    free(percore_alloc_ptr_);
-    free(percore_alloc_bytes_remaining_);
+    delete[] percore_alloc_ptr_;
+    delete[] percore_alloc_bytes_remaining_;
+    delete[] percore_busy_;
+    delete[] percore_sub_mem_;
+    delete[] percore_fill_start_;
+    delete[] percore_fill_micros_;
+    free(sub_mem_base);
+    free(region_sub_mem);
+    delete spare_regions;
+    delete spare_mu;
     free(sub_mem_bset);
     free(sub_immem_bset);
     free(in_trans_bset);
+    free(sub_mem_writers);
     for (size_t i = 0; i < sub_mem_count; i++) {
         for(size_t j = 0; j<skiplist_blocks[i].size(); j++) {
-            delete[] skiplist_blocks[i][j];
+            sub_mem_pool->Release(skiplist_blocks[i][j]);
             skiplist_blocks[i][j] = NULL;
         }
     }
+    delete[] skiplist_blocks;
     free(skiplist_alloc_ptr_);
     free(skiplist_alloc_bytes_remaining_);
 }
@@ -389,7 +533,7 @@ void ArenaNVM::operator delete(void* ptr)
 #ifdef _USE_ARENA2_ALLOC
     xxfree(ptr);
 #else
-    delete[] (char*)ptr;
+    free(ptr);
 #endif
     ptr = NULL;
 }
@@ -605,12 +749,11 @@ char* ArenaNVM::AllocateNVMBlock(size_t block_bytes) {
 }
 
 char* ArenaNVM::AllocateFallbackNVM(size_t bytes) {
-    char *tmp_ptr;
-    if(isDataLock)
-        tmp_ptr = AllocateNVMBlock(kSize);
-    else
-        tmp_ptr = AllocateNVMBlock(SUB_MEM_SIZE);
+    // Sub-imms no longer map regions of their own, so this always maps
+    // the whole buffer: alloc_sub_mem() may hand out any region of it
+    char *tmp_ptr = AllocateNVMBlock(kSize);
     map_start_ = (void *)tmp_ptr;
+    MapSubMems(kSize);
 
 #if defined(ENABLE_RECOVERY)
     memory_usage_.NoBarrier_Store(
@@ -14,19 +14,28 @@
 #include <atomic>
 #define _GNU_SOURCE
 #include <unistd.h>
+#include <sched.h>
 #include <sys/syscall.h>
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#include <sys/rseq.h>
+#define LEVELDB_HAVE_RSEQ 1
+#endif
 
+// Default size of a sub-memtable region; see Options::sub_mem_size
 #define SUB_MEM_SIZE 2097152 
 
 namespace leveldb {
 
+class SubMemPool;
+
 //Overprovision
 #define MEM_THRESH 1.5
 
 class Arena {
 public:
     Arena();
-    ~Arena();
+    virtual ~Arena();
 
     // Return a pointer to a newly allocated memory block of "bytes" bytes.
     char* Allocate(size_t bytes);
@@ -67,12 +76,43 @@ public:
     bool isDataLock;
     char** percore_alloc_ptr_;
     size_t* percore_alloc_bytes_remaining_;
+    std::atomic_bool *percore_busy_;
     long cores;
     std::atomic_bool *sub_mem_bset;
     size_t sub_mem_count;
     std::atomic_bool *sub_immem_bset;
     size_t sub_immem_count;
     std::atomic_bool *in_trans_bset;
+    // Entries allocated in each sub-mem by AllocateEntry() whose writer
+    // has not called FinishEntry() yet
+    std::atomic<int> *sub_mem_writers;
+    // Set by ArenaNVM::SetSubMemFullHook().  Kept here with the rest of
+    // the sub-mem state since MemTable holds a copy of the base Arena.
+    void (*sub_mem_full_hook_)(void* arg, int index);
+    void* sub_mem_full_arg_;
+    // Bytes in each sub-mem region, a power of two: 1 << sub_mem_shift
+    size_t sub_mem_size;
+    int sub_mem_shift;
+    // Pool of sub_mem_size blocks for node slabs and region copies
+    SubMemPool* sub_mem_pool;
+    // Region backing each sub-mem.  ArenaNVM::DetachSubMem() may give a
+    // full region away and back the sub-mem by a spare one instead.
+    char** sub_mem_base;
+    // Sub-mem backed by each sub_mem_size region of the mapping, -1 for
+    // spares and given-away regions
+    int* region_sub_mem;
+    size_t region_count;
+    // Sub-mem each core allocates from, -1 while it has none
+    int* percore_sub_mem_;
+    // When each core took its current sub-mem, and a moving average of
+    // how long it took to fill the previous ones, in microseconds; 0
+    // until it has filled one
+    uint64_t* percore_fill_start_;
+    uint64_t* percore_fill_micros_;
+    // Regions of the mapping beyond the sub-mems, free for
+    // DetachSubMem(); guarded by *spare_mu
+    std::vector<char*> *spare_regions;
+    port::Mutex *spare_mu;
     std::vector<char*> *skiplist_blocks;
     char** skiplist_alloc_ptr_;
     size_t *skiplist_alloc_bytes_remaining_;
@@ -108,7 +148,9 @@ inline char* Arena::Allocate(size_t bytes) {
 class ArenaNVM : public Arena{
 public:
 #ifdef ENABLE_RECOVERY
-    ArenaNVM(long size, std::string *filename, bool recovery);
+    // "sub_mem_size" must be a power of two no larger than "size"
+    ArenaNVM(long size, std::string *filename, bool recovery,
+             size_t sub_mem_size = SUB_MEM_SIZE);
 #else
     ArenaNVM();
 #endif
@@ -122,15 +164,53 @@ public:
     char* AllocateAligned(size_t bytes);
     char* AllocateAlignedNVM(size_t bytes);
     char* Allocate(size_t bytes);
+    // Like Allocate(), but also returns the sub-mem holding the entry in
+    // *sub_mem_index and counts the entry as in flight there until the
+    // writer calls FinishEntry(), once the entry is indexed.  The count
+    // is raised before the region can be marked immutable, so a region
+    // whose WaitForEntries() returned has no writer left in it.
+    char* AllocateEntry(size_t bytes, int* sub_mem_index);
+    void FinishEntry(int sub_mem_index) {
+        sub_mem_writers[sub_mem_index].fetch_sub(1, std::memory_order_release);
+    }
+    void WaitForEntries(int sub_mem_index);
+    // Give away the region backing full sub-mem "index", whose entries
+    // may then stay where they are, and back the sub-mem by a spare
+    // region.  Returns the region, or NULL if no spare is left.
+    // REQUIRES: caller owns in_trans_bset[index] and no writer is left
+    // in the sub-mem
+    char* DetachSubMem(int index);
+    // Return a region from DetachSubMem() to the spares
+    void ReleaseRegion(char* region);
+    // Sub-mem whose region holds "p"
+    int SubMemOf(const char* p) const {
+        return region_sub_mem[(p - (const char*)map_start_) >> sub_mem_shift];
+    }
     void* CalculateOffset(void* ptr);
     void* getMapStart();
+    // Give "cpu" a free sub-mem.  Cores that fill theirs faster than
+    // average take the lowest free region, which is the first to sit in
+    // locked cache; slower ones take the highest, so that a region they
+    // hold half-filled for long does not take up locked capacity.
     int alloc_sub_mem(int cpu);
+    bool FillsSlowly(int cpu) const;
     int swap_sub_mem(int cpu);
     void reclaim_sub_mem(int cpu);
     void setSubMemToImm();
+    // Have swap_sub_mem() and setSubMemToImm() call hook(arg, index) for
+    // every sub-mem they mark immutable, so that its owner can convert it.
+    void SetSubMemFullHook(void (*hook)(void* arg, int index), void* arg);
     int init_memory(char* mmap_ptr, size_t sz);
+    // Lay the sub-mems and spare regions out over a mapping of
+    // "mapped" bytes at map_start_
+    void MapSubMems(size_t mapped);
     int dlock_exit(void);
 
+    // Returns the CPU the calling thread is running on, without entering
+    // the kernel where possible.  The result is only a hint: the thread
+    // may migrate as soon as it returns.
+    static int CurrentCPU();
+
     // Returns an estimate of the total memory usage of data allocated
     // by the arena.
     size_t MemoryUsage() const {
@@ -139,27 +219,61 @@ public:
     // Total memory usage of the arena.
 };
 
+inline int ArenaNVM::CurrentCPU() {
+#ifdef LEVELDB_HAVE_RSEQ
+    // glibc registers an rseq area for every thread and the kernel
+    // refreshes its cpu_id on each return to user space
+    if (__rseq_size > 0) {
+        const struct rseq* rs = reinterpret_cast<const struct rseq*>(
+                (char*)__builtin_thread_pointer() + __rseq_offset);
+        int cpu = (int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+        if (cpu >= 0)
+            return cpu;
+    }
+#endif
+    // vDSO on x86-64, no kernel entry
+    return sched_getcpu();
+}
+
 inline char* ArenaNVM::Allocate(size_t bytes) {
+    return AllocateEntry(bytes, NULL);
+}
+
+inline char* ArenaNVM::AllocateEntry(size_t bytes, int* sub_mem_index) {
     assert(bytes > 0);
     
     if(!allocation && !AllocateFallbackNVM(bytes))
         return NULL;
-    unsigned int cpu;
-    if(syscall(SYS_getcpu, &cpu, NULL, NULL)) {
+    int cpu = CurrentCPU();
+    if(cpu < 0) {
         return NULL;
     }
+    cpu %= cores;
+    // The thread can migrate between CurrentCPU() and the bump below, so
+    // two threads may pick the same slot.  The per-core flag is
+    // uncontended unless that happens.
+    while(percore_busy_[cpu].load() || percore_busy_[cpu].exchange(1));
     if(bytes > percore_alloc_bytes_remaining_[cpu])
         if(percore_alloc_ptr_[cpu]) {
-            if(swap_sub_mem(cpu) == -1)
+            if(swap_sub_mem(cpu) == -1) {
+                percore_busy_[cpu].store(0);
                 return NULL;
+            }
         }
         else {
-            if(alloc_sub_mem(cpu) == -1)
+            if(alloc_sub_mem(cpu) == -1) {
+                percore_busy_[cpu].store(0);
                 return NULL;
+            }
         }
     char* result = percore_alloc_ptr_[cpu];
     percore_alloc_ptr_[cpu] += bytes;
     percore_alloc_bytes_remaining_[cpu] -= bytes;
+    if(sub_mem_index != NULL) {
+        *sub_mem_index = percore_sub_mem_[cpu];
+        sub_mem_writers[*sub_mem_index].fetch_add(1, std::memory_order_relaxed);
+    }
+    percore_busy_[cpu].store(0);
 #if defined(ENABLE_RECOVERY)
     memory_usage_.NoBarrier_Store(reinterpret_cast<void*>(MemoryUsage() + bytes + sizeof(char*)));
 #endif
@@ -4,6 +4,7 @@
 
 #include "util/arena.h"
 
+#include "leveldb/env.h"
 #include "util/random.h"
 #include "util/testharness.h"
 
@@ -61,6 +62,104 @@ TEST(ArenaTest, Simple) {
   }
 }
 
+TEST(ArenaTest, CurrentCPU) {
+  const long online_core = sysconf(_SC_NPROCESSORS_ONLN);
+  ASSERT_GE(ArenaNVM::CurrentCPU(), 0);
+  ASSERT_LT(ArenaNVM::CurrentCPU(), online_core);
+
+  // Pinned to one CPU at a time, the lookup follows the thread
+  cpu_set_t allowed;
+  ASSERT_EQ(0, sched_getaffinity(0, sizeof(allowed), &allowed));
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed)) continue;
+    cpu_set_t one;
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    ASSERT_EQ(0, sched_setaffinity(0, sizeof(one), &one));
+    ASSERT_EQ(cpu, ArenaNVM::CurrentCPU());
+  }
+  ASSERT_EQ(0, sched_setaffinity(0, sizeof(allowed), &allowed));
+}
+
+#if defined(ENABLE_RECOVERY)
+TEST(ArenaTest, PerCoreAllocate) {
+  std::string fname = test::TmpDir() + "/arena_test.map";
+  Env* env = Env::Default();
+  env->DeleteFile(fname);
+  // A single sub-memtable region, so every allocation lands in it
+  ArenaNVM* arena = new ArenaNVM(SUB_MEM_SIZE, &fname, false);
+  const size_t kBytes = 64;
+  const int kRounds = 50;
+  int count = 0;
+
+  bool contiguous = true;
+
+  for (int r = 0; r < kRounds; r++) {
+    char* prev = NULL;
+    char* p;
+    while ((p = arena->Allocate(kBytes)) != NULL) {
+      // Single-threaded, so the slot is never shared
+      char* expected = (prev == NULL) ? (char*)arena->map_start_
+                                      : prev + kBytes;
+      contiguous &= (p == expected);
+      prev = p;
+      count++;
+    }
+    arena->reclaim_sub_mem(-1);
+  }
+  ASSERT_TRUE(contiguous);
+  ASSERT_EQ(kRounds * (SUB_MEM_SIZE / kBytes), count);
+
+  delete arena;
+  env->DeleteFile(fname);
+}
+
+TEST(ArenaTest, SubMemSize) {
+  std::string fname = test::TmpDir() + "/arena_test.map";
+  Env* env = Env::Default();
+  env->DeleteFile(fname);
+  const size_t kRegion = 64 << 10;
+  const int kRegions = 4;
+  ArenaNVM* arena = new ArenaNVM(kRegions * kRegion, &fname, false, kRegion);
+  ASSERT_EQ(kRegions, arena->sub_mem_count);
+
+  // A region is refilled every kRegion bytes
+  int index;
+  char* first = arena->AllocateEntry(100, &index);
+  arena->FinishEntry(index);
+  ASSERT_EQ(0, index);
+  ASSERT_EQ(0, arena->SubMemOf(first));
+  ASSERT_EQ(0, arena->SubMemOf(first + kRegion - 1));
+  ASSERT_EQ(1, arena->SubMemOf(first + kRegion));
+  int regions = 1;
+  for (size_t used = 100; used + 100 <= 2 * kRegion; used += 100) {
+    char* p = arena->AllocateEntry(100, &index);
+    arena->FinishEntry(index);
+    ASSERT_EQ(index, arena->SubMemOf(p));
+    if (index != 0) regions = 2;
+  }
+  ASSERT_EQ(2, regions);
+
+  // Cores that fill regions slower than the others take the highest
+  // free one, away from the locked cache at the front of the mapping
+  if (arena->cores >= 2) {
+    arena->reclaim_sub_mem(-1);
+    for (int i = 0; i < arena->cores; i++) {
+      arena->percore_fill_micros_[i] = 0;
+    }
+    arena->percore_fill_micros_[0] = 1000;
+    arena->percore_fill_micros_[1] = 10;
+    ASSERT_TRUE(arena->FillsSlowly(0));
+    ASSERT_TRUE(!arena->FillsSlowly(1));
+    ASSERT_EQ(kRegions - 1, arena->alloc_sub_mem(0));
+    ASSERT_EQ(0, arena->alloc_sub_mem(1));
+  }
+
+  delete arena;
+  env->DeleteFile(fname);
+}
+#endif
+
 }  // namespace leveldb
 
 int main(int argc, char** argv) {
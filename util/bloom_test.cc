@@ -4,6 +4,8 @@
 
 #include "leveldb/filter_policy.h"
 
+#include "util/BloomFilter.h"
+#include "util/arena.h"
 #include "util/coding.h"
 #include "util/logging.h"
 #include "util/testharness.h"
@@ -155,6 +157,77 @@ TEST(BloomTest, VaryingLengths) {
 
 // Different bits-per-byte
 
+// The memtable's per sub-mem filter: a bit per 16 bytes of region and 6
+// probes, filled with entries of about 100-byte values.
+static const uint64_t kSubMemFilterBits = SUB_MEM_SIZE / 16;
+static const int kSubMemFilterProbes = 6;
+static const int kSubMemEntries = SUB_MEM_SIZE / 112;
+
+class BlockedBloomTest {
+ public:
+  BlockedBloomFilter filter_;
+
+  BlockedBloomTest() : filter_(kSubMemFilterBits, kSubMemFilterProbes) { }
+
+  bool Matches(const Slice& s) const {
+    return filter_.possiblyContains(s.data(), s.size());
+  }
+
+  double FalsePositiveRate() const {
+    char buffer[sizeof(int)];
+    int result = 0;
+    for (int i = 0; i < 10000; i++) {
+      if (Matches(Key(i + 1000000000, buffer))) {
+        result++;
+      }
+    }
+    return result / 10000.0;
+  }
+};
+
+TEST(BlockedBloomTest, BlockedEmptyFilter) {
+  ASSERT_TRUE(! Matches("hello"));
+  ASSERT_TRUE(! Matches("world"));
+  ASSERT_EQ(0.0, FalsePositiveRate());
+}
+
+TEST(BlockedBloomTest, BlockedSubMemFilter) {
+  char buffer[sizeof(int)];
+  const int lengths[] = { 1, 10, 100, 1000, kSubMemEntries / 2, kSubMemEntries };
+  for (size_t n = 0; n < sizeof(lengths) / sizeof(lengths[0]); n++) {
+    const int length = lengths[n];
+    filter_.clear();
+    for (int i = 0; i < length; i++) {
+      Slice key = Key(i, buffer);
+      filter_.add(key.data(), key.size());
+    }
+
+    // All added keys must match
+    for (int i = 0; i < length; i++) {
+      ASSERT_TRUE(Matches(Key(i, buffer)))
+          << "Length " << length << "; key " << i;
+    }
+
+    double rate = FalsePositiveRate();
+    if (kVerbose >= 1) {
+      fprintf(stderr, "False positives: %5.2f%% @ length = %6d\n",
+              rate*100.0, length);
+    }
+    ASSERT_LE(rate, 0.06);   // About 4% with the region full
+  }
+}
+
+TEST(BlockedBloomTest, BlockedClear) {
+  char buffer[sizeof(int)];
+  for (int i = 0; i < kSubMemEntries; i++) {
+    Slice key = Key(i, buffer);
+    filter_.add(key.data(), key.size());
+  }
+  filter_.clear();
+  ASSERT_EQ(0.0, FalsePositiveRate());
+  ASSERT_TRUE(! Matches(Key(0, buffer)));
+}
+
 }  // namespace leveldb
 
 int main(int argc, char** argv) {
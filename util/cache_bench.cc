@@ -0,0 +1,180 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "leveldb/cache.h"
+#include "leveldb/env.h"
+#include "port/port.h"
+#include "util/coding.h"
+#include "util/mutexlock.h"
+#include "util/random.h"
+
+// Multi-threaded microbenchmark of the Cache implementations.  Each
+// thread looks up keys drawn from a skewed distribution, inserting the
+// ones it misses, and the ops/sec of every cache are reported side by
+// side.
+//
+//   --caches=lru,clock  Comma-separated list of caches to compare
+//   --threads=N         Threads hammering each cache at once
+//   --ops=N             Operations per thread
+//   --cache_size=N      Capacity, in bytes
+//   --value_size=N      Charge of each entry
+//   --keys=N            Number of distinct keys
+//   --shard_bits=N      Shards of the CLOCK cache, as a power of two
+//   --erase_percent=N   Percentage of operations that erase their key
+
+static const char* FLAGS_caches = "lru,clock";
+static int FLAGS_threads = 16;
+static int FLAGS_ops = 1000000;
+static int FLAGS_cache_size = 8 << 20;
+static int FLAGS_value_size = 4096;
+static int FLAGS_keys = 4096;
+static int FLAGS_shard_bits = 4;
+static int FLAGS_erase_percent = 1;
+
+namespace leveldb {
+
+namespace {
+
+static void DeleteValue(const Slice& key, void* value) { }
+
+struct SharedState {
+  Cache* cache;
+  port::Mutex mu;
+  port::CondVar cv;
+  int next_id;
+  int initialized;
+  int done;
+  bool start;
+  uint64_t hits;
+
+  SharedState() : cv(&mu), next_id(0), initialized(0), done(0),
+                  start(false), hits(0) { }
+};
+
+static void ThreadBody(void* arg) {
+  SharedState* shared = reinterpret_cast<SharedState*>(arg);
+  int id;
+  {
+    MutexLock l(&shared->mu);
+    id = shared->next_id++;
+    shared->initialized++;
+    shared->cv.SignalAll();
+    while (!shared->start) {
+      shared->cv.Wait();
+    }
+  }
+
+  Cache* cache = shared->cache;
+  Random rnd(1000 + id);
+  uint64_t hits = 0;
+  char key[4];
+  for (int i = 0; i < FLAGS_ops; i++) {
+    // Skewed, so a hot set stays cached while the tail churns
+    const uint32_t k = rnd.Skewed(30) % FLAGS_keys;
+    EncodeFixed32(key, k);
+    const Slice s(key, sizeof(key));
+    if (static_cast<int>(rnd.Uniform(100)) < FLAGS_erase_percent) {
+      cache->Erase(s);
+      continue;
+    }
+    Cache::Handle* h = cache->Lookup(s);
+    if (h != NULL) {
+      hits++;
+    } else {
+      h = cache->Insert(s, NULL, FLAGS_value_size, &DeleteValue);
+    }
+    cache->Release(h);
+  }
+
+  MutexLock l(&shared->mu);
+  shared->hits += hits;
+  shared->done++;
+  shared->cv.SignalAll();
+}
+
+static void Run(const std::string& name) {
+  SharedState shared;
+  if (name == "lru") {
+    shared.cache = NewLRUCache(FLAGS_cache_size);
+  } else if (name == "clock") {
+    shared.cache = NewClockCache(FLAGS_cache_size, FLAGS_shard_bits,
+                                 FLAGS_value_size);
+  } else {
+    fprintf(stderr, "unknown cache %s\n", name.c_str());
+    exit(1);
+  }
+
+  Env* env = Env::Default();
+  for (int t = 0; t < FLAGS_threads; t++) {
+    env->StartThread(ThreadBody, &shared);
+  }
+  uint64_t start;
+  {
+    MutexLock l(&shared.mu);
+    while (shared.initialized < FLAGS_threads) {
+      shared.cv.Wait();
+    }
+    start = env->NowMicros();
+    shared.start = true;
+    shared.cv.SignalAll();
+    while (shared.done < FLAGS_threads) {
+      shared.cv.Wait();
+    }
+  }
+  const double seconds = (env->NowMicros() - start) * 1e-6;
+  const double ops = static_cast<double>(FLAGS_ops) * FLAGS_threads;
+  fprintf(stdout, "%-6s : %11.0f ops/sec; %5.1f%% hits; %8.3f micros/op per thread\n",
+          name.c_str(), ops / seconds,
+          100.0 * shared.hits / ops,
+          seconds * 1e6 / FLAGS_ops);
+  delete shared.cache;
+}
+
+}  // namespace
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    int n;
+    char junk;
+    if (strncmp(argv[i], "--caches=", 9) == 0) {
+      FLAGS_caches = argv[i] + 9;
+    } else if (sscanf(argv[i], "--threads=%d%c", &n, &junk) == 1) {
+      FLAGS_threads = n;
+    } else if (sscanf(argv[i], "--ops=%d%c", &n, &junk) == 1) {
+      FLAGS_ops = n;
+    } else if (sscanf(argv[i], "--cache_size=%d%c", &n, &junk) == 1) {
+      FLAGS_cache_size = n;
+    } else if (sscanf(argv[i], "--value_size=%d%c", &n, &junk) == 1) {
+      FLAGS_value_size = n;
+    } else if (sscanf(argv[i], "--keys=%d%c", &n, &junk) == 1) {
+      FLAGS_keys = n;
+    } else if (sscanf(argv[i], "--shard_bits=%d%c", &n, &junk) == 1) {
+      FLAGS_shard_bits = n;
+    } else if (sscanf(argv[i], "--erase_percent=%d%c", &n, &junk) == 1) {
+      FLAGS_erase_percent = n;
+    } else {
+      fprintf(stderr, "Invalid flag '%s'\n", argv[i]);
+      exit(1);
+    }
+  }
+
+  fprintf(stdout, "Threads:    %d\n", FLAGS_threads);
+  fprintf(stdout, "Capacity:   %d entries of %d bytes, %d keys\n",
+          FLAGS_cache_size / FLAGS_value_size, FLAGS_value_size, FLAGS_keys);
+  fprintf(stdout, "------------------------------------------------\n");
+  const char* caches = FLAGS_caches;
+  while (*caches != '\0') {
+    const char* sep = strchr(caches, ',');
+    std::string name = (sep == NULL) ? std::string(caches)
+                                     : std::string(caches, sep - caches);
+    leveldb::Run(name);
+    caches = (sep == NULL) ? caches + strlen(caches) : sep + 1;
+  }
+  return 0;
+}
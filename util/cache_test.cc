@@ -4,8 +4,13 @@
 
 #include "leveldb/cache.h"
 
+#include <atomic>
 #include <vector>
+#include "leveldb/env.h"
+#include "port/port.h"
 #include "util/coding.h"
+#include "util/mutexlock.h"
+#include "util/random.h"
 #include "util/testharness.h"
 
 namespace leveldb {
@@ -41,6 +46,10 @@ class CacheTest {
     current_ = this;
   }
 
+  explicit CacheTest(Cache* cache) : cache_(cache) {
+    current_ = this;
+  }
+
   ~CacheTest() {
     delete cache_;
   }
@@ -192,6 +201,216 @@ TEST(CacheTest, Prune) {
   ASSERT_EQ(-1, Lookup(2));
 }
 
+class ClockCacheTest : public CacheTest {
+ public:
+  // Four shards, each with room for the whole capacity in entries
+  ClockCacheTest() : CacheTest(NewClockCache(kCacheSize, 2, 1)) { }
+};
+
+TEST(ClockCacheTest, ClockHitAndMiss) {
+  ASSERT_EQ(-1, Lookup(100));
+
+  Insert(100, 101);
+  ASSERT_EQ(101, Lookup(100));
+  ASSERT_EQ(-1,  Lookup(200));
+
+  Insert(200, 201);
+  Insert(100, 102);
+  ASSERT_EQ(102, Lookup(100));
+  ASSERT_EQ(201, Lookup(200));
+
+  ASSERT_EQ(1, deleted_keys_.size());
+  ASSERT_EQ(100, deleted_keys_[0]);
+  ASSERT_EQ(101, deleted_values_[0]);
+
+  Erase(100);
+  ASSERT_EQ(-1,  Lookup(100));
+  ASSERT_EQ(201, Lookup(200));
+  ASSERT_EQ(2, deleted_keys_.size());
+}
+
+TEST(ClockCacheTest, ClockEntriesArePinned) {
+  Insert(100, 101);
+  Cache::Handle* h1 = cache_->Lookup(EncodeKey(100));
+  Insert(100, 102);
+  Cache::Handle* h2 = cache_->Lookup(EncodeKey(100));
+  ASSERT_EQ(101, DecodeValue(cache_->Value(h1)));
+  ASSERT_EQ(102, DecodeValue(cache_->Value(h2)));
+  ASSERT_EQ(0, deleted_keys_.size());
+
+  cache_->Release(h1);
+  ASSERT_EQ(1, deleted_keys_.size());
+  ASSERT_EQ(101, deleted_values_[0]);
+
+  Erase(100);
+  ASSERT_EQ(-1, Lookup(100));
+  ASSERT_EQ(1, deleted_keys_.size());
+
+  cache_->Release(h2);
+  ASSERT_EQ(2, deleted_keys_.size());
+  ASSERT_EQ(102, deleted_values_[1]);
+}
+
+TEST(ClockCacheTest, ClockEvictionPolicy) {
+  Insert(100, 101);
+  Insert(200, 201);
+
+  // An entry that is hit between sweeps of the hand is kept around.
+  // Enough inserts that every shard fills up.
+  for (int i = 0; i < 2 * kCacheSize; i++) {
+    Insert(1000+i, 2000+i);
+    ASSERT_EQ(2000+i, Lookup(1000+i));
+    ASSERT_EQ(101, Lookup(100));
+  }
+  ASSERT_EQ(101, Lookup(100));
+  ASSERT_EQ(-1, Lookup(200));
+}
+
+TEST(ClockCacheTest, ClockHeavyEntries) {
+  const int kLight = 1;
+  const int kHeavy = 10;
+  int added = 0;
+  int index = 0;
+  while (added < 2*kCacheSize) {
+    const int weight = (index & 1) ? kLight : kHeavy;
+    Insert(index, 1000+index, weight);
+    added += weight;
+    index++;
+  }
+
+  int cached_weight = 0;
+  for (int i = 0; i < index; i++) {
+    const int weight = (i & 1 ? kLight : kHeavy);
+    int r = Lookup(i);
+    if (r >= 0) {
+      cached_weight += weight;
+      ASSERT_EQ(1000+i, r);
+    }
+  }
+  ASSERT_LE(cached_weight, kCacheSize + kCacheSize/10);
+  ASSERT_LE(cache_->TotalCharge(), kCacheSize + kCacheSize/10);
+}
+
+TEST(ClockCacheTest, ClockEntryLimit) {
+  // Sized for 10 entries of charge 100; tiny ones are capped by count
+  delete cache_;
+  cache_ = NewClockCache(kCacheSize, 0, 100);
+  for (int i = 0; i < 1000; i++) {
+    Insert(i, 1000+i);
+  }
+  int cached = 0;
+  for (int i = 0; i < 1000; i++) {
+    if (Lookup(i) >= 0) {
+      cached++;
+    }
+  }
+  ASSERT_GT(cached, 0);
+  ASSERT_LT(cached, 100);
+  ASSERT_EQ(1000 - cached, deleted_keys_.size());
+}
+
+TEST(ClockCacheTest, ClockOversizedEntry) {
+  Cache::Handle* h = cache_->Insert(EncodeKey(1), EncodeValue(100),
+                                    kCacheSize + 1, &CacheTest::Deleter);
+  ASSERT_EQ(100, DecodeValue(cache_->Value(h)));
+  ASSERT_EQ(-1, Lookup(1));
+  ASSERT_EQ(0, deleted_keys_.size());
+  cache_->Release(h);
+  ASSERT_EQ(1, deleted_keys_.size());
+  ASSERT_EQ(0, cache_->TotalCharge());
+}
+
+TEST(ClockCacheTest, ClockPrune) {
+  Insert(1, 100);
+  Insert(2, 200);
+
+  Cache::Handle* handle = cache_->Lookup(EncodeKey(1));
+  ASSERT_TRUE(handle);
+  cache_->Prune();
+  cache_->Release(handle);
+
+  ASSERT_EQ(100, Lookup(1));
+  ASSERT_EQ(-1, Lookup(2));
+}
+
+namespace {
+static const int kThreads = 4;
+static const int kKeys = 2000;
+
+struct ConcurrentState {
+  Cache* cache;
+  std::atomic<int> inserted;
+  std::atomic<int> deleted;
+  std::atomic<int> bad;
+  port::Mutex mu;
+  port::CondVar cv;
+  int next_id;
+  int running;
+
+  ConcurrentState() : inserted(0), deleted(0), bad(0), cv(&mu),
+                      next_id(0), running(0) { }
+};
+static ConcurrentState* concurrent_state;
+
+static void CountingDeleter(const Slice& key, void* v) {
+  if (DecodeValue(v) != DecodeKey(key) * 2) {
+    concurrent_state->bad.fetch_add(1);
+  }
+  concurrent_state->deleted.fetch_add(1);
+}
+
+static void ConcurrentUser(void* arg) {
+  ConcurrentState* state = reinterpret_cast<ConcurrentState*>(arg);
+  int id;
+  {
+    MutexLock l(&state->mu);
+    id = state->next_id++;
+  }
+  Random rnd(301 + id);
+  for (int n = 0; n < 50000; n++) {
+    const int k = rnd.Skewed(11) % kKeys;
+    const std::string key = EncodeKey(k);
+    Cache::Handle* h = state->cache->Lookup(key);
+    if (h == NULL) {
+      h = state->cache->Insert(key, EncodeValue(k * 2), 1 + k % 3,
+                               &CountingDeleter);
+      state->inserted.fetch_add(1);
+    } else if (rnd.OneIn(50)) {
+      state->cache->Erase(key);
+    }
+    // Still readable after any erase or eviction
+    if (DecodeValue(state->cache->Value(h)) != k * 2) {
+      state->bad.fetch_add(1);
+    }
+    state->cache->Release(h);
+  }
+  MutexLock l(&state->mu);
+  state->running--;
+  state->cv.SignalAll();
+}
+}  // namespace
+
+TEST(ClockCacheTest, ClockConcurrent) {
+  ConcurrentState state;
+  concurrent_state = &state;
+  state.cache = NewClockCache(kCacheSize, 2, 2);
+  state.running = kThreads;
+  for (int t = 0; t < kThreads; t++) {
+    Env::Default()->StartThread(ConcurrentUser, &state);
+  }
+  {
+    MutexLock l(&state.mu);
+    while (state.running > 0) {
+      state.cv.Wait();
+    }
+  }
+  ASSERT_EQ(0, state.bad.load());
+  ASSERT_LE(state.cache->TotalCharge(), kCacheSize);
+  delete state.cache;
+  ASSERT_EQ(state.inserted.load(), state.deleted.load());
+  ASSERT_EQ(0, state.bad.load());
+}
+
 }  // namespace leveldb
 
 int main(int argc, char** argv) {
@@ -0,0 +1,436 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include "leveldb/cache.h"
+#include "port/port.h"
+#include "util/hash.h"
+#include "util/mutexlock.h"
+
+namespace leveldb {
+
+namespace {
+
+// CLOCK cache implementation
+//
+// Each shard keeps its entries in a fixed open-addressed table, probed
+// by double hashing.  Lookups take no lock: an entry is pinned by
+// a compare-and-swap on its state word, which also sets its reference
+// bit, and that is all a hit writes.  Insert, Erase and eviction are
+// serialized by the shard's mutex, so the table has a single writer.
+//
+// A slot's state word holds, from low to high bits, the number of
+// handles pinning the entry, the CLOCK reference bit, a flag for
+// handles that live outside the table, and the slot state:
+//
+//   kEmpty      free for Insert() to claim
+//   kExclusive  owned by the thread filling or freeing it
+//   kVisible    found by lookups
+//   kInvisible  erased, but still pinned; the last Release() frees it
+//
+// Lookups only pin visible entries, so once an entry is invisible its
+// count can only drop, and whoever drops it to zero frees the slot.
+// Erasing an unpinned entry frees it at once.
+//
+// Every slot also counts the entries whose probe passed over it on the
+// way to their own slot.  A lookup stops at the first slot that does
+// not match and was passed over by none, so misses end without
+// touching the whole table.
+static const uint64_t kRefsMask = 0xffffffffu;
+static const uint64_t kClockBit = static_cast<uint64_t>(1) << 32;
+static const uint64_t kDetachedBit = static_cast<uint64_t>(1) << 33;
+static const int kStateShift = 62;
+static const uint64_t kEmpty = 0;
+static const uint64_t kExclusive = 1;
+static const uint64_t kVisible = 2;
+static const uint64_t kInvisible = 3;
+
+static inline uint64_t StateOf(uint64_t meta) { return meta >> kStateShift; }
+static inline uint64_t RefsOf(uint64_t meta) { return meta & kRefsMask; }
+
+struct ClockHandle {
+  std::atomic<uint64_t> meta;
+  std::atomic<uint32_t> displacements;
+  uint32_t hash;      // Hash of key(); used for fast sharding and comparisons
+  void* value;
+  void (*deleter)(const Slice&, void* value);
+  size_t charge;
+  size_t key_length;
+  char* key_data;
+
+  Slice key() const { return Slice(key_data, key_length); }
+};
+
+// A single shard of sharded cache.
+class ClockCache {
+ public:
+  ClockCache();
+  ~ClockCache();
+
+  // Separate from constructor so caller can easily make an array of
+  // ClockCache.  Sizes the table for capacity / estimated_entry_charge
+  // entries, which is also the most it holds.
+  void SetCapacity(size_t capacity, size_t estimated_entry_charge);
+
+  // Like Cache methods, but with an extra "hash" parameter.
+  Cache::Handle* Insert(const Slice& key, uint32_t hash,
+                        void* value, size_t charge,
+                        void (*deleter)(const Slice& key, void* value));
+  Cache::Handle* Lookup(const Slice& key, uint32_t hash);
+  void Release(Cache::Handle* handle);
+  void Erase(const Slice& key, uint32_t hash);
+  void Prune();
+  size_t TotalCharge() const { return usage_.load(std::memory_order_relaxed); }
+
+ private:
+  bool Unref(ClockHandle* h);
+  void Free(ClockHandle* h);
+  ClockHandle* FindVisible(const Slice& key, uint32_t hash);
+  void Remove(ClockHandle* h);
+  void Evict(size_t charge);
+
+  // The i-th slot probed for "hash".  Entries are never moved once
+  // placed, so with linear probing the runs of full slots would only
+  // grow; double hashing keeps the keys that collide at one slot from
+  // colliding at the next.  The stride is odd, so every slot is probed.
+  uint32_t Probe(uint32_t hash, uint32_t i) const {
+    const uint32_t home = (hash * 0x9e3779b1u) >> (32 - length_bits_);
+    const uint32_t stride = ((hash * 0x85ebca6bu) >> (32 - length_bits_)) | 1;
+    return (home + i * stride) & (length_ - 1);
+  }
+
+  // Initialized before use.
+  size_t capacity_;
+  int length_bits_;
+  uint32_t length_;
+  uint32_t max_occupancy_;
+  ClockHandle* slots_;
+
+  // Changed by Release() as well as under mutex_
+  std::atomic<size_t> usage_;
+  std::atomic<uint32_t> occupancy_;
+
+  // mutex_ serializes the writers: Insert, Erase, Prune and eviction
+  port::Mutex mutex_;
+  uint32_t hand_;
+};
+
+ClockCache::ClockCache()
+    : capacity_(0),
+      length_bits_(0),
+      length_(0),
+      max_occupancy_(0),
+      slots_(NULL),
+      usage_(0),
+      occupancy_(0),
+      hand_(0) {
+}
+
+ClockCache::~ClockCache() {
+  for (uint32_t i = 0; i < length_; i++) {
+    ClockHandle* h = &slots_[i];
+    const uint64_t meta = h->meta.load(std::memory_order_acquire);
+    if (StateOf(meta) == kVisible) {
+      assert(RefsOf(meta) == 0);  // Error if caller has an unreleased handle
+      Free(h);
+    }
+  }
+  delete[] slots_;
+}
+
+void ClockCache::SetCapacity(size_t capacity, size_t estimated_entry_charge) {
+  assert(slots_ == NULL);
+  capacity_ = capacity;
+  size_t entries = capacity / (estimated_entry_charge > 0 ? estimated_entry_charge : 1);
+  if (entries > (1u << 30)) {
+    entries = 1u << 30;
+  }
+  // Keep a quarter of the slots free so probes stay short
+  int bits = 4;
+  while ((static_cast<size_t>(1) << bits) < entries + entries / 3 + 1) {
+    bits++;
+  }
+  const uint32_t length = 1u << bits;
+  length_bits_ = bits;
+  length_ = length;
+  max_occupancy_ = length - length / 4;
+  slots_ = new ClockHandle[length];
+  for (uint32_t i = 0; i < length; i++) {
+    slots_[i].meta.store(0, std::memory_order_relaxed);
+    slots_[i].displacements.store(0, std::memory_order_relaxed);
+  }
+}
+
+// Drop one pin; returns true if that left "h" invisible and unpinned,
+// in which case the caller must Free() it.
+bool ClockCache::Unref(ClockHandle* h) {
+  const uint64_t old = h->meta.fetch_sub(1, std::memory_order_acq_rel);
+  assert(RefsOf(old) > 0);
+  return RefsOf(old) == 1 && StateOf(old) == kInvisible;
+}
+
+// REQUIRES: "h" is no longer visible and nothing pins it
+void ClockCache::Free(ClockHandle* h) {
+  (*h->deleter)(h->key(), h->value);
+  free(h->key_data);
+  usage_.fetch_sub(h->charge, std::memory_order_relaxed);
+  if (h->meta.load(std::memory_order_relaxed) & kDetachedBit) {
+    delete h;
+  } else {
+    occupancy_.fetch_sub(1, std::memory_order_relaxed);
+    h->meta.store(kEmpty << kStateShift, std::memory_order_release);
+  }
+}
+
+Cache::Handle* ClockCache::Lookup(const Slice& key, uint32_t hash) {
+  for (uint32_t i = 0; i < length_; i++) {
+    ClockHandle* h = &slots_[Probe(hash, i)];
+    uint64_t meta = h->meta.load(std::memory_order_acquire);
+    while (StateOf(meta) == kVisible) {
+      if (h->meta.compare_exchange_weak(meta, (meta + 1) | kClockBit,
+                                        std::memory_order_acq_rel)) {
+        // Pinned, so the slot cannot be refilled under us
+        if (h->hash == hash && h->key() == key) {
+          return reinterpret_cast<Cache::Handle*>(h);
+        }
+        if (Unref(h)) {
+          Free(h);
+        }
+        break;
+      }
+    }
+    if (h->displacements.load(std::memory_order_acquire) == 0) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+void ClockCache::Release(Cache::Handle* handle) {
+  ClockHandle* h = reinterpret_cast<ClockHandle*>(handle);
+  if (Unref(h)) {
+    Free(h);
+  }
+}
+
+// REQUIRES: mutex_ held, which keeps visible entries from being freed
+ClockHandle* ClockCache::FindVisible(const Slice& key, uint32_t hash) {
+  for (uint32_t i = 0; i < length_; i++) {
+    ClockHandle* h = &slots_[Probe(hash, i)];
+    if (StateOf(h->meta.load(std::memory_order_acquire)) == kVisible &&
+        h->hash == hash && h->key() == key) {
+      return h;
+    }
+    if (h->displacements.load(std::memory_order_relaxed) == 0) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+// Take visible "h" out of the table, freeing it unless it is pinned.
+// REQUIRES: mutex_ held
+void ClockCache::Remove(ClockHandle* h) {
+  uint64_t meta = h->meta.load(std::memory_order_acquire);
+  uint64_t next;
+  do {
+    assert(StateOf(meta) == kVisible);
+    next = (RefsOf(meta) == 0) ? (kExclusive << kStateShift)
+                               : ((kInvisible << kStateShift) | RefsOf(meta));
+  } while (!h->meta.compare_exchange_weak(meta, next,
+                                          std::memory_order_acq_rel));
+
+  // The entry is no longer on the probe paths it lengthened
+  const uint32_t slot = h - slots_;
+  for (uint32_t i = 0; Probe(h->hash, i) != slot; i++) {
+    slots_[Probe(h->hash, i)].displacements.fetch_sub(1, std::memory_order_relaxed);
+  }
+  if (StateOf(next) == kExclusive) {
+    Free(h);
+  }
+}
+
+// Sweep the clock hand until "charge" more fits, giving each referenced
+// entry a second chance.
+// REQUIRES: mutex_ held
+void ClockCache::Evict(size_t charge) {
+  for (uint32_t step = 0; step < 2 * length_; step++) {
+    if (usage_.load(std::memory_order_relaxed) + charge <= capacity_ &&
+        occupancy_.load(std::memory_order_relaxed) < max_occupancy_) {
+      break;
+    }
+    ClockHandle* h = &slots_[hand_];
+    hand_ = (hand_ + 1) & (length_ - 1);
+    uint64_t meta = h->meta.load(std::memory_order_acquire);
+    if (StateOf(meta) != kVisible) {
+      continue;
+    }
+    if (meta & kClockBit) {
+      // A lookup racing with this sets it again, which is just as good
+      h->meta.compare_exchange_strong(meta, meta & ~kClockBit,
+                                      std::memory_order_acq_rel);
+      continue;
+    }
+    Remove(h);
+  }
+}
+
+Cache::Handle* ClockCache::Insert(
+    const Slice& key, uint32_t hash, void* value, size_t charge,
+    void (*deleter)(const Slice& key, void* value)) {
+  MutexLock l(&mutex_);
+
+  Evict(charge);
+
+  ClockHandle* e = NULL;
+  if (usage_.load(std::memory_order_relaxed) + charge <= capacity_) {
+    for (uint32_t i = 0; i < length_; i++) {
+      ClockHandle* h = &slots_[Probe(hash, i)];
+      if (StateOf(h->meta.load(std::memory_order_acquire)) == kEmpty) {
+        e = h;
+        e->meta.store(kExclusive << kStateShift, std::memory_order_relaxed);
+        occupancy_.fetch_add(1, std::memory_order_relaxed);
+        break;
+      }
+      h->displacements.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (e == NULL) {
+      // Every slot is held by pinned entries; undo the probe
+      for (uint32_t i = 0; i < length_; i++) {
+        slots_[Probe(hash, i)].displacements.fetch_sub(
+            1, std::memory_order_relaxed);
+      }
+    }
+  }
+  const bool detached = (e == NULL);
+  if (detached) {
+    // Does not fit; hand out an entry that is never cached
+    e = new ClockHandle;
+    e->displacements.store(0, std::memory_order_relaxed);
+  }
+
+  e->hash = hash;
+  e->value = value;
+  e->deleter = deleter;
+  e->charge = charge;
+  e->key_length = key.size();
+  e->key_data = reinterpret_cast<char*>(malloc(key.size() > 0 ? key.size() : 1));
+  memcpy(e->key_data, key.data(), key.size());
+  usage_.fetch_add(charge, std::memory_order_relaxed);
+
+  ClockHandle* old = FindVisible(key, hash);
+  // One pin for the returned handle
+  if (detached) {
+    e->meta.store((kInvisible << kStateShift) | kDetachedBit | 1,
+                  std::memory_order_release);
+  } else {
+    e->meta.store((kVisible << kStateShift) | 1, std::memory_order_release);
+  }
+  if (old != NULL) {
+    Remove(old);
+  }
+  return reinterpret_cast<Cache::Handle*>(e);
+}
+
+void ClockCache::Erase(const Slice& key, uint32_t hash) {
+  MutexLock l(&mutex_);
+  ClockHandle* e = FindVisible(key, hash);
+  if (e != NULL) {
+    Remove(e);
+  }
+}
+
+void ClockCache::Prune() {
+  MutexLock l(&mutex_);
+  for (uint32_t i = 0; i < length_; i++) {
+    ClockHandle* h = &slots_[i];
+    const uint64_t meta = h->meta.load(std::memory_order_acquire);
+    if (StateOf(meta) == kVisible && RefsOf(meta) == 0) {
+      Remove(h);
+    }
+  }
+}
+
+class ShardedClockCache : public Cache {
+ private:
+  const int num_shard_bits_;
+  ClockCache* shard_;
+  std::atomic<uint64_t> last_id_;
+
+  static inline uint32_t HashSlice(const Slice& s) {
+    return Hash(s.data(), s.size(), 0);
+  }
+
+  uint32_t Shard(uint32_t hash) const {
+    return num_shard_bits_ > 0 ? hash >> (32 - num_shard_bits_) : 0;
+  }
+
+ public:
+  ShardedClockCache(size_t capacity, int num_shard_bits,
+                    size_t estimated_entry_charge)
+      : num_shard_bits_(num_shard_bits),
+        shard_(new ClockCache[1 << num_shard_bits]),
+        last_id_(0) {
+    const int num_shards = 1 << num_shard_bits_;
+    const size_t per_shard = (capacity + (num_shards - 1)) / num_shards;
+    for (int s = 0; s < num_shards; s++) {
+      shard_[s].SetCapacity(per_shard, estimated_entry_charge);
+    }
+  }
+  virtual ~ShardedClockCache() { delete[] shard_; }
+  virtual Handle* Insert(const Slice& key, void* value, size_t charge,
+                         void (*deleter)(const Slice& key, void* value)) {
+    const uint32_t hash = HashSlice(key);
+    return shard_[Shard(hash)].Insert(key, hash, value, charge, deleter);
+  }
+  virtual Handle* Lookup(const Slice& key) {
+    const uint32_t hash = HashSlice(key);
+    return shard_[Shard(hash)].Lookup(key, hash);
+  }
+  virtual void Release(Handle* handle) {
+    ClockHandle* h = reinterpret_cast<ClockHandle*>(handle);
+    shard_[Shard(h->hash)].Release(handle);
+  }
+  virtual void Erase(const Slice& key) {
+    const uint32_t hash = HashSlice(key);
+    shard_[Shard(hash)].Erase(key, hash);
+  }
+  virtual void* Value(Handle* handle) {
+    return reinterpret_cast<ClockHandle*>(handle)->value;
+  }
+  virtual uint64_t NewId() {
+    return last_id_.fetch_add(1, std::memory_order_relaxed) + 1;
+  }
+  virtual void Prune() {
+    for (int s = 0; s < (1 << num_shard_bits_); s++) {
+      shard_[s].Prune();
+    }
+  }
+  virtual size_t TotalCharge() const {
+    size_t total = 0;
+    for (int s = 0; s < (1 << num_shard_bits_); s++) {
+      total += shard_[s].TotalCharge();
+    }
+    return total;
+  }
+};
+
+}  // end anonymous namespace
+
+Cache* NewClockCache(size_t capacity, int num_shard_bits,
+                     size_t estimated_entry_charge) {
+  if (num_shard_bits < 0) {
+    num_shard_bits = 0;
+  } else if (num_shard_bits > 16) {
+    num_shard_bits = 16;
+  }
+  return new ShardedClockCache(capacity, num_shard_bits,
+                               estimated_entry_charge);
+}
+
+}  // namespace leveldb
@@ -14,8 +14,16 @@ namespace crc32c {
 // Return the crc32c of concat(A, data[0,n-1]) where init_crc is the
 // crc32c of some string A.  Extend() is often used to maintain the
 // crc32c of a stream of data.
+// Uses the SSE 4.2 crc32 instruction when the CPU has it.
 extern uint32_t Extend(uint32_t init_crc, const char* data, size_t n);
 
+// Table-driven Extend(), used when the CPU cannot accelerate crc32c.
+// Exposed for tests and benchmarks.
+extern uint32_t ExtendPortable(uint32_t init_crc, const char* data, size_t n);
+
+// Return true if Extend() runs on the accelerated path.
+extern bool IsAccelerated();
+
 // Return the crc32c of data[0,n-1]
 inline uint32_t Value(const char* data, size_t n) {
   return Extend(0, data, n);
@@ -8,6 +8,8 @@
 namespace leveldb {
 namespace crc32c {
 
+static const int kVerbose = 0;
+
 class CRC { };
 
 TEST(CRC, StandardResults) {
@@ -56,6 +58,32 @@ TEST(CRC, Extend) {
             Extend(Value("hello ", 6), "world", 5));
 }
 
+TEST(CRC, AcceleratedMatchesPortable) {
+  if (kVerbose >= 1) {
+    fprintf(stderr, "crc32c accelerated: %s\n", IsAccelerated() ? "yes" : "no");
+  }
+
+  // Long enough for both stripe sizes of the three-stream kernel, read
+  // at every alignment and with lengths straddling the stripe edges.
+  std::string data(3 * 8192 * 2 + 3 * 256 + 64, 0);
+  uint32_t seed = 301;
+  for (size_t i = 0; i < data.size(); i++) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = static_cast<char>(seed >> 16);
+  }
+  const size_t lengths[] = { 0, 1, 7, 8, 9, 255, 767, 768, 769, 4096,
+                             3 * 8192 - 1, 3 * 8192, 3 * 8192 + 768 + 5 };
+  for (size_t offset = 0; offset < 16; offset++) {
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+      const char* p = data.data() + offset;
+      ASSERT_EQ(ExtendPortable(0x12345678, p, lengths[i]),
+                Extend(0x12345678, p, lengths[i]));
+    }
+  }
+  ASSERT_EQ(ExtendPortable(0, data.data(), data.size()),
+            Value(data.data(), data.size()));
+}
+
 TEST(CRC, Mask) {
   uint32_t crc = Value("foo", 3);
   ASSERT_NE(crc, Mask(crc));
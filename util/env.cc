@@ -13,6 +13,27 @@ Status Env::NewAppendableFile(const std::string& fname, WritableFile** result) {
   return Status::NotSupported("NewAppendableFile", fname);
 }
 
+const char* Env::PoolName(Pool pool) {
+  switch (pool) {
+    case kMemTableSyncPool: return "memtable-sync";
+    case kSubImmPool:       return "sub-imm";
+    case kFlushPool:        return "flush";
+    case kCompactionPool:   return "compaction";
+    default:                return "unknown";
+  }
+}
+
+void Env::ScheduleOn(Pool pool, void (*function)(void*), void* arg) {
+  Schedule(function, arg);
+}
+
+void Env::SetPoolThreads(Pool pool, int threads, const std::string& cpus) {
+}
+
+bool Env::GetPoolStats(Pool pool, PoolStats* stats) {
+  return false;
+}
+
 SequentialFile::~SequentialFile() {
 }
 
@@ -22,10 +22,10 @@
 #include "port/port.h"
 #include "util/logging.h"
 #include "util/mutexlock.h"
+#include "util/executor.h"
 #include "util/posix_logger.h"
 
 #include <atomic>
-#define THREAD_COUNT 8
 
 namespace leveldb {
 
@@ -334,8 +334,6 @@ public:
 
 class PosixEnv : public Env {
 public:
-    std::atomic_int thread_count;
-
     PosixEnv();
     virtual ~PosixEnv() {
         char msg[] = "Destroying Env::Default()\n";
@@ -515,6 +513,12 @@ public:
 
     virtual void Schedule(void (*function)(void*), void* arg);
 
+    virtual void ScheduleOn(Pool pool, void (*function)(void*), void* arg);
+
+    virtual void SetPoolThreads(Pool pool, int threads, const std::string& cpus);
+
+    virtual bool GetPoolStats(Pool pool, PoolStats* stats);
+
     virtual void StartThread(void (*function)(void* arg), void* arg);
 
     virtual Status GetTestDirectory(std::string* result) {
@@ -567,81 +571,145 @@ private:
         }
     }
 
-    // BGThread() is the body of the background thread
-    void BGThread();
-    static void* BGThreadWrapper(void* arg) {
-        reinterpret_cast<PosixEnv*>(arg)->BGThread();
-        return NULL;
-    }
+    // How a pool's threads are set up.  Fixed once the pool starts.
+    struct PoolConfig {
+        int threads;
+        bool pinned;
+        cpu_set_t cpus;
+    };
 
-    pthread_mutex_t mu_;
-    pthread_cond_t bgsignal_;
-    pthread_t bgthread_;
-    bool started_bgthread_;
+    // Create the executor of "pool" unless another thread beat us to it
+    Executor* StartPool(Pool pool);
+    // Run by every pool thread before its first item
+    static void PinThread(void* arg);
 
-    // Entry per Schedule() call
-    struct BGItem { void* arg; void (*function)(void*); };
-    typedef std::deque<BGItem> BGQueue;
-    BGQueue queue_;
+    pthread_mutex_t mu_;
+    PoolConfig pool_config_[kNumPools];        // Guarded by mu_
+    std::atomic<Executor*> pools_[kNumPools];  // Started lazily, never freed
 
     PosixLockTable locks_;
     MmapLimiter mmap_limit_;
 };
 
-PosixEnv::PosixEnv() : started_bgthread_(false) {
+PosixEnv::PosixEnv() {
     PthreadCall("mutex_init", pthread_mutex_init(&mu_, NULL));
-    PthreadCall("cvar_init", pthread_cond_init(&bgsignal_, NULL));
+    for (int i = 0; i < kNumPools; i++) {
+        pool_config_[i].threads = 1;
+        pool_config_[i].pinned = false;
+        CPU_ZERO(&pool_config_[i].cpus);
+        pools_[i].store(NULL);
+    }
+}
 
-    thread_count.store(0);
+// Parse a list such as "0-7,16" into *cpus
+static bool ParseCpuList(const std::string& list, cpu_set_t* cpus) {
+    CPU_ZERO(cpus);
+    const char* p = list.c_str();
+    bool any = false;
+    while (*p != '\0') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1) {
+                return false;
+            }
+            p = end;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (long c = first; c <= last; c++) {
+            CPU_SET(c, cpus);
+        }
+        any = true;
+        while (*p == ',' || *p == ' ' || *p == '\n') {
+            p++;
+        }
+    }
+    return any;
+}
+
+// "node:N" selects the CPUs of NUMA node N, anything else is a CPU list
+static bool ParseCpuSpec(const std::string& spec, cpu_set_t* cpus) {
+    if (spec.compare(0, 5, "node:") != 0) {
+        return ParseCpuList(spec, cpus);
+    }
+    char fname[100];
+    snprintf(fname, sizeof(fname), "/sys/devices/system/node/node%d/cpulist",
+            atoi(spec.c_str() + 5));
+    FILE* f = fopen(fname, "r");
+    if (f == NULL) {
+        return false;
+    }
+    char buf[4096];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    return ParseCpuList(buf, cpus);
 }
 
 void PosixEnv::Schedule(void (*function)(void*), void* arg) {
-    cpu_set_t cpuset;
-    CPU_ZERO(&cpuset);
-    for(int i=0; i<16; i++)
-        CPU_SET(i*2, &cpuset);
+    ScheduleOn(kCompactionPool, function, arg);
+}
 
-    PthreadCall("lock", pthread_mutex_lock(&mu_));
-    // Start background thread if necessary
-    //if (!started_bgthread_) {
-    //    started_bgthread_ = true;
-    if (thread_count.load() < THREAD_COUNT) {
-        thread_count++;
-        PthreadCall(
-            "create thread",
-            pthread_create(&bgthread_, NULL,  &PosixEnv::BGThreadWrapper, this));
-        pthread_setaffinity_np(bgthread_, sizeof(cpu_set_t), &cpuset);
+void PosixEnv::ScheduleOn(Pool pool, void (*function)(void*), void* arg) {
+    Executor* executor = pools_[pool].load(std::memory_order_acquire);
+    if (executor == NULL) {
+        executor = StartPool(pool);
     }
+    executor->Submit(function, arg);
+}
 
-    // If the queue is currently empty, the background thread may currently be
-    // waiting.
-    if (queue_.empty()) {
-        PthreadCall("signal", pthread_cond_signal(&bgsignal_));
+Executor* PosixEnv::StartPool(Pool pool) {
+    PthreadCall("lock", pthread_mutex_lock(&mu_));
+    Executor* executor = pools_[pool].load(std::memory_order_relaxed);
+    if (executor == NULL) {
+        PoolConfig* config = &pool_config_[pool];
+        executor = new Executor(this, config->threads,
+                config->pinned ? &PosixEnv::PinThread : NULL, config);
+        pools_[pool].store(executor, std::memory_order_release);
     }
-
-    // Add to priority queue
-    queue_.push_back(BGItem());
-    queue_.back().function = function;
-    queue_.back().arg = arg;
-
     PthreadCall("unlock", pthread_mutex_unlock(&mu_));
+    return executor;
 }
 
-void PosixEnv::BGThread() {
-    while (true) {
-        // Wait until there is an item that is ready to run
-        PthreadCall("lock", pthread_mutex_lock(&mu_));
-        while (queue_.empty()) {
-            PthreadCall("wait", pthread_cond_wait(&bgsignal_, &mu_));
-        }
-
-        void (*function)(void*) = queue_.front().function;
-        void* arg = queue_.front().arg;
-        queue_.pop_front();
+void PosixEnv::PinThread(void* arg) {
+    PoolConfig* config = reinterpret_cast<PoolConfig*>(arg);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &config->cpus);
+}
 
-        PthreadCall("unlock", pthread_mutex_unlock(&mu_));
-        (*function)(arg);
+void PosixEnv::SetPoolThreads(Pool pool, int threads, const std::string& cpus) {
+    PthreadCall("lock", pthread_mutex_lock(&mu_));
+    if (pools_[pool].load(std::memory_order_relaxed) == NULL) {
+        PoolConfig* config = &pool_config_[pool];
+        config->threads = threads > 0 ? threads : 1;
+        config->pinned = !cpus.empty() && ParseCpuSpec(cpus, &config->cpus);
     }
+    PthreadCall("unlock", pthread_mutex_unlock(&mu_));
+}
+
+bool PosixEnv::GetPoolStats(Pool pool, PoolStats* stats) {
+    Executor* executor = pools_[pool].load(std::memory_order_acquire);
+    if (executor == NULL) {
+        stats->threads = 0;
+        stats->queue_depth = 0;
+        stats->scheduled = 0;
+        stats->wait_micros = 0;
+        stats->max_wait_micros = 0;
+    } else {
+        stats->threads = executor->NumWorkers();
+        stats->queue_depth = executor->QueueDepth();
+        stats->scheduled = executor->Submitted();
+        stats->wait_micros = executor->WaitMicros();
+        stats->max_wait_micros = executor->MaxWaitMicros();
+    }
+    return true;
 }
 
 
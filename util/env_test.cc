@@ -64,6 +64,40 @@ TEST(EnvPosixTest, RunMany) {
   ASSERT_EQ(4, reinterpret_cast<uintptr_t>(cur));
 }
 
+static void WaitForBool(void* ptr) {
+  port::AtomicPointer* release = reinterpret_cast<port::AtomicPointer*>(ptr);
+  while (release->Acquire_Load() == NULL) {
+    Env::Default()->SleepForMicroseconds(1000);
+  }
+}
+
+TEST(EnvPosixTest, PoolsAreIndependent) {
+  // Tie up the compaction pool; the sub-imm pool must keep running
+  port::AtomicPointer release(NULL);
+  env_->ScheduleOn(Env::kCompactionPool, &WaitForBool, &release);
+  port::AtomicPointer called(NULL);
+  env_->ScheduleOn(Env::kSubImmPool, &SetBool, &called);
+  Env::Default()->SleepForMicroseconds(kDelayMicros);
+  ASSERT_TRUE(called.NoBarrier_Load() != NULL);
+
+  port::AtomicPointer queued(NULL);
+  env_->ScheduleOn(Env::kCompactionPool, &SetBool, &queued);
+  Env::PoolStats stats;
+  ASSERT_TRUE(env_->GetPoolStats(Env::kCompactionPool, &stats));
+  ASSERT_GE(stats.threads, 1);
+  ASSERT_GE(stats.scheduled, 2);
+  if (stats.threads == 1) {
+    ASSERT_EQ(1, stats.queue_depth);
+  }
+
+  release.Release_Store(&release);
+  Env::Default()->SleepForMicroseconds(kDelayMicros);
+  ASSERT_TRUE(queued.NoBarrier_Load() != NULL);
+  ASSERT_TRUE(env_->GetPoolStats(Env::kCompactionPool, &stats));
+  ASSERT_EQ(0, stats.queue_depth);
+  ASSERT_GT(stats.max_wait_micros, 0);
+}
+
 struct State {
   port::Mutex mu;
   int val;
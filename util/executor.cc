@@ -0,0 +1,165 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/executor.h"
+
+#include <deque>
+#include "leveldb/env.h"
+#include "util/mutexlock.h"
+
+namespace leveldb {
+
+struct Executor::Worker {
+  Executor* executor;
+  int id;
+  port::Mutex mu;
+  std::deque<Task> tasks;  // Guarded by mu
+};
+
+// Which worker, if any, the calling thread is
+static __thread Executor* current_executor = NULL;
+static __thread int current_worker = -1;
+
+Executor::Executor(Env* env, int workers,
+                   void (*init)(void*), void* init_arg)
+    : env_(env),
+      nworkers_(workers > 0 ? workers : 1),
+      init_(init),
+      init_arg_(init_arg),
+      workers_(new Worker[nworkers_]),
+      next_worker_(0),
+      queued_(0),
+      unfinished_(0),
+      sleepers_(0),
+      submitted_(0),
+      wait_micros_(0),
+      max_wait_micros_(0),
+      work_cv_(&mu_),
+      idle_cv_(&mu_),
+      shutting_down_(false),
+      running_(nworkers_) {
+  for (int i = 0; i < nworkers_; i++) {
+    workers_[i].executor = this;
+    workers_[i].id = i;
+    env_->StartThread(&Executor::WorkerMain, &workers_[i]);
+  }
+}
+
+Executor::~Executor() {
+  {
+    MutexLock l(&mu_);
+    shutting_down_ = true;
+    work_cv_.SignalAll();
+    while (running_ > 0) {
+      idle_cv_.Wait();
+    }
+  }
+  delete[] workers_;
+}
+
+void Executor::Submit(void (*function)(void*), void* arg) {
+  Task task;
+  task.function = function;
+  task.arg = arg;
+  task.submit_micros = env_->NowMicros();
+  unfinished_.fetch_add(1);
+  submitted_.fetch_add(1);
+
+  const bool local = (current_executor == this);
+  Worker* w = &workers_[local ? current_worker
+                              : next_worker_.fetch_add(1) % nworkers_];
+  {
+    MutexLock l(&w->mu);
+    if (local) {
+      w->tasks.push_front(task);
+    } else {
+      w->tasks.push_back(task);
+    }
+  }
+  queued_.fetch_add(1);
+
+  // Pairs with the sleepers_/queued_ check in Run(): either the parking
+  // worker sees the new task, or we see it parking and wake it.
+  if (sleepers_.load() > 0) {
+    MutexLock l(&mu_);
+    work_cv_.Signal();
+  }
+}
+
+void Executor::WaitIdle() {
+  MutexLock l(&mu_);
+  while (unfinished_.load() > 0) {
+    idle_cv_.Wait();
+  }
+}
+
+bool Executor::Pop(int id, Task* task) {
+  for (int i = 0; i < nworkers_; i++) {
+    Worker* w = &workers_[(id + i) % nworkers_];
+    MutexLock l(&w->mu);
+    if (!w->tasks.empty()) {
+      if (i == 0) {
+        *task = w->tasks.front();
+        w->tasks.pop_front();
+      } else {
+        // Steal from the far end, away from the owner's newest work
+        *task = w->tasks.back();
+        w->tasks.pop_back();
+      }
+      queued_.fetch_sub(1);
+      return true;
+    }
+  }
+  return false;
+}
+
+void Executor::WorkerMain(void* arg) {
+  Worker* w = reinterpret_cast<Worker*>(arg);
+  w->executor->Run(w->id);
+}
+
+void Executor::Run(int id) {
+  current_executor = this;
+  current_worker = id;
+  if (init_ != NULL) {
+    (*init_)(init_arg_);
+  }
+  Task task;
+  for (;;) {
+    if (Pop(id, &task)) {
+      const uint64_t now = env_->NowMicros();
+      const uint64_t waited =
+          now > task.submit_micros ? now - task.submit_micros : 0;
+      wait_micros_.fetch_add(waited);
+      uint64_t max = max_wait_micros_.load();
+      while (waited > max &&
+             !max_wait_micros_.compare_exchange_weak(max, waited)) { }
+
+      (*task.function)(task.arg);
+      if (unfinished_.fetch_sub(1) == 1) {
+        MutexLock l(&mu_);
+        idle_cv_.SignalAll();
+      }
+      continue;
+    }
+
+    MutexLock l(&mu_);
+    sleepers_.fetch_add(1);
+    while (queued_.load() == 0 && !shutting_down_) {
+      work_cv_.Wait();
+    }
+    sleepers_.fetch_sub(1);
+    if (queued_.load() == 0 && shutting_down_) {
+      break;
+    }
+  }
+
+  current_executor = NULL;
+  current_worker = -1;
+  MutexLock l(&mu_);
+  running_--;
+  idle_cv_.SignalAll();
+}
+
+}  // namespace leveldb
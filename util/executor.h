@@ -0,0 +1,90 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_LEVELDB_UTIL_EXECUTOR_H_
+#define STORAGE_LEVELDB_UTIL_EXECUTOR_H_
+
+#include <stdint.h>
+#include <atomic>
+#include "port/port.h"
+
+namespace leveldb {
+
+class Env;
+
+// A fixed set of worker threads running short background tasks.
+//
+// Every worker owns a deque.  A task submitted by a worker goes to the
+// front of that worker's deque, so follow-up work runs next on the same
+// thread; tasks from other threads are spread over the deques round
+// robin.  A worker whose deque is empty steals the oldest task of
+// another worker, and parks on a condition variable once there is
+// nothing left to steal, so an idle executor uses no CPU.
+class Executor {
+ public:
+  // If "init" is non-NULL, every worker calls "(*init)(init_arg)" before
+  // it runs any task, e.g. to pin itself to some CPUs.
+  Executor(Env* env, int workers,
+           void (*init)(void*) = NULL, void* init_arg = NULL);
+
+  // Runs every task already submitted, then stops the workers.
+  ~Executor();
+
+  int NumWorkers() const { return nworkers_; }
+
+  // Arrange to run "(*function)(arg)" once on some worker.
+  void Submit(void (*function)(void*), void* arg);
+
+  // Wait until every submitted task has finished, including any tasks
+  // they submitted in turn.  Must not be called from a worker.
+  void WaitIdle();
+
+  // Counters for monitoring.
+  uint64_t QueueDepth() const { return queued_.load(); }
+  uint64_t Submitted() const { return submitted_.load(); }
+  // Total and longest time tasks waited in a deque before running
+  uint64_t WaitMicros() const { return wait_micros_.load(); }
+  uint64_t MaxWaitMicros() const { return max_wait_micros_.load(); }
+
+ private:
+  struct Task {
+    void (*function)(void*);
+    void* arg;
+    uint64_t submit_micros;
+  };
+  struct Worker;
+
+  static void WorkerMain(void* arg);
+  void Run(int id);
+
+  // Take a task from worker "id"'s own deque, or steal one.
+  bool Pop(int id, Task* task);
+
+  Env* const env_;
+  const int nworkers_;
+  void (*const init_)(void*);
+  void* const init_arg_;
+  Worker* workers_;
+  std::atomic<uint32_t> next_worker_;  // For submitters outside the pool
+  std::atomic<int64_t> queued_;        // Tasks sitting in some deque
+  std::atomic<int64_t> unfinished_;    // Tasks submitted but not finished
+  std::atomic<int> sleepers_;          // Workers parked or about to park
+  std::atomic<uint64_t> submitted_;
+  std::atomic<uint64_t> wait_micros_;
+  std::atomic<uint64_t> max_wait_micros_;
+
+  port::Mutex mu_;
+  port::CondVar work_cv_;  // Parked workers wait here
+  port::CondVar idle_cv_;  // WaitIdle() and the destructor wait here
+  bool shutting_down_;     // Guarded by mu_
+  int running_;            // Live workers, guarded by mu_
+
+  // No copying allowed
+  Executor(const Executor&);
+  void operator=(const Executor&);
+};
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_UTIL_EXECUTOR_H_
@@ -0,0 +1,83 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/executor.h"
+
+#include <atomic>
+#include "leveldb/env.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+class ExecutorTest { };
+
+namespace {
+
+struct Counter {
+  Executor* executor;
+  std::atomic<int> count;
+  int fanout;  // Tasks each task submits in turn
+
+  Counter(Executor* e, int f) : executor(e), count(0), fanout(f) { }
+};
+
+static void Increment(void* arg) {
+  reinterpret_cast<Counter*>(arg)->count.fetch_add(1);
+}
+
+static void Spawn(void* arg) {
+  Counter* c = reinterpret_cast<Counter*>(arg);
+  c->count.fetch_add(1);
+  for (int i = 0; i < c->fanout; i++) {
+    c->executor->Submit(&Increment, c);
+  }
+}
+
+}  // namespace
+
+TEST(ExecutorTest, RunsEverySubmittedTask) {
+  Executor executor(Env::Default(), 4);
+  Counter c(&executor, 0);
+  for (int i = 0; i < 10000; i++) {
+    executor.Submit(&Increment, &c);
+  }
+  executor.WaitIdle();
+  ASSERT_EQ(10000, c.count.load());
+
+  // Parked workers wake up for the next batch
+  Env::Default()->SleepForMicroseconds(10000);
+  for (int i = 0; i < 100; i++) {
+    executor.Submit(&Increment, &c);
+  }
+  executor.WaitIdle();
+  ASSERT_EQ(10100, c.count.load());
+}
+
+TEST(ExecutorTest, WaitIdleCoversNestedTasks) {
+  Executor executor(Env::Default(), 3);
+  Counter c(&executor, 10);
+  for (int i = 0; i < 100; i++) {
+    executor.Submit(&Spawn, &c);
+  }
+  executor.WaitIdle();
+  ASSERT_EQ(100 * 11, c.count.load());
+}
+
+TEST(ExecutorTest, DestructorDrains) {
+  Counter c(NULL, 10);
+  {
+    Executor executor(Env::Default(), 2);
+    c.executor = &executor;
+    for (int i = 0; i < 100; i++) {
+      executor.Submit(&Spawn, &c);
+    }
+  }
+  ASSERT_EQ(100 * 11, c.count.load());
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -18,14 +18,37 @@ Options::Options()
       info_log(NULL),
       write_buffer_size(4<<20),
       nvm_buffer_size(40<<20),
+      sub_mem_size(2<<20),
       num_levels(1),
+      subImm_partition(4),
+      subImm_thread(4),
+      memtable_sync_threads(1),
+      flush_threads(1),
+      compaction_threads(1),
+      max_subcompactions(1),
+      max_background_compactions(1),
+      max_file_size(2<<20),
+      max_bytes_for_level_base(10<<20),
+      max_bytes_for_level_multiplier(10),
+      level_compaction_dynamic_level_bytes(false),
+      level0_file_num_compaction_trigger(4),
+      level0_slowdown_writes_trigger(8),
+      level0_stop_writes_trigger(12),
+      concurrent_memtable_insert(true),
+      memtable_hash_index(false),
+      flushImm_threshold(8),
+      per_core_wal(false),
       max_open_files(1000),
+      clock_cache(false),
+      cache_shard_bits(4),
       block_cache(NULL),
       block_size(4096),
       block_restart_interval(16),
       compression(kSnappyCompression),
       reuse_logs(false),
-      filter_policy(NULL) {
+      filter_policy(NULL),
+      sec_diskpath(NULL),
+      sec_disk_level(2) {
 }
 
 }  // namespace leveldb
@@ -0,0 +1,147 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/sub_mem_pool.h"
+
+#include <assert.h>
+#include <numa.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "util/arena.h"
+#include "util/mutexlock.h"
+
+namespace leveldb {
+
+static const size_t kHugePageSize = 2 << 20;
+
+static bool IsPowerOfTwo(size_t n) {
+  return n != 0 && (n & (n - 1)) == 0;
+}
+
+SubMemPool::SubMemPool(size_t block_size)
+    : block_size_(block_size),
+      num_nodes_(1) {
+  if (numa_available() >= 0)
+    num_nodes_ = numa_max_node() + 1;
+  free_.resize(num_nodes_);
+}
+
+SubMemPool::~SubMemPool() {
+  // Blocks still handed out stay mapped
+  for (size_t n = 0; n < free_.size(); n++) {
+    for (size_t i = 0; i < free_[n].size(); i++)
+      munmap(free_[n][i], block_size_);
+  }
+}
+
+static port::Mutex* shared_mu;
+static std::map<size_t, SubMemPool*>* shared_pools;
+static port::OnceType shared_once = LEVELDB_ONCE_INIT;
+static void InitSharedPools() {
+  shared_mu = new port::Mutex;
+  shared_pools = new std::map<size_t, SubMemPool*>;
+}
+
+SubMemPool* SubMemPool::Shared(size_t block_size) {
+  port::InitOnce(&shared_once, InitSharedPools);
+  MutexLock l(shared_mu);
+  SubMemPool*& pool = (*shared_pools)[block_size];
+  if (pool == NULL)
+    pool = new SubMemPool(block_size);
+  return pool;
+}
+
+int SubMemPool::CurrentNode() const {
+  if (num_nodes_ == 1)
+    return 0;
+  int node = numa_node_of_cpu(ArenaNVM::CurrentCPU());
+  return (node < 0 || node >= num_nodes_) ? 0 : node;
+}
+
+char* SubMemPool::MapBlock() {
+  void* p = MAP_FAILED;
+  // Reserved huge pages, if any, come prefaulted by MAP_POPULATE
+  if (block_size_ % kHugePageSize == 0) {
+    p = mmap(NULL, block_size_, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+  }
+  if (p == MAP_FAILED) {
+    // Align the block so transparent huge pages can back it, then fault
+    // it in now rather than on the first writes
+    const size_t align = IsPowerOfTwo(block_size_) ? block_size_ : 0;
+    const size_t len = block_size_ + align;
+    char* raw = (char*)mmap(NULL, len, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == (char*)MAP_FAILED)
+      abort();
+    char* start = raw;
+    if (align != 0) {
+      start = (char*)(((uintptr_t)raw + align - 1) & ~(uintptr_t)(align - 1));
+      if (start > raw)
+        munmap(raw, start - raw);
+      if (raw + len > start + block_size_)
+        munmap(start + block_size_, raw + len - (start + block_size_));
+    }
+    madvise(start, block_size_, MADV_HUGEPAGE);
+    const long page = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < block_size_; i += page)
+      start[i] = 0;
+    p = start;
+  }
+  return (char*)p;
+}
+
+char* SubMemPool::Allocate() {
+  const int node = CurrentNode();
+  {
+    MutexLock l(&mu_);
+    for (int i = 0; i < num_nodes_; i++) {
+      std::vector<char*>& list = free_[(node + i) % num_nodes_];
+      if (!list.empty()) {
+        char* block = list.back();
+        list.pop_back();
+        return block;
+      }
+    }
+  }
+  // Pages are placed on first touch, i.e. on this thread's node
+  char* block = MapBlock();
+  MutexLock l(&mu_);
+  node_of_[block] = node;
+  return block;
+}
+
+void SubMemPool::Release(char* block) {
+  MutexLock l(&mu_);
+  std::map<char*, int>::const_iterator it = node_of_.find(block);
+  assert(it != node_of_.end());
+  free_[it->second].push_back(block);
+}
+
+void SubMemPool::Reserve(size_t n) {
+  const int node = CurrentNode();
+  for (;;) {
+    {
+      MutexLock l(&mu_);
+      if (free_[node].size() >= n)
+        return;
+    }
+    char* block = MapBlock();
+    MutexLock l(&mu_);
+    node_of_[block] = node;
+    free_[node].push_back(block);
+  }
+}
+
+size_t SubMemPool::FreeBlocks() {
+  MutexLock l(&mu_);
+  size_t n = 0;
+  for (size_t i = 0; i < free_.size(); i++)
+    n += free_[i].size();
+  return n;
+}
+
+}  // namespace leveldb
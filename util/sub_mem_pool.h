@@ -0,0 +1,68 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_LEVELDB_UTIL_SUB_MEM_POOL_H_
+#define STORAGE_LEVELDB_UTIL_SUB_MEM_POOL_H_
+
+#include <stddef.h>
+#include <map>
+#include <vector>
+#include "port/port.h"
+
+namespace leveldb {
+
+// Recycles fixed-size blocks: the regions copied out of sub-mems when
+// they become sub-imms, and the slabs their skiplist nodes are carved
+// from.  These come and go with every sub-mem rotation, so a block is
+// mapped and faulted in once and then handed out again, and a rotation
+// makes no system call once the pool has warmed up.
+//
+// Blocks are mapped anonymous and prefaulted, on huge pages where the
+// system has them.  Free blocks are kept per NUMA node, the node of the
+// thread that first allocated them, and Allocate() prefers blocks of
+// the calling thread's node.  Blocks stay mapped for the life of the
+// pool.
+//
+// Thread-safe.
+class SubMemPool {
+ public:
+  explicit SubMemPool(size_t block_size);
+  ~SubMemPool();
+
+  // The pool of "block_size" blocks shared by every DB in the process
+  static SubMemPool* Shared(size_t block_size);
+
+  size_t block_size() const { return block_size_; }
+
+  // A block of block_size() bytes, aligned to block_size() if that is a
+  // power of two.  Its contents are unspecified.
+  char* Allocate();
+
+  // Return "block", from Allocate(), to the pool
+  void Release(char* block);
+
+  // Map blocks until at least "n" are free on the calling thread's node
+  void Reserve(size_t n);
+
+  // Blocks free on all nodes
+  size_t FreeBlocks();
+
+ private:
+  char* MapBlock();
+  int CurrentNode() const;
+
+  const size_t block_size_;
+  int num_nodes_;
+  port::Mutex mu_;
+  std::vector<std::vector<char*> > free_;  // Per node; guarded by mu_
+  std::map<char*, int> node_of_;           // Guarded by mu_
+
+  // No copying allowed
+  SubMemPool(const SubMemPool&);
+  void operator=(const SubMemPool&);
+};
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_UTIL_SUB_MEM_POOL_H_
@@ -0,0 +1,67 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/sub_mem_pool.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <set>
+#include "util/arena.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+class SubMemPoolTest { };
+
+TEST(SubMemPoolTest, Recycles) {
+  SubMemPool pool(1 << 16);
+  ASSERT_EQ(0, pool.FreeBlocks());
+  char* a = pool.Allocate();
+  char* b = pool.Allocate();
+  ASSERT_TRUE(a != b);
+  memset(a, 'a', pool.block_size());
+  memset(b, 'b', pool.block_size());
+  pool.Release(a);
+  ASSERT_EQ(1, pool.FreeBlocks());
+  ASSERT_EQ(a, pool.Allocate());
+  ASSERT_EQ(0, pool.FreeBlocks());
+  pool.Release(a);
+  pool.Release(b);
+  ASSERT_EQ(2, pool.FreeBlocks());
+}
+
+TEST(SubMemPoolTest, Aligned) {
+  SubMemPool pool(SUB_MEM_SIZE);
+  char* block = pool.Allocate();
+  ASSERT_EQ(0, reinterpret_cast<uintptr_t>(block) % SUB_MEM_SIZE);
+  block[0] = 1;
+  block[SUB_MEM_SIZE - 1] = 1;
+  pool.Release(block);
+}
+
+TEST(SubMemPoolTest, Reserve) {
+  SubMemPool pool(1 << 16);
+  pool.Reserve(8);
+  ASSERT_EQ(8, pool.FreeBlocks());
+  // Tops up rather than adds
+  pool.Reserve(4);
+  ASSERT_EQ(8, pool.FreeBlocks());
+
+  std::set<char*> blocks;
+  for (int i = 0; i < 8; i++) {
+    blocks.insert(pool.Allocate());
+  }
+  ASSERT_EQ(8, blocks.size());
+  ASSERT_EQ(0, pool.FreeBlocks());
+  for (std::set<char*>::iterator it = blocks.begin(); it != blocks.end(); ++it) {
+    pool.Release(*it);
+  }
+  ASSERT_EQ(8, pool.FreeBlocks());
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}